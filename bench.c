@@ -0,0 +1,471 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "edbg.h"
+#include "dap.h"
+#include "dbg.h"
+#include "bench.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define DEFAULT_ADDR       0x20000000
+#define DEFAULT_SIZE       4096
+#define DEFAULT_TIME       100 // ms
+#define MIN_BLOCK_SIZE     64
+#define MAX_BLOCK_SIZE     (1024 * 1024)
+#define MAX_BLOCKS         16
+#define DEFAULT_CLOCKS     4
+#define MIN_CLOCK          100000
+#define MIN_SAMPLES        100
+#define MAX_SAMPLES        10000
+#define JTAG_BITS          8192
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  long     clock;
+  int      block;
+  double   write; // bytes/s
+  double   read;  // bytes/s
+} mem_result_t;
+
+typedef struct
+{
+  bench_options_t *options;
+  long         clocks[BENCH_MAX_CLOCKS];
+  int          clock_count;
+  int          packet_size;
+  int          packet_count;
+  uint32_t     samples[MAX_SAMPLES];
+  int          sample_count;
+  mem_result_t mem_results[BENCH_MAX_CLOCKS * MAX_BLOCKS];
+  int          mem_count;
+  double       poll_rate;
+  bool         jtag;
+  double       jtag_write;
+  double       jtag_read;
+} bench_state_t;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static void parse_clocks(bench_options_t *options, char *value)
+{
+  char *str = value;
+
+  options->clock_count = 0;
+
+  while (*str)
+  {
+    char *end = NULL;
+    long clock = strtol(str, &end, 0) * 1000;
+
+    if (str == end || (*end && ':' != *end) || clock <= 0)
+      error_exit("invalid benchmark clock list: %s", value);
+
+    check(options->clock_count < BENCH_MAX_CLOCKS, "too many benchmark clocks, maximum is %d", BENCH_MAX_CLOCKS);
+    options->clocks[options->clock_count++] = clock;
+
+    str = *end ? end + 1 : end;
+  }
+}
+
+//-----------------------------------------------------------------------------
+bench_options_t *bench_configure(char *options)
+{
+  bench_options_t *bench = buf_alloc(sizeof(bench_options_t));
+  char *opts = strdup(options ? options : "");
+  char *save = NULL;
+  char *name = strtok_r(opts, ",", &save);
+
+  bench->addr = DEFAULT_ADDR;
+  bench->size = DEFAULT_SIZE;
+  bench->time = DEFAULT_TIME;
+
+  while (name)
+  {
+    char *value = strchr(name, '=');
+    char *end = NULL;
+    long n = 0;
+
+    if (NULL == value)
+      error_exit("invalid benchmark option: %s", name);
+
+    *value++ = 0;
+
+    if (0 == strcmp(name, "json"))
+    {
+      free(bench->json);
+      bench->json = strdup(value);
+      name = strtok_r(NULL, ",", &save);
+      continue;
+    }
+    else if (0 == strcmp(name, "clocks"))
+    {
+      parse_clocks(bench, value);
+      name = strtok_r(NULL, ",", &save);
+      continue;
+    }
+
+    n = strtol(value, &end, 0);
+
+    if (value == end || *end)
+      error_exit("invalid benchmark option: %s", name);
+
+    if (0 == strcmp(name, "addr"))
+    {
+      check(0 == (n % 4), "benchmark address must be word aligned");
+      bench->addr = n;
+    }
+    else if (0 == strcmp(name, "size"))
+    {
+      check(MIN_BLOCK_SIZE <= n && n <= MAX_BLOCK_SIZE && 0 == (n % 4),
+          "benchmark size must be a multiple of 4 between %d and %d", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+      bench->size = n;
+    }
+    else if (0 == strcmp(name, "time"))
+    {
+      check(n > 0, "benchmark time must be positive");
+      bench->time = n;
+    }
+    else
+    {
+      error_exit("unknown benchmark option: %s", name);
+    }
+
+    name = strtok_r(NULL, ",", &save);
+  }
+
+  free(opts);
+
+  return bench;
+}
+
+//-----------------------------------------------------------------------------
+void bench_free(bench_options_t *options)
+{
+  free(options->json);
+  buf_free(options);
+}
+
+//-----------------------------------------------------------------------------
+static char *format_clock(long clock)
+{
+  static char str[32];
+
+  if (clock < 1000000)
+    snprintf(str, sizeof(str), "%.1f kHz", clock / 1.0e3);
+  else
+    snprintf(str, sizeof(str), "%.1f MHz", clock / 1.0e6);
+
+  return str;
+}
+
+//-----------------------------------------------------------------------------
+static bool time_left(bench_state_t *bench, uint64_t start, int count, int min_count)
+{
+  return count < min_count || (get_time_us() - start) < (uint64_t)bench->options->time * 1000;
+}
+
+//-----------------------------------------------------------------------------
+static int compare_samples(const void *a, const void *b)
+{
+  uint32_t va = *(const uint32_t *)a;
+  uint32_t vb = *(const uint32_t *)b;
+
+  return (va > vb) - (va < vb);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t sample_percentile(bench_state_t *bench, int percent)
+{
+  return bench->samples[(bench->sample_count - 1) * percent / 100];
+}
+
+//-----------------------------------------------------------------------------
+static void bench_latency(bench_state_t *bench)
+{
+  uint64_t start = get_time_us();
+  uint8_t buf[4];
+
+  bench->sample_count = 0;
+
+  // DAP_Info is answered by the probe itself, so this is the transport round-trip time
+  while (bench->sample_count < MAX_SAMPLES && time_left(bench, start, bench->sample_count, MIN_SAMPLES))
+  {
+    uint64_t time = get_time_us();
+
+    dap_info(DAP_INFO_PACKET_COUNT, buf, sizeof(buf));
+    bench->samples[bench->sample_count++] = get_time_us() - time;
+  }
+
+  qsort(bench->samples, bench->sample_count, sizeof(uint32_t), compare_samples);
+}
+
+//-----------------------------------------------------------------------------
+static double bench_block(bench_state_t *bench, bool write, uint8_t *buf, int block)
+{
+  uint64_t start = get_time_us();
+  uint64_t bytes = 0;
+  int count = 0;
+
+  do
+  {
+    if (write)
+      dap_write_block(bench->options->addr, buf, block);
+    else
+      dap_read_block(bench->options->addr, buf, block);
+
+    bytes += block;
+    count++;
+  } while (time_left(bench, start, count, 2));
+
+  return bytes * 1.0e6 / (get_time_us() - start);
+}
+
+//-----------------------------------------------------------------------------
+static void bench_memory(bench_state_t *bench)
+{
+  int size = bench->options->size;
+  uint8_t *data = buf_alloc(size);
+  uint8_t *buf = buf_alloc(size);
+
+  for (int i = 0; i < size; i++)
+    data[i] = i * 73 + (i >> 8);
+
+  bench->mem_count = 0;
+
+  for (int c = 0; c < bench->clock_count; c++)
+  {
+    dap_swj_clock(bench->clocks[c]);
+
+    // Block sizes grow by a factor of 4, the last one is always the full size
+    for (int block = MIN_BLOCK_SIZE; ; block *= 4)
+    {
+      mem_result_t *res = &bench->mem_results[bench->mem_count++];
+
+      if (block > size)
+        block = size;
+
+      res->clock = bench->clocks[c];
+      res->block = block;
+      res->write = bench_block(bench, true, data, block);
+      res->read = bench_block(bench, false, buf, block);
+
+      if (0 != memcmp(data, buf, block))
+        warning("read back data does not match at %s with %d byte blocks", format_clock(res->clock), block);
+
+      if (block == size)
+        break;
+    }
+  }
+
+  buf_free(buf);
+  buf_free(data);
+}
+
+//-----------------------------------------------------------------------------
+static void bench_poll(bench_state_t *bench)
+{
+  uint64_t start = get_time_us();
+  int count = 0;
+
+  do
+  {
+    dap_read_word(bench->options->addr);
+    count++;
+  } while (time_left(bench, start, count, 2));
+
+  bench->poll_rate = count * 1.0e6 / (get_time_us() - start);
+}
+
+//-----------------------------------------------------------------------------
+static double bench_jtag_shift(bench_state_t *bench, bool read)
+{
+  uint8_t buf[JTAG_BITS / 8];
+  uint64_t start, bits = 0;
+  int count = 0;
+
+  memset(buf, 0x5a, sizeof(buf));
+
+  start = get_time_us();
+
+  do
+  {
+    if (read)
+    {
+      dap_jtag_read_dr(buf, JTAG_BITS);
+    }
+    else
+    {
+      dap_jtag_write_dr(buf, JTAG_BITS);
+      dap_jtag_flush();
+    }
+
+    bits += JTAG_BITS;
+    count++;
+  } while (time_left(bench, start, count, 2));
+
+  return bits * 1.0e6 / (get_time_us() - start);
+}
+
+//-----------------------------------------------------------------------------
+static void bench_jtag(bench_state_t *bench)
+{
+  int interf = dap_get_interface();
+  uint8_t buf[2];
+
+  bench->jtag = (dap_info(DAP_INFO_CAPABILITIES, buf, sizeof(buf)) > 0) && (buf[0] & DAP_CAP_JTAG);
+
+  if (!bench->jtag)
+    return;
+
+  // Data is shifted through the DR selected after the TAP reset, so the chain is not affected
+  if (DAP_INTERFACE_JTAG != interf)
+  {
+    dap_disconnect();
+    dap_connect(DAP_INTERFACE_JTAG);
+  }
+
+  dap_jtag_reset();
+
+  bench->jtag_write = bench_jtag_shift(bench, false);
+  bench->jtag_read = bench_jtag_shift(bench, true);
+
+  dap_jtag_reset();
+  dap_jtag_flush();
+
+  // The selected target may use either interface, so the one it was using is restored
+  if (DAP_INTERFACE_JTAG != interf)
+  {
+    dap_disconnect();
+
+    if (DAP_INTERFACE_NONE != interf)
+    {
+      dap_connect(interf);
+      dap_reset_link();
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void print_table(bench_state_t *bench, long clock)
+{
+  message("Benchmark: %d byte packets, %d packets in flight\n", bench->packet_size, bench->packet_count);
+  message("  Round-trip latency (%d samples): min %u us, median %u us, 99%% %u us, max %u us\n",
+      bench->sample_count, bench->samples[0], sample_percentile(bench, 50), sample_percentile(bench, 99),
+      bench->samples[bench->sample_count - 1]);
+  message("  Register polls at %s: %.0f reads/s\n", format_clock(clock), bench->poll_rate);
+
+  if (bench->jtag)
+  {
+    message("  JTAG sequences at %s: write %.1f kbit/s, read %.1f kbit/s\n", format_clock(clock),
+        bench->jtag_write / 1.0e3, bench->jtag_read / 1.0e3);
+  }
+
+  message("  Memory at 0x%08x:\n", bench->options->addr);
+  message("    %-10s %8s %12s %12s\n", "Clock", "Block", "Write, KB/s", "Read, KB/s");
+
+  for (int i = 0; i < bench->mem_count; i++)
+  {
+    mem_result_t *res = &bench->mem_results[i];
+
+    message("    %-10s %8d %12.1f %12.1f\n", format_clock(res->clock), res->block,
+        res->write / 1024.0, res->read / 1024.0);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void save_json(bench_state_t *bench, long clock)
+{
+  char *name = bench->options->json;
+  FILE *f = (0 == strcmp(name, "-")) ? stdout : fopen(name, "w");
+
+  if (NULL == f)
+    error_exit("unable to open file %s", name);
+
+  fprintf(f, "{\n");
+  fprintf(f, "  \"packet_size\": %d,\n", bench->packet_size);
+  fprintf(f, "  \"packet_count\": %d,\n", bench->packet_count);
+  fprintf(f, "  \"latency_us\": { \"samples\": %d, \"min\": %u, \"median\": %u, \"p99\": %u, \"max\": %u },\n",
+      bench->sample_count, bench->samples[0], sample_percentile(bench, 50), sample_percentile(bench, 99),
+      bench->samples[bench->sample_count - 1]);
+  fprintf(f, "  \"poll\": { \"clock\": %ld, \"reads_per_s\": %.1f },\n", clock, bench->poll_rate);
+
+  if (bench->jtag)
+  {
+    fprintf(f, "  \"jtag\": { \"clock\": %ld, \"bits\": %d, \"write_bits_per_s\": %.1f, \"read_bits_per_s\": %.1f },\n",
+        clock, JTAG_BITS, bench->jtag_write, bench->jtag_read);
+  }
+
+  fprintf(f, "  \"memory\": {\n");
+  fprintf(f, "    \"addr\": %u,\n", bench->options->addr);
+  fprintf(f, "    \"results\": [\n");
+
+  for (int i = 0; i < bench->mem_count; i++)
+  {
+    mem_result_t *res = &bench->mem_results[i];
+
+    fprintf(f, "      { \"clock\": %ld, \"block\": %d, \"write_bytes_per_s\": %.1f, \"read_bytes_per_s\": %.1f }%s\n",
+        res->clock, res->block, res->write, res->read, (i < bench->mem_count - 1) ? "," : "");
+  }
+
+  fprintf(f, "    ]\n");
+  fprintf(f, "  }\n");
+  fprintf(f, "}\n");
+
+  if (stdout != f)
+    fclose(f);
+}
+
+//-----------------------------------------------------------------------------
+void bench_run(bench_options_t *options, long clock)
+{
+  bench_state_t *bench = buf_alloc(sizeof(bench_state_t));
+  uint8_t buf[2];
+
+  bench->options = options;
+
+  if (options->clock_count)
+  {
+    memcpy(bench->clocks, options->clocks, sizeof(bench->clocks));
+    bench->clock_count = options->clock_count;
+  }
+  else
+  {
+    for (long c = clock; c >= MIN_CLOCK && bench->clock_count < DEFAULT_CLOCKS; c /= 2)
+      bench->clocks[bench->clock_count++] = c;
+  }
+
+  bench->packet_size = dbg_get_packet_size();
+  bench->packet_count = (1 == dap_info(DAP_INFO_PACKET_COUNT, buf, sizeof(buf))) ? buf[0] : 1;
+
+  verbose("Latency...");
+  bench_latency(bench);
+  verbose(" done.\n");
+
+  verbose("Memory...");
+  bench_memory(bench);
+  dap_swj_clock(clock);
+  verbose(" done.\n");
+
+  verbose("Polling...");
+  bench_poll(bench);
+  verbose(" done.\n");
+
+  verbose("JTAG...");
+  bench_jtag(bench);
+  verbose(" done.\n");
+
+  print_table(bench, clock);
+
+  if (options->json)
+    save_json(bench, clock);
+
+  buf_free(bench);
+}
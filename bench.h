@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+
+/*- Definitions -------------------------------------------------------------*/
+#define BENCH_MAX_CLOCKS   16
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t     addr;
+  int          size;
+  int          time; // ms
+  long         clocks[BENCH_MAX_CLOCKS];
+  int          clock_count;
+  char         *json;
+} bench_options_t;
+
+/*- Prototypes --------------------------------------------------------------*/
+bench_options_t *bench_configure(char *options);
+void bench_free(bench_options_t *options);
+void bench_run(bench_options_t *options, long clock);
+
+#endif // _BENCH_H_
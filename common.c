@@ -0,0 +1,393 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2013-2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "edbg.h"
+#include "dap.h"
+#include "dbg.h"
+#include "session.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/*- Variables ---------------------------------------------------------------*/
+static bool g_verbose = false;
+
+// Errors may be reported back to the caller instead of terminating the process
+static _Thread_local jmp_buf *g_error_jmp = NULL;
+static _Thread_local char g_error_text[MAX_ERROR_SIZE];
+static _Thread_local char *g_prefix = NULL;
+static _Thread_local FILE *g_output = NULL;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+void verbose(char *fmt, ...)
+{
+  FILE *out = g_output ? g_output : stdout;
+  va_list args;
+
+  if (g_verbose && NULL == g_prefix)
+  {
+    va_start(args, fmt);
+    vfprintf(out, fmt, args);
+    va_end(args);
+
+    fflush(out);
+  }
+}
+
+//-----------------------------------------------------------------------------
+void message(char *fmt, ...)
+{
+  FILE *out = g_output ? g_output : stdout;
+  va_list args;
+
+  va_start(args, fmt);
+  vfprintf(out, fmt, args);
+  va_end(args);
+
+  fflush(out);
+}
+
+//-----------------------------------------------------------------------------
+void warning(char *fmt, ...)
+{
+  FILE *out = g_output ? g_output : stderr;
+  va_list args;
+
+  va_start(args, fmt);
+  fprintf(out, "Warning: ");
+
+  if (g_prefix)
+    fprintf(out, "%s: ", g_prefix);
+
+  vfprintf(out, fmt, args);
+  fprintf(out, "\n");
+  va_end(args);
+}
+
+//-----------------------------------------------------------------------------
+void verbose_enable(bool enable)
+{
+  g_verbose = enable;
+}
+
+//-----------------------------------------------------------------------------
+void output_redirect(FILE *file)
+{
+  g_output = file;
+}
+
+//-----------------------------------------------------------------------------
+void output_prefix(char *prefix)
+{
+  g_prefix = prefix;
+}
+
+//-----------------------------------------------------------------------------
+jmp_buf *error_trap(jmp_buf *jmp)
+{
+  jmp_buf *prev = g_error_jmp;
+
+  g_error_jmp = jmp;
+
+  return prev;
+}
+
+//-----------------------------------------------------------------------------
+char *error_message(void)
+{
+  return g_error_text;
+}
+
+//-----------------------------------------------------------------------------
+static void error_report(char *fmt, va_list args)
+{
+  if (g_error_jmp)
+  {
+    vsnprintf(g_error_text, sizeof(g_error_text), fmt, args);
+    longjmp(*g_error_jmp, 1);
+  }
+
+  fprintf(stderr, "Error: ");
+  vfprintf(stderr, fmt, args);
+  fprintf(stderr, "\n");
+
+  exit(1);
+}
+
+//-----------------------------------------------------------------------------
+void check(bool cond, char *fmt, ...)
+{
+  if (cond)
+    return;
+
+  va_list args;
+
+  va_start(args, fmt);
+  error_report(fmt, args);
+  va_end(args);
+}
+
+//-----------------------------------------------------------------------------
+void error_exit(char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  error_report(fmt, args);
+  va_end(args);
+}
+
+//-----------------------------------------------------------------------------
+void perror_exit(char *text)
+{
+  if (g_error_jmp)
+  {
+    snprintf(g_error_text, sizeof(g_error_text), "%s: %s", text, strerror(errno));
+    longjmp(*g_error_jmp, 1);
+  }
+
+  perror(text);
+  exit(1);
+}
+
+//-----------------------------------------------------------------------------
+int round_up(int value, int multiple)
+{
+  return ((value + multiple - 1) / multiple) * multiple;
+}
+
+//-----------------------------------------------------------------------------
+void sleep_ms(int ms)
+{
+#ifdef _WIN32
+  Sleep(ms);
+#else
+  struct timespec ts;
+
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000;
+
+  nanosleep(&ts, NULL);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+uint64_t get_time_ns(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER freq, count;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+
+  return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000 +
+      (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000 / freq.QuadPart;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+uint64_t get_time_us(void)
+{
+  return get_time_ns() / 1000;
+}
+
+//-----------------------------------------------------------------------------
+void *buf_alloc(int size)
+{
+  void *buf;
+
+  if (NULL == (buf = malloc(size)))
+    error_exit("out of memory");
+
+  memset(buf, 0, size);
+
+  return buf;
+}
+
+//-----------------------------------------------------------------------------
+void buf_free(void *buf)
+{
+  free(buf);
+}
+
+//-----------------------------------------------------------------------------
+int load_file(char *name, uint8_t *data, int size)
+{
+  struct stat stat;
+  int fd, rsize;
+
+  check(NULL != name, "input file name is not specified");
+
+  fd = open(name, O_RDONLY | O_BINARY);
+
+  if (fd < 0)
+    perror_exit("open()");
+
+  fstat(fd, &stat);
+
+  if (stat.st_size < size)
+    size = stat.st_size;
+
+  rsize = read(fd, data, size);
+
+  // Errors may return to the caller, the file must be closed before they are reported
+  if (rsize < 0)
+  {
+    int error = errno;
+
+    close(fd);
+    errno = error;
+    perror_exit("read()");
+  }
+
+  close(fd);
+
+  check(rsize == size, "cannot fully read file");
+
+  return rsize;
+}
+
+//-----------------------------------------------------------------------------
+uint8_t *load_image(char *name, int *size)
+{
+  struct stat stat_buf;
+  uint8_t *data;
+
+  check(NULL != name, "input file name is not specified");
+
+  if (stat(name, &stat_buf) < 0)
+    error_exit("unable to open %s", name);
+
+  // One extra byte keeps the allocation valid for an empty file
+  data = buf_alloc(stat_buf.st_size + 1);
+  *size = load_file(name, data, stat_buf.st_size);
+
+  return data;
+}
+
+//-----------------------------------------------------------------------------
+void save_file(char *name, uint8_t *data, int size)
+{
+  int fd, rsize;
+
+  check(NULL != name, "output file name is not specified");
+
+  fd = open(name, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY, 0644);
+
+  if (fd < 0)
+    perror_exit("open()");
+
+  rsize = write(fd, data, size);
+
+  if (rsize < 0)
+  {
+    int error = errno;
+
+    close(fd);
+    errno = error;
+    perror_exit("write()");
+  }
+
+  close(fd);
+
+  check(rsize == size, "error writing the file");
+}
+
+//-----------------------------------------------------------------------------
+uint8_t *mem_find(uint8_t *haystack, int haystack_size, uint8_t *needle, int needle_size)
+{
+  if (haystack_size == 0 || needle_size == 0 || haystack_size < needle_size)
+    return NULL;
+
+  for (int i = 0; i < (haystack_size - needle_size); i++)
+  {
+    if (memcmp(haystack + i, needle, needle_size) == 0)
+      return haystack + i;
+  }
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+int find_debugger(debugger_t *debuggers, int count, const char *serial)
+{
+  char *end = NULL;
+  int index = strtoul(serial, &end, 10);
+
+  if (index < count && end[0] == 0)
+    return index;
+
+  for (int i = 0; i < count; i++)
+  {
+    if (0 == strcmp(debuggers[i].serial, serial))
+      return i;
+  }
+
+  error_exit("unable to find a debugger with a specified serial number (%s)", serial);
+
+  return -1;
+}
+
+//-----------------------------------------------------------------------------
+int select_version(debugger_t *debugger, int version)
+{
+  if (0 == version)
+    version = (debugger->versions & DBG_CMSIS_DAP_V2) ? DBG_CMSIS_DAP_V2 : DBG_CMSIS_DAP_V1;
+  else if (1 == version)
+    version = DBG_CMSIS_DAP_V1;
+  else if (2 == version)
+    version = DBG_CMSIS_DAP_V2;
+  else
+    error_exit("unsupported CMSIS-DAP version: %d", version);
+
+  check(version & debugger->versions, "selected debugger does not support this CMSIS-DAP version");
+
+  return version;
+}
+
+//-----------------------------------------------------------------------------
+void connect_debugger(debugger_t *debugger, int version)
+{
+  // Packets that were in flight are dropped together with the protocol state
+  dap_session_free(g_session);
+  dap_session_init(g_session);
+
+  dbg_open(debugger, version);
+}
+
+//-----------------------------------------------------------------------------
+void configure_debugger(long clock)
+{
+  dap_disconnect();
+  dap_connect(DAP_INTERFACE_SWD);
+  dap_transfer_configure(0, 32768, 32768);
+  dap_swd_configure(0);
+  dap_swj_clock(clock);
+  dap_led(0, 1);
+}
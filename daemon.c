@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "edbg.h"
+#include "daemon.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define MAX_LINE_SIZE    4096
+#define MAX_ARGS         16
+
+/*- Variables ---------------------------------------------------------------*/
+static char *g_path = NULL;
+
+/*- Implementations ---------------------------------------------------------*/
+
+#ifndef _WIN32
+
+//-----------------------------------------------------------------------------
+static void remove_socket(void)
+{
+  if (g_path)
+    unlink(g_path);
+}
+
+//-----------------------------------------------------------------------------
+static int split_line(char *line, char **argv)
+{
+  int argc = 0;
+
+  for (char *arg = strtok(line, " \t\r\n"); arg; arg = strtok(NULL, " \t\r\n"))
+  {
+    if (argc == MAX_ARGS)
+      return -1;
+
+    argv[argc++] = arg;
+  }
+
+  return argc;
+}
+
+//-----------------------------------------------------------------------------
+static bool serve_client(int fd, daemon_handler_t handler)
+{
+  FILE *in = fdopen(fd, "r");
+  FILE *out = fdopen(dup(fd), "w");
+  char line[MAX_LINE_SIZE];
+  char *argv[MAX_ARGS];
+  bool running = true;
+
+  check(in && out, "unable to open the client connection");
+
+  while (fgets(line, sizeof(line), in))
+  {
+    char *error = NULL;
+    int argc;
+
+    if (NULL == strchr(line, '\n') && !feof(in))
+    {
+      int c;
+
+      while ((c = fgetc(in)) != EOF && c != '\n');
+
+      fprintf(out, "ERROR: request is too long\n");
+      fflush(out);
+      continue;
+    }
+
+    argc = split_line(line, argv);
+
+    if (0 == argc)
+      continue;
+
+    if (argc < 0)
+    {
+      error = "too many arguments";
+    }
+    else if (0 == strcmp(argv[0], "quit"))
+    {
+      fprintf(out, "OK\n");
+      break;
+    }
+    else if (0 == strcmp(argv[0], "shutdown"))
+    {
+      fprintf(out, "OK\n");
+      running = false;
+      break;
+    }
+    else
+    {
+      output_redirect(out);
+      error = handler(argc, argv);
+      output_redirect(NULL);
+    }
+
+    if (error)
+      fprintf(out, "ERROR: %s\n", error);
+    else
+      fprintf(out, "OK\n");
+
+    fflush(out);
+  }
+
+  fclose(in);
+  fclose(out);
+
+  return running;
+}
+
+//-----------------------------------------------------------------------------
+void daemon_run(char *path, daemon_handler_t handler)
+{
+  struct sockaddr_un addr;
+  struct stat stat_buf;
+  mode_t mask;
+  int server;
+  int res;
+
+  check(strlen(path) < sizeof(addr.sun_path), "socket path is too long");
+
+  // A socket left by a daemon that was killed would prevent binding
+  if (0 == stat(path, &stat_buf))
+  {
+    check(S_ISSOCK(stat_buf.st_mode), "%s exists and is not a socket", path);
+    unlink(path);
+  }
+
+  // Clients that disconnect in the middle of a response must not stop the daemon
+  signal(SIGPIPE, SIG_IGN);
+
+  server = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (server < 0)
+    perror_exit("socket()");
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  // Clients can write files and target memory, so only the owner may connect
+  mask = umask(077);
+  res = bind(server, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+
+  if (res < 0)
+    perror_exit("bind()");
+
+  g_path = path;
+  atexit(remove_socket);
+
+  if (listen(server, 4) < 0)
+    perror_exit("listen()");
+
+  verbose("Listening on %s\n", path);
+
+  while (1)
+  {
+    int client = accept(server, NULL, NULL);
+
+    if (client < 0)
+      perror_exit("accept()");
+
+    if (!serve_client(client, handler))
+      break;
+  }
+
+  close(server);
+  remove_socket();
+  g_path = NULL;
+}
+
+#else
+
+//-----------------------------------------------------------------------------
+void daemon_run(char *path, daemon_handler_t handler)
+{
+  error_exit("daemon mode is not supported on Windows");
+  (void)path;
+  (void)handler;
+}
+
+#endif
@@ -0,0 +1,14 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+/*- Types -------------------------------------------------------------------*/
+// Returns NULL on success or the error message
+typedef char *(*daemon_handler_t)(int argc, char **argv);
+
+/*- Prototypes --------------------------------------------------------------*/
+void daemon_run(char *path, daemon_handler_t handler);
+
+#endif // _DAEMON_H_
@@ -10,6 +10,7 @@
 #include "edbg.h"
 #include "dap.h"
 #include "dbg.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 enum
@@ -33,6 +34,7 @@ enum
   ID_DAP_JTAG_SEQUENCE      = 0x14,
   ID_DAP_JTAG_CONFIGURE     = 0x15,
   ID_DAP_JTAG_IDCODE        = 0x16,
+  ID_DAP_EXECUTE_COMMANDS   = 0x7f,
 };
 
 enum
@@ -150,11 +152,21 @@ enum
 #define AP_CSW_PROT(x)         ((x) << 24)
 #define AP_CSW_DBGSWENABLE     (1 << 31)
 
-#define TRANSFER_SIZE          16384
+#define TRANSFER_SIZE          32768
+#define STREAM_LOOKAHEAD       1024 // Must cover all requests that fit into one packet
 #define TRANSFER_BUF_SIZE      (DBG_MAX_EP_SIZE + 64)
+#define TRANSFER_BUF_EXTRA     64
+#define TRANSFER_BLOCK_MAX     65535
 
-#define JTAG_TRANSFER_SIZE     65536
-#define JTAG_RESPONSE_BUF_SIZE (JTAG_TRANSFER_SIZE / 8)
+#define RETRY_MAX              8 // Consecutive failures before giving up
+#define CLOCK_BACKOFF_RETRIES  2 // Failures at the same position before the clock is lowered
+#define WAIT_TIMEOUT           60000 // ms, longer than the slowest chip erase
+
+#define CMD_QUEUE_SIZE         64
+#define DELAY_MAX              65535 // us
+
+#define JTAG_QUEUE_SIZE        4096 // Sequences of up to 64 clocks
+#define JTAG_RESPONSE_BUF_SIZE (65536 / 8)
 
 enum
 {
@@ -163,6 +175,9 @@ enum
   TRANSFER_TYPE_WRITE_READ,
   TRANSFER_TYPE_READ_REG,
   TRANSFER_TYPE_WRITE_REG,
+  TRANSFER_TYPE_WAIT,
+  TRANSFER_TYPE_READ_BLOCK,
+  TRANSFER_TYPE_WRITE_BLOCK,
 };
 
 enum
@@ -181,6 +196,9 @@ enum
   OP_SKIP,
   OP_READ,
   OP_WRITE,
+  OP_MATCH_MASK,
+  OP_WAIT,
+  OP_CACHED,
 };
 
 /*- Types -------------------------------------------------------------------*/
@@ -190,60 +208,273 @@ typedef struct
   uint8_t  size;
   uint32_t addr;
   uint32_t data;
+  uint32_t mask;
+  uint8_t  *dst;
+  int      count; // Words in a block request
 } dap_request_t;
 
 typedef struct
 {
   uint8_t  opt;
-  uint8_t  tdi;
-} dap_jtag_request_t;
+  uint8_t  count;
+  uint64_t tdi;
+} dap_jtag_sequence_t;
+
+typedef struct
+{
+  uint8_t  id;
+  uint8_t  resp_size;
+  char     *name;
+} dap_cmd_t;
+
+typedef struct
+{
+  uint8_t  *buf;
+  uint8_t  ops[256];
+  int      ops_size;
+  int      xfer_count;
+  int      first;
+  int      count;
+  bool     block;
+  bool     wait;
+  bool     cmds;
+} dap_packet_t;
+
+typedef struct
+{
+  int                   dp_version;
+  uint32_t              target_id;
+  uint32_t              tar_wrap_size;
+  int                   interface;
+
+  dap_request_t         request[TRANSFER_SIZE];
+  int                   request_count;
+  int                   request_index;
+  int                   request_offset;
+  int                   response_offset;
+
+  uint32_t              response[TRANSFER_SIZE];
+  int                   response_count;
+  int                   response_size;
+
+  dap_packet_t          packet[DBG_MAX_PACKETS];
+  int                   packet_count;
+  int                   packet_first;
+  int                   packet_pending;
+  int                   packet_buf_size;
+  int                   stream_lookahead;
+
+  uint8_t               *buf;
+  int                   buf_size;
+  int                   buf_reserve;
+
+  bool                  atomic_cmd;
+  dap_cmd_t             cmd_queue[CMD_QUEUE_SIZE];
+  int                   cmd_count;
+  uint8_t               cmd_buf[TRANSFER_BUF_SIZE];
+  int                   cmd_size;
+  int                   cmd_resp_size;
+
+  uint8_t               *ops;
+  int                   ops_size;
+
+  bool                  set_address;
+  int                   address_inc;
+  uint32_t              address;
+  uint32_t              csw;
+  uint32_t              match_mask;
+  bool                  set_select;
+  uint32_t              select;
+
+  dap_cache_stats_t     cache_stats;
+
+  bool                  error_exit;
+  bool                  error;
+
+  uint32_t              clock;
+  const long            *clock_steps; // Lower clocks to try after repeated errors, in descending order
+  int                   clock_step_count;
+
+  bool                  retry;
+  int                   retry_status;
+  int                   retry_position;
+  int                   retry_offset;
+  int                   retry_count;
+  dap_error_stats_t     error_stats;
+
+  int                   wait_position;
+  uint64_t              wait_start;
+
+  dap_transport_stats_t transport_stats;
+
+  int                   jtag_index;
+
+  dap_jtag_sequence_t   jtag_sequence[JTAG_QUEUE_SIZE];
+  int                   jtag_sequence_count;
+
+  uint8_t               *jtag_buf;
+  uint8_t               jtag_response_buf[JTAG_RESPONSE_BUF_SIZE];
+  int                   jtag_response_count;
+  bool                  jtag_response_done;
+} dap_state_t;
 
 /*- Prototypes --------------------------------------------------------------*/
-static void dap_add_req(int type, int size, uint32_t addr, uint32_t data);
+static dap_request_t *dap_add_req(int type, int size, uint32_t addr, uint32_t data);
+static void stream_requests(bool flush);
+static void receive_packet(void);
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static inline dap_state_t *dap_state(void)
+{
+  return (dap_state_t *)g_session->dap_state;
+}
+
+//-----------------------------------------------------------------------------
+static int sync_cmd(uint8_t *data, int resp_size, int req_size)
+{
+  dap_state_t *dap = dap_state();
+  int size = dbg_dap_cmd(data, resp_size, req_size);
 
-/*- Variables ---------------------------------------------------------------*/
-static int dap_dp_version = 1;
-static uint32_t dap_target_id = DAP_INVALID_TARGET_ID;
-static int dap_interface = DAP_INTERFACE_NONE;
+  dap->transport_stats.packets++;
+  dap->transport_stats.round_trips++;
+  dap->transport_stats.usb_out += req_size;
+  dap->transport_stats.usb_in += size;
+
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+static int receive_cmds(uint8_t *data)
+{
+  dap_state_t *dap = dap_state();
+  int offs = 0;
 
-static dap_request_t dap_request[TRANSFER_SIZE];
-static int dap_request_count = 0;
+  for (int i = 0; i < dap->cmd_count; i++)
+  {
+    dap_cmd_t *cmd = &dap->cmd_queue[i];
 
-static uint32_t dap_response[TRANSFER_SIZE];
-static int dap_response_count = 0;
-static int dap_response_size = 0;
+    if (data[offs] != cmd->id)
+      error_exit("invalid response received: request = 0x%02x, response = 0x%02x", cmd->id, data[offs]);
 
-static uint8_t dap_buf[TRANSFER_BUF_SIZE];
-static int dap_buf_size = 0;
+    if (cmd->name)
+      check(DAP_OK == data[offs + 1], "%s failed", cmd->name);
 
-static uint8_t dap_ops[TRANSFER_BUF_SIZE];
-static int dap_ops_size = 0;
+    offs += cmd->resp_size;
+  }
 
-static bool dap_set_address = true;
-static int dap_address_inc = 0;
-static uint32_t dap_address = 0;
-static uint32_t dap_csw;
+  dap->cmd_count = 0;
+  dap->cmd_size = 0;
+  dap->cmd_resp_size = 0;
 
-static int dap_jtag_index = 0;
+  return offs;
+}
 
-static dap_jtag_request_t dap_jtag_request[JTAG_TRANSFER_SIZE];
-static int dap_jtag_request_count = 0;
+//-----------------------------------------------------------------------------
+static void flush_cmds(void)
+{
+  dap_state_t *dap = dap_state();
+  uint8_t buf[TRANSFER_BUF_SIZE];
 
-static uint8_t dap_jtag_response_buf[JTAG_RESPONSE_BUF_SIZE];
-static int dap_jtag_response_count = 0;
+  if (0 == dap->cmd_count)
+    return;
 
-/*- Implementations ---------------------------------------------------------*/
+  buf[0] = ID_DAP_EXECUTE_COMMANDS;
+  buf[1] = dap->cmd_count;
+  memcpy(&buf[2], dap->cmd_buf, dap->cmd_size);
+  sync_cmd(buf, sizeof(buf), dap->cmd_size + 2);
+
+  check(buf[0] == dap->cmd_count, "EXECUTE_COMMANDS failed");
+
+  receive_cmds(&buf[1]);
+}
+
+//-----------------------------------------------------------------------------
+static int dap_cmd(uint8_t *data, int resp_size, int req_size)
+{
+  flush_cmds();
+  return sync_cmd(data, resp_size, req_size);
+}
+
+//-----------------------------------------------------------------------------
+static void queue_cmd(uint8_t *data, int req_size, int resp_size, char *name)
+{
+  dap_state_t *dap = dap_state();
+  dap_cmd_t *cmd;
+  int max_size;
+
+  if (!dap->atomic_cmd)
+  {
+    dap_cmd(data, resp_size, req_size);
+
+    if (name)
+      check(DAP_OK == data[0], "%s failed", name);
+
+    return;
+  }
+
+  // Leave at least half of the packet for the transfer that will carry the queued commands
+  max_size = (dbg_get_packet_size() < DBG_MAX_EP_SIZE) ? dbg_get_packet_size() : DBG_MAX_EP_SIZE;
+
+  if (dap->cmd_count == CMD_QUEUE_SIZE || (dap->cmd_size + req_size + 2) > (max_size / 2) ||
+      (dap->cmd_resp_size + resp_size + 2) > (max_size / 2))
+    flush_cmds();
+
+  cmd = &dap->cmd_queue[dap->cmd_count++];
+  cmd->id = data[0];
+  cmd->resp_size = resp_size + 1;
+  cmd->name = name;
+
+  memcpy(&dap->cmd_buf[dap->cmd_size], data, req_size);
+  dap->cmd_size += req_size;
+  dap->cmd_resp_size += cmd->resp_size;
+}
+
+//-----------------------------------------------------------------------------
+static void invalidate_cache(void)
+{
+  dap_state_t *dap = dap_state();
+
+  dap->set_address = true;
+  dap->set_select = true;
+  dap->csw = 0;
+  dap->match_mask = 0;
+}
 
 //-----------------------------------------------------------------------------
 void dap_set_dp_version(int version)
 {
-  dap_dp_version = version;
+  dap_state_t *dap = dap_state();
+
+  dap->dp_version = version;
 }
 
 //-----------------------------------------------------------------------------
 void dap_set_target_id(uint32_t id)
 {
-  dap_target_id = id;
+  dap_state_t *dap = dap_state();
+
+  dap->target_id = id;
+}
+
+//-----------------------------------------------------------------------------
+void dap_reset_target_config(void)
+{
+  dap_state_t *dap = dap_state();
+
+  dap->dp_version = 1;
+  dap->target_id = DAP_INVALID_TARGET_ID;
+  dap->tar_wrap_size = DAP_TAR_WRAP_SIZE;
+}
+
+//-----------------------------------------------------------------------------
+void dap_set_tar_wrap_size(uint32_t size)
+{
+  dap_state_t *dap = dap_state();
+
+  check(size >= DAP_TAR_WRAP_SIZE && 0 == (size & (size - 1)), "internal: invalid TAR wrap size (%d)", size);
+  dap->tar_wrap_size = size;
 }
 
 //-----------------------------------------------------------------------------
@@ -254,7 +485,7 @@ void dap_led(int index, int state)
   buf[0] = ID_DAP_LED;
   buf[1] = index;
   buf[2] = state;
-  dbg_dap_cmd(buf, sizeof(buf), 3);
+  dap_cmd(buf, sizeof(buf), 3);
 
   check(DAP_OK == buf[0], "DAP_LED failed");
 }
@@ -262,32 +493,44 @@ void dap_led(int index, int state)
 //-----------------------------------------------------------------------------
 void dap_connect(int interf)
 {
+  dap_state_t *dap = dap_state();
   uint8_t buf[2];
   int cap = (DAP_INTERFACE_SWD == interf) ? DAP_CAP_SWD : DAP_CAP_JTAG;
 
   buf[0] = ID_DAP_CONNECT;
   buf[1] = cap;
-  dbg_dap_cmd(buf, sizeof(buf), 2);
+  dap_cmd(buf, sizeof(buf), 2);
 
   check(buf[0] == cap, "DAP_CONNECT failed");
 
-  dap_interface = interf;
+  dap->interface = interf;
+  invalidate_cache();
+}
+
+//-----------------------------------------------------------------------------
+int dap_get_interface(void)
+{
+  dap_state_t *dap = dap_state();
+
+  return dap->interface;
 }
 
 //-----------------------------------------------------------------------------
 void dap_disconnect(void)
 {
+  dap_state_t *dap = dap_state();
   uint8_t buf[1];
 
   buf[0] = ID_DAP_DISCONNECT;
-  dbg_dap_cmd(buf, sizeof(buf), 1);
+  dap_cmd(buf, sizeof(buf), 1);
 
-  dap_interface = DAP_INTERFACE_NONE;
+  dap->interface = DAP_INTERFACE_NONE;
 }
 
 //-----------------------------------------------------------------------------
-void dap_swj_clock(uint32_t clock)
+static void swj_clock(uint32_t clock)
 {
+  dap_state_t *dap = dap_state();
   uint8_t buf[5];
 
   buf[0] = ID_DAP_SWJ_CLOCK;
@@ -295,9 +538,35 @@ void dap_swj_clock(uint32_t clock)
   buf[2] = (clock >> 8) & 0xff;
   buf[3] = (clock >> 16) & 0xff;
   buf[4] = (clock >> 24) & 0xff;
-  dbg_dap_cmd(buf, sizeof(buf), 5);
+  sync_cmd(buf, sizeof(buf), 5);
 
   check(DAP_OK == buf[0], "SWJ_CLOCK failed");
+
+  dap->clock = clock;
+}
+
+//-----------------------------------------------------------------------------
+void dap_swj_clock(uint32_t clock)
+{
+  flush_cmds();
+  swj_clock(clock);
+}
+
+//-----------------------------------------------------------------------------
+uint32_t dap_get_clock(void)
+{
+  dap_state_t *dap = dap_state();
+
+  return dap->clock;
+}
+
+//-----------------------------------------------------------------------------
+void dap_set_clock_steps(const long *clocks, int count)
+{
+  dap_state_t *dap = dap_state();
+
+  dap->clock_steps = clocks;
+  dap->clock_step_count = count;
 }
 
 //-----------------------------------------------------------------------------
@@ -311,7 +580,7 @@ void dap_transfer_configure(uint8_t idle, uint16_t retry, uint16_t match_retry)
   buf[3] = (retry >> 8) & 0xff;
   buf[4] = match_retry & 0xff;
   buf[5] = (match_retry >> 8) & 0xff;
-  dbg_dap_cmd(buf, sizeof(buf), 6);
+  dap_cmd(buf, sizeof(buf), 6);
 
   check(DAP_OK == buf[0], "TRANSFER_CONFIGURE failed");
 }
@@ -323,7 +592,7 @@ void dap_swd_configure(int cfg)
 
   buf[0] = ID_DAP_SWD_CONFIGURE;
   buf[1] = cfg;
-  dbg_dap_cmd(buf, sizeof(buf), 2);
+  dap_cmd(buf, sizeof(buf), 2);
 
   check(DAP_OK == buf[0], "SWD_CONFIGURE failed");
 }
@@ -337,7 +606,7 @@ void dap_jtag_configure(int count, int *ir_len)
   buf[1] = count;
   for (int i = 0; i < count; i++)
     buf[2+i] = ir_len[i];
-  dbg_dap_cmd(buf, sizeof(buf), 2 + count);
+  dap_cmd(buf, sizeof(buf), 2 + count);
 
   check(DAP_OK == buf[0], "JTAG_CONFIGURE failed");
 }
@@ -345,7 +614,10 @@ void dap_jtag_configure(int count, int *ir_len)
 //-----------------------------------------------------------------------------
 void dap_jtag_set_index(int index)
 {
-  dap_jtag_index = index;
+  dap_state_t *dap = dap_state();
+
+  dap->jtag_index = index;
+  invalidate_cache();
 }
 
 //-----------------------------------------------------------------------------
@@ -356,7 +628,7 @@ int dap_info(int info, uint8_t *data, int size)
 
   buf[0] = ID_DAP_INFO;
   buf[1] = info;
-  dbg_dap_cmd(buf, sizeof(buf), 2);
+  dap_cmd(buf, sizeof(buf), 2);
 
   rsize = (size < buf[0]) ? size : buf[0];
   memcpy(data, &buf[1], rsize);
@@ -367,6 +639,65 @@ int dap_info(int info, uint8_t *data, int size)
   return rsize;
 }
 
+//-----------------------------------------------------------------------------
+void dap_session_init(session_t *session)
+{
+  dap_state_t *state = buf_alloc(sizeof(dap_state_t));
+
+  state->dp_version = 1;
+  state->target_id = DAP_INVALID_TARGET_ID;
+  state->tar_wrap_size = DAP_TAR_WRAP_SIZE;
+  state->interface = DAP_INTERFACE_NONE;
+  state->packet_count = 1;
+  state->stream_lookahead = STREAM_LOOKAHEAD;
+  state->set_address = true;
+  state->set_select = true;
+  state->error_exit = true;
+  state->retry_position = -1;
+  state->wait_position = -1;
+  state->jtag_response_done = true;
+
+  session->dap_state = state;
+}
+
+//-----------------------------------------------------------------------------
+void dap_session_free(session_t *session)
+{
+  dap_state_t *state = session->dap_state;
+
+  if (NULL == state)
+    return;
+
+  for (int i = 0; i < DBG_MAX_PACKETS; i++)
+    buf_free(state->packet[i].buf);
+
+  buf_free(state->jtag_buf);
+  buf_free(state);
+
+  session->dap_state = NULL;
+}
+
+//-----------------------------------------------------------------------------
+void dap_init(void)
+{
+  dap_state_t *dap = dap_state();
+  uint8_t buf[2];
+
+  if (2 == dap_info(DAP_INFO_PACKET_SIZE, buf, sizeof(buf)))
+  {
+    int size = buf[0] | (buf[1] << 8);
+
+    if (size > dbg_get_packet_size())
+      dbg_set_packet_size(size);
+  }
+
+  if (1 == dap_info(DAP_INFO_PACKET_COUNT, buf, sizeof(buf)) && buf[0] > 0)
+    dap->packet_count = (buf[0] < DBG_MAX_PACKETS) ? buf[0] : DBG_MAX_PACKETS;
+
+  if (dap_info(DAP_INFO_CAPABILITIES, buf, sizeof(buf)) > 0)
+    dap->atomic_cmd = (buf[0] & DAP_CAP_ATOMIC_CMD) ? true : false;
+}
+
 //-----------------------------------------------------------------------------
 static uint32_t dap_parity(uint32_t value)
 {
@@ -378,14 +709,52 @@ static uint32_t dap_parity(uint32_t value)
   return (0x6996 >> value) & 1;
 }
 
+//-----------------------------------------------------------------------------
+static int target_select_sequence(uint8_t *buf)
+{
+  dap_state_t *dap = dap_state();
+
+  buf[0] = ID_DAP_SWD_SEQUENCE;
+  buf[1] = 5; // Request Count
+  // 1
+  buf[2] = SWD_SEQUENCE_COUNT(7 * 8);
+  buf[3] = 0xff;
+  buf[4] = 0xff;
+  buf[5] = 0xff;
+  buf[6] = 0xff;
+  buf[7] = 0xff;
+  buf[8] = 0xff;
+  buf[9] = 0x3f;
+  // 2
+  buf[10] = SWD_SEQUENCE_COUNT(8);
+  buf[11] = 0x99; // DP, Write, TARGETSEL
+  // 3
+  buf[12] = SWD_SEQUENCE_COUNT(5) | SWD_SEQUENCE_DIN;
+  // 4
+  buf[13] = SWD_SEQUENCE_COUNT(32+1);
+  buf[14] = dap->target_id >> 0;
+  buf[15] = dap->target_id >> 8;
+  buf[16] = dap->target_id >> 16;
+  buf[17] = dap->target_id >> 24;
+  buf[18] = dap_parity(dap->target_id);
+  // 5
+  buf[19] = SWD_SEQUENCE_COUNT(2);
+  buf[20] = 0x00;
+
+  return 21;
+}
+
 //-----------------------------------------------------------------------------
 void dap_reset_link(void)
 {
+  dap_state_t *dap = dap_state();
   uint8_t buf[32];
 
-  if (DAP_INTERFACE_SWD == dap_interface)
+  invalidate_cache();
+
+  if (DAP_INTERFACE_SWD == dap->interface)
   {
-    if (dap_dp_version == 1)
+    if (dap->dp_version == 1)
     {
       buf[0] = ID_DAP_SWJ_SEQUENCE;
       buf[1] = (7 + 2 + 7 + 1) * 8;
@@ -407,12 +776,11 @@ void dap_reset_link(void)
       buf[17] = 0xff;
       buf[18] = 0x00;
 
-      dbg_dap_cmd(buf, sizeof(buf), 19);
-      check(DAP_OK == buf[0], "SWJ_SEQUENCE failed");
+      queue_cmd(buf, 19, 1, "SWJ_SEQUENCE");
 
-      dap_read_idcode();
+      dap_read_idcode_req();
     }
-    else if (dap_dp_version == 2)
+    else if (dap->dp_version == 2)
     {
       // Switch to SWD
       buf[0] = ID_DAP_SWJ_SEQUENCE;
@@ -443,48 +811,19 @@ void dap_reset_link(void)
       buf[25] = 0xff;
       buf[26] = 0x3f;
 
-      dbg_dap_cmd(buf, sizeof(buf), 27);
-      check(DAP_OK == buf[0], "SWJ_SEQUENCE failed");
+      queue_cmd(buf, 27, 1, "SWJ_SEQUENCE");
 
       // Target Select
-      buf[0] = ID_DAP_SWD_SEQUENCE;
-      buf[1] = 5; // Request Count
-      // 1
-      buf[2] = SWD_SEQUENCE_COUNT(7 * 8);
-      buf[3] = 0xff;
-      buf[4] = 0xff;
-      buf[5] = 0xff;
-      buf[6] = 0xff;
-      buf[7] = 0xff;
-      buf[8] = 0xff;
-      buf[9] = 0x3f;
-      // 2
-      buf[10] = SWD_SEQUENCE_COUNT(8);
-      buf[11] = 0x99; // DP, Write, TARGETSEL
-      // 3
-      buf[12] = SWD_SEQUENCE_COUNT(5) | SWD_SEQUENCE_DIN;
-      // 4
-      buf[13] = SWD_SEQUENCE_COUNT(32+1);
-      buf[14] = dap_target_id >> 0;
-      buf[15] = dap_target_id >> 8;
-      buf[16] = dap_target_id >> 16;
-      buf[17] = dap_target_id >> 24;
-      buf[18] = dap_parity(dap_target_id);
-      // 5
-      buf[19] = SWD_SEQUENCE_COUNT(2);
-      buf[20] = 0x00;
-
-      dbg_dap_cmd(buf, sizeof(buf), 21);
-      check(DAP_OK == buf[0], "SWD_SEQUENCE failed");
-
-      dap_read_idcode();
+      queue_cmd(buf, target_select_sequence(buf), 2, "SWD_SEQUENCE");
+
+      dap_read_idcode_req();
     }
     else
     {
-      error_exit("internal: unknown dap_dp_version value (%d)", dap_dp_version);
+      error_exit("internal: unknown dap_dp_version value (%d)", dap->dp_version);
     }
   }
-  else if (DAP_INTERFACE_JTAG == dap_interface)
+  else if (DAP_INTERFACE_JTAG == dap->interface)
   {
     buf[0] = ID_DAP_SWJ_SEQUENCE;
     buf[1] = (7 + 2 + 1 + 1) * 8;
@@ -500,8 +839,7 @@ void dap_reset_link(void)
     buf[11] = 0xff;
     buf[12] = 0x00;
 
-    dbg_dap_cmd(buf, sizeof(buf), 13);
-    check(DAP_OK == buf[0], "SWJ_SEQUENCE failed");
+    queue_cmd(buf, 13, 1, "SWJ_SEQUENCE");
   }
   else
   {
@@ -530,7 +868,7 @@ void dap_reset_target(void)
   uint8_t buf[1];
 
   buf[0] = ID_DAP_RESET_TARGET;
-  dbg_dap_cmd(buf, sizeof(buf), 1);
+  dap_cmd(buf, sizeof(buf), 1);
 
   check(DAP_OK == buf[0], "RESET_TARGET failed");
 }
@@ -541,6 +879,8 @@ void dap_reset_target_hw(int state)
   uint8_t buf[7];
   int value = state ? (DAP_SWJ_SWCLK_TCK | DAP_SWJ_SWDIO_TMS) : 0;
 
+  invalidate_cache();
+
   //-------------
   buf[0] = ID_DAP_SWJ_PINS;
   buf[1] = value; // Value
@@ -549,9 +889,9 @@ void dap_reset_target_hw(int state)
   buf[4] = 0;
   buf[5] = 0;
   buf[6] = 0;
-  dbg_dap_cmd(buf, sizeof(buf), 7);
+  queue_cmd(buf, 7, 1, NULL);
 
-  sleep_ms(10);
+  dap_delay(10000);
 
   //-------------
   buf[0] = ID_DAP_SWJ_PINS;
@@ -561,9 +901,9 @@ void dap_reset_target_hw(int state)
   buf[4] = 0;
   buf[5] = 0;
   buf[6] = 0;
-  dbg_dap_cmd(buf, sizeof(buf), 7);
+  queue_cmd(buf, 7, 1, NULL);
 
-  sleep_ms(10);
+  dap_delay(10000);
 }
 
 //-----------------------------------------------------------------------------
@@ -571,6 +911,8 @@ void dap_reset_pin(int state)
 {
   uint8_t buf[7];
 
+  invalidate_cache();
+
   buf[0] = ID_DAP_SWJ_PINS;
   buf[1] = state ? DAP_SWJ_nRESET : 0; // Value
   buf[2] = DAP_SWJ_nRESET; // Select
@@ -578,19 +920,112 @@ void dap_reset_pin(int state)
   buf[4] = 0;
   buf[5] = 0;
   buf[6] = 0;
-  dbg_dap_cmd(buf, sizeof(buf), 7);
+  queue_cmd(buf, 7, 1, NULL);
+}
+
+//-----------------------------------------------------------------------------
+void dap_delay(uint32_t us)
+{
+  dap_state_t *dap = dap_state();
+  uint8_t buf[3];
+
+  if (!dap->atomic_cmd)
+  {
+    sleep_ms((us + 999) / 1000);
+    return;
+  }
+
+  while (us)
+  {
+    uint32_t delay = (us < DELAY_MAX) ? us : DELAY_MAX;
+
+    buf[0] = ID_DAP_DELAY;
+    buf[1] = delay & 0xff;
+    buf[2] = (delay >> 8) & 0xff;
+    queue_cmd(buf, 3, 1, "DAP_DELAY");
+
+    us -= delay;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void dap_flush(void)
+{
+  flush_cmds();
+}
+
+//-----------------------------------------------------------------------------
+static void alloc_buffers(void)
+{
+  dap_state_t *dap = dap_state();
+  int size = dbg_get_packet_size() + TRANSFER_BUF_EXTRA;
+
+  if (size <= dap->packet_buf_size)
+    return;
+
+  assert(0 == dap->packet_pending);
+
+  for (int i = 0; i < DBG_MAX_PACKETS; i++)
+  {
+    buf_free(dap->packet[i].buf);
+    dap->packet[i].buf = buf_alloc(size);
+  }
+
+  buf_free(dap->jtag_buf);
+  dap->jtag_buf = buf_alloc(size);
+
+  dap->packet_buf_size = size;
+
+  // A whole block of word requests must be available before it can be sent
+  dap->stream_lookahead = dbg_get_packet_size() / sizeof(uint32_t) + 1;
+
+  if (dap->stream_lookahead < STREAM_LOOKAHEAD)
+    dap->stream_lookahead = STREAM_LOOKAHEAD;
+}
+
+//-----------------------------------------------------------------------------
+static dap_request_t *get_request(int index)
+{
+  dap_state_t *dap = dap_state();
+
+  return &dap->request[index % TRANSFER_SIZE];
 }
 
 //-----------------------------------------------------------------------------
-static void dap_add_req(int type, int size, uint32_t addr, uint32_t data)
+static dap_request_t *dap_add_req(int type, int size, uint32_t addr, uint32_t data)
 {
-  dap_request_t req;
-  req.type = type;
-  req.size = size;
-  req.addr = addr;
-  req.data = data;
-  assert(dap_request_count < TRANSFER_SIZE);
-  dap_request[dap_request_count++] = req;
+  dap_state_t *dap = dap_state();
+  dap_request_t *req;
+
+  if (0 == dap->request_count)
+    dap->response_count = 0;
+
+  // Make room for the new request if all entries are still waiting for responses
+  while ((dap->request_count - dap->response_count) == TRANSFER_SIZE)
+  {
+    if (dap->packet_pending)
+      receive_packet();
+    else
+      stream_requests(true);
+  }
+
+  req = get_request(dap->request_count++);
+  req->type = type;
+  req->size = size;
+  req->addr = addr;
+  req->data = data;
+  req->mask = 0;
+  req->dst  = NULL;
+  req->count = 0;
+
+  if (TRANSFER_TYPE_READ == type || TRANSFER_TYPE_WRITE == type)
+    dap->transport_stats.bytes += 1 << size;
+
+  // Full packets are sent as soon as they can be built
+  if ((dap->request_count - dap->request_index) >= dap->stream_lookahead)
+    stream_requests(false);
+
+  return req;
 }
 
 //-----------------------------------------------------------------------------
@@ -629,6 +1064,48 @@ void dap_write_word_req(uint32_t addr, uint32_t data)
   dap_add_req(TRANSFER_TYPE_WRITE, TRANSFER_SIZE_WORD, addr, data);
 }
 
+//-----------------------------------------------------------------------------
+static bool is_bulk(dap_request_t *req)
+{
+  return (TRANSFER_TYPE_READ_BLOCK == req->type || TRANSFER_TYPE_WRITE_BLOCK == req->type);
+}
+
+//-----------------------------------------------------------------------------
+static void dap_add_block_req(int type, uint32_t addr, uint8_t *data, int count)
+{
+  dap_state_t *dap = dap_state();
+  dap_request_t *req = dap_add_req(type, TRANSFER_SIZE_WORD, addr, 0);
+
+  req->dst   = data;
+  req->count = count;
+
+  dap->transport_stats.bytes += count * sizeof(uint32_t);
+}
+
+//-----------------------------------------------------------------------------
+static void dap_add_wait_req(int size, uint32_t addr, uint32_t mask, uint32_t value)
+{
+  dap_add_req(TRANSFER_TYPE_WAIT, size, addr, value)->mask = mask;
+}
+
+//-----------------------------------------------------------------------------
+void dap_wait_byte_req(uint32_t addr, uint32_t mask, uint32_t value)
+{
+  dap_add_wait_req(TRANSFER_SIZE_BYTE, addr, mask, value);
+}
+
+//-----------------------------------------------------------------------------
+void dap_wait_half_req(uint32_t addr, uint32_t mask, uint32_t value)
+{
+  dap_add_wait_req(TRANSFER_SIZE_HALF, addr, mask, value);
+}
+
+//-----------------------------------------------------------------------------
+void dap_wait_word_req(uint32_t addr, uint32_t mask, uint32_t value)
+{
+  dap_add_wait_req(TRANSFER_SIZE_WORD, addr, mask, value);
+}
+
 //-----------------------------------------------------------------------------
 void dap_read_idcode_req(void)
 {
@@ -638,9 +1115,13 @@ void dap_read_idcode_req(void)
 //-----------------------------------------------------------------------------
 void dap_readback_req(void)
 {
-  assert(dap_request_count > 0);
-  assert(dap_request[dap_request_count-1].type == TRANSFER_TYPE_WRITE);
-  dap_request[dap_request_count-1].type = TRANSFER_TYPE_WRITE_READ;
+  dap_state_t *dap = dap_state();
+  dap_request_t *req;
+
+  assert(dap->request_count > dap->request_index);
+  req = get_request(dap->request_count-1);
+  assert(req->type == TRANSFER_TYPE_WRITE);
+  req->type = TRANSFER_TYPE_WRITE_READ;
 }
 
 //-----------------------------------------------------------------------------
@@ -672,109 +1153,167 @@ static uint32_t from_lane(int size, uint32_t addr, uint32_t data)
 //-----------------------------------------------------------------------------
 static void append_word(uint32_t value)
 {
-  dap_buf[dap_buf_size + 0] = value & 0xff;
-  dap_buf[dap_buf_size + 1] = (value >> 8) & 0xff;
-  dap_buf[dap_buf_size + 2] = (value >> 16) & 0xff;
-  dap_buf[dap_buf_size + 3] = (value >> 24) & 0xff;
-  dap_buf_size += sizeof(uint32_t);
+  dap_state_t *dap = dap_state();
+
+  dap->buf[dap->buf_size + 0] = value & 0xff;
+  dap->buf[dap->buf_size + 1] = (value >> 8) & 0xff;
+  dap->buf[dap->buf_size + 2] = (value >> 16) & 0xff;
+  dap->buf[dap->buf_size + 3] = (value >> 24) & 0xff;
+  dap->buf_size += sizeof(uint32_t);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t get_word(uint8_t *buf)
+{
+  return ((uint32_t)buf[3] << 24) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[1] << 8) | buf[0];
 }
 
 //-----------------------------------------------------------------------------
 static bool buffer_request(dap_request_t *req)
 {
-  int packet_size = dbg_get_packet_size();
+  dap_state_t *dap = dap_state();
+  int packet_size = dbg_get_packet_size() - dap->buf_reserve;
   int buf_size, ops_size, response_size, address_inc;
-  uint32_t address, csw;
-  bool set_address;
-
-  buf_size      = dap_buf_size;
-  ops_size      = dap_ops_size;
-  response_size = dap_response_size;
-  set_address   = dap_set_address;
-  address_inc   = dap_address_inc;
-  address       = dap_address;
-  csw           = dap_csw;
+  uint32_t address, csw, match_mask, select;
+  bool set_address, set_select;
+  dap_cache_stats_t cache_stats;
+
+  buf_size      = dap->buf_size;
+  ops_size      = dap->ops_size;
+  response_size = dap->response_size;
+  set_address   = dap->set_address;
+  address_inc   = dap->address_inc;
+  address       = dap->address;
+  csw           = dap->csw;
+  match_mask    = dap->match_mask;
+  set_select    = dap->set_select;
+  select        = dap->select;
+  cache_stats   = dap->cache_stats;
 
   if (TRANSFER_TYPE_READ == req->type || TRANSFER_TYPE_WRITE == req->type ||
-      TRANSFER_TYPE_WRITE_READ == req->type)
+      TRANSFER_TYPE_WRITE_READ == req->type || TRANSFER_TYPE_WAIT == req->type)
   {
-    dap_csw = AP_CSW_DBGSWENABLE | AP_CSW_PROT(0x23);
+    dap->csw = AP_CSW_DBGSWENABLE | AP_CSW_PROT(0x23);
 
     if (TRANSFER_SIZE_BYTE == req->size)
     {
-      dap_csw |= AP_CSW_SIZE_BYTE;
-      dap_address_inc = sizeof(uint8_t);
+      dap->csw |= AP_CSW_SIZE_BYTE;
+      dap->address_inc = sizeof(uint8_t);
     }
     else if (TRANSFER_SIZE_HALF == req->size)
     {
-      dap_csw |= AP_CSW_SIZE_HALF;
-      dap_address_inc = sizeof(uint16_t);
+      dap->csw |= AP_CSW_SIZE_HALF;
+      dap->address_inc = sizeof(uint16_t);
     }
     else if (TRANSFER_SIZE_WORD == req->size)
     {
-      dap_csw |= AP_CSW_SIZE_WORD;
-      dap_address_inc = sizeof(uint32_t);
+      dap->csw |= AP_CSW_SIZE_WORD;
+      dap->address_inc = sizeof(uint32_t);
     }
 
-    if (TRANSFER_TYPE_WRITE_READ == req->type)
-      dap_address_inc = 0;
+    if (TRANSFER_TYPE_WRITE_READ == req->type || TRANSFER_TYPE_WAIT == req->type)
+      dap->address_inc = 0;
     else
-      dap_csw |= AP_CSW_ADDRINC_SINGLE;
+      dap->csw |= AP_CSW_ADDRINC_SINGLE;
 
-    if (dap_csw != csw)
+    if (dap->csw != csw)
     {
-      dap_buf[dap_buf_size++] = SWD_AP_CSW;
-      append_word(dap_csw);
-      dap_ops[dap_ops_size++] = OP_SIZE;
+      dap->buf[dap->buf_size++] = SWD_AP_CSW;
+      append_word(dap->csw);
+      dap->ops[dap->ops_size++] = OP_SIZE;
+      dap->cache_stats.csw_misses++;
+    }
+    else
+    {
+      dap->cache_stats.csw_hits++;
     }
 
-    if (dap_set_address || dap_address != req->addr || 0 == (dap_address & 0x3ff))
+    if (dap->set_address || dap->address != req->addr || 0 == (dap->address % dap->tar_wrap_size))
     {
-      dap_buf[dap_buf_size++] = SWD_AP_TAR;
+      dap->buf[dap->buf_size++] = SWD_AP_TAR;
       append_word(req->addr);
-      dap_ops[dap_ops_size++] = OP_ADDRESS;
-      dap_address = req->addr;
-      dap_set_address = false;
+      dap->ops[dap->ops_size++] = OP_ADDRESS;
+      dap->address = req->addr;
+      dap->set_address = false;
+      dap->cache_stats.tar_misses++;
+    }
+    else
+    {
+      dap->cache_stats.tar_hits++;
     }
 
     if (TRANSFER_TYPE_WRITE == req->type || TRANSFER_TYPE_WRITE_READ == req->type)
     {
-      dap_buf[dap_buf_size++] = SWD_AP_DRW;
+      dap->buf[dap->buf_size++] = SWD_AP_DRW;
       append_word(to_lane(req->size, req->addr, req->data));
-      dap_ops[dap_ops_size++] = (TRANSFER_TYPE_WRITE == req->type) ? OP_WRITE : OP_SKIP;
+      dap->ops[dap->ops_size++] = (TRANSFER_TYPE_WRITE == req->type) ? OP_WRITE : OP_SKIP;
     }
 
     if (TRANSFER_TYPE_READ == req->type || TRANSFER_TYPE_WRITE_READ == req->type)
     {
-      dap_buf[dap_buf_size++] = SWD_AP_DRW | DAP_TRANSFER_RnW;
-      dap_ops[dap_ops_size++] = OP_READ;
-      dap_response_size += sizeof(uint32_t);
+      dap->buf[dap->buf_size++] = SWD_AP_DRW | DAP_TRANSFER_RnW;
+      dap->ops[dap->ops_size++] = OP_READ;
+      dap->response_size += sizeof(uint32_t);
+    }
+
+    if (TRANSFER_TYPE_WAIT == req->type)
+    {
+      uint32_t mask = to_lane(req->size, req->addr, req->mask);
+
+      if (dap->match_mask != mask)
+      {
+        dap->buf[dap->buf_size++] = DAP_TRANSFER_MATCH_MASK;
+        append_word(mask);
+        dap->ops[dap->ops_size++] = OP_MATCH_MASK;
+        dap->match_mask = mask;
+      }
+
+      dap->buf[dap->buf_size++] = SWD_AP_DRW | DAP_TRANSFER_RnW | DAP_TRANSFER_MATCH_VALUE;
+      append_word(to_lane(req->size, req->addr, req->data));
+      dap->ops[dap->ops_size++] = OP_WAIT;
     }
 
-    dap_address += dap_address_inc;
+    dap->address += dap->address_inc;
+  }
+  else if (TRANSFER_TYPE_WRITE_REG == req->type && SWD_DP_W_SELECT == req->addr &&
+      !dap->set_select && dap->select == req->data)
+  {
+    dap->ops[dap->ops_size++] = OP_CACHED;
+    dap->cache_stats.select_hits++;
   }
   else if (TRANSFER_TYPE_WRITE_REG == req->type)
   {
-    dap_buf[dap_buf_size++] = req->addr;
+    if (SWD_DP_W_SELECT == req->addr)
+    {
+      dap->select = req->data;
+      dap->set_select = false;
+      dap->cache_stats.select_misses++;
+    }
+
+    dap->buf[dap->buf_size++] = req->addr;
     append_word(req->data);
-    dap_ops[dap_ops_size++] = OP_WRITE;
+    dap->ops[dap->ops_size++] = OP_WRITE;
   }
   else // TRANSFER_TYPE_READ_REG
   {
-    dap_buf[dap_buf_size++] = req->addr | DAP_TRANSFER_RnW;
-    dap_ops[dap_ops_size++] = OP_READ;
-    dap_response_size += sizeof(uint32_t);
+    dap->buf[dap->buf_size++] = req->addr | DAP_TRANSFER_RnW;
+    dap->ops[dap->ops_size++] = OP_READ;
+    dap->response_size += sizeof(uint32_t);
   }
 
-  if (dap_buf_size > packet_size || dap_response_size > packet_size || dap_ops_size > 255)
+  if (dap->buf_size > packet_size || dap->response_size > packet_size || dap->ops_size > 255)
   {
-    dap_buf_size      = buf_size;
-    dap_ops_size      = ops_size;
-    dap_response_size = response_size;
-    dap_set_address   = set_address;
-    dap_address_inc   = address_inc;
-    dap_address       = address;
-    dap_csw           = csw;
+    dap->buf_size      = buf_size;
+    dap->ops_size      = ops_size;
+    dap->response_size = response_size;
+    dap->set_address   = set_address;
+    dap->address_inc   = address_inc;
+    dap->address       = address;
+    dap->csw           = csw;
+    dap->match_mask    = match_mask;
+    dap->set_select    = set_select;
+    dap->select        = select;
+    dap->cache_stats   = cache_stats;
     return false;
   }
 
@@ -782,92 +1321,804 @@ static bool buffer_request(dap_request_t *req)
 }
 
 //-----------------------------------------------------------------------------
-void dap_transfer(void)
+static bool buffer_bulk(dap_request_t *req)
 {
-  int count, status;
-  uint32_t *data;
-
-  dap_response_count = 0;
-  dap_csw = 0;
+  dap_state_t *dap = dap_state();
+  int packet_size = dbg_get_packet_size() - dap->buf_reserve;
+  uint32_t csw = AP_CSW_DBGSWENABLE | AP_CSW_PROT(0x23) | AP_CSW_SIZE_WORD | AP_CSW_ADDRINC_SINGLE;
+  bool read = (TRANSFER_TYPE_READ_BLOCK == req->type);
 
-  while (dap_response_count < dap_request_count)
+  // Words are encoded directly from the caller's buffer, as many as fit into the packet
+  while (dap->request_offset < req->count)
   {
-    dap_buf[0] = ID_DAP_TRANSFER;
-    dap_buf[1] = dap_jtag_index;
-    dap_buf[2] = 0; // Request size (placeholder)
+    uint32_t addr = req->addr + dap->request_offset * sizeof(uint32_t);
+    bool set_csw = (dap->csw != csw);
+    bool set_tar = (dap->set_address || dap->address != addr || 0 == (addr % dap->tar_wrap_size));
+    int buf_size = dap->buf_size + (read ? 1 : 5) + (set_csw ? 5 : 0) + (set_tar ? 5 : 0);
+    int response_size = dap->response_size + (read ? sizeof(uint32_t) : 0);
 
-    dap_buf_size = 3;
-    dap_ops_size = 0;
-    dap_response_size = 2; // count and status
+    if (buf_size > packet_size || response_size > packet_size || (dap->ops_size + 3) > 255)
+      return false;
 
-    for (int i = dap_response_count; i < dap_request_count; i++)
+    if (set_csw)
     {
-      if (!buffer_request(&dap_request[i]))
-        break;
+      dap->buf[dap->buf_size++] = SWD_AP_CSW;
+      append_word(csw);
+      dap->ops[dap->ops_size++] = OP_SIZE;
+      dap->csw = csw;
+      dap->cache_stats.csw_misses++;
+    }
+    else
+    {
+      dap->cache_stats.csw_hits++;
     }
 
-    dap_buf[2] = dap_ops_size;
-
-    //verbose("--- %d / %d, req_cnt = %d, resp_cnt = %d, resp_size = %d\n",
-    //  dap_ops_size, dap_buf_size, dap_request_count, dap_response_count, dap_response_size);
-
-    dbg_dap_cmd(dap_buf, sizeof(dap_buf), dap_buf_size);
-
-    count  = dap_buf[0];
-    status = dap_buf[1];
-    data   = (uint32_t *)&dap_buf[2];
-
-    if (dap_ops_size != count || DAP_TRANSFER_OK != status)
-      error_exit("invalid response during transfer (count = %d/%d, status = %d)", count, dap_ops_size, status);
-
-    for (int i = 0; i < count; i++)
+    if (set_tar)
+    {
+      dap->buf[dap->buf_size++] = SWD_AP_TAR;
+      append_word(addr);
+      dap->ops[dap->ops_size++] = OP_ADDRESS;
+      dap->address = addr;
+      dap->set_address = false;
+      dap->cache_stats.tar_misses++;
+    }
+    else
     {
-      dap_request_t *req = &dap_request[dap_response_count];
+      dap->cache_stats.tar_hits++;
+    }
 
-      if (OP_READ == dap_ops[i])
-      {
-        dap_response[dap_response_count++] = from_lane(req->size, req->addr, *data);
-        data++;
-      }
-      else if (OP_WRITE == dap_ops[i])
-      {
-        dap_response[dap_response_count++] = req->data;
-      }
+    if (read)
+    {
+      dap->buf[dap->buf_size++] = SWD_AP_DRW | DAP_TRANSFER_RnW;
+      dap->ops[dap->ops_size++] = OP_READ;
+      dap->response_size = response_size;
     }
+    else
+    {
+      dap->buf[dap->buf_size++] = SWD_AP_DRW;
+      memcpy(&dap->buf[dap->buf_size], &req->dst[dap->request_offset * sizeof(uint32_t)], sizeof(uint32_t));
+      dap->buf_size += sizeof(uint32_t);
+      dap->ops[dap->ops_size++] = OP_WRITE;
+    }
+
+    dap->address += sizeof(uint32_t);
+    dap->request_offset++;
   }
 
-  dap_request_count = 0;
+  dap->request_offset = 0;
+
+  return true;
 }
 
 //-----------------------------------------------------------------------------
-uint32_t dap_get_response(int index)
+static int block_size(int index)
 {
-  assert(index < dap_response_count);
-  return dap_response[index];
-}
+  dap_state_t *dap = dap_state();
+  int packet_size = dbg_get_packet_size() - dap->buf_reserve;
+  dap_request_t *first = get_request(index);
+  uint32_t csw = AP_CSW_DBGSWENABLE | AP_CSW_PROT(0x23) | AP_CSW_SIZE_WORD | AP_CSW_ADDRINC_SINGLE;
+  uint32_t addr = first->addr + dap->request_offset * sizeof(uint32_t);
+  bool read = (TRANSFER_TYPE_READ == first->type || TRANSFER_TYPE_READ_BLOCK == first->type);
+  int size, max_size;
+
+  if (TRANSFER_SIZE_WORD != first->size)
+    return 0;
+
+  if (TRANSFER_TYPE_READ != first->type && TRANSFER_TYPE_WRITE != first->type && !is_bulk(first))
+    return 0;
+
+  // Block transfers rely on CSW and TAR being already set up by a regular transfer
+  if (dap->set_address || dap->csw != csw || dap->address != addr || 0 == (dap->address % dap->tar_wrap_size))
+    return 0;
+
+  if (read)
+    max_size = (packet_size - 4) / sizeof(uint32_t); // Command, Count[2], Status
+  else
+    max_size = (packet_size - 5) / sizeof(uint32_t); // Command, Index, Count[2], Request
+
+  if (max_size > TRANSFER_BLOCK_MAX)
+    max_size = TRANSFER_BLOCK_MAX;
+
+  // TAR auto-increment is only guaranteed within the wrap boundary
+  size = (dap->tar_wrap_size - (addr % dap->tar_wrap_size)) / sizeof(uint32_t);
+
+  if (is_bulk(first))
+  {
+    int remaining = first->count - dap->request_offset;
+
+    if (max_size > remaining)
+      max_size = remaining;
+
+    // With large packets a block up to the wrap boundary still beats a regular
+    // transfer, which is limited to 255 operations
+    if (size < max_size)
+      return (size > 255) ? size : 0;
+
+    return max_size;
+  }
+
+  // Regular transfers can cross the wrap boundary, so blocks are only used when they fill a whole packet
+  if (size < max_size)
+    return 0;
+
+  size = 1;
+
+  while (size < max_size && (index + size) < dap->request_count)
+  {
+    dap_request_t *req = get_request(index + size);
+
+    if (req->type != first->type || req->size != first->size ||
+        req->addr != (first->addr + size * sizeof(uint32_t)))
+      break;
+
+    size++;
+  }
+
+  return (size == max_size) ? size : 0;
+}
+
+//-----------------------------------------------------------------------------
+static void buffer_block(dap_packet_t *packet, int size)
+{
+  dap_state_t *dap = dap_state();
+  dap_request_t *req = get_request(packet->first);
+  bool read = (TRANSFER_TYPE_READ == req->type || TRANSFER_TYPE_READ_BLOCK == req->type);
+
+  dap->buf[0] = ID_DAP_TRANSFER_BLOCK;
+  dap->buf[1] = dap->jtag_index;
+  dap->buf[2] = size & 0xff;
+  dap->buf[3] = (size >> 8) & 0xff;
+  dap->buf[4] = read ? (SWD_AP_DRW | DAP_TRANSFER_RnW) : SWD_AP_DRW;
+  dap->buf_size = 5;
+
+  if (is_bulk(req))
+  {
+    if (!read)
+    {
+      memcpy(&dap->buf[dap->buf_size], &req->dst[dap->request_offset * sizeof(uint32_t)], size * sizeof(uint32_t));
+      dap->buf_size += size * sizeof(uint32_t);
+    }
+
+    dap->request_offset += size;
+
+    if (dap->request_offset == req->count)
+      dap->request_offset = 0;
+
+    packet->count = (0 == dap->request_offset) ? 1 : 0;
+  }
+  else
+  {
+    if (!read)
+    {
+      for (int i = 0; i < size; i++)
+        append_word(get_request(packet->first + i)->data);
+    }
+
+    packet->count = size;
+  }
+
+  dap->address += size * sizeof(uint32_t);
+  dap->cache_stats.csw_hits += size;
+  dap->cache_stats.tar_hits += size;
+  packet->xfer_count = size;
+  packet->block = true;
+  packet->wait  = false;
+}
+
+//-----------------------------------------------------------------------------
+static void buffer_transfer(dap_packet_t *packet)
+{
+  dap_state_t *dap = dap_state();
+  int index = packet->first;
+
+  dap->buf[0] = ID_DAP_TRANSFER;
+  dap->buf[1] = dap->jtag_index;
+  dap->buf[2] = 0; // Request size (placeholder)
+
+  dap->buf_size = 3;
+  dap->ops_size = 0;
+  dap->response_size = 2; // count and status
+
+  packet->wait = false;
+
+  while (index < dap->request_count)
+  {
+    dap_request_t *req = get_request(index);
+
+    if (is_bulk(req) ? !buffer_bulk(req) : !buffer_request(req))
+      break;
+
+    if (TRANSFER_TYPE_WAIT == req->type)
+      packet->wait = true;
+
+    index++;
+  }
+
+  packet->xfer_count = 0;
+
+  for (int i = 0; i < dap->ops_size; i++)
+  {
+    if (OP_CACHED != dap->ops[i])
+      packet->xfer_count++;
+  }
+
+  dap->buf[2] = packet->xfer_count;
+
+  //verbose("--- %d / %d, req_cnt = %d, resp_cnt = %d, resp_size = %d\n",
+  //  dap->ops_size, dap->buf_size, dap->request_count, dap->response_count, dap->response_size);
+
+  packet->ops_size = dap->ops_size;
+  packet->count    = index - packet->first;
+  packet->block    = false;
+}
+
+//-----------------------------------------------------------------------------
+static bool transfer_error(int status, char *fmt, ...)
+{
+  dap_state_t *dap = dap_state();
+  char str[256];
+  va_list args;
+
+  dap->error = true;
+
+  if (!dap->error_exit)
+    return false;
+
+  // Requests that were not completed are sent again after the link is recovered
+  if (dap->retry_position != dap->response_count || dap->retry_offset != dap->response_offset)
+  {
+    dap->retry_position = dap->response_count;
+    dap->retry_offset = dap->response_offset;
+    dap->retry_count = 0;
+  }
+
+  if (++dap->retry_count <= RETRY_MAX)
+  {
+    dap->retry = true;
+    dap->retry_status = status;
+    return true;
+  }
+
+  va_start(args, fmt);
+  vsnprintf(str, sizeof(str), fmt, args);
+  va_end(args);
+
+  error_exit("%s", str);
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+static int completed_count(dap_packet_t *packet, int count)
+{
+  if (count > packet->xfer_count)
+    return 0;
+
+  if (0 == count)
+    return 0;
+
+  // The probe may count a posted read whose data was never returned, so it is read again
+  if (packet->block)
+    return (TRANSFER_TYPE_READ == get_request(packet->first)->type ||
+        TRANSFER_TYPE_READ_BLOCK == get_request(packet->first)->type) ? (count - 1) : count;
+
+  for (int i = 0, done = 0; i < packet->ops_size; i++)
+  {
+    if (OP_CACHED == packet->ops[i])
+      continue;
+
+    if (++done == count)
+      return (OP_READ == packet->ops[i]) ? (count - 1) : count;
+  }
+
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+static void complete_request(dap_request_t *req, uint32_t value)
+{
+  dap_state_t *dap = dap_state();
+
+  if (req->dst && !is_bulk(req))
+    memcpy(req->dst, &value, 1 << req->size);
+
+  if (dap->response_count < TRANSFER_SIZE)
+    dap->response[dap->response_count] = value;
+
+  dap->response_count++;
+}
+
+//-----------------------------------------------------------------------------
+static void receive_bulk(dap_request_t *req, uint8_t *data, int count)
+{
+  dap_state_t *dap = dap_state();
+
+  if (TRANSFER_TYPE_READ_BLOCK == req->type)
+    memcpy(&req->dst[dap->response_offset * sizeof(uint32_t)], data, count * sizeof(uint32_t));
+
+  dap->response_offset += count;
+
+  if (dap->response_offset == req->count)
+  {
+    dap->response_offset = 0;
+    complete_request(req, 0);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void receive_block(dap_packet_t *packet)
+{
+  dap_request_t *first = get_request(packet->first);
+  bool read = (TRANSFER_TYPE_READ == first->type);
+  int count, status;
+
+  count  = packet->buf[0] | (packet->buf[1] << 8);
+  status = packet->buf[2];
+
+  // Without the error exit the requests are completed anyway to keep the queue consistent
+  if (packet->xfer_count != count || DAP_TRANSFER_OK != status)
+  {
+    if (!transfer_error(status, "invalid response during block transfer (count = %d/%d, status = %d)", count, packet->xfer_count, status))
+      count = packet->xfer_count;
+    else
+      count = completed_count(packet, count);
+  }
+
+  if (is_bulk(first))
+  {
+    receive_bulk(first, &packet->buf[3], count);
+    return;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    dap_request_t *req = get_request(packet->first + i);
+    complete_request(req, read ? get_word(&packet->buf[3 + i * sizeof(uint32_t)]) : req->data);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void receive_transfer(dap_packet_t *packet)
+{
+  dap_state_t *dap = dap_state();
+  uint8_t *data = &packet->buf[2];
+  int count, status;
+  bool mismatch;
+
+  count  = packet->buf[0];
+  status = packet->buf[1];
+
+  // On a mismatch the remaining requests are sent again by dap_transfer()
+  mismatch = packet->wait && (DAP_TRANSFER_OK | DAP_TRANSFER_MISMATCH) == status;
+
+  if (!mismatch && (packet->xfer_count != count || DAP_TRANSFER_OK != status))
+  {
+    if (!transfer_error(status, "invalid response during transfer (count = %d/%d, status = %d)", count, packet->xfer_count, status))
+      count = packet->xfer_count;
+    else
+      count = completed_count(packet, count);
+  }
+
+  for (int i = 0, done = 0; i < packet->ops_size; i++)
+  {
+    dap_request_t *req = get_request(dap->response_count);
+
+    if (OP_CACHED != packet->ops[i])
+    {
+      if (done == count)
+        break;
+
+      done++;
+    }
+
+    if (is_bulk(req))
+    {
+      if (OP_READ == packet->ops[i] || OP_WRITE == packet->ops[i])
+        receive_bulk(req, data, 1);
+
+      if (OP_READ == packet->ops[i])
+        data += sizeof(uint32_t);
+    }
+    else if (OP_READ == packet->ops[i])
+    {
+      complete_request(req, from_lane(req->size, req->addr, get_word(data)));
+      data += sizeof(uint32_t);
+    }
+    else if (OP_WRITE == packet->ops[i] || OP_WAIT == packet->ops[i] || OP_CACHED == packet->ops[i])
+    {
+      complete_request(req, req->data);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void lower_clock(void)
+{
+  dap_state_t *dap = dap_state();
+
+  for (int i = 0; i < dap->clock_step_count; i++)
+  {
+    uint32_t clock = dap->clock_steps[i];
+
+    if (clock < dap->clock)
+    {
+      warning("repeated transfer errors at %u kHz, lowering the clock to %u kHz", dap->clock / 1000, clock / 1000);
+
+      // Queued commands are left for the requests that will be sent again
+      swj_clock(clock);
+      dap->retry_count = 0;
+      return;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void recover_link(void)
+{
+  dap_state_t *dap = dap_state();
+  uint64_t start = get_time_us();
+  int status = dap->retry_status & 7;
+  uint32_t abort = DP_ABORT_STKCMPCLR | DP_ABORT_STKERRCLR | DP_ABORT_ORUNERRCLR | DP_ABORT_WDERRCLR;
+  uint8_t buf[32];
+  bool line_reset;
+  int size;
+
+  if (DAP_TRANSFER_WAIT == status)
+    dap->error_stats.wait++;
+  else if (DAP_TRANSFER_FAULT == status)
+    dap->error_stats.fault++;
+  else
+    dap->error_stats.protocol++;
+
+  // Protocol errors may leave the SWD interface in the lockout state
+  line_reset = (DAP_INTERFACE_SWD == dap->interface && DAP_TRANSFER_WAIT != status && DAP_TRANSFER_FAULT != status);
+
+  // Queued commands are left for the requests that will be sent again
+  if (line_reset)
+  {
+    if (dap->dp_version == 2)
+    {
+      size = target_select_sequence(buf);
+    }
+    else
+    {
+      buf[0] = ID_DAP_SWJ_SEQUENCE;
+      buf[1] = (7 + 1) * 8;
+      memset(&buf[2], 0xff, 7);
+      buf[9] = 0x00;
+      size = 10;
+    }
+
+    sync_cmd(buf, sizeof(buf), size);
+    check(DAP_OK == buf[0], "line reset failed");
+
+    dap->error_stats.line_resets++;
+  }
+
+  // A stalled access is also cancelled, so the probe does not wait for it
+  if (DAP_TRANSFER_WAIT == status)
+    abort |= DP_ABORT_DAPABORT;
+
+  buf[0] = ID_DAP_TRANSFER;
+  buf[1] = dap->jtag_index;
+  buf[2] = line_reset ? 2 : 1;
+  size = 3;
+
+  if (line_reset)
+    buf[size++] = SWD_DP_R_IDCODE | DAP_TRANSFER_RnW;
+
+  buf[size++] = SWD_DP_W_ABORT;
+  buf[size++] = abort >> 0;
+  buf[size++] = abort >> 8;
+  buf[size++] = abort >> 16;
+  buf[size++] = abort >> 24;
+
+  sync_cmd(buf, sizeof(buf), size);
+
+  if (buf[0] != (line_reset ? 2 : 1) || DAP_TRANSFER_OK != buf[1])
+    error_exit("failed to recover the link after a transfer error (status = %d)", dap->retry_status);
+
+  // The link fails at the same place again, so it is likely too fast for the target
+  if (dap->retry_count >= CLOCK_BACKOFF_RETRIES)
+    lower_clock();
+
+  // Only the requests that did not complete are sent again
+  dap->request_index = dap->response_count;
+  dap->request_offset = dap->response_offset;
+  invalidate_cache();
+
+  dap->retry = false;
+  dap->error_stats.retries++;
+
+  dap->error_stats.recovery_time += get_time_us() - start;
+}
+
+//-----------------------------------------------------------------------------
+static void receive_packet(void)
+{
+  dap_state_t *dap = dap_state();
+  dap_packet_t *packet = &dap->packet[dap->packet_first];
+
+  dap->transport_stats.usb_in += dbg_dap_cmd_receive(packet->buf, dap->packet_buf_size);
+
+  if (packet->cmds)
+  {
+    int offs;
+
+    check(packet->buf[0] == (dap->cmd_count + 1), "EXECUTE_COMMANDS failed");
+
+    offs = 1 + receive_cmds(&packet->buf[1]);
+
+    if (packet->buf[offs] != (packet->block ? ID_DAP_TRANSFER_BLOCK : ID_DAP_TRANSFER))
+      error_exit("invalid response received: response = 0x%02x", packet->buf[offs]);
+
+    memmove(packet->buf, &packet->buf[offs + 1], dap->packet_buf_size - offs - 1);
+  }
+
+  dap->packet_first = (dap->packet_first + 1) % DBG_MAX_PACKETS;
+  dap->packet_pending--;
+
+  if (0 == dap->packet_pending)
+    dap->transport_stats.round_trips++;
+
+  // Packets sent after a failed one are discarded and sent again
+  if (dap->retry)
+    return;
+
+  if (packet->block)
+    receive_block(packet);
+  else
+    receive_transfer(packet);
+
+  if (dap->retry)
+  {
+    while (dap->packet_pending)
+      receive_packet();
+
+    recover_link();
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void check_wait_timeout(void)
+{
+  dap_state_t *dap = dap_state();
+  dap_request_t *req = get_request(dap->response_count);
+
+  // A condition that never becomes true (a stuck busy flag) must not resend the wait forever
+  if (dap->wait_position != dap->response_count)
+  {
+    dap->wait_position = dap->response_count;
+    dap->wait_start = get_time_us();
+  }
+  else if ((get_time_us() - dap->wait_start) > WAIT_TIMEOUT * 1000ull)
+  {
+    if (TRANSFER_TYPE_WAIT == req->type)
+      error_exit("timeout waiting for 0x%08x & 0x%08x to become 0x%08x", req->addr, req->mask, req->data);
+    else
+      error_exit("timeout waiting for a transfer to complete");
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void stream_requests(bool flush)
+{
+  dap_state_t *dap = dap_state();
+
+  alloc_buffers();
+
+  // Up to dap->packet_count packets are kept in flight, responses are processed in order
+  while (dap->request_index < dap->request_count)
+  {
+    dap_packet_t *packet;
+    int size;
+
+    // Without a flush, the last requests may still be a part of a larger block
+    if (!flush && (dap->request_count - dap->request_index) < dap->stream_lookahead)
+      break;
+
+    if (dap->packet_pending == dap->packet_count)
+      receive_packet();
+
+    packet = &dap->packet[(dap->packet_first + dap->packet_pending) % DBG_MAX_PACKETS];
+
+    // Queued commands are sent together with the first packet
+    packet->cmds = (dap->cmd_count > 0 && 0 == dap->packet_pending);
+
+    if (packet->cmds)
+    {
+      packet->buf[0] = ID_DAP_EXECUTE_COMMANDS;
+      packet->buf[1] = dap->cmd_count + 1;
+      memcpy(&packet->buf[2], dap->cmd_buf, dap->cmd_size);
+
+      dap->buf = &packet->buf[dap->cmd_size + 2];
+      dap->buf_reserve = (dap->cmd_size > dap->cmd_resp_size) ? (dap->cmd_size + 2) : (dap->cmd_resp_size + 2);
+    }
+    else
+    {
+      dap->buf = packet->buf;
+      dap->buf_reserve = 0;
+    }
+
+    dap->ops = packet->ops;
+
+    packet->first = dap->request_index;
+    size = block_size(dap->request_index);
+
+    if (size)
+      buffer_block(packet, size);
+    else
+      buffer_transfer(packet);
+
+    if (packet->cmds)
+      dbg_dap_cmd_send(packet->buf, dap->buf_size + dap->cmd_size + 2);
+    else
+      dbg_dap_cmd_send(dap->buf, dap->buf_size);
+
+    dap->packet_pending++;
+
+    dap->transport_stats.packets++;
+    dap->transport_stats.transfer_packets++;
+    dap->transport_stats.transfers += packet->xfer_count;
+    dap->transport_stats.usb_out += dap->buf_size + (packet->cmds ? (dap->cmd_size + 2) : 0);
+
+    dap->request_index += packet->count;
+
+    // The probe must not execute anything past a wait until the condition is met
+    if (packet->wait)
+    {
+      uint64_t start = get_time_us();
+
+      while (dap->packet_pending)
+        receive_packet();
+
+      dap->transport_stats.poll_time += get_time_us() - start;
+
+      if (dap->response_count < dap->request_index || dap->response_offset != dap->request_offset)
+      {
+        check_wait_timeout();
+
+        dap->request_index = dap->response_count;
+        dap->request_offset = dap->response_offset;
+        invalidate_cache();
+      }
+    }
+  }
+
+  dap->buf_reserve = 0;
+}
+
+//-----------------------------------------------------------------------------
+void dap_transfer(void)
+{
+  dap_state_t *dap = dap_state();
+
+  if (0 == dap->request_count)
+    dap->response_count = 0;
+
+  // A transfer error rewinds the stream to the first request that did not complete
+  do
+  {
+    stream_requests(true);
+
+    while (dap->packet_pending)
+      receive_packet();
+  } while (dap->request_index < dap->request_count);
+
+  dap->retry_position = -1;
+  dap->wait_position = -1;
+  dap->request_count = 0;
+  dap->request_index = 0;
+  dap->request_offset = 0;
+  dap->response_offset = 0;
+}
+
+//-----------------------------------------------------------------------------
+bool dap_get_error(void)
+{
+  dap_state_t *dap = dap_state();
+  bool error = dap->error;
+
+  dap->error = false;
+
+  return error;
+}
+
+//-----------------------------------------------------------------------------
+bool dap_check_link(void)
+{
+  dap_state_t *dap = dap_state();
+  static const uint32_t patterns[] = { 0x00000000, 0xfffffffc, 0xaaaaaaa8, 0x55555554, 0x12345678, 0xedcba984 };
+  bool res = true;
+
+  // The link is exercised with TAR writes and reads, so target memory is not affected
+  dap->error_exit = false;
+  dap->error = false;
+
+  dap_reset_link();
+
+  if (!dap->error)
+  {
+    for (int i = 0; i < ARRAY_SIZE(patterns); i++)
+    {
+      dap_add_req(TRANSFER_TYPE_WRITE_REG, TRANSFER_SIZE_WORD, SWD_AP_TAR, patterns[i]);
+      dap_add_req(TRANSFER_TYPE_READ_REG, TRANSFER_SIZE_WORD, SWD_AP_TAR, 0);
+    }
+
+    dap_transfer();
+
+    for (int i = 0; i < ARRAY_SIZE(patterns) && !dap->error; i++)
+      res = res && (dap_get_response(i * 2 + 1) == patterns[i]);
+  }
+
+  invalidate_cache();
+
+  dap->error_exit = true;
+
+  return res && !dap_get_error();
+}
+
+//-----------------------------------------------------------------------------
+void dap_get_cache_stats(dap_cache_stats_t *stats)
+{
+  dap_state_t *dap = dap_state();
+
+  *stats = dap->cache_stats;
+}
+
+//-----------------------------------------------------------------------------
+void dap_get_error_stats(dap_error_stats_t *stats)
+{
+  dap_state_t *dap = dap_state();
+
+  *stats = dap->error_stats;
+}
+
+//-----------------------------------------------------------------------------
+void dap_get_transport_stats(dap_transport_stats_t *stats)
+{
+  dap_state_t *dap = dap_state();
+
+  *stats = dap->transport_stats;
+}
+
+//-----------------------------------------------------------------------------
+uint32_t dap_get_response(int index)
+{
+  dap_state_t *dap = dap_state();
+
+  assert(index < dap->response_count && index < TRANSFER_SIZE);
+  return dap->response[index];
+}
 
 //-----------------------------------------------------------------------------
 uint8_t dap_read_byte(uint32_t addr)
 {
+  dap_state_t *dap = dap_state();
+
   dap_read_byte_req(addr);
   dap_transfer();
-  return dap_response[0];
+  return dap->response[0];
 }
 
 //-----------------------------------------------------------------------------
 uint16_t dap_read_half(uint32_t addr)
 {
+  dap_state_t *dap = dap_state();
+
   dap_read_half_req(addr);
   dap_transfer();
-  return dap_response[0];
+  return dap->response[0];
 }
 
 //-----------------------------------------------------------------------------
 uint32_t dap_read_word(uint32_t addr)
 {
+  dap_state_t *dap = dap_state();
+
   dap_read_word_req(addr);
   dap_transfer();
-  return dap_response[0];
+  return dap->response[0];
 }
 
 //-----------------------------------------------------------------------------
@@ -894,109 +2145,147 @@ void dap_write_word(uint32_t addr, uint32_t data)
 //-----------------------------------------------------------------------------
 void dap_read_block(uint32_t addr, uint8_t *data, int size)
 {
-  uint32_t ptr = addr;
-  uint32_t rem = size;
-  int cnt = 0;
+  uint32_t start = addr & ~(uint32_t)(sizeof(uint32_t) - 1);
+  uint32_t end = (addr + size + sizeof(uint32_t) - 1) & ~(uint32_t)(sizeof(uint32_t) - 1);
+  int offs = addr - start;
+  int tail = (addr + size) % sizeof(uint32_t);
+  uint32_t first = start, last = end;
+  uint32_t head_word, tail_word;
 
   if (size == 0)
     return;
 
-  while (rem && (ptr % sizeof(uint32_t)))
+  // Unaligned head and tail bytes are read as a part of their containing words,
+  // everything else goes directly into the caller's buffer
+  if (offs || size < (int)sizeof(uint32_t))
   {
-    dap_read_byte_req(ptr);
-    ptr += sizeof(uint8_t);
-    rem -= sizeof(uint8_t);
+    dap_add_req(TRANSFER_TYPE_READ, TRANSFER_SIZE_WORD, first, 0)->dst = (uint8_t *)&head_word;
+    first += sizeof(uint32_t);
   }
 
-  while (rem >= sizeof(uint32_t))
-  {
-    dap_read_word_req(ptr);
-    ptr += sizeof(uint32_t);
-    rem -= sizeof(uint32_t);
-  }
+  if (tail && last > first)
+    last -= sizeof(uint32_t);
 
-  while (rem)
-  {
-    dap_read_byte_req(ptr);
-    ptr += sizeof(uint8_t);
-    rem -= sizeof(uint8_t);
-  }
+  if (last > first)
+    dap_add_block_req(TRANSFER_TYPE_READ_BLOCK, first, &data[first - addr], (last - first) / sizeof(uint32_t));
+
+  if (last < end && last >= first)
+    dap_add_req(TRANSFER_TYPE_READ, TRANSFER_SIZE_WORD, last, 0)->dst = (uint8_t *)&tail_word;
 
   dap_transfer();
 
-  while (size && (addr % sizeof(uint32_t)))
+  if (offs || size < (int)sizeof(uint32_t))
   {
-    *data = dap_response[cnt++];
-    data += sizeof(uint8_t);
-    addr += sizeof(uint8_t);
-    size -= sizeof(uint8_t);
-  }
+    int count = sizeof(uint32_t) - offs;
 
-  while (size >= (int)sizeof(uint32_t))
-  {
-    *(uint32_t *)data = dap_response[cnt++];
-    data += sizeof(uint32_t);
-    size -= sizeof(uint32_t);
+    if (count > size)
+      count = size;
+
+    memcpy(data, (uint8_t *)&head_word + offs, count);
+
+    data += count;
+    size -= count;
   }
 
+  if (tail && size)
+    memcpy(&data[size - tail], &tail_word, tail);
+}
+
+//-----------------------------------------------------------------------------
+static void write_partial_req(uint32_t addr, uint8_t *data, int size)
+{
   while (size)
   {
-    *data = dap_response[cnt++];
-    data += sizeof(uint8_t);
-    size -= sizeof(uint8_t);
+    if (0 == (addr % sizeof(uint16_t)) && size >= (int)sizeof(uint16_t))
+    {
+      dap_write_half_req(addr, data[0] | (data[1] << 8));
+      data += sizeof(uint16_t);
+      addr += sizeof(uint16_t);
+      size -= sizeof(uint16_t);
+    }
+    else
+    {
+      dap_write_byte_req(addr, *data);
+      data += sizeof(uint8_t);
+      addr += sizeof(uint8_t);
+      size -= sizeof(uint8_t);
+    }
   }
 }
 
 //-----------------------------------------------------------------------------
 void dap_write_block(uint32_t addr, uint8_t *data, int size)
 {
+  int head;
+
   if (size == 0)
     return;
 
-  while (size && (addr % sizeof(uint32_t)))
-  {
-    dap_write_byte_req(addr, *data);
-    data += sizeof(uint8_t);
-    addr += sizeof(uint8_t);
-    size -= sizeof(uint8_t);
-  }
+  head = (sizeof(uint32_t) - (addr % sizeof(uint32_t))) % sizeof(uint32_t);
 
-  while (size >= (int)sizeof(uint32_t))
-  {
-    dap_write_word_req(addr, *(uint32_t *)data);
-    data += sizeof(uint32_t);
-    addr += sizeof(uint32_t);
-    size -= sizeof(uint32_t);
-  }
+  if (head > size)
+    head = size;
 
-  while (size)
+  write_partial_req(addr, data, head);
+  data += head;
+  addr += head;
+  size -= head;
+
+  if (size >= (int)sizeof(uint32_t))
   {
-    dap_write_byte_req(addr, *data);
-    data += sizeof(uint8_t);
-    addr += sizeof(uint8_t);
-    size -= sizeof(uint8_t);
+    int count = size / sizeof(uint32_t);
+
+    dap_add_block_req(TRANSFER_TYPE_WRITE_BLOCK, addr, data, count);
+    data += count * sizeof(uint32_t);
+    addr += count * sizeof(uint32_t);
+    size -= count * sizeof(uint32_t);
   }
 
+  write_partial_req(addr, data, size);
+
+  dap_transfer();
+}
+
+//-----------------------------------------------------------------------------
+void dap_wait_byte(uint32_t addr, uint8_t mask, uint8_t value)
+{
+  dap_wait_byte_req(addr, mask, value);
+  dap_transfer();
+}
+
+//-----------------------------------------------------------------------------
+void dap_wait_half(uint32_t addr, uint16_t mask, uint16_t value)
+{
+  dap_wait_half_req(addr, mask, value);
+  dap_transfer();
+}
+
+//-----------------------------------------------------------------------------
+void dap_wait_word(uint32_t addr, uint32_t mask, uint32_t value)
+{
+  dap_wait_word_req(addr, mask, value);
   dap_transfer();
 }
 
 //-----------------------------------------------------------------------------
 uint32_t dap_read_idcode(void)
 {
-  if (DAP_INTERFACE_SWD == dap_interface)
+  dap_state_t *dap = dap_state();
+
+  if (DAP_INTERFACE_SWD == dap->interface)
   {
     dap_read_idcode_req();
     dap_transfer();
-    return dap_response[0];
+    return dap->response[0];
   }
-  else if (DAP_INTERFACE_JTAG == dap_interface)
+  else if (DAP_INTERFACE_JTAG == dap->interface)
   {
     uint8_t buf[16];
 
     buf[0] = ID_DAP_JTAG_IDCODE;
-    buf[1] = dap_jtag_index;
+    buf[1] = dap->jtag_index;
 
-    dbg_dap_cmd(buf, sizeof(buf), 2);
+    dap_cmd(buf, sizeof(buf), 2);
     check(DAP_OK == buf[0], "JTAG_IDCODE failed");
 
     return *((uint32_t *)&buf[1]);
@@ -1006,192 +2295,271 @@ uint32_t dap_read_idcode(void)
 }
 
 //-----------------------------------------------------------------------------
-static void dap_jtag_add_req(int tdi, int tms, int tdo)
+static uint64_t get_bits(uint8_t *buf, int offset, int count)
 {
-  dap_jtag_request_t req;
-  req.tdi = tdi ? 1 : 0;
-  req.opt = (tms ? JTAG_SEQUENCE_TMS : 0) | (tdo ? JTAG_SEQUENCE_TDO : 0);
-  assert(dap_request_count < TRANSFER_SIZE);
-  dap_jtag_request[dap_jtag_request_count++] = req;
+  int shift = offset % 8;
+  int size = (shift + count + 7) / 8;
+  uint64_t value;
+
+  buf += offset / 8;
+  value = buf[0] >> shift;
+
+  for (int i = 1; i < size; i++)
+    value |= (uint64_t)buf[i] << (i * 8 - shift);
+
+  return (count < 64) ? (value & ((1ull << count) - 1)) : value;
 }
 
 //-----------------------------------------------------------------------------
-void dap_jtag_clk(int tdi, int tms)
+static void put_bits(uint8_t *buf, int offset, uint64_t value, int count)
 {
-  dap_jtag_add_req(tdi, tms, 0);
+  int shift = offset % 8;
+  int size = (shift + count + 7) / 8;
+
+  // The destination is expected to be cleared past the offset
+  buf += offset / 8;
+  buf[0] |= value << shift;
+
+  for (int i = 1; i < size; i++)
+    buf[i] |= value >> (i * 8 - shift);
 }
 
 //-----------------------------------------------------------------------------
-void dap_jtag_clk_read(int tdi, int tms)
+static void jtag_send_packet(uint8_t *buf, int req_count, int req_size, int *tdo_size, int tdo_count)
 {
-  dap_jtag_add_req(tdi, tms, 1);
+  dap_state_t *dap = dap_state();
+  int tdo_index = 1;
+
+  buf[0] = ID_DAP_JTAG_SEQUENCE;
+  buf[1] = req_count;
+
+  dap_cmd(buf, dap->packet_buf_size, req_size);
+  check(DAP_OK == buf[0], "JTAG_SEQUENCE failed");
+
+  for (int i = 0; i < tdo_count; i++)
+  {
+    assert((dap->jtag_response_count + tdo_size[i]) <= (JTAG_RESPONSE_BUF_SIZE * 8));
+    put_bits(dap->jtag_response_buf, dap->jtag_response_count, get_bits(&buf[tdo_index], 0, tdo_size[i]), tdo_size[i]);
+    dap->jtag_response_count += tdo_size[i];
+    tdo_index += (tdo_size[i] + 7) / 8;
+  }
 }
 
 //-----------------------------------------------------------------------------
-void dap_jtag_flush(void)
+static void jtag_send(void)
 {
-  uint8_t buf[DBG_MAX_EP_SIZE];
-  int tdo_size[DBG_MAX_EP_SIZE / 2];
-  int tdo_count, req_count, req_size, index, remaining;
-
-  if (0 == dap_jtag_request_count)
-    return;
-
-  memset(dap_jtag_response_buf, 0, sizeof(dap_jtag_response_buf));
-  dap_jtag_response_count = 0;
+  dap_state_t *dap = dap_state();
+  uint8_t *buf;
+  int tdo_size[255];
+  int tdo_count = 0;
+  int req_count = 0;
+  int req_size  = 2; // Command and Count
+  int max_size  = dbg_get_packet_size() - 1;
 
-  memset(buf, 0, sizeof(buf));
+  int index = 0;
+  int offset = 0;
 
-  index     = 0;
-  tdo_count = 0;
-  req_count = 0;
-  req_size  = 2; // Command and Count
-  remaining = dbg_get_packet_size() - req_size - 1;
+  alloc_buffers();
+  buf = dap->jtag_buf;
 
-  while (index < dap_jtag_request_count)
+  while (index < dap->jtag_sequence_count)
   {
-    int count = 0;
+    dap_jtag_sequence_t *seq = &dap->jtag_sequence[index];
+    int count = seq->count - offset;
     int size;
 
-    for (int i = index; i < dap_jtag_request_count; i++, count++)
+    // Sequences that do not fit are split to fill the packet completely
+    if ((max_size - req_size) < 2 || 255 == req_count)
     {
-      if (dap_jtag_request[i].opt != dap_jtag_request[index].opt)
-        break;
+      jtag_send_packet(buf, req_count, req_size, tdo_size, tdo_count);
+      tdo_count = 0;
+      req_count = 0;
+      req_size  = 2;
     }
 
-    if (count > 64)
-      count = 64;
+    if (count > (max_size - req_size - 1) * 8)
+      count = (max_size - req_size - 1) * 8;
 
-    if (count > (remaining * 8))
-      count = remaining * 8;
+    size = (count + 7) / 8;
 
-    buf[req_size] = JTAG_SEQUENCE_COUNT(count) | dap_jtag_request[index].opt;
+    buf[req_size] = JTAG_SEQUENCE_COUNT(count) | seq->opt;
 
-    for (int i = 0; i < count; i++)
-      buf[req_size + 1 + i / 8] |= (dap_jtag_request[index + i].tdi << (i % 8));
+    for (int i = 0; i < size; i++)
+      buf[req_size + 1 + i] = (seq->tdi >> offset) >> (i * 8);
 
-    if (dap_jtag_request[index].opt & JTAG_SEQUENCE_TDO)
+    if (seq->opt & JTAG_SEQUENCE_TDO)
       tdo_size[tdo_count++] = count;
 
-    size = 1 + (count + 7) / 8;
-    req_size += size;
-    remaining -= size;
-
+    req_size += size + 1;
     req_count++;
-    index += count;
 
-    if (remaining < 2 || index == dap_jtag_request_count)
+    offset += count;
+
+    if (offset == seq->count)
     {
-      int tdo_index = 1;
+      index++;
+      offset = 0;
+    }
+  }
 
-      buf[0] = ID_DAP_JTAG_SEQUENCE;
-      buf[1] = req_count;
+  if (req_count)
+    jtag_send_packet(buf, req_count, req_size, tdo_size, tdo_count);
 
-      dbg_dap_cmd(buf, sizeof(buf), req_size);
-      check(DAP_OK == buf[0], "JTAG_SEQUENCE failed");
+  dap->jtag_sequence_count = 0;
+}
 
-      for (int i = 0; i < tdo_count; i++)
-      {
-        for (int j = 0; j < tdo_size[i]; j++)
-        {
-          int bit = (buf[tdo_index + j / 8] & (1 << (j % 8))) ? 1 : 0;
-          dap_jtag_response_buf[dap_jtag_response_count / 8] |= (bit << (dap_jtag_response_count % 8));
-          dap_jtag_response_count++;
-        }
-
-        tdo_index += (tdo_size[i] + 7) / 8;
-      }
+//-----------------------------------------------------------------------------
+static void jtag_add(uint64_t tdi, int count, int opt)
+{
+  dap_state_t *dap = dap_state();
+
+  // Responses are kept until the first request after an explicit flush
+  if (dap->jtag_response_done)
+  {
+    memset(dap->jtag_response_buf, 0, sizeof(dap->jtag_response_buf));
+    dap->jtag_response_count = 0;
+    dap->jtag_response_done = false;
+  }
 
-      memset(buf, 0, sizeof(buf));
+  // Clocks with the same options are merged into sequences of up to 64 bits
+  while (count)
+  {
+    dap_jtag_sequence_t *seq = NULL;
+    int size;
 
-      tdo_count = 0;
-      req_count = 0;
-      req_size  = 2; // Command and Count
-      remaining = dbg_get_packet_size() - req_size - 1;
+    if (dap->jtag_sequence_count)
+      seq = &dap->jtag_sequence[dap->jtag_sequence_count - 1];
+
+    if (NULL == seq || seq->opt != opt || 64 == seq->count)
+    {
+      if (dap->jtag_sequence_count == JTAG_QUEUE_SIZE)
+        jtag_send();
+
+      seq = &dap->jtag_sequence[dap->jtag_sequence_count++];
+      seq->opt   = opt;
+      seq->count = 0;
+      seq->tdi   = 0;
     }
-  }
 
-  dap_jtag_request_count = 0;
+    size = 64 - seq->count;
+
+    if (size > count)
+      size = count;
+
+    seq->tdi |= ((size < 64) ? (tdi & ((1ull << size) - 1)) : tdi) << seq->count;
+    seq->count += size;
+
+    tdi = (size < 64) ? (tdi >> size) : 0;
+    count -= size;
+  }
 }
 
 //-----------------------------------------------------------------------------
-void dap_jtag_read(int offset, uint8_t *data, int size)
+static void jtag_add_data(uint8_t *data, int size, int opt)
 {
-  dap_jtag_flush();
+  if (0 == size)
+    return;
 
-  for (int i = 0; i < size; i++)
+  // The last bit exits the shift state
+  for (int i = 0; i < (size - 1); i += 64)
   {
-    int index = offset + i;
-    int bit;
+    int count = (size - 1 - i) < 64 ? (size - 1 - i) : 64;
+    jtag_add(data ? get_bits(data, i, count) : 0, count, opt);
+  }
+
+  jtag_add(data ? get_bits(data, size - 1, 1) : 0, 1, opt | JTAG_SEQUENCE_TMS);
+}
+
+//-----------------------------------------------------------------------------
+void dap_jtag_clk(int tdi, int tms)
+{
+  jtag_add(tdi ? 1 : 0, 1, tms ? JTAG_SEQUENCE_TMS : 0);
+}
+
+//-----------------------------------------------------------------------------
+void dap_jtag_clk_read(int tdi, int tms)
+{
+  jtag_add(tdi ? 1 : 0, 1, (tms ? JTAG_SEQUENCE_TMS : 0) | JTAG_SEQUENCE_TDO);
+}
+
+//-----------------------------------------------------------------------------
+void dap_jtag_flush(void)
+{
+  dap_state_t *dap = dap_state();
+
+  jtag_send();
+  dap->jtag_response_done = true;
+}
 
-    assert(index < dap_jtag_response_count);
+//-----------------------------------------------------------------------------
+void dap_jtag_read(int offset, uint8_t *data, int size)
+{
+  dap_state_t *dap = dap_state();
 
-    bit = (dap_jtag_response_buf[index / 8] & (1 << (index % 8))) ? 1 : 0;
+  dap_jtag_flush();
+
+  assert((offset + size) <= dap->jtag_response_count);
 
-    if ((i % 8) == 0)
-      data[i / 8] = 0;
+  for (int i = 0; i < size; i += 64)
+  {
+    int count = (size - i) < 64 ? (size - i) : 64;
+    uint64_t value = get_bits(dap->jtag_response_buf, offset + i, count);
 
-    data[i / 8] |= (bit << (i % 8));
+    for (int j = 0; j < (count + 7) / 8; j++)
+      data[i / 8 + j] = value >> (j * 8);
   }
 }
 
 //-----------------------------------------------------------------------------
 void dap_jtag_idle(int count)
 {
-  for (int i = 0; i < count; i++)
-    dap_jtag_clk(0, 0);
+  for (int i = 0; i < count; i += 64)
+    jtag_add(0, (count - i) < 64 ? (count - i) : 64, 0);
 }
 
 //-----------------------------------------------------------------------------
 void dap_jtag_reset(void)
 {
-  for (int i = 0; i < 16; i++)
-    dap_jtag_clk(0, 1);
-
-  dap_jtag_clk(0, 0);
+  jtag_add(0, 16, JTAG_SEQUENCE_TMS);
+  jtag_add(0, 1, 0);
 }
 
 //-----------------------------------------------------------------------------
 void dap_jtag_write_ir(int ir, int size)
 {
-  dap_jtag_clk(0, 1);
-  dap_jtag_clk(0, 1);
-  dap_jtag_clk(0, 0);
-  dap_jtag_clk(0, 0);
+  uint8_t data[4] = { ir, ir >> 8, ir >> 16, ir >> 24 };
 
-  for (int i = 0; i < size; i++)
-    dap_jtag_clk((ir >> i) & 1, i == (size-1));
+  jtag_add(0, 2, JTAG_SEQUENCE_TMS);
+  jtag_add(0, 2, 0);
+
+  jtag_add_data(data, size, 0);
 
-  dap_jtag_clk(0, 1);
-  dap_jtag_clk(0, 0);
+  jtag_add(0, 1, JTAG_SEQUENCE_TMS);
+  jtag_add(0, 1, 0);
 }
 
 //-----------------------------------------------------------------------------
 void dap_jtag_write_dr(uint8_t *data, int size)
 {
-  dap_jtag_clk(0, 1);
-  dap_jtag_clk(0, 0);
-  dap_jtag_clk(0, 0);
+  jtag_add(0, 1, JTAG_SEQUENCE_TMS);
+  jtag_add(0, 2, 0);
 
-  for (int i = 0; i < size; i++)
-    dap_jtag_clk((data[i / 8] >> (i % 8)) & 1, i == (size-1));
+  jtag_add_data(data, size, 0);
 
-  dap_jtag_clk(0, 1);
-  dap_jtag_clk(0, 0);
+  jtag_add(0, 1, JTAG_SEQUENCE_TMS);
+  jtag_add(0, 1, 0);
 }
 
 //-----------------------------------------------------------------------------
 void dap_jtag_read_dr(uint8_t *data, int size)
 {
-  dap_jtag_clk(0, 1);
-  dap_jtag_clk(0, 0);
-  dap_jtag_clk(0, 0);
+  jtag_add(0, 1, JTAG_SEQUENCE_TMS);
+  jtag_add(0, 2, 0);
 
-  for (int i = 0; i < size; i++)
-    dap_jtag_clk_read(0, i == (size-1));
+  jtag_add_data(NULL, size, JTAG_SEQUENCE_TDO);
 
-  dap_jtag_clk(0, 1);
-  dap_jtag_clk(0, 0);
+  jtag_add(0, 1, JTAG_SEQUENCE_TMS);
+  jtag_add(0, 1, 0);
 
   dap_jtag_read(0, data, size);
 }
@@ -1203,14 +2571,12 @@ int dap_jtag_scan_chain(uint32_t *idcode, int size)
 
   dap_jtag_reset();
 
-  dap_jtag_clk(1, 1);
-  dap_jtag_clk(1, 0);
-  dap_jtag_clk(1, 0);
+  jtag_add(1, 1, JTAG_SEQUENCE_TMS);
+  jtag_add(3, 2, 0);
 
   for (int i = 0; i < size; i++)
   {
-    for (int j = 0; j < 32; j++)
-      dap_jtag_clk_read(0, 0);
+    jtag_add(0, 32, JTAG_SEQUENCE_TDO);
 
     dap_jtag_read(0, (uint8_t *)&idcode[count], 32);
 
@@ -1220,11 +2586,9 @@ int dap_jtag_scan_chain(uint32_t *idcode, int size)
       break;
   }
 
-  dap_jtag_clk(1, 1);
-  dap_jtag_clk(1, 1);
-  dap_jtag_clk(1, 0);
+  jtag_add(3, 2, JTAG_SEQUENCE_TMS);
+  jtag_add(1, 1, 0);
 
   return count;
 }
 
-
@@ -7,6 +7,7 @@
 /*- Includes ----------------------------------------------------------------*/
 #include <stdint.h>
 #include <stdbool.h>
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 enum
@@ -48,26 +49,70 @@ enum
 };
 
 #define DAP_INVALID_TARGET_ID  0xffffffff
+#define DAP_TAR_WRAP_SIZE      1024 // Minimum allowed by the architecture
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  int      csw_hits;
+  int      csw_misses;
+  int      tar_hits;
+  int      tar_misses;
+  int      select_hits;
+  int      select_misses;
+} dap_cache_stats_t;
+
+typedef struct
+{
+  int      wait;
+  int      fault;
+  int      protocol;
+  int      retries;
+  int      line_resets;
+  uint64_t recovery_time; // us
+} dap_error_stats_t;
+
+typedef struct
+{
+  int      packets;
+  int      round_trips;      // Waits for a response with no other packets in flight
+  int      transfer_packets; // DAP_Transfer and DAP_TransferBlock packets
+  int      transfers;        // Operations in those packets
+  uint64_t bytes;            // Target memory data requested
+  uint64_t usb_out;
+  uint64_t usb_in;
+  uint64_t poll_time;        // us
+} dap_transport_stats_t;
 
 /*- Prototypes --------------------------------------------------------------*/
 void dap_set_dp_version(int version);
 void dap_set_target_id(uint32_t id);
+void dap_set_tar_wrap_size(uint32_t size);
+void dap_reset_target_config(void);
 
 void dap_led(int index, int state);
 void dap_connect(int interf);
 void dap_disconnect(void);
+int dap_get_interface(void);
 void dap_swj_clock(uint32_t clock);
+uint32_t dap_get_clock(void);
+void dap_set_clock_steps(const long *clocks, int count);
 void dap_transfer_configure(uint8_t idle, uint16_t retry, uint16_t match_retry);
 void dap_swd_configure(int cfg);
 void dap_jtag_configure(int count, int *ir_len);
 void dap_jtag_set_index(int index);
 int dap_info(int info, uint8_t *data, int size);
+void dap_session_init(session_t *session);
+void dap_session_free(session_t *session);
+void dap_init(void);
 void dap_reset_link(void);
 void dap_clear_pwrup_req(void);
 
 void dap_reset_target(void);
 void dap_reset_target_hw(int state);
 void dap_reset_pin(int state);
+void dap_delay(uint32_t us);
+void dap_flush(void);
 
 uint32_t dap_read_reg(uint8_t reg);
 void dap_write_reg(uint8_t reg, uint32_t data);
@@ -77,6 +122,9 @@ uint32_t dap_read_word(uint32_t addr);
 void dap_write_byte(uint32_t addr, uint8_t data);
 void dap_write_half(uint32_t addr, uint16_t data);
 void dap_write_word(uint32_t addr, uint32_t data);
+void dap_wait_byte(uint32_t addr, uint8_t mask, uint8_t value);
+void dap_wait_half(uint32_t addr, uint16_t mask, uint16_t value);
+void dap_wait_word(uint32_t addr, uint32_t mask, uint32_t value);
 void dap_read_block(uint32_t addr, uint8_t *data, int size);
 void dap_write_block(uint32_t addr, uint8_t *data, int size);
 
@@ -86,10 +134,18 @@ void dap_read_word_req(uint32_t addr);
 void dap_write_byte_req(uint32_t addr, uint32_t data);
 void dap_write_half_req(uint32_t addr, uint32_t data);
 void dap_write_word_req(uint32_t addr, uint32_t data);
+void dap_wait_byte_req(uint32_t addr, uint32_t mask, uint32_t value);
+void dap_wait_half_req(uint32_t addr, uint32_t mask, uint32_t value);
+void dap_wait_word_req(uint32_t addr, uint32_t mask, uint32_t value);
 void dap_read_idcode_req(void);
 void dap_readback_req(void);
 void dap_transfer(void);
 uint32_t dap_get_response(int index);
+bool dap_get_error(void);
+bool dap_check_link(void);
+void dap_get_cache_stats(dap_cache_stats_t *stats);
+void dap_get_error_stats(dap_error_stats_t *stats);
+void dap_get_transport_stats(dap_transport_stats_t *stats);
 
 uint32_t dap_read_idcode(void);
 
@@ -0,0 +1,532 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "edbg.h"
+#include "dbg.h"
+#include "session.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define TRACE_SIZE         65536 // Records, the oldest ones are overwritten
+#define TRACE_MAGIC        "EDBGTRC1"
+#define TRACE_RECORD_SIZE  20
+#define TRACE_BUCKETS      14
+#define TRACE_BUCKET_MIN   16 // us
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  int  (*enumerate)(debugger_t *debuggers, int size);
+  void (*open)(debugger_t *debugger, int version);
+  void (*close)(void);
+  int  (*get_packet_size)(void);
+  void (*set_packet_size)(int size);
+  void (*dap_cmd_send)(uint8_t *data, int req_size);
+  int  (*dap_cmd_receive)(uint8_t *data, int resp_size);
+} dbg_backend_t;
+
+typedef struct
+{
+  uint64_t time;    // ns from the start of the trace to the submit
+  uint32_t latency; // ns from the submit to the reap
+  uint16_t req_size;
+  uint16_t resp_size;
+  uint8_t  cmd;
+  uint8_t  pending; // Packets in flight at the submit, including this one
+} trace_record_t;
+
+typedef struct
+{
+  uint8_t  id;
+  char     *name;
+} trace_cmd_t;
+
+typedef struct
+{
+  const dbg_backend_t *backend;
+
+  FILE                *record;
+  uint64_t            record_start;
+
+  char                *trace_name;
+  trace_record_t      *trace;
+  uint64_t            trace_count;
+  uint64_t            trace_start;
+  trace_record_t      trace_pending[DBG_MAX_PACKETS];
+  int                 trace_first;
+  int                 trace_pending_count;
+} dbg_state_t;
+
+/*- Constants ---------------------------------------------------------------*/
+static const dbg_backend_t dbg_hw_backend =
+{
+  dbg_hw_enumerate, dbg_hw_open, dbg_hw_close, dbg_hw_get_packet_size,
+  dbg_hw_set_packet_size, dbg_hw_dap_cmd_send, dbg_hw_dap_cmd_receive,
+};
+
+static const dbg_backend_t dbg_sim_backend =
+{
+  dbg_sim_enumerate, dbg_sim_open, dbg_sim_close, dbg_sim_get_packet_size,
+  dbg_sim_set_packet_size, dbg_sim_dap_cmd_send, dbg_sim_dap_cmd_receive,
+};
+
+static const dbg_backend_t dbg_replay_backend =
+{
+  dbg_replay_enumerate, dbg_replay_open, dbg_replay_close, dbg_replay_get_packet_size,
+  dbg_replay_set_packet_size, dbg_replay_dap_cmd_send, dbg_replay_dap_cmd_receive,
+};
+
+static const trace_cmd_t trace_cmds[] =
+{
+  { 0x00, "INFO" },
+  { 0x01, "LED" },
+  { 0x02, "CONNECT" },
+  { 0x03, "DISCONNECT" },
+  { 0x04, "TRANSFER_CONFIGURE" },
+  { 0x05, "TRANSFER" },
+  { 0x06, "TRANSFER_BLOCK" },
+  { 0x07, "TRANSFER_ABORT" },
+  { 0x08, "WRITE_ABORT" },
+  { 0x09, "DELAY" },
+  { 0x0a, "RESET_TARGET" },
+  { 0x10, "SWJ_PINS" },
+  { 0x11, "SWJ_CLOCK" },
+  { 0x12, "SWJ_SEQUENCE" },
+  { 0x13, "SWD_CONFIGURE" },
+  { 0x14, "JTAG_SEQUENCE" },
+  { 0x15, "JTAG_CONFIGURE" },
+  { 0x16, "JTAG_IDCODE" },
+  { 0x1d, "SWD_SEQUENCE" },
+  { 0x7f, "EXECUTE_COMMANDS" },
+};
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static inline dbg_state_t *dbg_state(void)
+{
+  return (dbg_state_t *)g_session->dbg_state;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_session_init(session_t *session)
+{
+  dbg_state_t *state = buf_alloc(sizeof(dbg_state_t));
+
+  state->backend = &dbg_hw_backend;
+
+  session->dbg_state = state;
+
+  dbg_hw_session_init(session);
+  dbg_sim_session_init(session);
+  dbg_replay_session_init(session);
+}
+
+//-----------------------------------------------------------------------------
+void dbg_session_free(session_t *session)
+{
+  dbg_state_t *state = session->dbg_state;
+
+  dbg_replay_session_free(session);
+  dbg_sim_session_free(session);
+  dbg_hw_session_free(session);
+
+  if (NULL == state)
+    return;
+
+  if (state->record)
+    fclose(state->record);
+
+  buf_free(state->trace);
+  buf_free(state);
+
+  session->dbg_state = NULL;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_select_sim(char *options)
+{
+  dbg_state_t *dbg = dbg_state();
+
+  dbg_sim_configure(options);
+  dbg->backend = &dbg_sim_backend;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_select_replay(char *options)
+{
+  dbg_state_t *dbg = dbg_state();
+
+  dbg_replay_configure(options);
+  dbg->backend = &dbg_replay_backend;
+}
+
+//-----------------------------------------------------------------------------
+static void put_value(uint8_t *buf, uint64_t value, int size)
+{
+  for (int i = 0; i < size; i++)
+    buf[i] = value >> (i * 8);
+}
+
+//-----------------------------------------------------------------------------
+static void record_write(int type, uint32_t value, uint8_t *data, int size)
+{
+  dbg_state_t *dbg = dbg_state();
+  uint8_t buf[DBG_RECORD_HEADER_SIZE];
+
+  buf[0] = type;
+  put_value(&buf[1], get_time_ns() - dbg->record_start, 8);
+  put_value(&buf[9], value, 4);
+  put_value(&buf[13], size, 4);
+
+  if (1 != fwrite(buf, sizeof(buf), 1, dbg->record) || (size && 1 != fwrite(data, size, 1, dbg->record)))
+    error_exit("unable to write the recording");
+}
+
+//-----------------------------------------------------------------------------
+static void record_open(debugger_t *debugger, int version)
+{
+  dbg_state_t *dbg = dbg_state();
+  char *strings[] = { debugger->serial, debugger->manufacturer, debugger->product };
+  uint8_t buf[1024];
+  int size = 6;
+
+  buf[0] = debugger->versions;
+  buf[1] = debugger->use_v2;
+  put_value(&buf[2], debugger->vid, 2);
+  put_value(&buf[4], debugger->pid, 2);
+
+  for (int i = 0; i < ARRAY_SIZE(strings); i++)
+  {
+    char *str = strings[i] ? strings[i] : "";
+    int len = strlen(str) + 1;
+
+    if (size + len > (int)sizeof(buf))
+      len = 1, str = "";
+
+    memcpy(&buf[size], str, len);
+    size += len;
+  }
+
+  record_write(DBG_RECORD_OPEN, version, buf, size);
+  record_write(DBG_RECORD_PACKET_SIZE, dbg->backend->get_packet_size(), NULL, 0);
+}
+
+//-----------------------------------------------------------------------------
+static void record_close(void)
+{
+  dbg_state_t *dbg;
+
+  // The session may be freed or not selected on the thread that exits
+  if (NULL == g_session)
+    return;
+
+  dbg = dbg_state();
+
+  if (dbg->record)
+    fclose(dbg->record);
+
+  dbg->record = NULL;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_record(char *name)
+{
+  dbg_state_t *dbg = dbg_state();
+
+  dbg->record = fopen(name, "wb");
+
+  if (NULL == dbg->record)
+    error_exit("unable to open the recording file %s", name);
+
+  if (1 != fwrite(DBG_RECORD_MAGIC, DBG_RECORD_MAGIC_SIZE, 1, dbg->record))
+    error_exit("unable to write the recording");
+
+  dbg->record_start = get_time_ns();
+
+  // The file is closed at exit, so failed sessions are captured as well
+  atexit(record_close);
+}
+
+//-----------------------------------------------------------------------------
+int dbg_enumerate(debugger_t *debuggers, int size)
+{
+  dbg_state_t *dbg = dbg_state();
+
+  return dbg->backend->enumerate(debuggers, size);
+}
+
+//-----------------------------------------------------------------------------
+void dbg_open(debugger_t *debugger, int version)
+{
+  dbg_state_t *dbg = dbg_state();
+
+  dbg->backend->open(debugger, version);
+
+  if (dbg->record)
+    record_open(debugger, version);
+}
+
+//-----------------------------------------------------------------------------
+void dbg_close(void)
+{
+  dbg_state_t *dbg = dbg_state();
+
+  dbg->backend->close();
+
+  if (dbg->record)
+    fflush(dbg->record);
+}
+
+//-----------------------------------------------------------------------------
+int dbg_get_packet_size(void)
+{
+  dbg_state_t *dbg = dbg_state();
+
+  return dbg->backend->get_packet_size();
+}
+
+//-----------------------------------------------------------------------------
+void dbg_set_packet_size(int size)
+{
+  dbg_state_t *dbg = dbg_state();
+
+  dbg->backend->set_packet_size(size);
+
+  if (dbg->record)
+    record_write(DBG_RECORD_PACKET_SIZE, dbg->backend->get_packet_size(), NULL, 0);
+}
+
+//-----------------------------------------------------------------------------
+static void trace_submit(uint8_t cmd, int req_size)
+{
+  dbg_state_t *dbg = dbg_state();
+  trace_record_t *rec = &dbg->trace_pending[(dbg->trace_first + dbg->trace_pending_count) % DBG_MAX_PACKETS];
+
+  dbg->trace_pending_count++;
+
+  rec->cmd = cmd;
+  rec->req_size = req_size;
+  rec->pending = dbg->trace_pending_count;
+  rec->time = get_time_ns();
+}
+
+//-----------------------------------------------------------------------------
+static void trace_reap(int resp_size)
+{
+  dbg_state_t *dbg = dbg_state();
+  uint64_t time = get_time_ns();
+  trace_record_t *rec = &dbg->trace[dbg->trace_count % TRACE_SIZE];
+
+  // Responses come back in the order the packets were submitted
+  *rec = dbg->trace_pending[dbg->trace_first];
+  dbg->trace_first = (dbg->trace_first + 1) % DBG_MAX_PACKETS;
+  dbg->trace_pending_count--;
+
+  rec->latency = time - rec->time;
+  rec->time -= dbg->trace_start;
+  rec->resp_size = resp_size;
+
+  dbg->trace_count++;
+}
+
+//-----------------------------------------------------------------------------
+static char *trace_cmd_name(uint8_t id)
+{
+  for (int i = 0; i < ARRAY_SIZE(trace_cmds); i++)
+  {
+    if (trace_cmds[i].id == id)
+      return trace_cmds[i].name;
+  }
+
+  return "";
+}
+
+//-----------------------------------------------------------------------------
+static int compare_latency(const void *a, const void *b)
+{
+  uint32_t va = *(const uint32_t *)a;
+  uint32_t vb = *(const uint32_t *)b;
+
+  return (va > vb) - (va < vb);
+}
+
+//-----------------------------------------------------------------------------
+static void trace_write_file(int first, int count)
+{
+  dbg_state_t *dbg = dbg_state();
+  uint8_t buf[TRACE_RECORD_SIZE];
+  FILE *f = fopen(dbg->trace_name, "wb");
+
+  if (NULL == f)
+  {
+    warning("unable to save the trace to %s", dbg->trace_name);
+    return;
+  }
+
+  memcpy(buf, TRACE_MAGIC, 8);
+  put_value(&buf[8], TRACE_RECORD_SIZE, 4);
+  put_value(&buf[12], count, 4);
+  put_value(&buf[16], dbg->trace_count - count, 4);
+  fwrite(buf, 1, 20, f);
+
+  // Records are little-endian and packed, from the oldest to the newest
+  for (int i = 0; i < count; i++)
+  {
+    trace_record_t *rec = &dbg->trace[(first + i) % TRACE_SIZE];
+
+    put_value(&buf[0], rec->time, 8);
+    put_value(&buf[8], rec->latency, 4);
+    put_value(&buf[12], rec->req_size, 2);
+    put_value(&buf[14], rec->resp_size, 2);
+    buf[16] = rec->cmd;
+    buf[17] = rec->pending;
+    put_value(&buf[18], 0, 2);
+    fwrite(buf, 1, TRACE_RECORD_SIZE, f);
+  }
+
+  fclose(f);
+}
+
+//-----------------------------------------------------------------------------
+static void trace_print_summary(int first, int count)
+{
+  dbg_state_t *dbg = dbg_state();
+  uint32_t *latency = buf_alloc(count * sizeof(uint32_t));
+  int buckets[TRACE_BUCKETS] = {0};
+  int max_bucket = 1;
+
+  message("USB trace: %llu packets, %d saved to %s\n", (unsigned long long)dbg->trace_count, count, dbg->trace_name);
+  message("  %-4s %-18s %8s %10s %10s %10s %10s %10s\n", "ID", "Command", "Count", "Min, us",
+      "Median, us", "90%, us", "99%, us", "Max, us");
+
+  for (int id = 0; id < 256; id++)
+  {
+    int n = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+      trace_record_t *rec = &dbg->trace[(first + i) % TRACE_SIZE];
+
+      if (rec->cmd == id)
+        latency[n++] = rec->latency;
+    }
+
+    if (0 == n)
+      continue;
+
+    qsort(latency, n, sizeof(uint32_t), compare_latency);
+
+    message("  0x%02x %-18s %8d %10.1f %10.1f %10.1f %10.1f %10.1f\n", id, trace_cmd_name(id), n,
+        latency[0] / 1.0e3, latency[(n - 1) / 2] / 1.0e3, latency[(n - 1) * 90 / 100] / 1.0e3,
+        latency[(n - 1) * 99 / 100] / 1.0e3, latency[n - 1] / 1.0e3);
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    uint32_t us = dbg->trace[(first + i) % TRACE_SIZE].latency / 1000;
+    int bucket = 0;
+
+    while (bucket < (TRACE_BUCKETS - 1) && us >= ((uint32_t)TRACE_BUCKET_MIN << bucket))
+      bucket++;
+
+    buckets[bucket]++;
+  }
+
+  for (int i = 0; i < TRACE_BUCKETS; i++)
+    max_bucket = (buckets[i] > max_bucket) ? buckets[i] : max_bucket;
+
+  message("  Latency histogram:\n");
+
+  for (int i = 0; i < TRACE_BUCKETS; i++)
+  {
+    char bar[41];
+    int size = (buckets[i] * 40 + max_bucket - 1) / max_bucket;
+
+    memset(bar, '#', size);
+    bar[size] = 0;
+
+    if (i < (TRACE_BUCKETS - 1))
+      message("    < %6d us %8d %s\n", TRACE_BUCKET_MIN << i, buckets[i], bar);
+    else
+      message("    >=%6d us %8d %s\n", TRACE_BUCKET_MIN << (i - 1), buckets[i], bar);
+  }
+
+  buf_free(latency);
+}
+
+//-----------------------------------------------------------------------------
+static void trace_save(void)
+{
+  dbg_state_t *dbg;
+  int count, first;
+
+  if (NULL == g_session)
+    return;
+
+  dbg = dbg_state();
+
+  if (NULL == dbg->trace)
+    return;
+
+  count = (dbg->trace_count < TRACE_SIZE) ? (int)dbg->trace_count : TRACE_SIZE;
+  first = (dbg->trace_count < TRACE_SIZE) ? 0 : (int)(dbg->trace_count % TRACE_SIZE);
+
+  trace_write_file(first, count);
+
+  if (count)
+    trace_print_summary(first, count);
+}
+
+//-----------------------------------------------------------------------------
+void dbg_trace(char *name)
+{
+  dbg_state_t *dbg = dbg_state();
+
+  dbg->trace_name = name;
+  dbg->trace = buf_alloc(TRACE_SIZE * sizeof(trace_record_t));
+  dbg->trace_start = get_time_ns();
+
+  atexit(trace_save);
+}
+
+//-----------------------------------------------------------------------------
+void dbg_dap_cmd_send(uint8_t *data, int req_size)
+{
+  dbg_state_t *dbg = dbg_state();
+
+  if (dbg->trace)
+    trace_submit(data[0], req_size);
+
+  if (dbg->record)
+    record_write(DBG_RECORD_REQUEST, req_size, data, req_size);
+
+  dbg->backend->dap_cmd_send(data, req_size);
+}
+
+//-----------------------------------------------------------------------------
+int dbg_dap_cmd_receive(uint8_t *data, int resp_size)
+{
+  dbg_state_t *dbg = dbg_state();
+  int size = dbg->backend->dap_cmd_receive(data, resp_size);
+
+  if (dbg->trace)
+    trace_reap(size);
+
+  if (dbg->record)
+    record_write(DBG_RECORD_RESPONSE, size, data, (resp_size < size) ? resp_size : size);
+
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_dap_cmd(uint8_t *data, int resp_size, int req_size)
+{
+  dbg_dap_cmd_send(data, req_size);
+  return dbg_dap_cmd_receive(data, resp_size);
+}
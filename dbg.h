@@ -8,13 +8,24 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define DBG_MAX_EP_SIZE    1024
+#define DBG_MAX_PACKETS    16
 
 #define DBG_CMSIS_DAP_V1   (1 << 1)
 #define DBG_CMSIS_DAP_V2   (1 << 2)
 
+#define DBG_RECORD_MAGIC        "EDBGREC1"
+#define DBG_RECORD_MAGIC_SIZE   8
+#define DBG_RECORD_HEADER_SIZE  17 // Type, time (ns), value, data size
+
+#define DBG_RECORD_OPEN         'O'
+#define DBG_RECORD_PACKET_SIZE  'P'
+#define DBG_RECORD_REQUEST      'S'
+#define DBG_RECORD_RESPONSE     'R'
+
 /*- Types -------------------------------------------------------------------*/
 typedef struct
 {
@@ -43,11 +54,52 @@ typedef struct
 } debugger_t;
 
 /*- Prototypes --------------------------------------------------------------*/
+void dbg_session_init(session_t *session);
+void dbg_session_free(session_t *session);
 int dbg_enumerate(debugger_t *debuggers, int size);
 void dbg_open(debugger_t *debugger, int version);
 void dbg_close(void);
 int dbg_get_packet_size(void);
+void dbg_set_packet_size(int size);
 int dbg_dap_cmd(uint8_t *data, int resp_size, int req_size);
+void dbg_dap_cmd_send(uint8_t *data, int req_size);
+int dbg_dap_cmd_receive(uint8_t *data, int resp_size);
+void dbg_select_sim(char *options);
+void dbg_select_replay(char *options);
+void dbg_trace(char *name);
+void dbg_record(char *name);
+
+void dbg_hw_session_init(session_t *session);
+void dbg_hw_session_free(session_t *session);
+int dbg_hw_enumerate(debugger_t *debuggers, int size);
+void dbg_hw_open(debugger_t *debugger, int version);
+void dbg_hw_close(void);
+int dbg_hw_get_packet_size(void);
+void dbg_hw_set_packet_size(int size);
+void dbg_hw_dap_cmd_send(uint8_t *data, int req_size);
+int dbg_hw_dap_cmd_receive(uint8_t *data, int resp_size);
+
+void dbg_sim_session_init(session_t *session);
+void dbg_sim_session_free(session_t *session);
+void dbg_sim_configure(char *options);
+int dbg_sim_enumerate(debugger_t *debuggers, int size);
+void dbg_sim_open(debugger_t *debugger, int version);
+void dbg_sim_close(void);
+int dbg_sim_get_packet_size(void);
+void dbg_sim_set_packet_size(int size);
+void dbg_sim_dap_cmd_send(uint8_t *data, int req_size);
+int dbg_sim_dap_cmd_receive(uint8_t *data, int resp_size);
+
+void dbg_replay_session_init(session_t *session);
+void dbg_replay_session_free(session_t *session);
+void dbg_replay_configure(char *options);
+int dbg_replay_enumerate(debugger_t *debuggers, int size);
+void dbg_replay_open(debugger_t *debugger, int version);
+void dbg_replay_close(void);
+int dbg_replay_get_packet_size(void);
+void dbg_replay_set_packet_size(int size);
+void dbg_replay_dap_cmd_send(uint8_t *data, int req_size);
+int dbg_replay_dap_cmd_receive(uint8_t *data, int resp_size);
 
 #endif // _DBG_H_
 
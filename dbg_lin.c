@@ -17,17 +17,43 @@
 #include <libudev.h>
 #include "edbg.h"
 #include "dbg.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define CONTROL_TIMEOUT    150 // ms
 #define LANGID_US_ENGLISH  0x0409
 
-/*- Variables ---------------------------------------------------------------*/
-static debugger_t *g_debugger;
-static int g_debugger_fd = -1;
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  struct usbdevfs_urb tx_urb;
+  struct usbdevfs_urb rx_urb;
+  bool     tx_done;
+  bool     rx_done;
+  uint8_t  cmd;
+  uint8_t  *tx_buf;
+  uint8_t  *rx_buf;
+} packet_t;
+
+typedef struct
+{
+  debugger_t *debugger;
+  int        debugger_fd;
+  int        packet_size;
+
+  packet_t   packets[DBG_MAX_PACKETS];
+  int        packet_first;
+  int        packet_pending;
+} hw_state_t;
 
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline hw_state_t *hw_state(void)
+{
+  return (hw_state_t *)g_session->hw_state;
+}
+
 //-----------------------------------------------------------------------------
 static char *get_string(int fd, int index)
 {
@@ -173,7 +199,36 @@ static void parse_descriptors(debugger_t *debugger, int fd, uint8_t *desc, int s
 }
 
 //-----------------------------------------------------------------------------
-int dbg_enumerate(debugger_t *debuggers, int size)
+void dbg_hw_session_init(session_t *session)
+{
+  hw_state_t *state = buf_alloc(sizeof(hw_state_t));
+
+  state->debugger_fd = -1;
+
+  session->hw_state = state;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_hw_session_free(session_t *session)
+{
+  hw_state_t *state = session->hw_state;
+
+  if (NULL == state)
+    return;
+
+  for (int i = 0; i < DBG_MAX_PACKETS; i++)
+  {
+    buf_free(state->packets[i].tx_buf);
+    buf_free(state->packets[i].rx_buf);
+  }
+
+  buf_free(state);
+
+  session->hw_state = NULL;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hw_enumerate(debugger_t *debuggers, int size)
 {
   struct udev *udev;
   struct udev_enumerate *enumerate;
@@ -230,18 +285,22 @@ int dbg_enumerate(debugger_t *debuggers, int size)
 }
 
 //-----------------------------------------------------------------------------
-void dbg_open(debugger_t *debugger, int version)
+void dbg_hw_open(debugger_t *debugger, int version)
 {
-  g_debugger = debugger;
+  hw_state_t *hw = hw_state();
+
+  hw->debugger = debugger;
+  hw->packet_first = 0;
+  hw->packet_pending = 0;
 
-  g_debugger_fd = open(g_debugger->path, O_RDWR);
+  hw->debugger_fd = open(hw->debugger->path, O_RDWR);
 
-  if (g_debugger_fd < 0)
-    error_exit("unable to open device %s: %s",  g_debugger->path, strerror(errno));
+  if (hw->debugger_fd < 0)
+    error_exit("unable to open device %s: %s",  hw->debugger->path, strerror(errno));
 
-  g_debugger->use_v2 = (DBG_CMSIS_DAP_V2 == version);
+  hw->debugger->use_v2 = (DBG_CMSIS_DAP_V2 == version);
 
-  int interface = g_debugger->use_v2 ? g_debugger->v2_interface : g_debugger->v1_interface;
+  int interface = hw->debugger->use_v2 ? hw->debugger->v2_interface : hw->debugger->v1_interface;
 
   { // Disconnect kernel driver
     struct usbdevfs_disconnect_claim dc;
@@ -250,81 +309,147 @@ void dbg_open(debugger_t *debugger, int version)
     dc.flags = USBDEVFS_DISCONNECT_CLAIM_EXCEPT_DRIVER;
     strcpy(dc.driver, "usbfs");
 
-    int res = ioctl(g_debugger_fd, USBDEVFS_DISCONNECT_CLAIM, &dc);
+    int res = ioctl(hw->debugger_fd, USBDEVFS_DISCONNECT_CLAIM, &dc);
     check(res >= 0, "ioctl(DISCONNECT_CLAIM): %d", res);
   }
 
   { // Claim interface
-    int res = ioctl(g_debugger_fd, USBDEVFS_CLAIMINTERFACE, &interface);
+    int res = ioctl(hw->debugger_fd, USBDEVFS_CLAIMINTERFACE, &interface);
     check(res >= 0, "ioctl(CLAIMINTERFACE): %d", res);
   }
+
+  dbg_hw_set_packet_size(hw->debugger->use_v2 ? hw->debugger->v2_ep_size : hw->debugger->v1_ep_size);
 }
 
 //-----------------------------------------------------------------------------
-void dbg_close(void)
+void dbg_hw_close(void)
 {
-  int interface = g_debugger->use_v2 ? g_debugger->v2_interface : g_debugger->v1_interface;
+  hw_state_t *hw = hw_state();
+  int interface = hw->debugger->use_v2 ? hw->debugger->v2_interface : hw->debugger->v1_interface;
 
   { // Release interface
-    int res = ioctl(g_debugger_fd, USBDEVFS_RELEASEINTERFACE, &interface);
+    int res = ioctl(hw->debugger_fd, USBDEVFS_RELEASEINTERFACE, &interface);
     check(res >= 0, "ioctl(RELEASEINTERFACE): %d", res);
   }
 
-  close(g_debugger_fd);
+  close(hw->debugger_fd);
 }
 
 //-----------------------------------------------------------------------------
-int dbg_get_packet_size(void)
+int dbg_hw_get_packet_size(void)
 {
-  return g_debugger->use_v2 ? g_debugger->v2_ep_size : g_debugger->v1_ep_size;
+  hw_state_t *hw = hw_state();
+
+  return hw->packet_size;
 }
 
 //-----------------------------------------------------------------------------
-int dbg_dap_cmd(uint8_t *data, int resp_size, int req_size)
+void dbg_hw_set_packet_size(int size)
 {
-  uint8_t cmd = data[0];
-  struct usbdevfs_urb urb = { 0 };
-  struct usbdevfs_urb *purb = NULL;
-  uint8_t buf[DBG_MAX_EP_SIZE];
+  hw_state_t *hw = hw_state();
+
+  check(0 == hw->packet_pending, "internal: packet size changed with pending packets");
+
+  // HID reports always match the endpoint size, bulk transfers may span multiple USB packets
+  if (!hw->debugger->use_v2)
+    size = hw->debugger->v1_ep_size;
+
+  for (int i = 0; i < DBG_MAX_PACKETS; i++)
+  {
+    buf_free(hw->packets[i].tx_buf);
+    buf_free(hw->packets[i].rx_buf);
+
+    hw->packets[i].tx_buf = buf_alloc(size);
+    hw->packets[i].rx_buf = buf_alloc(size);
+  }
+
+  hw->packet_size = size;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_hw_dap_cmd_send(uint8_t *data, int req_size)
+{
+  hw_state_t *hw = hw_state();
+  packet_t *packet;
   int res;
 
-  memset(buf, 0xff, sizeof(buf));
-  memcpy(buf, data, req_size);
+  check(hw->packet_pending < DBG_MAX_PACKETS, "internal: too many pending packets");
 
-  // TX
-  urb.endpoint      = g_debugger->use_v2 ? g_debugger->v2_tx_ep : g_debugger->v1_tx_ep;
-  urb.type          = g_debugger->use_v2 ? USBDEVFS_URB_TYPE_BULK : USBDEVFS_URB_TYPE_INTERRUPT;
-  urb.buffer        = buf;
-  urb.buffer_length = g_debugger->use_v2 ? req_size : g_debugger->v1_ep_size;
+  packet = &hw->packets[(hw->packet_first + hw->packet_pending) % DBG_MAX_PACKETS];
 
-  res = ioctl(g_debugger_fd, USBDEVFS_SUBMITURB, &urb);
-  check(res >= 0, "ioctl(SUBMITURB) for TX: %d", res);
+  memset(packet->tx_buf, 0xff, hw->packet_size);
+  memcpy(packet->tx_buf, data, req_size);
 
-  res = ioctl(g_debugger_fd, USBDEVFS_REAPURB, &purb);
-  check(res >= 0, "ioctl(REAPURB) for TX: %d", res);
-  check(urb.actual_length == urb.buffer_length, "incomplete buffer TX: request = %d, actual = %d",
-      urb.buffer_length, urb.actual_length);
+  packet->cmd     = data[0];
+  packet->tx_done = false;
+  packet->rx_done = false;
 
-  // RX
-  urb.endpoint      = g_debugger->use_v2 ? g_debugger->v2_rx_ep : g_debugger->v1_rx_ep;
-  urb.type          = g_debugger->use_v2 ? USBDEVFS_URB_TYPE_BULK : USBDEVFS_URB_TYPE_INTERRUPT;
-  urb.buffer        = buf;
-  urb.buffer_length = g_debugger->use_v2 ? g_debugger->v2_ep_size : g_debugger->v1_ep_size;
+  // TX
+  memset(&packet->tx_urb, 0, sizeof(struct usbdevfs_urb));
+  packet->tx_urb.endpoint      = hw->debugger->use_v2 ? hw->debugger->v2_tx_ep : hw->debugger->v1_tx_ep;
+  packet->tx_urb.type          = hw->debugger->use_v2 ? USBDEVFS_URB_TYPE_BULK : USBDEVFS_URB_TYPE_INTERRUPT;
+  packet->tx_urb.buffer        = packet->tx_buf;
+  packet->tx_urb.buffer_length = hw->debugger->use_v2 ? req_size : hw->debugger->v1_ep_size;
+  packet->tx_urb.usercontext   = &packet->tx_done;
+
+  // A transfer shorter than the packet size that fills whole USB packets needs a terminator
+  if (hw->debugger->use_v2 && 0 == (req_size % hw->debugger->v2_ep_size) && req_size < hw->packet_size)
+    packet->tx_urb.flags = USBDEVFS_URB_ZERO_PACKET;
+
+  res = ioctl(hw->debugger_fd, USBDEVFS_SUBMITURB, &packet->tx_urb);
+  check(res >= 0, "ioctl(SUBMITURB) for TX: %d", res);
 
-  res = ioctl(g_debugger_fd, USBDEVFS_SUBMITURB, &urb);
+  // RX
+  memset(&packet->rx_urb, 0, sizeof(struct usbdevfs_urb));
+  packet->rx_urb.endpoint      = hw->debugger->use_v2 ? hw->debugger->v2_rx_ep : hw->debugger->v1_rx_ep;
+  packet->rx_urb.type          = hw->debugger->use_v2 ? USBDEVFS_URB_TYPE_BULK : USBDEVFS_URB_TYPE_INTERRUPT;
+  packet->rx_urb.buffer        = packet->rx_buf;
+  packet->rx_urb.buffer_length = hw->packet_size;
+  packet->rx_urb.usercontext   = &packet->rx_done;
+
+  res = ioctl(hw->debugger_fd, USBDEVFS_SUBMITURB, &packet->rx_urb);
   check(res >= 0, "ioctl(SUBMITURB) for RX: %d", res);
 
-  res = ioctl(g_debugger_fd, USBDEVFS_REAPURB, &purb);
-  check(res >= 0, "ioctl(REAPURB) for RX: %d", res);
+  hw->packet_pending++;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hw_dap_cmd_receive(uint8_t *data, int resp_size)
+{
+  hw_state_t *hw = hw_state();
+  packet_t *packet;
+  int size;
+
+  check(hw->packet_pending > 0, "internal: no pending packets");
+
+  packet = &hw->packets[hw->packet_first];
+
+  // URBs complete in order on each endpoint, but TX and RX completions may interleave
+  while (!packet->tx_done || !packet->rx_done)
+  {
+    struct usbdevfs_urb *purb = NULL;
+
+    int res = ioctl(hw->debugger_fd, USBDEVFS_REAPURB, &purb);
+    check(res >= 0, "ioctl(REAPURB): %d", res);
+
+    *(bool *)purb->usercontext = true;
+  }
+
+  hw->packet_first = (hw->packet_first + 1) % DBG_MAX_PACKETS;
+  hw->packet_pending--;
+
+  check(packet->tx_urb.actual_length == packet->tx_urb.buffer_length, "incomplete buffer TX: request = %d, actual = %d",
+      packet->tx_urb.buffer_length, packet->tx_urb.actual_length);
 
   // Result
-  check(urb.actual_length, "empty response received");
+  check(packet->rx_urb.actual_length, "empty response received");
 
-  if (buf[0] != cmd)
-    error_exit("invalid response received: request = 0x%02x, response = 0x%02x", cmd, buf[0]);
+  if (packet->rx_buf[0] != packet->cmd)
+    error_exit("invalid response received: request = 0x%02x, response = 0x%02x", packet->cmd, packet->rx_buf[0]);
 
-  memcpy(data, &buf[1], (resp_size < (urb.actual_length - 1)) ? resp_size : (urb.actual_length - 1));
+  size = packet->rx_urb.actual_length - 1;
 
-  return urb.actual_length - 1;
-}
+  memcpy(data, &packet->rx_buf[1], (resp_size < size) ? resp_size : size);
 
+  return size;
+}
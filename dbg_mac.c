@@ -13,19 +13,35 @@
 #include <IOKit/hid/IOHIDDevice.h>
 #include "edbg.h"
 #include "dbg.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define MAX_DEVICES    256 // Not possible with USB, just a big safe number
 
-/*- Variables ---------------------------------------------------------------*/
-static IOHIDDeviceRef debugger_handle = NULL;
-static uint8_t tx_buffer[DBG_MAX_EP_SIZE];
-static uint8_t rx_buffer[DBG_MAX_EP_SIZE];
-static int rx_size = -1;
-static int report_size;
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  IOHIDDeviceRef debugger_handle;
+  uint8_t        tx_buffer[DBG_MAX_EP_SIZE];
+  uint8_t        rx_buffer[DBG_MAX_EP_SIZE];
+  int            report_size;
+
+  uint8_t        tx_cmd[DBG_MAX_PACKETS];
+  int            tx_pending;
+  uint8_t        rx_queue[DBG_MAX_PACKETS][DBG_MAX_EP_SIZE];
+  int            rx_queue_size[DBG_MAX_PACKETS];
+  int            rx_first;
+  int            rx_count;
+} hw_state_t;
 
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline hw_state_t *hw_state(void)
+{
+  return (hw_state_t *)g_session->hw_state;
+}
+
 //-----------------------------------------------------------------------------
 static int32_t get_int_property(IOHIDDeviceRef device, CFStringRef prop)
 {
@@ -72,7 +88,20 @@ static char * get_string_property(IOHIDDeviceRef device, CFStringRef prop)
 }
 
 //-----------------------------------------------------------------------------
-int dbg_enumerate(debugger_t *debuggers, int size)
+void dbg_hw_session_init(session_t *session)
+{
+  session->hw_state = buf_alloc(sizeof(hw_state_t));
+}
+
+//-----------------------------------------------------------------------------
+void dbg_hw_session_free(session_t *session)
+{
+  buf_free(session->hw_state);
+  session->hw_state = NULL;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hw_enumerate(debugger_t *debuggers, int size)
 {
   IOHIDManagerRef hid_manager;
   CFSetRef device_set;
@@ -141,42 +170,54 @@ int dbg_enumerate(debugger_t *debuggers, int size)
 static void rx_callback(void *user, IOReturn result, void *sender, IOHIDReportType type,
     uint32_t report_id, uint8_t *report, CFIndex report_length)
 {
-  rx_size = report_length;
+  hw_state_t *hw = hw_state();
+  int index = (hw->rx_first + hw->rx_count) % DBG_MAX_PACKETS;
+
+  if (hw->rx_count == DBG_MAX_PACKETS)
+    error_exit("debugger rx queue overflow");
+
+  memcpy(hw->rx_queue[index], report, report_length);
+  hw->rx_queue_size[index] = report_length;
+  hw->rx_count++;
 
   (void)user;
   (void)result;
   (void)sender;
   (void)type;
   (void)report_id;
-  (void)report;
 }
 
 //-----------------------------------------------------------------------------
-void dbg_open(debugger_t *debugger, int version)
+void dbg_hw_open(debugger_t *debugger, int version)
 {
+  hw_state_t *hw = hw_state();
   io_registry_entry_t entry = MACH_PORT_NULL;
   IOReturn ret = kIOReturnInvalid;
 
+  hw->tx_pending = 0;
+  hw->rx_first = 0;
+  hw->rx_count = 0;
+
   entry = IOServiceGetMatchingService((mach_port_t)0, IORegistryEntryIDMatching(debugger->entry_id));
 
   if (MACH_PORT_NULL == entry)
     error_exit("IOServiceGetMatchingService() failed");
 
-  debugger_handle = IOHIDDeviceCreate(kCFAllocatorDefault, entry);
+  hw->debugger_handle = IOHIDDeviceCreate(kCFAllocatorDefault, entry);
 
-  if (NULL == debugger_handle)
+  if (NULL == hw->debugger_handle)
     error_exit("IOHIDDeviceCreate() failed");
 
-  ret = IOHIDDeviceOpen(debugger_handle, kIOHIDOptionsTypeNone);
+  ret = IOHIDDeviceOpen(hw->debugger_handle, kIOHIDOptionsTypeNone);
 
   if (kIOReturnSuccess != ret)
     error_exit("IOHIDDeviceOpen() failed");
 
-  report_size = get_int_property(debugger_handle, CFSTR(kIOHIDMaxInputReportSizeKey));
+  hw->report_size = get_int_property(hw->debugger_handle, CFSTR(kIOHIDMaxInputReportSizeKey));
 
-  IOHIDDeviceRegisterInputReportCallback(debugger_handle, rx_buffer, report_size, &rx_callback, NULL);
+  IOHIDDeviceRegisterInputReportCallback(hw->debugger_handle, hw->rx_buffer, hw->report_size, &rx_callback, NULL);
 
-  IOHIDDeviceScheduleWithRunLoop(debugger_handle, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
+  IOHIDDeviceScheduleWithRunLoop(hw->debugger_handle, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
 
   IOObjectRelease(entry);
 
@@ -184,42 +225,69 @@ void dbg_open(debugger_t *debugger, int version)
 }
 
 //-----------------------------------------------------------------------------
-void dbg_close(void)
+void dbg_hw_close(void)
 {
-  if (debugger_handle)
+  hw_state_t *hw = hw_state();
+
+  if (hw->debugger_handle)
   {
-    IOHIDDeviceRegisterRemovalCallback(debugger_handle, NULL, NULL);
-    IOHIDDeviceClose(debugger_handle, kIOHIDOptionsTypeNone);
-    debugger_handle = NULL;
+    IOHIDDeviceRegisterRemovalCallback(hw->debugger_handle, NULL, NULL);
+    IOHIDDeviceClose(hw->debugger_handle, kIOHIDOptionsTypeNone);
+    hw->debugger_handle = NULL;
   }
 }
 
 //-----------------------------------------------------------------------------
-int dbg_get_packet_size(void)
+int dbg_hw_get_packet_size(void)
+{
+  hw_state_t *hw = hw_state();
+
+  return hw->report_size;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_hw_set_packet_size(int size)
 {
-  return report_size;
+  (void)size; // Only HID is supported, reports always match the endpoint size
 }
 
 //-----------------------------------------------------------------------------
-int dbg_dap_cmd(uint8_t *data, int resp_size, int req_size)
+void dbg_hw_dap_cmd_send(uint8_t *data, int req_size)
 {
-  uint8_t cmd = data[0];
+  hw_state_t *hw = hw_state();
   IOReturn ret;
 
-  if (NULL == debugger_handle)
-    return 0;
+  if (NULL == hw->debugger_handle)
+    return;
 
-  rx_size = -1;
+  check(hw->tx_pending < DBG_MAX_PACKETS, "internal: too many pending packets");
 
-  memset(tx_buffer, 0xff, report_size);
-  memcpy(tx_buffer, data, req_size);
+  memset(hw->tx_buffer, 0xff, hw->report_size);
+  memcpy(hw->tx_buffer, data, req_size);
 
-  ret = IOHIDDeviceSetReport(debugger_handle, kIOHIDReportTypeOutput, 0, tx_buffer, report_size);
+  ret = IOHIDDeviceSetReport(hw->debugger_handle, kIOHIDReportTypeOutput, 0, hw->tx_buffer, hw->report_size);
 
   if (ret != kIOReturnSuccess)
     error_exit("HID write failed");
 
-  while (1)
+  hw->tx_cmd[(hw->rx_first + hw->tx_pending) % DBG_MAX_PACKETS] = data[0];
+  hw->tx_pending++;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hw_dap_cmd_receive(uint8_t *data, int resp_size)
+{
+  hw_state_t *hw = hw_state();
+  uint8_t cmd = hw->tx_cmd[hw->rx_first];
+  uint8_t *rx_data;
+  int rx_size;
+
+  if (NULL == hw->debugger_handle)
+    return 0;
+
+  check(hw->tx_pending > 0, "internal: no pending packets");
+
+  while (0 == hw->rx_count)
   {
     int res = CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.001, true);
 
@@ -228,20 +296,23 @@ int dbg_dap_cmd(uint8_t *data, int resp_size, int req_size)
 
     if (kCFRunLoopRunTimedOut != res && kCFRunLoopRunHandledSource != res)
       error_exit("debugger rx error");
-
-    if (rx_size >= 0)
-      break;
   }
 
+  rx_data = hw->rx_queue[hw->rx_first];
+  rx_size = hw->rx_queue_size[hw->rx_first];
+
+  hw->rx_first = (hw->rx_first + 1) % DBG_MAX_PACKETS;
+  hw->rx_count--;
+  hw->tx_pending--;
+
   check(rx_size, "empty response received");
 
-  if (rx_buffer[0] != cmd)
-    error_exit("invalid response received: request = 0x%02x, response = 0x%02x", cmd, rx_buffer[0]);
+  if (rx_data[0] != cmd)
+    error_exit("invalid response received: request = 0x%02x, response = 0x%02x", cmd, rx_data[0]);
 
   rx_size--;
 
-  memcpy(data, &rx_buffer[1], (resp_size < rx_size) ? resp_size : rx_size);
+  memcpy(data, &rx_data[1], (resp_size < rx_size) ? resp_size : rx_size);
 
   return rx_size;
 }
-
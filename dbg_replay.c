@@ -0,0 +1,330 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "edbg.h"
+#include "dbg.h"
+#include "session.h"
+
+/*- Definitions -------------------------------------------------------------*/
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  int      type;
+  uint64_t time;
+  uint32_t value;
+  int      size;
+  uint8_t  *data;
+} record_t;
+
+typedef struct
+{
+  char     *name;
+  bool     timing;
+  uint8_t  *file;
+  record_t *records;
+  int      record_count;
+
+  // Requests, responses and packet size changes are consumed independently, so
+  // the replay does not depend on how the sends and receives were interleaved
+  int      next_request;
+  int      next_response;
+  int      next_packet_size;
+
+  int      packet_size;
+  int      requests;
+  int      responses;
+  uint64_t sent[DBG_MAX_PACKETS][2]; // Recorded and actual send times
+} replay_state_t;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static inline replay_state_t *replay_state(void)
+{
+  return (replay_state_t *)g_session->replay_state;
+}
+
+//-----------------------------------------------------------------------------
+static uint64_t get_value(uint8_t *buf, int size)
+{
+  uint64_t value = 0;
+
+  for (int i = 0; i < size; i++)
+    value |= (uint64_t)buf[i] << (i * 8);
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static void parse_recording(int size)
+{
+  replay_state_t *replay = replay_state();
+  int count = 0;
+  int offs;
+
+  check(size >= DBG_RECORD_MAGIC_SIZE && 0 == memcmp(replay->file, DBG_RECORD_MAGIC, DBG_RECORD_MAGIC_SIZE),
+      "%s is not a recording", replay->name);
+
+  for (int pass = 0; pass < 2; pass++)
+  {
+    offs = DBG_RECORD_MAGIC_SIZE;
+    count = 0;
+
+    while (offs < size)
+    {
+      uint8_t *hdr = &replay->file[offs];
+      uint32_t data_size;
+
+      check(offs + DBG_RECORD_HEADER_SIZE <= size, "truncated record at offset %d", offs);
+
+      data_size = get_value(&hdr[13], 4);
+      offs += DBG_RECORD_HEADER_SIZE;
+
+      check(data_size <= (uint32_t)(size - offs), "truncated record at offset %d", offs - DBG_RECORD_HEADER_SIZE);
+
+      if (pass)
+      {
+        record_t *rec = &replay->records[count];
+
+        rec->type  = hdr[0];
+        rec->time  = get_value(&hdr[1], 8);
+        rec->value = get_value(&hdr[9], 4);
+        rec->size  = data_size;
+        rec->data  = &replay->file[offs];
+      }
+
+      offs += data_size;
+      count++;
+    }
+
+    if (0 == pass)
+      replay->records = buf_alloc((count + 1) * sizeof(record_t));
+  }
+
+  replay->record_count = count;
+}
+
+//-----------------------------------------------------------------------------
+static record_t *next_record(int *index, int type)
+{
+  replay_state_t *replay = replay_state();
+
+  while (*index < replay->record_count && replay->records[*index].type != type)
+    (*index)++;
+
+  if (*index == replay->record_count)
+    return NULL;
+
+  return &replay->records[(*index)++];
+}
+
+//-----------------------------------------------------------------------------
+void dbg_replay_session_init(session_t *session)
+{
+  session->replay_state = buf_alloc(sizeof(replay_state_t));
+}
+
+//-----------------------------------------------------------------------------
+void dbg_replay_session_free(session_t *session)
+{
+  replay_state_t *state = session->replay_state;
+
+  if (NULL == state)
+    return;
+
+  buf_free(state->records);
+  buf_free(state->file);
+  buf_free(state);
+
+  session->replay_state = NULL;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_replay_configure(char *options)
+{
+  replay_state_t *replay = replay_state();
+  char *opts = strdup(options ? options : "");
+  char *save = NULL;
+  char *name = strtok_r(opts, ",", &save);
+  char *value;
+  long size;
+  FILE *f;
+
+  check(NULL != name, "replay file name is not specified");
+
+  replay->name = name;
+
+  while (NULL != (value = strtok_r(NULL, ",", &save)))
+  {
+    if (0 == strcmp(value, "timing"))
+      replay->timing = true;
+    else
+      error_exit("unknown replay option: %s", value);
+  }
+
+  f = fopen(replay->name, "rb");
+
+  if (NULL == f)
+    error_exit("unable to open the recording %s", replay->name);
+
+  fseek(f, 0, SEEK_END);
+  size = ftell(f);
+  check(0 <= size && size < 0x7fffffff, "recording %s is too big", replay->name);
+  fclose(f);
+
+  replay->file = buf_alloc(size + 1);
+  load_file(replay->name, replay->file, size);
+
+  parse_recording(size);
+}
+
+//-----------------------------------------------------------------------------
+int dbg_replay_enumerate(debugger_t *debuggers, int size)
+{
+  replay_state_t *replay = replay_state();
+  int index = 0;
+  record_t *rec = next_record(&index, DBG_RECORD_OPEN);
+  char *str;
+
+  if (size < 1)
+    return 0;
+
+  check(NULL != rec && rec->size > 6 && 0 == rec->data[rec->size-1], "recording %s has no debugger information", replay->name);
+
+  memset(&debuggers[0], 0, sizeof(debugger_t));
+
+  str = (char *)&rec->data[6];
+  debuggers[0].path         = replay->name;
+  debuggers[0].serial       = str;
+  str += strlen(str) + 1;
+  debuggers[0].manufacturer = (str < (char *)&rec->data[rec->size]) ? str : "";
+  str += strlen(str) + 1;
+  debuggers[0].product      = (str < (char *)&rec->data[rec->size]) ? str : "";
+  debuggers[0].vid          = get_value(&rec->data[2], 2);
+  debuggers[0].pid          = get_value(&rec->data[4], 2);
+  debuggers[0].versions     = rec->data[0];
+
+  // Only the recorded protocol version can be replayed
+  if (DBG_CMSIS_DAP_V1 == rec->value)
+    debuggers[0].versions &= ~DBG_CMSIS_DAP_V2;
+
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_replay_open(debugger_t *debugger, int version)
+{
+  replay_state_t *replay = replay_state();
+
+  // A reopen continues with the next session in the recording
+  int index = replay->next_request;
+  record_t *rec = next_record(&index, DBG_RECORD_OPEN);
+
+  check(NULL != rec, "recording %s has no %sdebugger information", replay->name,
+      replay->next_request ? "more " : "");
+  check(version == (int)rec->value, "recording was made with CMSIS-DAP v%d",
+      (DBG_CMSIS_DAP_V1 == rec->value) ? 1 : 2);
+
+  debugger->use_v2 = (DBG_CMSIS_DAP_V2 == version);
+
+  replay->next_request = index;
+  replay->next_response = index;
+  replay->next_packet_size = index;
+
+  dbg_replay_set_packet_size(0);
+
+  verbose("Replaying %s (%d records)%s\n", replay->name, replay->record_count, replay->timing ? " with recorded timing" : "");
+}
+
+//-----------------------------------------------------------------------------
+void dbg_replay_close(void)
+{
+  replay_state_t *replay = replay_state();
+  int index = replay->next_request;
+
+  if (next_record(&index, DBG_RECORD_REQUEST))
+    verbose("Replay stopped before the end of the recording\n");
+
+  verbose("Replay: %d packets\n", replay->requests);
+}
+
+//-----------------------------------------------------------------------------
+int dbg_replay_get_packet_size(void)
+{
+  replay_state_t *replay = replay_state();
+
+  return replay->packet_size;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_replay_set_packet_size(int size)
+{
+  replay_state_t *replay = replay_state();
+  record_t *rec = next_record(&replay->next_packet_size, DBG_RECORD_PACKET_SIZE);
+
+  check(replay->requests == replay->responses, "internal: packet size changed with pending packets");
+  check(NULL != rec, "replay: packet size change is not in the recording");
+
+  replay->packet_size = rec->value;
+  (void)size;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_replay_dap_cmd_send(uint8_t *data, int req_size)
+{
+  replay_state_t *replay = replay_state();
+  record_t *rec = next_record(&replay->next_request, DBG_RECORD_REQUEST);
+  uint64_t *sent = replay->sent[replay->requests % DBG_MAX_PACKETS];
+
+  check(replay->requests - replay->responses < DBG_MAX_PACKETS, "internal: too many pending packets");
+  check(NULL != rec, "replay: request %d (command 0x%02x) is past the end of the recording", replay->requests, data[0]);
+
+  for (int i = 0; i < req_size || i < rec->size; i++)
+  {
+    if (i == req_size || i == rec->size || data[i] != rec->data[i])
+      error_exit("replay: request %d (command 0x%02x) differs from the recording at byte %d", replay->requests, data[0], i);
+  }
+
+  sent[0] = rec->time;
+  sent[1] = get_time_ns();
+
+  replay->requests++;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_replay_dap_cmd_receive(uint8_t *data, int resp_size)
+{
+  replay_state_t *replay = replay_state();
+  record_t *rec = next_record(&replay->next_response, DBG_RECORD_RESPONSE);
+  uint64_t *sent = replay->sent[replay->responses % DBG_MAX_PACKETS];
+  int size;
+
+  check(replay->responses < replay->requests, "internal: no pending packets");
+  check(NULL != rec, "replay: response %d is past the end of the recording", replay->responses);
+
+  if (replay->timing && rec->time > sent[0])
+  {
+    uint64_t ready = sent[1] + (rec->time - sent[0]);
+    uint64_t now;
+
+    while ((now = get_time_ns()) < ready)
+    {
+      if ((ready - now) > 2000000)
+        sleep_ms(1);
+    }
+  }
+
+  size = (resp_size < rec->size) ? resp_size : rec->size;
+  memcpy(data, rec->data, size);
+
+  replay->responses++;
+
+  return rec->value;
+}
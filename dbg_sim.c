@@ -0,0 +1,1197 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "edbg.h"
+#include "dbg.h"
+#include "dbg_sim.h"
+#include "session.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define DEFAULT_LATENCY       0 // us
+#define DEFAULT_PACKET_SIZE   512
+#define DEFAULT_PACKET_COUNT  4
+#define DEFAULT_TIMING        100 // %
+#define DEFAULT_CLOCK         1000000 // Hz
+#define HID_PACKET_SIZE       64
+#define MAX_PACKET_SIZE       0xffff
+
+#define PAGE_SIZE             4096
+#define HASH_SIZE             1024
+#define TAR_WRAP_SIZE         1024
+#define MAX_REGIONS           16
+#define MAX_PROBES            16
+
+// Request, turnaround, acknowledge, data, parity and idle cycles of one SWD transfer
+#define SWD_TRANSFER_CYCLES   46
+
+#define SIM_DPIDR             0x0bc11477
+#define SIM_AP_IDR            0x24770011
+#define SIM_JTAG_IDCODE       0x4ba00477
+
+enum
+{
+  ID_DAP_INFO               = 0x00,
+  ID_DAP_LED                = 0x01,
+  ID_DAP_CONNECT            = 0x02,
+  ID_DAP_DISCONNECT         = 0x03,
+  ID_DAP_TRANSFER_CONFIGURE = 0x04,
+  ID_DAP_TRANSFER           = 0x05,
+  ID_DAP_TRANSFER_BLOCK     = 0x06,
+  ID_DAP_TRANSFER_ABORT     = 0x07,
+  ID_DAP_WRITE_ABORT        = 0x08,
+  ID_DAP_DELAY              = 0x09,
+  ID_DAP_RESET_TARGET       = 0x0a,
+  ID_DAP_SWJ_PINS           = 0x10,
+  ID_DAP_SWJ_CLOCK          = 0x11,
+  ID_DAP_SWJ_SEQUENCE       = 0x12,
+  ID_DAP_SWD_CONFIGURE      = 0x13,
+  ID_DAP_SWD_SEQUENCE       = 0x1d,
+  ID_DAP_JTAG_SEQUENCE      = 0x14,
+  ID_DAP_JTAG_CONFIGURE     = 0x15,
+  ID_DAP_JTAG_IDCODE        = 0x16,
+  ID_DAP_EXECUTE_COMMANDS   = 0x7f,
+  ID_DAP_INVALID            = 0xff,
+};
+
+enum
+{
+  DAP_INFO_VENDOR           = 0x01,
+  DAP_INFO_PRODUCT          = 0x02,
+  DAP_INFO_SER_NUM          = 0x03,
+  DAP_INFO_CMSIS_DAP_VER    = 0x04,
+  DAP_INFO_CAPABILITIES     = 0xf0,
+  DAP_INFO_PACKET_COUNT     = 0xfe,
+  DAP_INFO_PACKET_SIZE      = 0xff,
+};
+
+enum
+{
+  DAP_TRANSFER_APnDP        = 1 << 0,
+  DAP_TRANSFER_RnW          = 1 << 1,
+  DAP_TRANSFER_MATCH_VALUE  = 1 << 4,
+  DAP_TRANSFER_MATCH_MASK   = 1 << 5,
+};
+
+enum
+{
+  DAP_TRANSFER_OK           = 1 << 0,
+  DAP_TRANSFER_FAULT        = 1 << 2,
+  DAP_TRANSFER_MISMATCH     = 1 << 4,
+  DAP_TRANSFER_NO_ACK       = 7,
+};
+
+#define DAP_CAP_SWD            (1 << 0)
+#define DAP_CAP_JTAG           (1 << 1)
+#define DAP_CAP_ATOMIC_CMD     (1 << 4)
+
+#define SEQUENCE_COUNT(x)      (((x) & 0x3f) ? ((x) & 0x3f) : 64)
+
+#define SWD_TARGETSEL          0x99
+#define TARGET_ID_MASK         0x0fffffff // The instance number is in the upper bits
+#define JTAG_SEQUENCE_TDO      (1 << 7)
+#define SWD_SEQUENCE_DIN       (1 << 7)
+
+#define DP_ABORT_STKERRCLR     (1 << 2)
+
+#define DP_CST_STICKYERR       (1 << 5)
+#define DP_CST_CDBGPWRUPREQ    (1 << 28)
+#define DP_CST_CSYSPWRUPREQ    (1 << 30)
+
+#define AP_CSW_SIZE_MASK       (7 << 0)
+#define AP_CSW_ADDRINC_MASK    (3 << 4)
+#define AP_CSW_ADDRINC_PACKED  (2 << 4)
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct page_t
+{
+  struct page_t *next;
+  uint32_t addr;
+  uint8_t  data[PAGE_SIZE];
+} page_t;
+
+typedef struct
+{
+  uint32_t    addr;
+  uint32_t    size;
+  sim_read_t  read;
+  sim_write_t write;
+} region_t;
+
+typedef struct
+{
+  uint8_t  *buf;
+  int      size;
+  uint64_t ready;
+} packet_t;
+
+typedef struct
+{
+  int         latency;
+  int         probe_packet_size;
+  int         probe_packet_count;
+  int         timing;
+  int         probes;
+  int         max_clock;
+  char        serials[MAX_PROBES][16];
+  sim_model_t *model;
+  bool        model_ready;
+
+  bool        use_v2;
+  int         packet_size;
+  packet_t    packets[DBG_MAX_PACKETS];
+  int         packet_first;
+  int         packet_pending;
+
+  int         clock;
+  uint64_t    time; // ns
+  int         stat_packets;
+  int         stat_transfers;
+  uint64_t    stat_busy; // ns
+
+  page_t      *pages[HASH_SIZE];
+  page_t      *last_page;
+
+  region_t    regions[MAX_REGIONS];
+  int         region_count;
+  uint32_t    tar_wrap_size;
+
+  bool        dp_selected; // A multidrop DP only answers after a matching TARGETSEL
+  uint32_t    dp_ctrl_stat;
+  uint32_t    dp_select;
+  uint32_t    dp_rdbuff;
+  uint32_t    ap_csw;
+  uint32_t    ap_tar;
+  uint32_t    match_mask;
+  int         match_retry;
+} sim_state_t;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static inline sim_state_t *sim_state(void)
+{
+  return (sim_state_t *)g_session->sim_state;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t get_uint32(uint8_t *buf)
+{
+  return ((uint32_t)buf[3] << 24) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[1] << 8) | buf[0];
+}
+
+//-----------------------------------------------------------------------------
+static void put_uint32(uint8_t *buf, uint32_t value)
+{
+  buf[0] = value;
+  buf[1] = value >> 8;
+  buf[2] = value >> 16;
+  buf[3] = value >> 24;
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t *mem_page(uint32_t addr)
+{
+  sim_state_t *sim = sim_state();
+  uint32_t base = addr & ~(PAGE_SIZE - 1);
+  page_t **bucket = &sim->pages[(base / PAGE_SIZE) % HASH_SIZE];
+  page_t *page;
+
+  if (sim->last_page && sim->last_page->addr == base)
+    return sim->last_page->data;
+
+  for (page = *bucket; page; page = page->next)
+  {
+    if (page->addr == base)
+      break;
+  }
+
+  if (NULL == page)
+  {
+    page = buf_alloc(sizeof(page_t));
+    memset(page->data, 0, PAGE_SIZE);
+    page->addr = base;
+    page->next = *bucket;
+    *bucket = page;
+  }
+
+  sim->last_page = page;
+
+  return page->data;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t mem_read(uint32_t addr, int size)
+{
+  uint8_t *data = mem_page(addr);
+  int offs = addr & (PAGE_SIZE - 1) & ~(size - 1);
+  uint32_t value = 0;
+
+  for (int i = 0; i < size; i++)
+    value |= (uint32_t)data[offs + i] << (((offs + i) & 3) * 8);
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static void mem_write(uint32_t addr, int size, uint32_t value)
+{
+  uint8_t *data = mem_page(addr);
+  int offs = addr & (PAGE_SIZE - 1) & ~(size - 1);
+
+  for (int i = 0; i < size; i++)
+    data[offs + i] = value >> (((offs + i) & 3) * 8);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t lane_mask(uint32_t addr, int size)
+{
+  if (4 == size)
+    return 0xffffffff;
+
+  return ((1u << (size * 8)) - 1) << ((addr & 3 & ~(size - 1)) * 8);
+}
+
+//-----------------------------------------------------------------------------
+static region_t *find_region(uint32_t addr)
+{
+  sim_state_t *sim = sim_state();
+
+  for (int i = 0; i < sim->region_count; i++)
+  {
+    if ((addr - sim->regions[i].addr) < sim->regions[i].size)
+      return &sim->regions[i];
+  }
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t bus_read(uint32_t addr, int size)
+{
+  region_t *region = find_region(addr);
+
+  if (region && region->read)
+    return region->read(addr & ~3) & lane_mask(addr, size);
+
+  return mem_read(addr, size);
+}
+
+//-----------------------------------------------------------------------------
+static void bus_write(uint32_t addr, int size, uint32_t value)
+{
+  region_t *region = find_region(addr);
+
+  if (region && region->write)
+    region->write(addr & ~3, value & lane_mask(addr, size), lane_mask(addr, size));
+  else
+    mem_write(addr, size, value);
+}
+
+//-----------------------------------------------------------------------------
+static void swd_cycles(int count)
+{
+  sim_state_t *sim = sim_state();
+
+  sim->time += (uint64_t)count * 1000000000 / sim->clock;
+}
+
+//-----------------------------------------------------------------------------
+static void tar_increment(int size)
+{
+  sim_state_t *sim = sim_state();
+  uint32_t tar = sim->ap_tar + size;
+
+  // Auto-increment is only guaranteed to work within the TAR wrap boundary
+  sim->ap_tar = (sim->ap_tar & ~(sim->tar_wrap_size - 1)) | (tar & (sim->tar_wrap_size - 1));
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t drw_read(void)
+{
+  sim_state_t *sim = sim_state();
+  int size = 1 << (sim->ap_csw & AP_CSW_SIZE_MASK);
+  int inc = sim->ap_csw & AP_CSW_ADDRINC_MASK;
+  uint32_t value = 0;
+
+  if (AP_CSW_ADDRINC_PACKED == inc && size < 4)
+  {
+    for (int i = 0; i < 4 / size; i++)
+    {
+      value |= bus_read(sim->ap_tar, size);
+      tar_increment(size);
+    }
+  }
+  else
+  {
+    value = bus_read(sim->ap_tar, size);
+
+    if (inc)
+      tar_increment(size);
+  }
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static void drw_write(uint32_t value)
+{
+  sim_state_t *sim = sim_state();
+  int size = 1 << (sim->ap_csw & AP_CSW_SIZE_MASK);
+  int inc = sim->ap_csw & AP_CSW_ADDRINC_MASK;
+
+  if (AP_CSW_ADDRINC_PACKED == inc && size < 4)
+  {
+    for (int i = 0; i < 4 / size; i++)
+    {
+      bus_write(sim->ap_tar, size, value);
+      tar_increment(size);
+    }
+  }
+  else
+  {
+    bus_write(sim->ap_tar, size, value);
+
+    if (inc)
+      tar_increment(size);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t ap_read(int reg)
+{
+  sim_state_t *sim = sim_state();
+  uint32_t value;
+
+  reg |= sim->dp_select & 0xf0;
+
+  if (0x00 == reg)
+    value = sim->ap_csw;
+  else if (0x04 == reg)
+    value = sim->ap_tar;
+  else if (0x0c == reg)
+    value = drw_read();
+  else if (0x10 <= reg && reg < 0x20)
+    value = bus_read((sim->ap_tar & ~0xf) | (reg & 0xc), 4);
+  else if (0xfc == reg)
+    value = SIM_AP_IDR;
+  else
+    value = 0;
+
+  sim->dp_rdbuff = value;
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static void ap_write(int reg, uint32_t value)
+{
+  sim_state_t *sim = sim_state();
+
+  reg |= sim->dp_select & 0xf0;
+
+  if (0x00 == reg)
+    sim->ap_csw = value;
+  else if (0x04 == reg)
+    sim->ap_tar = value;
+  else if (0x0c == reg)
+    drw_write(value);
+  else if (0x10 <= reg && reg < 0x20)
+    bus_write((sim->ap_tar & ~0xf) | (reg & 0xc), 4, value);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t dp_read(int reg)
+{
+  sim_state_t *sim = sim_state();
+
+  if (0x00 == reg)
+    return SIM_DPIDR;
+  else if (0x04 == reg)
+    return sim->dp_ctrl_stat | ((sim->dp_ctrl_stat & (DP_CST_CDBGPWRUPREQ | DP_CST_CSYSPWRUPREQ)) << 1);
+  else if (0x0c == reg)
+    return sim->dp_rdbuff;
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void dp_write(int reg, uint32_t value)
+{
+  sim_state_t *sim = sim_state();
+
+  if (0x00 == reg)
+  {
+    if (value & DP_ABORT_STKERRCLR)
+      sim->dp_ctrl_stat &= ~DP_CST_STICKYERR;
+  }
+  else if (0x04 == reg)
+    sim->dp_ctrl_stat = value;
+  else if (0x08 == reg)
+    sim->dp_select = value;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t reg_read(int request)
+{
+  sim_state_t *sim = sim_state();
+
+  swd_cycles(SWD_TRANSFER_CYCLES);
+  sim->stat_transfers++;
+
+  if (request & DAP_TRANSFER_APnDP)
+    return ap_read(request & 0x0c);
+  else
+    return dp_read(request & 0x0c);
+}
+
+//-----------------------------------------------------------------------------
+static void reg_write(int request, uint32_t value)
+{
+  sim_state_t *sim = sim_state();
+
+  swd_cycles(SWD_TRANSFER_CYCLES);
+  sim->stat_transfers++;
+
+  if (request & DAP_TRANSFER_APnDP)
+    ap_write(request & 0x0c, value);
+  else
+    dp_write(request & 0x0c, value);
+}
+
+//-----------------------------------------------------------------------------
+static int dap_info(uint8_t *req, uint8_t *resp)
+{
+  sim_state_t *sim = sim_state();
+  char *str = NULL;
+
+  resp[1] = 0;
+
+  switch (req[1])
+  {
+    case DAP_INFO_VENDOR: str = "edbg"; break;
+    case DAP_INFO_PRODUCT: str = "CMSIS-DAP Simulator"; break;
+    case DAP_INFO_SER_NUM: str = "sim"; break;
+    case DAP_INFO_CMSIS_DAP_VER: str = "2.1.0"; break;
+
+    case DAP_INFO_CAPABILITIES:
+      resp[1] = 1;
+      resp[2] = DAP_CAP_SWD | DAP_CAP_JTAG | DAP_CAP_ATOMIC_CMD;
+      break;
+
+    case DAP_INFO_PACKET_COUNT:
+      resp[1] = 1;
+      resp[2] = sim->probe_packet_count;
+      break;
+
+    case DAP_INFO_PACKET_SIZE:
+      resp[1] = 2;
+      resp[2] = sim->packet_size;
+      resp[3] = sim->packet_size >> 8;
+      break;
+  }
+
+  if (str)
+  {
+    resp[1] = strlen(str) + 1;
+    strcpy((char *)&resp[2], str);
+  }
+
+  return resp[1] + 2;
+}
+
+//-----------------------------------------------------------------------------
+static int link_fault(int request)
+{
+  sim_state_t *sim = sim_state();
+
+  if (sim->model && sim->model->target_id && !sim->dp_selected)
+  {
+    swd_cycles(SWD_TRANSFER_CYCLES);
+    return DAP_TRANSFER_NO_ACK;
+  }
+
+  // Above the clock limit DRW accesses fail, the link check only uses TAR and still passes
+  if (0 == sim->max_clock || sim->clock <= sim->max_clock || 0 == (request & DAP_TRANSFER_APnDP) ||
+      0x0c != ((request & 0x0c) | (sim->dp_select & 0xf0)))
+    return 0;
+
+  swd_cycles(SWD_TRANSFER_CYCLES);
+
+  return DAP_TRANSFER_FAULT;
+}
+
+//-----------------------------------------------------------------------------
+static int dap_transfer(uint8_t *req, int *req_size, uint8_t *resp)
+{
+  sim_state_t *sim = sim_state();
+  int count = req[2];
+  int offs = 3;
+  int size = 3;
+  int done = 0;
+  int status = DAP_TRANSFER_OK;
+  int fault;
+
+  for (done = 0; done < count; done++)
+  {
+    int request = req[offs++];
+
+    if ((fault = link_fault(request)))
+    {
+      offs += (request & (DAP_TRANSFER_RnW | DAP_TRANSFER_MATCH_VALUE)) == DAP_TRANSFER_RnW ? 0 : 4;
+      status = fault;
+      break;
+    }
+
+    if (request & DAP_TRANSFER_RnW)
+    {
+      if (request & DAP_TRANSFER_MATCH_VALUE)
+      {
+        uint32_t match = get_uint32(&req[offs]);
+        uint32_t value;
+        int retry = sim->match_retry;
+
+        offs += 4;
+
+        while (((value = reg_read(request)) & sim->match_mask) != match && retry)
+          retry--;
+
+        if ((value & sim->match_mask) != match)
+        {
+          status |= DAP_TRANSFER_MISMATCH;
+          break;
+        }
+      }
+      else
+      {
+        put_uint32(&resp[size], reg_read(request));
+        size += 4;
+      }
+    }
+    else
+    {
+      uint32_t value = get_uint32(&req[offs]);
+
+      offs += 4;
+
+      if (request & DAP_TRANSFER_MATCH_MASK)
+        sim->match_mask = value;
+      else
+        reg_write(request, value);
+    }
+  }
+
+  // Skip the rest of the request after a mismatch or a fault
+  for (int i = done + 1; i < count; i++)
+    offs += (req[offs] & (DAP_TRANSFER_RnW | DAP_TRANSFER_MATCH_VALUE)) == DAP_TRANSFER_RnW ? 1 : 5;
+
+  resp[1] = done;
+  resp[2] = status;
+  *req_size = offs;
+
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+static int dap_transfer_block(uint8_t *req, int *req_size, uint8_t *resp)
+{
+  int count = req[2] | (req[3] << 8);
+  int request = req[4];
+  int size = 4;
+  int fault;
+
+  if ((fault = link_fault(request)))
+  {
+    *req_size = (request & DAP_TRANSFER_RnW) ? 5 : (5 + count * 4);
+    resp[1] = 0;
+    resp[2] = 0;
+    resp[3] = fault;
+
+    return size;
+  }
+
+  if (request & DAP_TRANSFER_RnW)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      put_uint32(&resp[size], reg_read(request));
+      size += 4;
+    }
+
+    *req_size = 5;
+  }
+  else
+  {
+    for (int i = 0; i < count; i++)
+      reg_write(request, get_uint32(&req[5 + i * 4]));
+
+    *req_size = 5 + count * 4;
+  }
+
+  resp[1] = count;
+  resp[2] = count >> 8;
+  resp[3] = DAP_TRANSFER_OK;
+
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+static int dap_sequence(uint8_t *req, int *req_size, uint8_t *resp, bool jtag)
+{
+  sim_state_t *sim = sim_state();
+  bool targetsel = false;
+  int count = req[1];
+  int offs = 2;
+  int size = 2;
+
+  for (int i = 0; i < count; i++)
+  {
+    int info = req[offs++];
+    int bytes = (SEQUENCE_COUNT(info) + 7) / 8;
+
+    swd_cycles(SEQUENCE_COUNT(info));
+
+    if (jtag)
+    {
+      // TDI is looped back to TDO
+      if (info & JTAG_SEQUENCE_TDO)
+      {
+        memcpy(&resp[size], &req[offs], bytes);
+        size += bytes;
+      }
+
+      offs += bytes;
+    }
+    else
+    {
+      if (info & SWD_SEQUENCE_DIN)
+      {
+        memset(&resp[size], 0, bytes);
+        size += bytes;
+      }
+      else
+      {
+        // TARGETSEL data follows the request and the undriven ACK phase
+        if (targetsel && 33 == SEQUENCE_COUNT(info))
+        {
+          uint32_t id = get_uint32(&req[offs]);
+          uint32_t target_id = sim->model ? sim->model->target_id : 0;
+
+          sim->dp_selected = target_id && 0 == ((id ^ target_id) & TARGET_ID_MASK);
+          targetsel = false;
+        }
+        else if (8 == SEQUENCE_COUNT(info))
+        {
+          targetsel = (SWD_TARGETSEL == req[offs]);
+        }
+
+        offs += bytes;
+      }
+    }
+  }
+
+  *req_size = offs;
+
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+static int dap_command(uint8_t *req, int *req_size, uint8_t *resp)
+{
+  sim_state_t *sim = sim_state();
+
+  resp[0] = req[0];
+  resp[1] = 0; // DAP_OK
+
+  switch (req[0])
+  {
+    case ID_DAP_INFO:
+      *req_size = 2;
+      return dap_info(req, resp);
+
+    case ID_DAP_LED:
+      *req_size = 3;
+      return 2;
+
+    case ID_DAP_CONNECT:
+      *req_size = 2;
+      resp[1] = req[1] ? req[1] : 1; // Default port is SWD
+      return 2;
+
+    case ID_DAP_DISCONNECT:
+    case ID_DAP_TRANSFER_ABORT:
+      *req_size = 1;
+      return 2;
+
+    case ID_DAP_TRANSFER_CONFIGURE:
+      *req_size = 6;
+      sim->match_retry = req[4] | (req[5] << 8);
+      return 2;
+
+    case ID_DAP_TRANSFER:
+      return dap_transfer(req, req_size, resp);
+
+    case ID_DAP_TRANSFER_BLOCK:
+      return dap_transfer_block(req, req_size, resp);
+
+    case ID_DAP_WRITE_ABORT:
+      *req_size = 6;
+      dp_write(0x00, get_uint32(&req[2]));
+      return 2;
+
+    case ID_DAP_DELAY:
+      *req_size = 3;
+      sim->time += (uint64_t)(req[1] | (req[2] << 8)) * 1000;
+      return 2;
+
+    case ID_DAP_RESET_TARGET:
+      *req_size = 1;
+      resp[2] = 0;
+      return 3;
+
+    case ID_DAP_SWJ_PINS:
+      *req_size = 7;
+      resp[1] = req[1];
+      return 2;
+
+    case ID_DAP_SWJ_CLOCK:
+      *req_size = 5;
+
+      if (get_uint32(&req[1]))
+        sim->clock = get_uint32(&req[1]);
+
+      return 2;
+
+    case ID_DAP_SWJ_SEQUENCE:
+      *req_size = 2 + ((req[1] ? req[1] : 256) + 7) / 8;
+      swd_cycles(req[1] ? req[1] : 256);
+      sim->dp_selected = false; // A line reset deselects a multidrop DP
+      return 2;
+
+    case ID_DAP_SWD_CONFIGURE:
+      *req_size = 2;
+      return 2;
+
+    case ID_DAP_SWD_SEQUENCE:
+      return dap_sequence(req, req_size, resp, false);
+
+    case ID_DAP_JTAG_SEQUENCE:
+      return dap_sequence(req, req_size, resp, true);
+
+    case ID_DAP_JTAG_CONFIGURE:
+      *req_size = 2 + req[1];
+      return 2;
+
+    case ID_DAP_JTAG_IDCODE:
+      *req_size = 2;
+      put_uint32(&resp[2], SIM_JTAG_IDCODE);
+      return 6;
+
+    case ID_DAP_EXECUTE_COMMANDS:
+    {
+      int count = req[1];
+      int offs = 2;
+      int size = 2;
+
+      for (int i = 0; i < count; i++)
+      {
+        int cmd_size = 0;
+
+        size += dap_command(&req[offs], &cmd_size, &resp[size]);
+        offs += cmd_size;
+      }
+
+      resp[1] = count;
+      *req_size = offs;
+
+      return size;
+    }
+  }
+
+  resp[0] = ID_DAP_INVALID;
+  *req_size = 1;
+
+  return 1;
+}
+
+//-----------------------------------------------------------------------------
+void sim_add_region(uint32_t addr, uint32_t size, sim_read_t read, sim_write_t write)
+{
+  sim_state_t *sim = sim_state();
+
+  check(sim->region_count < MAX_REGIONS, "internal: too many simulator regions");
+
+  sim->regions[sim->region_count].addr  = addr;
+  sim->regions[sim->region_count].size  = size;
+  sim->regions[sim->region_count].read  = read;
+  sim->regions[sim->region_count].write = write;
+  sim->region_count++;
+}
+
+//-----------------------------------------------------------------------------
+uint32_t sim_mem_read(uint32_t addr)
+{
+  return mem_read(addr & ~3, 4);
+}
+
+//-----------------------------------------------------------------------------
+void sim_mem_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  uint32_t old = mem_read(addr & ~3, 4);
+
+  mem_write(addr & ~3, 4, (old & ~mask) | (value & mask));
+}
+
+//-----------------------------------------------------------------------------
+uint8_t sim_mem_read_byte(uint32_t addr)
+{
+  return mem_page(addr)[addr & (PAGE_SIZE - 1)];
+}
+
+//-----------------------------------------------------------------------------
+void sim_mem_write_byte(uint32_t addr, uint8_t value)
+{
+  mem_page(addr)[addr & (PAGE_SIZE - 1)] = value;
+}
+
+//-----------------------------------------------------------------------------
+void sim_mem_fill(uint32_t addr, uint32_t size, uint8_t value)
+{
+  while (size)
+  {
+    uint32_t offs = addr & (PAGE_SIZE - 1);
+    uint32_t chunk = PAGE_SIZE - offs;
+
+    if (chunk > size)
+      chunk = size;
+
+    memset(&mem_page(addr)[offs], value, chunk);
+
+    addr += chunk;
+    size -= chunk;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void sim_flash_program(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  // Programming can only clear bits
+  sim_mem_write(addr, sim_mem_read(addr) & value, mask);
+}
+
+//-----------------------------------------------------------------------------
+void sim_flash_erase(uint32_t addr, uint32_t size)
+{
+  sim_mem_fill(addr, size, 0xff);
+}
+
+//-----------------------------------------------------------------------------
+uint64_t sim_time(void)
+{
+  sim_state_t *sim = sim_state();
+
+  return sim->time;
+}
+
+//-----------------------------------------------------------------------------
+uint64_t sim_deadline(int us)
+{
+  sim_state_t *sim = sim_state();
+
+  return sim->time + (uint64_t)us * sim->timing * 10;
+}
+
+//-----------------------------------------------------------------------------
+void sim_stall(uint64_t time)
+{
+  sim_state_t *sim = sim_state();
+
+  if (sim->time < time)
+    sim->time = time;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_sim_session_init(session_t *session)
+{
+  sim_state_t *state = buf_alloc(sizeof(sim_state_t));
+
+  state->latency = DEFAULT_LATENCY;
+  state->probe_packet_size = DEFAULT_PACKET_SIZE;
+  state->probe_packet_count = DEFAULT_PACKET_COUNT;
+  state->timing = DEFAULT_TIMING;
+  state->probes = 1;
+  state->clock = DEFAULT_CLOCK;
+  state->tar_wrap_size = TAR_WRAP_SIZE;
+  state->match_mask = 0xffffffff;
+
+  session->sim_state = state;
+
+  sim_model_session_init(session);
+}
+
+//-----------------------------------------------------------------------------
+void dbg_sim_session_free(session_t *session)
+{
+  sim_state_t *state = session->sim_state;
+
+  sim_model_session_free(session);
+
+  if (NULL == state)
+    return;
+
+  for (int i = 0; i < HASH_SIZE; i++)
+  {
+    page_t *page = state->pages[i];
+
+    while (page)
+    {
+      page_t *next = page->next;
+      buf_free(page);
+      page = next;
+    }
+  }
+
+  for (int i = 0; i < DBG_MAX_PACKETS; i++)
+    buf_free(state->packets[i].buf);
+
+  buf_free(state);
+
+  session->sim_state = NULL;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_sim_configure(char *options)
+{
+  sim_state_t *sim = sim_state();
+  char *opts = strdup(options ? options : "");
+  char *save = NULL;
+  char *name = strtok_r(opts, ",", &save);
+
+  while (name)
+  {
+    char *value = strchr(name, '=');
+    char *end = NULL;
+    long n = 0;
+
+    if (NULL == value)
+      error_exit("invalid simulator option: %s", name);
+
+    *value++ = 0;
+
+    if (0 == strcmp(name, "target"))
+    {
+      sim->model = sim_find_model(value);
+
+      if (NULL == sim->model)
+        error_exit("unknown simulator target: %s", value);
+
+      name = strtok_r(NULL, ",", &save);
+      continue;
+    }
+
+    n = strtol(value, &end, 0);
+
+    if (value == end || *end)
+      error_exit("invalid simulator option: %s", name);
+
+    if (0 == strcmp(name, "latency"))
+    {
+      check(n >= 0, "simulator latency must not be negative");
+      sim->latency = n;
+    }
+    else if (0 == strcmp(name, "size"))
+    {
+      check(HID_PACKET_SIZE <= n && n <= MAX_PACKET_SIZE, "simulator packet size must be between %d and %d",
+          HID_PACKET_SIZE, MAX_PACKET_SIZE);
+      sim->probe_packet_size = n;
+    }
+    else if (0 == strcmp(name, "count"))
+    {
+      check(1 <= n && n <= DBG_MAX_PACKETS, "simulator packet count must be between 1 and %d", DBG_MAX_PACKETS);
+      sim->probe_packet_count = n;
+    }
+    else if (0 == strcmp(name, "timing"))
+    {
+      check(n >= 0, "simulator timing must not be negative");
+      sim->timing = n;
+    }
+    else if (0 == strcmp(name, "probes"))
+    {
+      check(1 <= n && n <= MAX_PROBES, "simulator probe count must be between 1 and %d", MAX_PROBES);
+      sim->probes = n;
+    }
+    else if (0 == strcmp(name, "maxclock"))
+    {
+      check(n > 0, "simulator clock limit must be positive");
+      sim->max_clock = n * 1000;
+    }
+    else
+    {
+      error_exit("unknown simulator option: %s", name);
+    }
+
+    name = strtok_r(NULL, ",", &save);
+  }
+
+  free(opts);
+}
+
+//-----------------------------------------------------------------------------
+int dbg_sim_enumerate(debugger_t *debuggers, int size)
+{
+  sim_state_t *sim = sim_state();
+  int count = (sim->probes < size) ? sim->probes : size;
+
+  for (int i = 0; i < count; i++)
+  {
+    if (1 == sim->probes)
+      strcpy(sim->serials[i], "sim");
+    else
+      snprintf(sim->serials[i], sizeof(sim->serials[i]), "sim%d", i);
+
+    memset(&debuggers[i], 0, sizeof(debugger_t));
+
+    debuggers[i].path         = "sim";
+    debuggers[i].serial       = sim->serials[i];
+    debuggers[i].manufacturer = "edbg";
+    debuggers[i].product      = "CMSIS-DAP Simulator";
+    debuggers[i].versions     = DBG_CMSIS_DAP_V1 | DBG_CMSIS_DAP_V2;
+    debuggers[i].v1_ep_size   = HID_PACKET_SIZE;
+    debuggers[i].v2_ep_size   = sim->probe_packet_size;
+  }
+
+  return count;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_sim_open(debugger_t *debugger, int version)
+{
+  sim_state_t *sim = sim_state();
+
+  debugger->use_v2 = (DBG_CMSIS_DAP_V2 == version);
+  sim->use_v2 = debugger->use_v2;
+  sim->packet_first = 0;
+  sim->packet_pending = 0;
+
+  dbg_sim_set_packet_size(sim->use_v2 ? debugger->v2_ep_size : debugger->v1_ep_size);
+
+  // The target keeps its state when the debugger is reopened
+  if (sim->model && !sim->model_ready)
+  {
+    verbose("Simulated target: %s\n", sim->model->description);
+    sim->tar_wrap_size = sim->model->tar_wrap_size;
+    sim->model->init();
+    sim->model_ready = true;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void dbg_sim_close(void)
+{
+  sim_state_t *sim = sim_state();
+
+  verbose("Simulator: %d packets, %d SWD transfers, %.3f s on the probe\n",
+      sim->stat_packets, sim->stat_transfers, sim->stat_busy / 1e9);
+
+  for (int i = 0; i < DBG_MAX_PACKETS; i++)
+  {
+    buf_free(sim->packets[i].buf);
+    sim->packets[i].buf = NULL;
+  }
+}
+
+//-----------------------------------------------------------------------------
+int dbg_sim_get_packet_size(void)
+{
+  sim_state_t *sim = sim_state();
+
+  return sim->packet_size;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_sim_set_packet_size(int size)
+{
+  sim_state_t *sim = sim_state();
+
+  check(0 == sim->packet_pending, "internal: packet size changed with pending packets");
+
+  if (!sim->use_v2)
+    size = HID_PACKET_SIZE;
+  else if (size > sim->probe_packet_size)
+    size = sim->probe_packet_size;
+
+  for (int i = 0; i < DBG_MAX_PACKETS; i++)
+  {
+    buf_free(sim->packets[i].buf);
+
+    // Requests are executed in place and responses may be longer than requests
+    sim->packets[i].buf = buf_alloc(size * 2);
+  }
+
+  sim->packet_size = size;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_sim_dap_cmd_send(uint8_t *data, int req_size)
+{
+  sim_state_t *sim = sim_state();
+  packet_t *packet;
+  uint64_t now = get_time_us() * 1000;
+  uint64_t start;
+  int size = 0;
+
+  check(sim->packet_pending < sim->probe_packet_count, "internal: too many pending packets");
+  check(req_size <= sim->packet_size, "internal: request does not fit into a packet");
+
+  packet = &sim->packets[(sim->packet_first + sim->packet_pending) % DBG_MAX_PACKETS];
+
+  // Packets are processed in order, but their latencies overlap. The request
+  // reaches the probe after half of the latency, the response takes the other half.
+  if (sim->time < now + sim->latency * 500ull)
+    sim->time = now + sim->latency * 500ull;
+
+  start = sim->time;
+  packet->size = dap_command(data, &size, packet->buf);
+  sim->stat_busy += sim->time - start;
+
+  check(size <= req_size, "simulator: truncated request for command 0x%02x", data[0]);
+  check(packet->size <= sim->packet_size, "simulator: response does not fit into a packet");
+
+  packet->ready = (sim->time + sim->latency * 500ull + 999) / 1000;
+
+  sim->packet_pending++;
+  sim->stat_packets++;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_sim_dap_cmd_receive(uint8_t *data, int resp_size)
+{
+  sim_state_t *sim = sim_state();
+  packet_t *packet;
+  uint64_t now;
+  int size;
+
+  check(sim->packet_pending > 0, "internal: no pending packets");
+
+  packet = &sim->packets[sim->packet_first];
+
+  while ((now = get_time_us()) < packet->ready)
+  {
+    if ((packet->ready - now) > 2000)
+      sleep_ms(1);
+  }
+
+  sim->packet_first = (sim->packet_first + 1) % DBG_MAX_PACKETS;
+  sim->packet_pending--;
+
+  size = packet->size - 1;
+
+  memcpy(data, &packet->buf[1], (resp_size < size) ? resp_size : size);
+
+  return size;
+}
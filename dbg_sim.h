@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+#ifndef _DBG_SIM_H_
+#define _DBG_SIM_H_
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdbool.h>
+#include "session.h"
+
+/*- Types -------------------------------------------------------------------*/
+// Register handlers operate on aligned words, the mask selects the written byte lanes
+typedef uint32_t (*sim_read_t)(uint32_t addr);
+typedef void (*sim_write_t)(uint32_t addr, uint32_t value, uint32_t mask);
+
+typedef struct
+{
+  char     *name;
+  char     *description;
+  int      tar_wrap_size;
+  void     (*init)(void);
+  uint32_t target_id; // Multidrop DPv2 instance 0 TARGETID, 0 for a regular DP
+} sim_model_t;
+
+/*- Prototypes --------------------------------------------------------------*/
+void sim_add_region(uint32_t addr, uint32_t size, sim_read_t read, sim_write_t write);
+
+uint32_t sim_mem_read(uint32_t addr);
+void sim_mem_write(uint32_t addr, uint32_t value, uint32_t mask);
+uint8_t sim_mem_read_byte(uint32_t addr);
+void sim_mem_write_byte(uint32_t addr, uint8_t value);
+void sim_mem_fill(uint32_t addr, uint32_t size, uint8_t value);
+
+void sim_flash_program(uint32_t addr, uint32_t value, uint32_t mask);
+void sim_flash_erase(uint32_t addr, uint32_t size);
+
+uint64_t sim_time(void);
+uint64_t sim_deadline(int us);
+void sim_stall(uint64_t time);
+
+void sim_model_session_init(session_t *session);
+void sim_model_session_free(session_t *session);
+sim_model_t *sim_find_model(char *name);
+
+#endif // _DBG_SIM_H_
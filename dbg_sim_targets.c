@@ -0,0 +1,1881 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "edbg.h"
+#include "dbg_sim.h"
+#include "session.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define MAX_PAGE_SIZE          512
+
+// Operation times are approximate typical values from the device datasheets (us)
+#define SAMD21_ROW_ERASE_TIME       6000
+#define SAMD21_PAGE_WRITE_TIME      2500
+#define SAMD21_CHIP_ERASE_TIME      240000
+#define SAMD51_BLOCK_ERASE_TIME     50000
+#define SAMD51_PAGE_ERASE_TIME      6000
+#define SAMD51_PAGE_WRITE_TIME      2500
+#define SAMD51_QUAD_WORD_WRITE_TIME 100
+#define SAMD51_CHIP_ERASE_TIME      500000
+#define SAML10_ROW_ERASE_TIME       6000
+#define SAML10_PAGE_WRITE_TIME      2500
+#define SAML10_CHIP_ERASE_TIME      40000
+#define EEFC_WRITE_PAGE_TIME        1500
+#define EEFC_ERASE_PAGE_TIME        3000
+#define EEFC_ERASE_BLOCK_TIME       50000 // 16 pages
+#define EEFC_ERASE_ALL_TIME         200000 // per 256 KB
+#define EEFC_COMMAND_TIME           10
+#define STM32_PAGE_ERASE_TIME       22000
+#define STM32_MASS_ERASE_TIME       22000
+#define STM32_DOUBLE_WORD_TIME      85
+#define PY32_PAGE_ERASE_TIME        4000
+#define PY32_PAGE_PROGRAM_TIME      1000
+#define PY32_MASS_ERASE_TIME        4000
+#define PY32_OPTION_TIME            5000
+#define GD32_SECTOR_ERASE_TIME      3000 // per KB
+#define GD32_WORD_PROGRAM_TIME      16
+#define GD32_OPTION_TIME            50000
+#define M480_PROGRAM_TIME           20
+#define M480_PAGE_ERASE_TIME        20000
+#define M480_BANK_ERASE_TIME        200000
+#define M480_READ_TIME              1
+#define SPI_NOR_PAGE_PROGRAM_TIME   400
+#define SPI_NOR_SECTOR_ERASE_TIME   45000
+#define SPI_NOR_CHIP_ERASE_TIME     5000000
+
+// Microchip DSU and NVMCTRL
+#define DSU_CTRL               0x41002100
+#define DSU_DID                0x41002118
+#define DSU_BCC0               0x41002120
+#define DSU_BCC1               0x41002124
+
+#define DSU_CTRL_CE            (1 << 4)
+#define DSU_STATUSA_DONE       (1 << 0)
+#define DSU_STATUSA_CRSTEXT    (1 << 1)
+#define DSU_STATUSB_PROT       (1 << 0)
+#define DSU_STATUSB_DAL_MASK   (3 << 0)
+#define DSU_STATUSB_BCCD1      (1 << 7)
+
+#define NVMCTRL                0x41004000
+#define NVMCTRL_CMD_KEY        0xa5
+
+#define USER_ROW_ADDR          0x00804000
+#define BOCOR_ROW_ADDR         0x0080c000
+
+#define BOOTROM_CMD_PREFIX     0x44424700
+#define BOOTROM_SIG_PREFIX     0xec000000
+#define BOOTROM_MAX_RESPONSES  4
+
+enum
+{
+  BOOTROM_CMD_INIT      = 0x55,
+  BOOTROM_CMD_EXIT      = 0xaa,
+  BOOTROM_CMD_CE2       = 0xe2,
+  BOOTROM_CMD_CHIPERASE = 0xe3,
+};
+
+enum
+{
+  BOOTROM_SIG_COMM        = 0x20,
+  BOOTROM_SIG_CMD_SUCCESS = 0x21,
+  BOOTROM_SIG_CMD_VALID   = 0x24,
+  BOOTROM_SIG_BOOTOK      = 0x39,
+  BOOTROM_SIG_BOOT_ERR    = 0x41,
+};
+
+// Microchip (Atmel) EEFC
+#define EEFC_MAX_COUNT         2
+#define EEFC_FLASH_ID          0x00150001
+#define EEFC_FCR_KEY           0x5a
+#define EEFC_FSR_FRDY          (1 << 0)
+#define EEFC_FSR_FCMDE         (1 << 1)
+
+enum
+{
+  EEFC_CMD_GETD = 0x00,
+  EEFC_CMD_WP   = 0x01,
+  EEFC_CMD_WPL  = 0x02,
+  EEFC_CMD_EWP  = 0x03,
+  EEFC_CMD_EWPL = 0x04,
+  EEFC_CMD_EA   = 0x05,
+  EEFC_CMD_EPA  = 0x07,
+  EEFC_CMD_SLB  = 0x08,
+  EEFC_CMD_CLB  = 0x09,
+  EEFC_CMD_GLB  = 0x0a,
+  EEFC_CMD_SGPB = 0x0b,
+  EEFC_CMD_CGPB = 0x0c,
+  EEFC_CMD_GGPB = 0x0d,
+};
+
+// STM32 and PY32 FLASH
+#define STM32_KEYR             0x08
+#define STM32_OPTKEYR          0x0c
+#define STM32_SR               0x10
+#define STM32_CR               0x14
+#define STM32_OPTR             0x20
+#define STM32_SFR              0x80
+
+#define STM32_KEY1             0x45670123
+#define STM32_KEY2             0xcdef89ab
+#define STM32_OPTKEY1          0x08192a3b
+#define STM32_OPTKEY2          0x4c5d6e7f
+
+#define STM32_SR_PROGERR       (1 << 3)
+#define STM32_SR_PGSERR        (1 << 7)
+#define STM32_SR_BSY           (1 << 16)
+#define STM32_SR_CFGBSY        (1 << 18)
+
+#define STM32_CR_PG            (1 << 0)
+#define STM32_CR_PER           (1 << 1)
+#define STM32_CR_MER1          (1 << 2)
+#define STM32_CR_PNB(x)        (((x) >> 3) & 0xff)
+#define STM32_CR_MER2          (1 << 15)
+#define STM32_CR_STRT          (1 << 16)
+#define STM32_CR_OPTSTRT       (1 << 17)
+#define STM32_CR_PGSTRT        (1 << 19)
+#define STM32_CR_OPTLOCK       (1 << 30)
+#define STM32_CR_LOCK          (1 << 31)
+
+#define PY32_OPTR_TRIGGER      0x80
+#define PY32_OPTIONS_OPTR      0x1fff0e80
+
+// GD32F4xx FMC
+#define GD32_FMC               0x40023c00
+#define GD32_KEY               0x04
+#define GD32_OBKEY             0x08
+#define GD32_STAT              0x0c
+#define GD32_CTL               0x10
+#define GD32_OBCTL0            0x14
+#define GD32_OBCTL1            0x18
+
+#define GD32_STAT_PGSERR       (1 << 7)
+#define GD32_STAT_BUSY         (1 << 16)
+
+#define GD32_CTL_PG            (1 << 0)
+#define GD32_CTL_SER           (1 << 1)
+#define GD32_CTL_MER0          (1 << 2)
+#define GD32_CTL_SN(x)         (((x) >> 3) & 0x1f)
+#define GD32_CTL_MER1          (1 << 15)
+#define GD32_CTL_START         (1 << 16)
+#define GD32_CTL_LK            (1 << 31)
+
+#define GD32_OBCTL0_OB_LK      (1 << 0)
+#define GD32_OBCTL0_OB_START   (1 << 1)
+#define GD32_OBCTL0_SPC(x)     (((x) >> 8) & 0xff)
+
+#define GD32_OPTIONS_SPC       0x1fffc001
+
+// Nuvoton M480 FMC
+#define M480_FMC               0x4000c000
+#define M480_ISPCTL            0x00
+#define M480_ISPADDR           0x04
+#define M480_ISPDAT            0x08
+#define M480_ISPCMD            0x0c
+#define M480_ISPTRG            0x10
+#define M480_ISPSTS            0x40
+#define M480_MPDAT0            0x80
+#define M480_MPDAT1            0x84
+
+#define M480_ISPCTL_ISPEN      (1 << 0)
+#define M480_ISPCTL_APUEN      (1 << 3)
+#define M480_ISPCTL_CFGUEN     (1 << 4)
+#define M480_ISPTRG_ISPGO      (1 << 0)
+#define M480_ISPSTS_ISPBUSY    (1 << 0)
+#define M480_ISPSTS_ISPFF      (1 << 6)
+
+#define M480_CONFIG_ADDR       0x00300000
+#define M480_CONFIG_SIZE       16
+#define M480_PAGE_SIZE         4096
+
+enum
+{
+  M480_CMD_READ       = 0x00,
+  M480_CMD_32B_PROG   = 0x21,
+  M480_CMD_PAGE_ERASE = 0x22,
+  M480_CMD_BANK_ERASE = 0x23,
+  M480_CMD_MASS_ERASE = 0x26,
+  M480_CMD_64B_PROG   = 0x61,
+};
+
+// RP2040 SSI, DMA and SPI NOR flash
+#define RP2040_XIP_ADDR        0x13000000
+#define RP2040_SSI             0x18000000
+#define RP2040_SSI_BAUDR       0x14
+#define RP2040_SSI_SR          0x28
+#define RP2040_SSI_IDR         0x58
+#define RP2040_SSI_DR0         0x60
+#define RP2040_SSI_IDR_VALUE   0x51535049
+#define RP2040_SSI_SR_TFNF     (1 << 1)
+#define RP2040_SSI_SR_TFE      (1 << 2)
+#define RP2040_SSI_SR_RFNE     (1 << 3)
+#define RP2040_SSI_FIFO_SIZE   16
+#define RP2040_SYS_CLOCK_NS    8
+
+#define RP2040_IO_QSPI         0x40018000
+#define RP2040_GPIO_SS_CTRL    0x0c
+#define RP2040_OUTOVER(x)      (((x) >> 8) & 3)
+#define RP2040_OUTOVER_LOW     2
+
+#define RP2040_DMA             0x50000000
+#define RP2040_DMA_CH0_CTRL    0x10
+#define RP2040_DMA_CH0_WRITE   0x18
+#define RP2040_DMA_CH0_COUNT   0x1c
+#define RP2040_DMA_CH1_READ    0x54
+#define RP2040_DMA_CH1_COUNT   0x5c
+#define RP2040_DMA_CTRL_BUSY   (1 << 24)
+
+#define SPI_NOR_SIZE           (2 * 1024 * 1024)
+#define SPI_NOR_PAGE_SIZE      256
+#define SPI_NOR_SECTOR_SIZE    4096
+#define SPI_NOR_SFDP_SIZE      0xc0
+#define SPI_NOR_STATUS_WIP     (1 << 0)
+#define SPI_NOR_STATUS_WEL     (1 << 1)
+
+enum
+{
+  SPI_NOR_CMD_PAGE_PROGRAM = 0x02,
+  SPI_NOR_CMD_READ_DATA    = 0x03,
+  SPI_NOR_CMD_READ_STATUS  = 0x05,
+  SPI_NOR_CMD_WRITE_ENABLE = 0x06,
+  SPI_NOR_CMD_SECTOR_ERASE = 0x20,
+  SPI_NOR_CMD_READ_SFDP    = 0x5a,
+  SPI_NOR_CMD_READ_JEDEC   = 0x9f,
+  SPI_NOR_CMD_CHIP_ERASE   = 0xc7,
+};
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  uint32_t regs;
+  uint32_t flash_addr;
+  uint32_t flash_size;
+  uint32_t fmr;
+  uint32_t fsr;
+  int      cmd;
+  int      result;
+  uint32_t gpnvm;
+  uint64_t busy_until;
+  uint8_t  latch[MAX_PAGE_SIZE];
+} eefc_t;
+
+typedef struct
+{
+  uint32_t flash_addr;
+  uint32_t flash_size;
+  int      page_size;
+  uint64_t busy_until;
+  uint8_t  page_buf[MAX_PAGE_SIZE];
+
+  uint32_t dsu_did;
+  uint8_t  dsu_statusa;
+  uint8_t  dsu_statusb;
+  bool     dsu_erasing;
+  uint64_t dsu_erase_done;
+  int      dsu_erase_time;
+
+  uint32_t nvm_ctrla;
+  uint32_t nvm_ctrlb;
+  uint32_t nvm_addr;
+  bool     nvm_manual;
+
+  uint32_t bootrom_resp[BOOTROM_MAX_RESPONSES];
+  uint64_t bootrom_resp_time[BOOTROM_MAX_RESPONSES];
+  int      bootrom_resp_count;
+  int      bootrom_data;
+
+  eefc_t   eefc[EEFC_MAX_COUNT];
+  int      eefc_count;
+  int      eefc_lock_size;
+
+  uint32_t stm32_regs;
+  uint32_t stm32_sr;
+  uint32_t stm32_cr;
+  uint32_t stm32_optr;
+  uint32_t stm32_sfr;
+  uint32_t stm32_busy_mask;
+  bool     stm32_key;
+  bool     stm32_optkey;
+  bool     stm32_dw_pending;
+  uint32_t stm32_dw_addr;
+  uint32_t stm32_dw_data;
+
+  uint32_t gd32_stat;
+  uint32_t gd32_ctl;
+  uint32_t gd32_obctl0;
+  uint32_t gd32_obctl1;
+  bool     gd32_key;
+  bool     gd32_obkey;
+
+  uint32_t m480_regs[0x100 / 4];
+
+  uint32_t ssi_regs[0x100 / 4];
+  uint8_t  ssi_rx_fifo[RP2040_SSI_FIFO_SIZE];
+  int      ssi_rx_count;
+  uint32_t dma_regs[0x100 / 4];
+  uint64_t dma_busy_until;
+  bool     spi_selected;
+  int      spi_index;
+  int      spi_cmd;
+  uint32_t spi_addr;
+  bool     spi_wel;
+  uint8_t  spi_page[SPI_NOR_PAGE_SIZE];
+  int      spi_page_count;
+  uint8_t  spi_sfdp[SPI_NOR_SFDP_SIZE];
+} model_state_t;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static inline model_state_t *model_state(void)
+{
+  return (model_state_t *)g_session->model_state;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t update(uint32_t reg, uint32_t value, uint32_t mask)
+{
+  return (reg & ~mask) | (value & mask);
+}
+
+//-----------------------------------------------------------------------------
+static bool flash_busy(void)
+{
+  model_state_t *model = model_state();
+
+  return sim_time() < model->busy_until;
+}
+
+//-----------------------------------------------------------------------------
+static void flash_start(int us)
+{
+  model_state_t *model = model_state();
+
+  model->busy_until = sim_deadline(us);
+}
+
+//-----------------------------------------------------------------------------
+static void flash_wait(void)
+{
+  model_state_t *model = model_state();
+
+  // Bus accesses to a busy controller are stalled until it is ready
+  sim_stall(model->busy_until);
+}
+
+//-----------------------------------------------------------------------------
+static void page_buf_clear(void)
+{
+  model_state_t *model = model_state();
+
+  memset(model->page_buf, 0xff, sizeof(model->page_buf));
+}
+
+//-----------------------------------------------------------------------------
+static void page_buf_write(uint8_t *buf, uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+  uint32_t offs = addr & (model->page_size - 1);
+
+  for (int i = 0; i < 4; i++)
+  {
+    if (mask & (0xff << (i * 8)))
+      buf[offs + i] = value >> (i * 8);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void page_buf_program(uint8_t *buf, uint32_t addr, int size)
+{
+  model_state_t *model = model_state();
+  uint32_t offs = addr & (model->page_size - 1);
+
+  for (int i = 0; i < size; i += 4)
+  {
+    uint8_t *data = &buf[offs + i];
+    sim_flash_program(addr + i, data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24), 0xffffffff);
+  }
+
+  memset(&buf[offs], 0xff, size);
+}
+
+//-----------------------------------------------------------------------------
+static void add_flash(uint32_t addr, uint32_t size, sim_write_t write)
+{
+  sim_flash_erase(addr, size);
+  sim_add_region(addr, size, NULL, write);
+}
+
+//-----------------------------------------------------------------------------
+static void bootrom_respond(int sig, uint64_t time)
+{
+  model_state_t *model = model_state();
+
+  if (model->bootrom_resp_count == BOOTROM_MAX_RESPONSES)
+    return;
+
+  model->bootrom_resp[model->bootrom_resp_count] = BOOTROM_SIG_PREFIX | sig;
+  model->bootrom_resp_time[model->bootrom_resp_count] = time;
+  model->bootrom_resp_count++;
+}
+
+//-----------------------------------------------------------------------------
+static bool bootrom_ready(void)
+{
+  model_state_t *model = model_state();
+
+  return model->bootrom_resp_count > 0 && sim_time() >= model->bootrom_resp_time[0];
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t bootrom_read(void)
+{
+  model_state_t *model = model_state();
+  uint32_t value;
+
+  if (!bootrom_ready())
+    return 0;
+
+  value = model->bootrom_resp[0];
+  model->bootrom_resp_count--;
+
+  memmove(&model->bootrom_resp[0], &model->bootrom_resp[1], model->bootrom_resp_count * sizeof(uint32_t));
+  memmove(&model->bootrom_resp_time[0], &model->bootrom_resp_time[1], model->bootrom_resp_count * sizeof(uint64_t));
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static void bootrom_chip_erase(void)
+{
+  model_state_t *model = model_state();
+
+  sim_flash_erase(model->flash_addr, model->flash_size);
+  model->dsu_statusb = (model->dsu_statusb & ~DSU_STATUSB_DAL_MASK) | 2;
+  bootrom_respond(BOOTROM_SIG_CMD_SUCCESS, sim_deadline(model->dsu_erase_time));
+}
+
+//-----------------------------------------------------------------------------
+static void bootrom_write(uint32_t value)
+{
+  model_state_t *model = model_state();
+
+  if (model->bootrom_data)
+  {
+    if (0 == --model->bootrom_data)
+      bootrom_chip_erase();
+    return;
+  }
+
+  if ((value & 0xffffff00) != BOOTROM_CMD_PREFIX)
+  {
+    bootrom_respond(BOOTROM_SIG_BOOT_ERR, sim_time());
+    return;
+  }
+
+  switch (value & 0xff)
+  {
+    case BOOTROM_CMD_INIT:
+      bootrom_respond(BOOTROM_SIG_COMM, sim_time());
+      break;
+
+    case BOOTROM_CMD_EXIT:
+      bootrom_respond(BOOTROM_SIG_BOOTOK, sim_time());
+      break;
+
+    case BOOTROM_CMD_CHIPERASE:
+      bootrom_respond(BOOTROM_SIG_CMD_VALID, sim_time());
+      bootrom_chip_erase();
+      break;
+
+    case BOOTROM_CMD_CE2:
+      // The key is not checked
+      bootrom_respond(BOOTROM_SIG_CMD_VALID, sim_time());
+      model->bootrom_data = 4;
+      break;
+
+    default:
+      bootrom_respond(BOOTROM_SIG_BOOT_ERR, sim_time());
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t dsu_read(uint32_t addr)
+{
+  model_state_t *model = model_state();
+
+  if (DSU_CTRL == addr)
+  {
+    uint32_t statusb = model->dsu_statusb;
+
+    if (model->dsu_erasing && sim_time() >= model->dsu_erase_done)
+    {
+      model->dsu_statusa |= DSU_STATUSA_DONE;
+      model->dsu_erasing = false;
+    }
+
+    if (bootrom_ready())
+      statusb |= DSU_STATUSB_BCCD1;
+
+    return (statusb << 16) | (model->dsu_statusa << 8);
+  }
+  else if (DSU_DID == addr)
+  {
+    return model->dsu_did;
+  }
+  else if (DSU_BCC1 == addr)
+  {
+    return bootrom_read();
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void dsu_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+
+  (void)mask;
+
+  if (DSU_CTRL == addr)
+  {
+    model->dsu_statusa &= ~(value >> 8);
+
+    if (value & DSU_CTRL_CE)
+    {
+      sim_flash_erase(model->flash_addr, model->flash_size);
+      model->dsu_statusa &= ~DSU_STATUSA_DONE;
+      model->dsu_statusb &= ~DSU_STATUSB_PROT;
+      model->dsu_erasing = true;
+      model->dsu_erase_done = sim_deadline(model->dsu_erase_time);
+    }
+  }
+  else if (DSU_BCC0 == addr)
+  {
+    bootrom_write(value);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void dsu_init(uint32_t did, int erase_time)
+{
+  model_state_t *model = model_state();
+
+  model->dsu_did = did;
+  model->dsu_statusa = DSU_STATUSA_CRSTEXT;
+  model->dsu_statusb = 0;
+  model->dsu_erase_time = erase_time;
+
+  sim_add_region(DSU_CTRL, 0x100, dsu_read, dsu_write);
+}
+
+//-----------------------------------------------------------------------------
+static void nvm_buffer_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+
+  flash_wait();
+  page_buf_write(model->page_buf, addr, value, mask);
+
+  // Page buffer writes update the address register
+  model->nvm_addr = addr;
+
+  if (!model->nvm_manual && (addr & (model->page_size - 1)) == (uint32_t)(model->page_size - 4))
+  {
+    page_buf_program(model->page_buf, addr & ~(model->page_size - 1), model->page_size);
+    flash_start(SAMD21_PAGE_WRITE_TIME);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void nvm_init(uint32_t flash_size, int page_size, sim_read_t read, sim_write_t write)
+{
+  model_state_t *model = model_state();
+
+  model->flash_addr = 0;
+  model->flash_size = flash_size;
+  model->page_size = page_size;
+  model->nvm_manual = true;
+  page_buf_clear();
+
+  add_flash(model->flash_addr, model->flash_size, nvm_buffer_write);
+  add_flash(USER_ROW_ADDR, page_size * 4, nvm_buffer_write);
+  sim_add_region(NVMCTRL, 0x40, read, write);
+}
+
+//-----------------------------------------------------------------------------
+static void samd21_command(uint32_t cmd)
+{
+  model_state_t *model = model_state();
+  uint32_t addr = model->nvm_addr;
+
+  if ((cmd >> 8) != NVMCTRL_CMD_KEY)
+    return;
+
+  switch (cmd & 0x7f)
+  {
+    case 0x02: // ER
+    case 0x05: // EAR
+      sim_flash_erase(addr & ~(model->page_size * 4 - 1), model->page_size * 4);
+      flash_start(SAMD21_ROW_ERASE_TIME);
+      break;
+
+    case 0x04: // WP
+    case 0x06: // WAP
+      page_buf_program(model->page_buf, addr & ~(model->page_size - 1), model->page_size);
+      flash_start(SAMD21_PAGE_WRITE_TIME);
+      break;
+
+    case 0x44: // PBC
+      page_buf_clear();
+      break;
+
+    case 0x45: // SSB
+      model->dsu_statusb |= DSU_STATUSB_PROT;
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t samd21_nvm_read(uint32_t addr)
+{
+  model_state_t *model = model_state();
+
+  switch (addr - NVMCTRL)
+  {
+    case 0x00: return model->nvm_ctrla;
+    case 0x04: return model->nvm_ctrlb;
+    case 0x08: return (model->flash_size / model->page_size) | (3 << 16);
+    case 0x14: return flash_busy() ? 0 : 1;
+    case 0x1c: return model->nvm_addr >> 1;
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void samd21_nvm_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+
+  flash_wait();
+
+  switch (addr - NVMCTRL)
+  {
+    case 0x00:
+      samd21_command(value & 0xffff);
+      break;
+
+    case 0x04:
+      model->nvm_ctrlb = update(model->nvm_ctrlb, value, mask);
+      model->nvm_manual = (model->nvm_ctrlb & (1 << 7)) > 0;
+      break;
+
+    case 0x1c:
+      model->nvm_addr = update(model->nvm_addr >> 1, value, mask) << 1;
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void samd21_init(void)
+{
+  model_state_t *model = model_state();
+
+  dsu_init(0x10010000, SAMD21_CHIP_ERASE_TIME); // SAM D21J18A
+  nvm_init(256 * 1024, 64, samd21_nvm_read, samd21_nvm_write);
+  model->nvm_ctrlb = 1 << 7;
+}
+
+//-----------------------------------------------------------------------------
+static void samd51_command(uint32_t cmd)
+{
+  model_state_t *model = model_state();
+  uint32_t addr = model->nvm_addr;
+
+  if ((cmd >> 8) != NVMCTRL_CMD_KEY)
+    return;
+
+  switch (cmd & 0x7f)
+  {
+    case 0x00: // EP
+      sim_flash_erase(addr & ~(model->page_size - 1), model->page_size);
+      flash_start(SAMD51_PAGE_ERASE_TIME);
+      break;
+
+    case 0x01: // EB
+      sim_flash_erase(addr & ~(model->page_size * 16 - 1), model->page_size * 16);
+      flash_start(SAMD51_BLOCK_ERASE_TIME);
+      break;
+
+    case 0x03: // WP
+      page_buf_program(model->page_buf, addr & ~(model->page_size - 1), model->page_size);
+      flash_start(SAMD51_PAGE_WRITE_TIME);
+      break;
+
+    case 0x04: // WQW
+      page_buf_program(model->page_buf, addr & ~15, 16);
+      flash_start(SAMD51_QUAD_WORD_WRITE_TIME);
+      break;
+
+    case 0x15: // PBC
+      page_buf_clear();
+      break;
+
+    case 0x16: // SSB
+      model->dsu_statusb |= DSU_STATUSB_PROT;
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t samd51_nvm_read(uint32_t addr)
+{
+  model_state_t *model = model_state();
+
+  switch (addr - NVMCTRL)
+  {
+    case 0x00: return model->nvm_ctrla;
+    case 0x08: return (model->flash_size / model->page_size) | (6 << 16);
+    case 0x10: return flash_busy() ? 0 : ((1 << 16) | 1); // STATUS.READY, INTFLAG.DONE
+    case 0x14: return model->nvm_addr;
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void samd51_nvm_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+
+  flash_wait();
+
+  switch (addr - NVMCTRL)
+  {
+    case 0x00:
+      model->nvm_ctrla = update(model->nvm_ctrla, value, mask);
+      model->nvm_manual = (0 == (model->nvm_ctrla & (3 << 4)));
+      break;
+
+    case 0x04:
+      samd51_command(value & 0xffff);
+      break;
+
+    case 0x14:
+      model->nvm_addr = update(model->nvm_addr, value, mask);
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void samd51_init(void)
+{
+  model_state_t *model = model_state();
+
+  dsu_init(0x60060005, SAMD51_CHIP_ERASE_TIME); // SAM D51J19A
+  nvm_init(512 * 1024, 512, samd51_nvm_read, samd51_nvm_write);
+  model->nvm_ctrla = 1 << 2;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t saml10_nvm_read(uint32_t addr)
+{
+  model_state_t *model = model_state();
+
+  switch (addr - NVMCTRL)
+  {
+    case 0x08: return model->nvm_manual ? 1 : 0;
+    case 0x18: return flash_busy() ? 0 : (1 << 2);
+    case 0x1c: return model->nvm_addr;
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void saml10_nvm_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+
+  flash_wait();
+
+  switch (addr - NVMCTRL)
+  {
+    case 0x00:
+      if (((value >> 8) & 0xff) != NVMCTRL_CMD_KEY)
+        break;
+
+      if (0x02 == (value & 0x7f)) // ER
+      {
+        sim_flash_erase(model->nvm_addr & ~(model->page_size * 4 - 1), model->page_size * 4);
+        flash_start(SAML10_ROW_ERASE_TIME);
+      }
+      else if (0x04 == (value & 0x7f)) // WP
+      {
+        page_buf_program(model->page_buf, model->nvm_addr & ~(model->page_size - 1), model->page_size);
+        flash_start(SAML10_PAGE_WRITE_TIME);
+      }
+      else if (0x44 == (value & 0x7f)) // PBC
+      {
+        page_buf_clear();
+      }
+      else if (0x4b == (value & 0x7f)) // SDAL0
+      {
+        model->dsu_statusb = (model->dsu_statusb & ~DSU_STATUSB_DAL_MASK) | 1;
+      }
+      break;
+
+    case 0x08:
+      if (mask & 0xff)
+        model->nvm_manual = (value & 1) > 0;
+      break;
+
+    case 0x1c:
+      model->nvm_addr = update(model->nvm_addr, value, mask);
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void saml10_init(void)
+{
+  model_state_t *model = model_state();
+
+  dsu_init(0x20840000, SAML10_CHIP_ERASE_TIME); // SAM L10E16A
+  nvm_init(64 * 1024, 64, saml10_nvm_read, saml10_nvm_write);
+  add_flash(BOCOR_ROW_ADDR, model->page_size * 4, nvm_buffer_write);
+  model->dsu_statusb = 2; // DAL
+}
+
+//-----------------------------------------------------------------------------
+static eefc_t *eefc_find(uint32_t addr)
+{
+  model_state_t *model = model_state();
+
+  for (int i = 0; i < model->eefc_count; i++)
+  {
+    if ((addr - model->eefc[i].regs) < 0x10 || (addr - model->eefc[i].flash_addr) < model->eefc[i].flash_size)
+      return &model->eefc[i];
+  }
+
+  return &model->eefc[0];
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t eefc_result(eefc_t *eefc, int index)
+{
+  model_state_t *model = model_state();
+  int locks = eefc->flash_size / model->eefc_lock_size;
+
+  if (EEFC_CMD_GETD == eefc->cmd)
+  {
+    uint32_t descriptor[] = { EEFC_FLASH_ID, eefc->flash_size, model->page_size, 1, eefc->flash_size, locks };
+
+    if (index < ARRAY_SIZE(descriptor))
+      return descriptor[index];
+    else if (index < ARRAY_SIZE(descriptor) + locks)
+      return model->eefc_lock_size;
+  }
+  else if (EEFC_CMD_GGPB == eefc->cmd && 0 == index)
+  {
+    return eefc->gpnvm;
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void eefc_command(eefc_t *eefc, uint32_t value)
+{
+  model_state_t *model = model_state();
+  uint32_t pages = eefc->flash_size / model->page_size;
+  uint32_t arg = (value >> 8) & 0xffff;
+  uint32_t addr = eefc->flash_addr + (arg % pages) * model->page_size;
+  int time = EEFC_COMMAND_TIME;
+
+  if ((value >> 24) != EEFC_FCR_KEY)
+  {
+    eefc->fsr |= EEFC_FSR_FCMDE;
+    return;
+  }
+
+  eefc->cmd = value & 0xff;
+  eefc->result = 0;
+  eefc->fsr = 0;
+
+  switch (eefc->cmd)
+  {
+    case EEFC_CMD_EWP:
+    case EEFC_CMD_EWPL:
+      sim_flash_erase(addr, model->page_size);
+      time += EEFC_ERASE_PAGE_TIME;
+      // Fall through
+
+    case EEFC_CMD_WP:
+    case EEFC_CMD_WPL:
+      page_buf_program(eefc->latch, addr, model->page_size);
+      time += EEFC_WRITE_PAGE_TIME;
+      break;
+
+    case EEFC_CMD_EPA:
+    {
+      uint32_t count = 4 << (arg & 3);
+      uint32_t first = ((arg & ~3) % pages) & ~(count - 1);
+
+      sim_flash_erase(eefc->flash_addr + first * model->page_size, count * model->page_size);
+      time = EEFC_ERASE_BLOCK_TIME * count / 16;
+    } break;
+
+    case EEFC_CMD_EA:
+      sim_flash_erase(eefc->flash_addr, eefc->flash_size);
+      time = EEFC_ERASE_ALL_TIME * (eefc->flash_size / (256 * 1024));
+      break;
+
+    case EEFC_CMD_SGPB:
+      eefc->gpnvm |= (1 << arg);
+      break;
+
+    case EEFC_CMD_CGPB:
+      eefc->gpnvm &= ~(1 << arg);
+      break;
+
+    case EEFC_CMD_GETD:
+    case EEFC_CMD_SLB:
+    case EEFC_CMD_CLB:
+    case EEFC_CMD_GLB:
+    case EEFC_CMD_GGPB:
+      break;
+
+    default:
+      eefc->fsr |= EEFC_FSR_FCMDE;
+      return;
+  }
+
+  eefc->busy_until = sim_deadline(time);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t eefc_read(uint32_t addr)
+{
+  eefc_t *eefc = eefc_find(addr);
+
+  switch (addr - eefc->regs)
+  {
+    case 0x00: return eefc->fmr;
+    case 0x08: return eefc->fsr | ((sim_time() < eefc->busy_until) ? 0 : EEFC_FSR_FRDY);
+    case 0x0c: return eefc_result(eefc, eefc->result++);
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void eefc_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  eefc_t *eefc = eefc_find(addr);
+
+  sim_stall(eefc->busy_until);
+
+  if (0x00 == (addr - eefc->regs))
+    eefc->fmr = update(eefc->fmr, value, mask);
+  else if (0x04 == (addr - eefc->regs))
+    eefc_command(eefc, value);
+}
+
+//-----------------------------------------------------------------------------
+static void eefc_latch_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  eefc_t *eefc = eefc_find(addr);
+
+  sim_stall(eefc->busy_until);
+  page_buf_write(eefc->latch, addr, value, mask);
+}
+
+//-----------------------------------------------------------------------------
+static void eefc_add(uint32_t regs, uint32_t flash_addr, uint32_t flash_size)
+{
+  model_state_t *model = model_state();
+  eefc_t *eefc = &model->eefc[model->eefc_count++];
+
+  memset(eefc, 0, sizeof(eefc_t));
+  memset(eefc->latch, 0xff, sizeof(eefc->latch));
+
+  eefc->regs = regs;
+  eefc->flash_addr = flash_addr;
+  eefc->flash_size = flash_size;
+
+  sim_add_region(regs, 0x10, eefc_read, eefc_write);
+  add_flash(flash_addr, flash_size, eefc_latch_write);
+}
+
+//-----------------------------------------------------------------------------
+static void sam3x_init(void)
+{
+  model_state_t *model = model_state();
+
+  // ATSAM3X8E
+  sim_mem_write(0x400e0940, 0x285e0a60, 0xffffffff);
+  sim_mem_write(0x400e0944, 0, 0xffffffff);
+
+  model->page_size = 256;
+  model->eefc_lock_size = 16 * 1024;
+  eefc_add(0x400e0a00, 0x00080000, 256 * 1024);
+  eefc_add(0x400e0c00, 0x000c0000, 256 * 1024);
+}
+
+//-----------------------------------------------------------------------------
+static void sam4s_init(void)
+{
+  model_state_t *model = model_state();
+
+  // SAM4S16C (Rev B)
+  sim_mem_write(0x400e0740, 0x28ac0ce1, 0xffffffff);
+  sim_mem_write(0x400e0744, 0, 0xffffffff);
+
+  model->page_size = 512;
+  model->eefc_lock_size = 8 * 1024;
+  eefc_add(0x400e0a00, 0x00400000, 1024 * 1024);
+}
+
+//-----------------------------------------------------------------------------
+static void same70_init(void)
+{
+  model_state_t *model = model_state();
+
+  // SAM E70Q21 (Rev B)
+  sim_mem_write(0x400e0940, 0xa1020e01, 0xffffffff);
+  sim_mem_write(0x400e0944, 2, 0xffffffff);
+
+  model->page_size = 512;
+  model->eefc_lock_size = 16 * 1024;
+  eefc_add(0x400e0c00, 0x00400000, 2 * 1024 * 1024);
+}
+
+//-----------------------------------------------------------------------------
+static void stm32_start(void)
+{
+  model_state_t *model = model_state();
+
+  if (model->stm32_cr & STM32_CR_PER)
+  {
+    uint32_t addr = model->flash_addr + STM32_CR_PNB(model->stm32_cr) * model->page_size;
+
+    if ((addr - model->flash_addr) < model->flash_size)
+      sim_flash_erase(addr, model->page_size);
+
+    flash_start(STM32_PAGE_ERASE_TIME);
+  }
+  else if (model->stm32_cr & (STM32_CR_MER1 | STM32_CR_MER2))
+  {
+    sim_flash_erase(model->flash_addr, model->flash_size);
+    flash_start(STM32_MASS_ERASE_TIME);
+  }
+  else
+  {
+    model->stm32_sr |= STM32_SR_PGSERR;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t stm32_read(uint32_t addr)
+{
+  model_state_t *model = model_state();
+
+  switch (addr - model->stm32_regs)
+  {
+    case STM32_SR: return model->stm32_sr | (flash_busy() ? model->stm32_busy_mask : 0);
+    case STM32_CR: return model->stm32_cr;
+    case STM32_OPTR: return model->stm32_optr;
+    case STM32_SFR: return model->stm32_sfr;
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void stm32_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+  uint32_t locks = STM32_CR_LOCK | STM32_CR_OPTLOCK;
+
+  switch (addr - model->stm32_regs)
+  {
+    case STM32_KEYR:
+      if (model->stm32_key && STM32_KEY2 == value)
+        model->stm32_cr &= ~STM32_CR_LOCK;
+      model->stm32_key = (STM32_KEY1 == value);
+      break;
+
+    case STM32_OPTKEYR:
+      if (model->stm32_optkey && STM32_OPTKEY2 == value)
+        model->stm32_cr &= ~STM32_CR_OPTLOCK;
+      model->stm32_optkey = (STM32_OPTKEY1 == value);
+      break;
+
+    case STM32_SR:
+      model->stm32_sr &= ~value;
+      break;
+
+    case STM32_CR:
+      if (model->stm32_cr & STM32_CR_LOCK)
+        break;
+
+      // Lock bits can only be cleared by the key sequences
+      model->stm32_cr = (update(model->stm32_cr, value, mask) & ~(locks | STM32_CR_STRT)) | ((model->stm32_cr | value) & locks);
+      model->stm32_dw_pending = false;
+
+      if (value & STM32_CR_STRT)
+        stm32_start();
+      break;
+
+    case STM32_OPTR:
+      if (0 == (model->stm32_cr & STM32_CR_OPTLOCK))
+        model->stm32_optr = update(model->stm32_optr, value, mask);
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void stm32_flash_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+
+  flash_wait();
+
+  if (0 == (model->stm32_cr & STM32_CR_PG) || 0xffffffff != mask)
+  {
+    model->stm32_sr |= STM32_SR_PGSERR;
+    return;
+  }
+
+  // Flash is programmed by double words, the second word starts the operation
+  if (0 == (addr & 4))
+  {
+    model->stm32_dw_pending = true;
+    model->stm32_dw_addr = addr;
+    model->stm32_dw_data = value;
+    return;
+  }
+
+  if (!model->stm32_dw_pending || addr != (model->stm32_dw_addr + 4))
+  {
+    model->stm32_sr |= STM32_SR_PGSERR;
+    model->stm32_dw_pending = false;
+    return;
+  }
+
+  if (0xffffffff == (sim_mem_read(model->stm32_dw_addr) & sim_mem_read(addr)) || (0 == model->stm32_dw_data && 0 == value))
+  {
+    sim_flash_program(model->stm32_dw_addr, model->stm32_dw_data, 0xffffffff);
+    sim_flash_program(addr, value, 0xffffffff);
+  }
+  else
+  {
+    model->stm32_sr |= STM32_SR_PROGERR;
+  }
+
+  model->stm32_dw_pending = false;
+  flash_start(STM32_DOUBLE_WORD_TIME);
+}
+
+//-----------------------------------------------------------------------------
+static void stm32_init(uint32_t regs, uint32_t flash_size, int page_size, uint32_t busy_mask,
+    sim_write_t regs_write, sim_write_t flash_write)
+{
+  model_state_t *model = model_state();
+
+  model->stm32_regs = regs;
+  model->stm32_cr = STM32_CR_LOCK | STM32_CR_OPTLOCK;
+  model->stm32_busy_mask = busy_mask;
+  model->flash_addr = 0x08000000;
+  model->flash_size = flash_size;
+  model->page_size = page_size;
+
+  sim_add_region(regs, 0x100, stm32_read, regs_write);
+  add_flash(model->flash_addr, model->flash_size, flash_write);
+}
+
+//-----------------------------------------------------------------------------
+static void stm32g0_init(void)
+{
+  model_state_t *model = model_state();
+
+  // STM32G071RB
+  sim_mem_write(0x40015800, 0x10006460, 0xffffffff); // DBG_IDCODE
+  sim_mem_write(0x1fff75e0, 128, 0xffffffff); // FLASH_SIZE
+  sim_mem_write(0x1fff7800, 0xdffffeaa, 0xffffffff); // OPTR
+
+  stm32_init(0x40022000, 128 * 1024, 2048, STM32_SR_BSY, stm32_write, stm32_flash_write);
+  model->stm32_optr = 0xdffffeaa;
+}
+
+//-----------------------------------------------------------------------------
+static void stm32g4_init(void)
+{
+  model_state_t *model = model_state();
+
+  // STM32G474RE in dual bank mode
+  sim_mem_write(0xe0042000, 0x20006469, 0xffffffff); // DBGMCU_IDCODE
+  sim_mem_write(0x1fff75e0, 512, 0xffffffff); // FLASH_SIZE
+
+  stm32_init(0x40022000, 512 * 1024, 2048, STM32_SR_BSY, stm32_write, stm32_flash_write);
+  model->stm32_optr = 0xffeff8aa;
+}
+
+//-----------------------------------------------------------------------------
+static void stm32wb55_init(void)
+{
+  model_state_t *model = model_state();
+
+  // STM32WB55RG with the secure area starting at 768 KB
+  sim_mem_write(0xe0042000, 0x20016495, 0xffffffff); // DBGMCU_IDCODE
+  sim_mem_write(0x1fff75e0, 1024, 0xffffffff); // FLASH_SIZE
+
+  stm32_init(0x58004000, 1024 * 1024, 4096, STM32_SR_BSY | STM32_SR_CFGBSY, stm32_write, stm32_flash_write);
+  model->stm32_optr = 0x3ffff1aa;
+  model->stm32_sfr = 0xc0;
+}
+
+//-----------------------------------------------------------------------------
+static void py32_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+
+  if (PY32_OPTR_TRIGGER == (addr - model->stm32_regs) && (model->stm32_cr & STM32_CR_OPTSTRT))
+  {
+    flash_wait();
+    sim_mem_write(PY32_OPTIONS_OPTR, model->stm32_optr, 0x0000ffff);
+    model->stm32_cr &= ~STM32_CR_OPTSTRT;
+    flash_start(PY32_OPTION_TIME);
+    return;
+  }
+
+  stm32_write(addr, value, mask);
+}
+
+//-----------------------------------------------------------------------------
+static void py32_flash_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+
+  flash_wait();
+
+  if (model->stm32_cr & STM32_CR_LOCK)
+    return;
+
+  if (model->stm32_cr & STM32_CR_PER)
+  {
+    sim_flash_erase(addr & ~(model->page_size - 1), model->page_size);
+    flash_start(PY32_PAGE_ERASE_TIME);
+  }
+  else if (model->stm32_cr & STM32_CR_MER1)
+  {
+    sim_flash_erase(model->flash_addr, model->flash_size);
+    flash_start(PY32_MASS_ERASE_TIME);
+  }
+  else if (model->stm32_cr & STM32_CR_PG)
+  {
+    page_buf_write(model->page_buf, addr, value, mask);
+
+    // The page is programmed by the last word write after PGSTRT is set
+    if ((model->stm32_cr & STM32_CR_PGSTRT) && (addr & (model->page_size - 1)) == (uint32_t)(model->page_size - 4))
+    {
+      page_buf_program(model->page_buf, addr & ~(model->page_size - 1), model->page_size);
+      model->stm32_cr &= ~STM32_CR_PGSTRT;
+      flash_start(PY32_PAGE_PROGRAM_TIME);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void py32f0_init(void)
+{
+  model_state_t *model = model_state();
+
+  // PY32F002Axx5
+  sim_mem_write(0x40015800, 0x60001000, 0xffffffff); // DBG_IDCODE
+  sim_mem_write(PY32_OPTIONS_OPTR, 0x4155beaa, 0xffffffff);
+
+  stm32_init(0x40022000, 20 * 1024, 128, STM32_SR_BSY, py32_write, py32_flash_write);
+  model->stm32_optr = 0x4155beaa;
+  page_buf_clear();
+}
+
+//-----------------------------------------------------------------------------
+static void gd32_sector(int sn, uint32_t *addr, uint32_t *size)
+{
+  model_state_t *model = model_state();
+  static const int sizes[12] = { 16, 16, 16, 16, 64, 128, 128, 128, 128, 128, 128, 128 };
+  uint32_t base = model->flash_addr;
+  int index = sn;
+
+  if (sn >= 16)
+  {
+    base += 1024 * 1024;
+    index = sn - 16;
+  }
+  else if (sn >= 12)
+  {
+    *addr = model->flash_addr + 2 * 1024 * 1024 + (sn - 12) * 256 * 1024;
+    *size = 256 * 1024;
+    return;
+  }
+
+  *addr = base;
+
+  for (int i = 0; i < index; i++)
+    *addr += sizes[i] * 1024;
+
+  *size = sizes[index < 12 ? index : 11] * 1024;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t gd32_read(uint32_t addr)
+{
+  model_state_t *model = model_state();
+
+  switch (addr - GD32_FMC)
+  {
+    case GD32_STAT: return model->gd32_stat | (flash_busy() ? GD32_STAT_BUSY : 0);
+    case GD32_CTL: return model->gd32_ctl;
+    case GD32_OBCTL0: return model->gd32_obctl0;
+    case GD32_OBCTL1: return model->gd32_obctl1;
+  }
+
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void gd32_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+
+  switch (addr - GD32_FMC)
+  {
+    case GD32_KEY:
+      if (model->gd32_key && STM32_KEY2 == value)
+        model->gd32_ctl &= ~GD32_CTL_LK;
+      model->gd32_key = (STM32_KEY1 == value);
+      break;
+
+    case GD32_OBKEY:
+      if (model->gd32_obkey && STM32_OPTKEY2 == value)
+        model->gd32_obctl0 &= ~GD32_OBCTL0_OB_LK;
+      model->gd32_obkey = (STM32_OPTKEY1 == value);
+      break;
+
+    case GD32_STAT:
+      model->gd32_stat &= ~value;
+      break;
+
+    case GD32_CTL:
+      if (model->gd32_ctl & GD32_CTL_LK)
+        break;
+
+      model->gd32_ctl = update(model->gd32_ctl, value, mask) & ~GD32_CTL_START;
+
+      if (0 == (value & GD32_CTL_START))
+        break;
+
+      if (value & GD32_CTL_SER)
+      {
+        uint32_t sector_addr, sector_size;
+
+        gd32_sector(GD32_CTL_SN(value), &sector_addr, &sector_size);
+
+        if ((sector_addr - model->flash_addr) < model->flash_size)
+          sim_flash_erase(sector_addr, sector_size);
+
+        flash_start(GD32_SECTOR_ERASE_TIME * (sector_size / 1024));
+      }
+      else if (value & (GD32_CTL_MER0 | GD32_CTL_MER1))
+      {
+        sim_flash_erase(model->flash_addr, model->flash_size);
+        flash_start(GD32_SECTOR_ERASE_TIME * (model->flash_size / 1024));
+      }
+      break;
+
+    case GD32_OBCTL0:
+      if (model->gd32_obctl0 & GD32_OBCTL0_OB_LK)
+        break;
+
+      model->gd32_obctl0 = update(model->gd32_obctl0, value, mask) & ~GD32_OBCTL0_OB_START;
+
+      if (value & GD32_OBCTL0_OB_START)
+      {
+        sim_mem_write_byte(GD32_OPTIONS_SPC, GD32_OBCTL0_SPC(model->gd32_obctl0));
+        flash_start(GD32_OPTION_TIME);
+      }
+      break;
+
+    case GD32_OBCTL1:
+      if (0 == (model->gd32_obctl0 & GD32_OBCTL0_OB_LK))
+        model->gd32_obctl1 = update(model->gd32_obctl1, value, mask);
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void gd32_flash_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+
+  flash_wait();
+
+  if (0 == (model->gd32_ctl & GD32_CTL_PG))
+  {
+    model->gd32_stat |= GD32_STAT_PGSERR;
+    return;
+  }
+
+  sim_flash_program(addr, value, mask);
+  flash_start(GD32_WORD_PROGRAM_TIME);
+}
+
+//-----------------------------------------------------------------------------
+static void gd32f4xx_init(void)
+{
+  model_state_t *model = model_state();
+
+  // GD32F407VET6
+  sim_mem_write(0xe0042000, 0x16080413, 0xffffffff); // DBG_ID
+  sim_mem_write(0x1fff7a20, (512 << 16) | 192, 0xffffffff); // Flash and SRAM size
+  sim_mem_write_byte(GD32_OPTIONS_SPC, 0xaa);
+
+  model->flash_addr = 0x08000000;
+  model->flash_size = 512 * 1024;
+  model->gd32_ctl = GD32_CTL_LK;
+  model->gd32_obctl0 = 0x0fffaaed;
+  model->gd32_obctl1 = 0x0fff0000;
+
+  sim_add_region(GD32_FMC, 0x100, gd32_read, gd32_write);
+  add_flash(model->flash_addr, model->flash_size, gd32_flash_write);
+}
+
+//-----------------------------------------------------------------------------
+static void m480_command(void)
+{
+  model_state_t *model = model_state();
+  uint32_t ctl = model->m480_regs[M480_ISPCTL / 4];
+  uint32_t addr = model->m480_regs[M480_ISPADDR / 4];
+  int cmd = model->m480_regs[M480_ISPCMD / 4];
+  bool config = (addr - M480_CONFIG_ADDR) < M480_CONFIG_SIZE;
+  bool allowed = (ctl & M480_ISPCTL_ISPEN) && (ctl & (config ? M480_ISPCTL_CFGUEN : M480_ISPCTL_APUEN));
+  int time = M480_READ_TIME;
+
+  if (M480_CMD_READ == cmd && (ctl & M480_ISPCTL_ISPEN))
+  {
+    model->m480_regs[M480_ISPDAT / 4] = sim_mem_read(addr);
+  }
+  else if (M480_CMD_32B_PROG == cmd && allowed)
+  {
+    sim_flash_program(addr, model->m480_regs[M480_ISPDAT / 4], 0xffffffff);
+    time = M480_PROGRAM_TIME;
+  }
+  else if (M480_CMD_64B_PROG == cmd && allowed && !config)
+  {
+    sim_flash_program(addr & ~7, model->m480_regs[M480_MPDAT0 / 4], 0xffffffff);
+    sim_flash_program((addr & ~7) + 4, model->m480_regs[M480_MPDAT1 / 4], 0xffffffff);
+    time = M480_PROGRAM_TIME;
+  }
+  else if (M480_CMD_PAGE_ERASE == cmd && allowed)
+  {
+    sim_flash_erase(config ? M480_CONFIG_ADDR : (addr & ~(M480_PAGE_SIZE - 1)),
+        config ? M480_CONFIG_SIZE : M480_PAGE_SIZE);
+    time = M480_PAGE_ERASE_TIME;
+  }
+  else if (M480_CMD_BANK_ERASE == cmd && allowed && !config)
+  {
+    sim_flash_erase(addr & ~(model->flash_size / 2 - 1), model->flash_size / 2);
+    time = M480_BANK_ERASE_TIME;
+  }
+  else if (M480_CMD_MASS_ERASE == cmd && allowed && !config)
+  {
+    sim_flash_erase(model->flash_addr, model->flash_size);
+    sim_flash_erase(M480_CONFIG_ADDR, M480_CONFIG_SIZE);
+    time = M480_BANK_ERASE_TIME * 2;
+  }
+  else
+  {
+    model->m480_regs[M480_ISPSTS / 4] |= M480_ISPSTS_ISPFF;
+  }
+
+  flash_start(time);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t m480_read(uint32_t addr)
+{
+  model_state_t *model = model_state();
+  uint32_t offs = addr - M480_FMC;
+
+  if (M480_ISPTRG == offs)
+    return flash_busy() ? M480_ISPTRG_ISPGO : 0;
+  else if (M480_ISPSTS == offs)
+    return model->m480_regs[offs / 4] | (flash_busy() ? M480_ISPSTS_ISPBUSY : 0);
+
+  return model->m480_regs[offs / 4];
+}
+
+//-----------------------------------------------------------------------------
+static void m480_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+  uint32_t offs = addr - M480_FMC;
+
+  // The controller stalls the bus while ISP operation is in progress
+  flash_wait();
+
+  if (M480_ISPTRG == offs)
+  {
+    if (value & M480_ISPTRG_ISPGO)
+      m480_command();
+  }
+  else if (M480_ISPSTS == offs)
+  {
+    model->m480_regs[offs / 4] &= ~(value & M480_ISPSTS_ISPFF);
+  }
+  else
+  {
+    model->m480_regs[offs / 4] = update(model->m480_regs[offs / 4], value, mask);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void m480_flash_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  // Flash is read-only on the bus
+  (void)addr;
+  (void)value;
+  (void)mask;
+}
+
+//-----------------------------------------------------------------------------
+static void m480_init(void)
+{
+  model_state_t *model = model_state();
+
+  sim_mem_write(0x40000000, 0x00d48410, 0xffffffff); // SYS_PDID, M484SIDAE
+
+  model->flash_addr = 0;
+  model->flash_size = 512 * 1024;
+
+  sim_add_region(M480_FMC, 0x100, m480_read, m480_write);
+  add_flash(model->flash_addr, model->flash_size, m480_flash_write);
+  add_flash(M480_CONFIG_ADDR, M480_CONFIG_SIZE, m480_flash_write);
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t spi_nor_status(void)
+{
+  model_state_t *model = model_state();
+
+  return (flash_busy() ? SPI_NOR_STATUS_WIP : 0) | (model->spi_wel ? SPI_NOR_STATUS_WEL : 0);
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t spi_nor_transfer(uint8_t data)
+{
+  model_state_t *model = model_state();
+  int index = model->spi_index++;
+  uint8_t resp = 0xff;
+
+  if (!model->spi_selected)
+    return 0xff;
+
+  if (0 == index)
+  {
+    // Only the status can be read while an operation is in progress
+    model->spi_cmd = (flash_busy() && SPI_NOR_CMD_READ_STATUS != data) ? -1 : data;
+    model->spi_addr = 0;
+    model->spi_page_count = 0;
+
+    if (SPI_NOR_CMD_WRITE_ENABLE == model->spi_cmd)
+      model->spi_wel = true;
+
+    return resp;
+  }
+
+  if (index < 4)
+    model->spi_addr = (model->spi_addr << 8) | data;
+
+  switch (model->spi_cmd)
+  {
+    case SPI_NOR_CMD_READ_STATUS:
+      resp = spi_nor_status();
+      break;
+
+    case SPI_NOR_CMD_READ_JEDEC:
+    {
+      static const uint8_t jedec_id[3] = { 0xef, 0x40, 0x15 };
+      resp = (index < 4) ? jedec_id[index - 1] : 0xff;
+    } break;
+
+    case SPI_NOR_CMD_READ_DATA:
+      if (index >= 4)
+        resp = sim_mem_read_byte(RP2040_XIP_ADDR + (model->spi_addr++ % SPI_NOR_SIZE));
+      break;
+
+    case SPI_NOR_CMD_READ_SFDP:
+      if (index >= 5)
+      {
+        resp = (model->spi_addr < SPI_NOR_SFDP_SIZE) ? model->spi_sfdp[model->spi_addr] : 0xff;
+        model->spi_addr++;
+      }
+      break;
+
+    case SPI_NOR_CMD_PAGE_PROGRAM:
+      if (index >= 4)
+      {
+        model->spi_page[(model->spi_addr + model->spi_page_count) % SPI_NOR_PAGE_SIZE] = data;
+        model->spi_page_count++;
+      }
+      break;
+  }
+
+  return resp;
+}
+
+//-----------------------------------------------------------------------------
+static void spi_nor_deselect(void)
+{
+  model_state_t *model = model_state();
+  uint32_t addr = model->spi_addr % SPI_NOR_SIZE;
+
+  if (!model->spi_wel)
+    return;
+
+  if (SPI_NOR_CMD_PAGE_PROGRAM == model->spi_cmd && model->spi_index >= 4)
+  {
+    int count = model->spi_page_count < SPI_NOR_PAGE_SIZE ? model->spi_page_count : SPI_NOR_PAGE_SIZE;
+
+    for (int i = 0; i < count; i++)
+    {
+      uint32_t byte_addr = (addr & ~(SPI_NOR_PAGE_SIZE - 1)) + ((addr + i) % SPI_NOR_PAGE_SIZE);
+      uint8_t value = sim_mem_read_byte(RP2040_XIP_ADDR + byte_addr);
+
+      sim_mem_write_byte(RP2040_XIP_ADDR + byte_addr, value & model->spi_page[(addr + i) % SPI_NOR_PAGE_SIZE]);
+    }
+
+    flash_start(SPI_NOR_PAGE_PROGRAM_TIME);
+  }
+  else if (SPI_NOR_CMD_SECTOR_ERASE == model->spi_cmd && model->spi_index >= 4)
+  {
+    sim_flash_erase(RP2040_XIP_ADDR + (addr & ~(SPI_NOR_SECTOR_SIZE - 1)), SPI_NOR_SECTOR_SIZE);
+    flash_start(SPI_NOR_SECTOR_ERASE_TIME);
+  }
+  else if (SPI_NOR_CMD_CHIP_ERASE == model->spi_cmd)
+  {
+    sim_flash_erase(RP2040_XIP_ADDR, SPI_NOR_SIZE);
+    flash_start(SPI_NOR_CHIP_ERASE_TIME);
+  }
+  else
+  {
+    return;
+  }
+
+  model->spi_wel = false;
+}
+
+//-----------------------------------------------------------------------------
+static void spi_nor_init(void)
+{
+  model_state_t *model = model_state();
+  static const uint32_t params[] =
+  {
+    0xfff920e5, // 4 KB erase with opcode 0x20, 3-byte addressing, 1-1-4 read
+    SPI_NOR_SIZE * 8 - 1,
+    0x6b08eb44, // 1-1-4 read with opcode 0x6b and 8 wait cycles
+    0xbb423b08,
+  };
+
+  memset(model->spi_sfdp, 0xff, sizeof(model->spi_sfdp));
+  memcpy(&model->spi_sfdp[0], "SFDP\x06\x01\x00\xff", 8);
+  memcpy(&model->spi_sfdp[8], "\x00\x06\x01\x10\x80\x00\x00\xff", 8);
+
+  for (int i = 0; i < ARRAY_SIZE(params); i++)
+  {
+    for (int j = 0; j < 4; j++)
+      model->spi_sfdp[0x80 + i * 4 + j] = params[i] >> (j * 8);
+  }
+
+  sim_flash_erase(RP2040_XIP_ADDR, SPI_NOR_SIZE);
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t rp2040_ssi_read(uint32_t addr)
+{
+  model_state_t *model = model_state();
+  uint32_t offs = addr - RP2040_SSI;
+
+  if (RP2040_SSI_IDR == offs)
+  {
+    return RP2040_SSI_IDR_VALUE;
+  }
+  else if (RP2040_SSI_SR == offs)
+  {
+    return RP2040_SSI_SR_TFNF | RP2040_SSI_SR_TFE | (model->ssi_rx_count ? RP2040_SSI_SR_RFNE : 0);
+  }
+  else if (RP2040_SSI_DR0 == offs)
+  {
+    uint8_t value;
+
+    if (0 == model->ssi_rx_count)
+      return 0;
+
+    value = model->ssi_rx_fifo[0];
+    model->ssi_rx_count--;
+    memmove(&model->ssi_rx_fifo[0], &model->ssi_rx_fifo[1], model->ssi_rx_count);
+
+    return value;
+  }
+
+  return model->ssi_regs[offs / 4];
+}
+
+//-----------------------------------------------------------------------------
+static void rp2040_ssi_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+  uint32_t offs = addr - RP2040_SSI;
+
+  if (RP2040_SSI_DR0 == offs)
+  {
+    uint8_t resp = spi_nor_transfer(value);
+
+    if (model->ssi_rx_count < RP2040_SSI_FIFO_SIZE)
+      model->ssi_rx_fifo[model->ssi_rx_count++] = resp;
+  }
+  else
+  {
+    model->ssi_regs[offs / 4] = update(model->ssi_regs[offs / 4], value, mask);
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void rp2040_io_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+
+  if (RP2040_GPIO_SS_CTRL != (addr - RP2040_IO_QSPI) || 0 == (mask & 0x300))
+    return;
+
+  if (RP2040_OUTOVER_LOW == RP2040_OUTOVER(value))
+  {
+    if (!model->spi_selected)
+    {
+      model->spi_selected = true;
+      model->spi_index = 0;
+      model->spi_cmd = -1;
+    }
+  }
+  else if (model->spi_selected)
+  {
+    spi_nor_deselect();
+    model->spi_selected = false;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t rp2040_dma_read(uint32_t addr)
+{
+  model_state_t *model = model_state();
+  uint32_t offs = addr - RP2040_DMA;
+  uint32_t value = model->dma_regs[offs / 4];
+
+  if (RP2040_DMA_CH0_CTRL == offs && sim_time() < model->dma_busy_until)
+    value |= RP2040_DMA_CTRL_BUSY;
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static void rp2040_dma_write(uint32_t addr, uint32_t value, uint32_t mask)
+{
+  model_state_t *model = model_state();
+  uint32_t offs = addr - RP2040_DMA;
+
+  model->dma_regs[offs / 4] = update(model->dma_regs[offs / 4], value, mask);
+
+  // TX channel paces the transfer, RX channel stores the received bytes
+  if (RP2040_DMA_CH1_COUNT == offs)
+  {
+    uint32_t src = model->dma_regs[RP2040_DMA_CH1_READ / 4];
+    uint32_t dst = model->dma_regs[RP2040_DMA_CH0_WRITE / 4];
+    uint32_t rx_count = model->dma_regs[RP2040_DMA_CH0_COUNT / 4];
+    uint32_t baudr = model->ssi_regs[RP2040_SSI_BAUDR / 4] ? model->ssi_regs[RP2040_SSI_BAUDR / 4] : 2;
+
+    for (uint32_t i = 0; i < value; i++)
+    {
+      uint8_t resp = spi_nor_transfer(sim_mem_read_byte(src + i));
+
+      if (i < rx_count)
+        sim_mem_write_byte(dst + i, resp);
+    }
+
+    model->dma_regs[RP2040_DMA_CH0_COUNT / 4] = 0;
+    model->dma_regs[RP2040_DMA_CH1_COUNT / 4] = 0;
+    model->dma_busy_until = sim_time() + (uint64_t)value * 8 * baudr * RP2040_SYS_CLOCK_NS;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void rp2040_init(void)
+{
+  sim_mem_write_byte(0x13, 3); // ROM revision B2
+
+  sim_add_region(RP2040_SSI, 0x100, rp2040_ssi_read, rp2040_ssi_write);
+  sim_add_region(RP2040_IO_QSPI, 0x40, NULL, rp2040_io_write);
+  sim_add_region(RP2040_DMA, 0x100, rp2040_dma_read, rp2040_dma_write);
+
+  spi_nor_init();
+}
+
+//-----------------------------------------------------------------------------
+static sim_model_t sim_models[] =
+{
+  { "samd21",    "SAM D21J18A (NVMCTRL)",             1024, samd21_init,    0 },
+  { "samd51",    "SAM D51J19A (NVMCTRL)",             4096, samd51_init,    0 },
+  { "saml10",    "SAM L10E16A (NVMCTRL, BootROM)",    1024, saml10_init,    0 },
+  { "sam3x",     "ATSAM3X8E (EEFC, two planes)",      4096, sam3x_init,     0 },
+  { "sam4s",     "SAM4S16C (EEFC)",                   4096, sam4s_init,     0 },
+  { "same70",    "SAM E70Q21 (EEFC)",                 4096, same70_init,    0 },
+  { "stm32g0",   "STM32G071RB (FLASH)",               1024, stm32g0_init,   0 },
+  { "stm32g4",   "STM32G474RE (FLASH, dual bank)",    4096, stm32g4_init,   0 },
+  { "stm32wb55", "STM32WB55RG (FLASH)",               4096, stm32wb55_init, 0 },
+  { "gd32f4xx",  "GD32F407VET6 (FMC)",                4096, gd32f4xx_init,  0 },
+  { "m480",      "M484SIDAE (FMC ISP)",               4096, m480_init,      0 },
+  { "py32f0",    "PY32F002Axx5 (FLASH)",              1024, py32f0_init,    0 },
+  { "rp2040",    "RP2040 (SSI, DMA, 2 MB SPI NOR)",   1024, rp2040_init,    0x01002927 },
+};
+
+//-----------------------------------------------------------------------------
+void sim_model_session_init(session_t *session)
+{
+  session->model_state = buf_alloc(sizeof(model_state_t));
+}
+
+//-----------------------------------------------------------------------------
+void sim_model_session_free(session_t *session)
+{
+  buf_free(session->model_state);
+  session->model_state = NULL;
+}
+
+//-----------------------------------------------------------------------------
+sim_model_t *sim_find_model(char *name)
+{
+  for (int i = 0; i < ARRAY_SIZE(sim_models); i++)
+  {
+    if (0 == strcmp(sim_models[i].name, name))
+      return &sim_models[i];
+  }
+
+  return NULL;
+}
+
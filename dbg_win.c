@@ -12,6 +12,7 @@
 #include <hidpi.h>
 #include "dbg.h"
 #include "edbg.h"
+#include "session.h"
 
 #undef interface
 
@@ -21,13 +22,30 @@ DEFINE_GUID(GUID_CMSIS_DAP_V2, 0xcdb3b5adL, 0x293b, 0x4663, 0xaa, 0x36, 0x1a, 0x
 #define MAX_STRING_SIZE    256
 #define LANGID_US_ENGLISH  0x0409
 
-/*- Variables ---------------------------------------------------------------*/
-static debugger_t *g_debugger;
-static HANDLE g_handle = INVALID_HANDLE_VALUE;
-static WINUSB_INTERFACE_HANDLE g_winusb_handle = INVALID_HANDLE_VALUE;
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  debugger_t              *debugger;
+  HANDLE                  handle;
+  WINUSB_INTERFACE_HANDLE winusb_handle;
+
+  uint8_t                 *rx_buf;
+  int                     packet_size;
+  bool                    zero_packet;
+
+  uint8_t                 tx_cmd[DBG_MAX_PACKETS];
+  int                     packet_first;
+  int                     packet_pending;
+} hw_state_t;
 
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline hw_state_t *hw_state(void)
+{
+  return (hw_state_t *)g_session->hw_state;
+}
+
 //-----------------------------------------------------------------------------
 static void get_device_descriptor(WINUSB_INTERFACE_HANDLE handle, USB_DEVICE_DESCRIPTOR *desc)
 {
@@ -296,88 +314,182 @@ static int dbg_enumerate_hid(debugger_t *debuggers, int size)
 }
 
 //-----------------------------------------------------------------------------
-int dbg_enumerate(debugger_t *debuggers, int size)
+void dbg_hw_session_init(session_t *session)
+{
+  hw_state_t *state = buf_alloc(sizeof(hw_state_t));
+
+  state->handle = INVALID_HANDLE_VALUE;
+  state->winusb_handle = INVALID_HANDLE_VALUE;
+
+  session->hw_state = state;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_hw_session_free(session_t *session)
+{
+  hw_state_t *state = session->hw_state;
+
+  if (NULL == state)
+    return;
+
+  buf_free(state->rx_buf);
+  buf_free(state);
+
+  session->hw_state = NULL;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hw_enumerate(debugger_t *debuggers, int size)
 {
   int rsize = dbg_enumerate_hid(debuggers, size);
   return dbg_enumerate_bulk(debuggers, size, rsize);
 }
 
 //-----------------------------------------------------------------------------
-void dbg_open(debugger_t *debugger, int version)
+void dbg_hw_open(debugger_t *debugger, int version)
 {
-  g_debugger = debugger;
+  hw_state_t *hw = hw_state();
+
+  hw->debugger = debugger;
+  hw->packet_first = 0;
+  hw->packet_pending = 0;
 
-  g_debugger->use_v2 = (DBG_CMSIS_DAP_V2 == version);
+  hw->debugger->use_v2 = (DBG_CMSIS_DAP_V2 == version);
 
-  if (g_debugger->use_v2)
+  if (hw->debugger->use_v2)
   {
-    g_handle = CreateFile(g_debugger->v2_path, GENERIC_READ | GENERIC_WRITE,
+    hw->handle = CreateFile(hw->debugger->v2_path, GENERIC_READ | GENERIC_WRITE,
         FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
         FILE_FLAG_OVERLAPPED, NULL);
-    check(INVALID_HANDLE_VALUE != g_handle, "[bulk] CreateFile() failed");
+    check(INVALID_HANDLE_VALUE != hw->handle, "[bulk] CreateFile() failed");
 
-    WINBOOL res = WinUsb_Initialize(g_handle, &g_winusb_handle);
+    WINBOOL res = WinUsb_Initialize(hw->handle, &hw->winusb_handle);
     check(res, "[bulk] WinUsb_Initialize() failed");
+
+    hw->zero_packet = false;
   }
   else
   {
-    g_handle = CreateFile(g_debugger->v1_path, GENERIC_READ | GENERIC_WRITE,
+    hw->handle = CreateFile(hw->debugger->v1_path, GENERIC_READ | GENERIC_WRITE,
         FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
-    check(INVALID_HANDLE_VALUE != g_handle, "[hid] CreateFile() failed");
+    check(INVALID_HANDLE_VALUE != hw->handle, "[hid] CreateFile() failed");
   }
+
+  dbg_hw_set_packet_size(hw->debugger->use_v2 ? hw->debugger->v2_ep_size : hw->debugger->v1_ep_size);
 }
 
 //-----------------------------------------------------------------------------
-void dbg_close(void)
+void dbg_hw_close(void)
 {
-  if (g_debugger->use_v2)
-    WinUsb_Free(g_winusb_handle);
+  hw_state_t *hw = hw_state();
 
-  CloseHandle(g_handle);
+  if (hw->debugger->use_v2)
+    WinUsb_Free(hw->winusb_handle);
+
+  CloseHandle(hw->handle);
 }
 
 //-----------------------------------------------------------------------------
-int dbg_get_packet_size(void)
+int dbg_hw_get_packet_size(void)
 {
-  return g_debugger->use_v2 ? g_debugger->v2_ep_size : g_debugger->v1_ep_size;
+  hw_state_t *hw = hw_state();
+
+  return hw->packet_size;
 }
 
 //-----------------------------------------------------------------------------
-int dbg_dap_cmd(uint8_t *data, int resp_size, int req_size)
+void dbg_hw_set_packet_size(int size)
 {
-  uint8_t buf[DBG_MAX_EP_SIZE + 1];
-  int cmd = data[0];
-  int resp = 0;
-  int size;
+  hw_state_t *hw = hw_state();
+
+  // HID reports always match the endpoint size, bulk transfers may span multiple USB packets
+  if (!hw->debugger->use_v2)
+    size = hw->debugger->v1_ep_size;
+
+  buf_free(hw->rx_buf);
+  hw->rx_buf = buf_alloc(size + 1);
+
+  hw->packet_size = size;
+}
+
+//-----------------------------------------------------------------------------
+void dbg_hw_dap_cmd_send(uint8_t *data, int req_size)
+{
+  hw_state_t *hw = hw_state();
   WINBOOL res;
 
-  memset(buf, 0xff, sizeof(buf));
+  check(hw->packet_pending < DBG_MAX_PACKETS, "internal: too many pending packets");
 
-  if (g_debugger->use_v2)
+  if (hw->debugger->use_v2)
   {
     ULONG actual_size = 0;
+    bool zero_packet = (0 == (req_size % hw->debugger->v2_ep_size) && req_size < hw->packet_size);
 
-    res = WinUsb_WritePipe(g_winusb_handle, g_debugger->v2_tx_ep, data, req_size, &actual_size, NULL);
-    check(res && (int)actual_size == req_size, "WinUsb_WritePipe() failed");
+    // A transfer shorter than the packet size that fills whole USB packets needs a terminator
+    if (zero_packet != hw->zero_packet)
+    {
+      UCHAR value = zero_packet;
 
-    res = WinUsb_ReadPipe(g_winusb_handle, g_debugger->v2_rx_ep, buf, g_debugger->v2_ep_size, &actual_size, NULL);
-    check(res, "WinUsb_WritePipe() failed");
+      res = WinUsb_SetPipePolicy(hw->winusb_handle, hw->debugger->v2_tx_ep, SHORT_PACKET_TERMINATE,
+          sizeof(value), &value);
+      check(res, "WinUsb_SetPipePolicy() failed");
 
-    resp = buf[0];
-    size = actual_size - 1;
-    memcpy(data, &buf[1], (resp_size < size) ? resp_size : size);
+      hw->zero_packet = zero_packet;
+    }
+
+    res = WinUsb_WritePipe(hw->winusb_handle, hw->debugger->v2_tx_ep, data, req_size, &actual_size, NULL);
+    check(res && (int)actual_size == req_size, "WinUsb_WritePipe() failed");
   }
   else
   {
+    uint8_t buf[DBG_MAX_EP_SIZE + 1];
     DWORD actual_size = 0;
 
+    memset(buf, 0xff, sizeof(buf));
     buf[0] = 0x00; // Report ID
     memcpy(&buf[1], data, req_size);
 
-    res = WriteFile(g_handle, (LPCVOID)buf, g_debugger->v1_ep_size + 1, &actual_size, NULL);
-    check(res && (int)actual_size == (g_debugger->v1_ep_size + 1), "WriteFile() failed");
+    res = WriteFile(hw->handle, (LPCVOID)buf, hw->debugger->v1_ep_size + 1, &actual_size, NULL);
+    check(res && (int)actual_size == (hw->debugger->v1_ep_size + 1), "WriteFile() failed");
+  }
+
+  hw->tx_cmd[(hw->packet_first + hw->packet_pending) % DBG_MAX_PACKETS] = data[0];
+  hw->packet_pending++;
+}
+
+//-----------------------------------------------------------------------------
+int dbg_hw_dap_cmd_receive(uint8_t *data, int resp_size)
+{
+  hw_state_t *hw = hw_state();
+  uint8_t *buf = hw->rx_buf;
+  int cmd = hw->tx_cmd[hw->packet_first];
+  int resp = 0;
+  int size;
+  WINBOOL res;
+
+  check(hw->packet_pending > 0, "internal: no pending packets");
+
+  hw->packet_first = (hw->packet_first + 1) % DBG_MAX_PACKETS;
+  hw->packet_pending--;
+
+  memset(buf, 0xff, hw->packet_size + 1);
+
+  if (hw->debugger->use_v2)
+  {
+    ULONG actual_size = 0;
+
+    res = WinUsb_ReadPipe(hw->winusb_handle, hw->debugger->v2_rx_ep, buf, hw->packet_size, &actual_size, NULL);
+    check(res, "WinUsb_ReadPipe() failed");
+
+    resp = buf[0];
+    size = actual_size - 1;
+    memcpy(data, &buf[1], (resp_size < size) ? resp_size : size);
+  }
+  else
+  {
+    DWORD actual_size = 0;
 
-    res = ReadFile(g_handle, (LPVOID)buf, g_debugger->v1_ep_size + 1, &actual_size, NULL);
+    res = ReadFile(hw->handle, (LPVOID)buf, hw->debugger->v1_ep_size + 1, &actual_size, NULL);
     check(res, "ReadFile() failed");
 
     resp = buf[1];
@@ -2,7 +2,6 @@
 // Copyright (c) 2013-2024, Alex Taradov <alex@taradov.com>. All rights reserved.
 
 /*- Includes ----------------------------------------------------------------*/
-#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -11,23 +10,42 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <setjmp.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#ifdef _WIN32
-#include <windows.h>
-#endif
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
 #include "dbg.h"
+#include "session.h"
+#include "bench.h"
+#include "daemon.h"
+#include "job.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define MAX_DEBUGGERS     20
+#define CLOCK_CACHE_FILE  ".edbg_clock"
+#define CHECKPOINT_SUFFIX ".checkpoint"
+#define MAX_PHASES        16
 
-#ifndef O_BINARY
-#define O_BINARY 0
-#endif
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  char     *name;
+  uint64_t time; // us
+  dap_transport_stats_t transport;
+  dap_cache_stats_t cache;
+} phase_t;
+
+typedef struct
+{
+  debugger_t *debugger;
+  pthread_t  thread;
+  bool       passed;
+  uint64_t   time; // us
+  char       error[MAX_ERROR_SIZE];
+} gang_board_t;
 
 /*- Constants ---------------------------------------------------------------*/
 static const struct option long_options[] =
@@ -50,19 +68,55 @@ static const struct option long_options[] =
   { "offset",    required_argument,  0, 'o' },
   { "size",      required_argument,  0, 'z' },
   { "fuse",      required_argument,  0, 'F' },
+  { "resume",    no_argument,        0, 'R' },
+  { "sim",       optional_argument,  0, 'S' },
+  { "bench",     optional_argument,  0, 'B' },
+  { "stats",     optional_argument,  0, 'T' },
+  { "trace",     required_argument,  0, 'U' },
+  { "record",    required_argument,  0, 'W' },
+  { "replay",    required_argument,  0, 'P' },
+  { "daemon",    required_argument,  0, 'D' },
+  { "job",       required_argument,  0, 'J' },
   { 0, 0, 0, 0 }
 };
 
-static const char *short_options = "hbd:x:epvkurf:t:ls:c:o:z:F:";
+static const char *short_options = "hbd:x:epvkurf:t:ls:c:o:z:F:RS::B::T::U:W:P:D:J:";
+
+static const long auto_clocks[] =
+{
+  24000000, 16000000, 12000000, 8000000, 4000000, 2000000, 1000000, 500000, 200000, 100000,
+};
 
 /*- Variables ---------------------------------------------------------------*/
 static char *g_serial = NULL;
 static bool g_list    = false;
 static char *g_target = NULL;
-static bool g_verbose = false;
-static int  g_version = -1;
+static int  g_version = 0;
 static long g_clock   = 16000000;
-static bool g_debugger_open = false;
+static bool g_auto_clock = false;
+static long g_selected_clock = 0;
+static char *g_debugger_serial = NULL;
+static _Thread_local bool g_debugger_open = false;
+static bool g_resume = false;
+static bench_options_t *g_bench = NULL;
+static bool g_stats = false;
+static char *g_stats_file = NULL;
+static char *g_trace_file = NULL;
+static char *g_record_file = NULL;
+static bool g_sim = false;
+static char *g_sim_options = NULL;
+static char *g_replay_options = NULL;
+static target_ops_t *g_target_ops = NULL;
+static char *g_daemon = NULL;
+static bool g_link_ready = false;
+static char *g_job_file = NULL;
+static job_t *g_job = NULL;
+
+static _Thread_local debugger_t *g_debugger = NULL;
+static _Thread_local int g_debugger_version = 0;
+
+static _Thread_local phase_t g_phases[MAX_PHASES];
+static _Thread_local int g_phase_count = 0;
 
 static target_options_t g_target_options =
 {
@@ -82,256 +136,359 @@ static target_options_t g_target_options =
 /*- Implementations ---------------------------------------------------------*/
 
 //-----------------------------------------------------------------------------
-void verbose(char *fmt, ...)
+static void print_debugger_info(debugger_t *debugger)
 {
-  va_list args;
+  uint8_t buf[256];
+  char str[512] = "Debugger: ";
+  int size;
 
-  if (g_verbose)
-  {
-    va_start(args, fmt);
-    vprintf(fmt, args);
-    va_end(args);
+  size = dap_info(DAP_INFO_VENDOR, buf, sizeof(buf));
+  strcat(str, size ? (char *)buf : debugger->manufacturer);
+  strcat(str, " ");
 
-    fflush(stdout);
-  }
-}
+  size = dap_info(DAP_INFO_PRODUCT, buf, sizeof(buf));
+  strcat(str, size ? (char *)buf : debugger->product);
+  strcat(str, " ");
 
-//-----------------------------------------------------------------------------
-void message(char *fmt, ...)
-{
-  va_list args;
+  size = dap_info(DAP_INFO_SER_NUM, buf, sizeof(buf));
+  strcat(str, size ? (char *)buf : debugger->serial);
+  strcat(str, " ");
 
-  va_start(args, fmt);
-  vprintf(fmt, args);
-  va_end(args);
+  size = dap_info(DAP_INFO_CMSIS_DAP_VER, buf, sizeof(buf));
+  strcat(str, (char *)buf);
+  strcat(str, " ");
 
-  fflush(stdout);
-}
+  size = dap_info(DAP_INFO_CAPABILITIES, buf, sizeof(buf));
+  check(size == 1 || size == 2, "incorrect DAP_INFO_CAPABILITIES size");
 
-//-----------------------------------------------------------------------------
-void warning(char *fmt, ...)
-{
-  va_list args;
+  strcat(str, "(");
 
-  va_start(args, fmt);
-  fprintf(stderr, "Warning: ");
-  vfprintf(stderr, fmt, args);
-  fprintf(stderr, "\n");
-  va_end(args);
-}
+  if (buf[0] & DAP_CAP_SWD)
+    strcat(str, "S");
 
-//-----------------------------------------------------------------------------
-void check(bool cond, char *fmt, ...)
-{
-  if (cond)
-    return;
+  if (buf[0] & DAP_CAP_JTAG)
+    strcat(str, "J");
 
-  va_list args;
+  strcat(str, ", ");
 
-  va_start(args, fmt);
-  fprintf(stderr, "Error: ");
-  vfprintf(stderr, fmt, args);
-  fprintf(stderr, "\n");
-  va_end(args);
+  if (debugger->versions & DBG_CMSIS_DAP_V1)
+    strcat(str, "1");
 
-  exit(1);
-}
+  if (debugger->versions & DBG_CMSIS_DAP_V2)
+    strcat(str, "2");
 
-//-----------------------------------------------------------------------------
-void error_exit(char *fmt, ...)
-{
-  va_list args;
+  strcat(str, ")\n");
 
-  va_start(args, fmt);
-  fprintf(stderr, "Error: ");
-  vfprintf(stderr, fmt, args);
-  fprintf(stderr, "\n");
-  va_end(args);
+  verbose(str);
 
-  exit(1);
+  check(buf[0] & DAP_CAP_SWD, "SWD support required");
 }
 
 //-----------------------------------------------------------------------------
-void perror_exit(char *text)
+static void print_clock_freq(int freq)
 {
-  perror(text);
-  exit(1);
+  float value = freq;
+  char *unit;
+
+  if (value < 1.0e6)
+  {
+    value /= 1.0e3;
+    unit = "kHz";
+  }
+  else
+  {
+    value /= 1.0e6;
+    unit = "MHz";
+  }
+
+  verbose("Clock frequency: %.1f %s\n", value, unit);
 }
 
 //-----------------------------------------------------------------------------
-int round_up(int value, int multiple)
+static void print_error_stats(void)
 {
-  return ((value + multiple - 1) / multiple) * multiple;
+  dap_error_stats_t stats;
+
+  dap_get_error_stats(&stats);
+
+  if (0 == stats.retries)
+    return;
+
+  warning("recovered from %d transfer errors (WAIT %d, FAULT %d, protocol %d), "
+      "%d line resets, %d ms spent in recovery", stats.retries, stats.wait, stats.fault,
+      stats.protocol, stats.line_resets, (int)(stats.recovery_time / 1000));
 }
 
 //-----------------------------------------------------------------------------
-void sleep_ms(int ms)
+static void print_cache_stats(void)
 {
-#ifdef _WIN32
-  Sleep(ms);
-#else
-  struct timespec ts;
+  dap_cache_stats_t stats;
 
-  ts.tv_sec = ms / 1000;
-  ts.tv_nsec = (ms % 1000) * 1000000;
+  dap_get_cache_stats(&stats);
 
-  nanosleep(&ts, NULL);
-#endif
+  verbose("AP register cache (hits/misses): CSW %d/%d, TAR %d/%d, SELECT %d/%d\n",
+      stats.csw_hits, stats.csw_misses, stats.tar_hits, stats.tar_misses,
+      stats.select_hits, stats.select_misses);
 }
 
 //-----------------------------------------------------------------------------
-void *buf_alloc(int size)
+static void phase_begin(char *name)
 {
-  void *buf;
-
-  if (NULL == (buf = malloc(size)))
-    error_exit("out of memory");
+  phase_t *phase = &g_phases[g_phase_count];
 
-  memset(buf, 0, size);
+  check(g_phase_count < MAX_PHASES, "internal: too many phases");
 
-  return buf;
+  phase->name = name;
+  phase->time = get_time_us();
+  dap_get_transport_stats(&phase->transport);
+  dap_get_cache_stats(&phase->cache);
 }
 
 //-----------------------------------------------------------------------------
-void buf_free(void *buf)
+static void phase_end(void)
 {
-  free(buf);
+  phase_t *phase = &g_phases[g_phase_count++];
+  dap_transport_stats_t transport;
+  dap_cache_stats_t cache;
+
+  dap_get_transport_stats(&transport);
+  dap_get_cache_stats(&cache);
+
+  phase->time = get_time_us() - phase->time;
+  phase->transport.packets          = transport.packets - phase->transport.packets;
+  phase->transport.round_trips      = transport.round_trips - phase->transport.round_trips;
+  phase->transport.transfer_packets = transport.transfer_packets - phase->transport.transfer_packets;
+  phase->transport.transfers        = transport.transfers - phase->transport.transfers;
+  phase->transport.bytes            = transport.bytes - phase->transport.bytes;
+  phase->transport.usb_out          = transport.usb_out - phase->transport.usb_out;
+  phase->transport.usb_in           = transport.usb_in - phase->transport.usb_in;
+  phase->transport.poll_time        = transport.poll_time - phase->transport.poll_time;
+  phase->cache.csw_misses           = cache.csw_misses - phase->cache.csw_misses;
+  phase->cache.tar_misses           = cache.tar_misses - phase->cache.tar_misses;
 }
 
 //-----------------------------------------------------------------------------
-int load_file(char *name, uint8_t *data, int size)
+static double ops_per_packet(phase_t *phase)
 {
-  struct stat stat;
-  int fd, rsize;
+  if (0 == phase->transport.transfer_packets)
+    return 0.0;
 
-  check(NULL != name, "input file name is not specified");
+  return (double)phase->transport.transfers / phase->transport.transfer_packets;
+}
 
-  fd = open(name, O_RDONLY | O_BINARY);
+//-----------------------------------------------------------------------------
+static void print_phase_stats(void)
+{
+  message("Statistics:\n");
+  message("  %-8s %10s %10s %8s %8s %8s %8s %8s %10s\n", "Phase", "Time, ms", "Bytes", "KB/s",
+      "Packets", "Trips", "Ops/pkt", "CSW/TAR", "Poll, ms");
 
-  if (fd < 0)
-    perror_exit("open()");
+  for (int i = 0; i < g_phase_count; i++)
+  {
+    phase_t *phase = &g_phases[i];
+    double rate = phase->time ? (phase->transport.bytes * 1.0e6 / 1024.0 / phase->time) : 0.0;
 
-  fstat(fd, &stat);
+    message("  %-8s %10.1f %10llu %8.1f %8d %8d %8.1f %8d %10.1f\n", phase->name, phase->time / 1.0e3,
+        (unsigned long long)phase->transport.bytes, rate, phase->transport.packets,
+        phase->transport.round_trips, ops_per_packet(phase),
+        phase->cache.csw_misses + phase->cache.tar_misses, phase->transport.poll_time / 1.0e3);
+  }
+}
 
-  if (stat.st_size < size)
-    size = stat.st_size;
+//-----------------------------------------------------------------------------
+static void save_phase_stats(void)
+{
+  FILE *f = (0 == strcmp(g_stats_file, "-")) ? stdout : fopen(g_stats_file, "w");
 
-  rsize = read(fd, data, size);
+  if (NULL == f)
+    error_exit("unable to open file %s", g_stats_file);
 
-  if (rsize < 0)
-    perror_exit("read()");
+  fprintf(f, "{\n  \"phases\": [\n");
 
-  check(rsize == size, "cannot fully read file");
+  for (int i = 0; i < g_phase_count; i++)
+  {
+    phase_t *phase = &g_phases[i];
+
+    fprintf(f, "    { \"name\": \"%s\", \"time_us\": %llu, \"bytes\": %llu, \"packets\": %d, "
+        "\"round_trips\": %d, \"transfer_packets\": %d, \"transfers\": %d, \"ops_per_packet\": %.2f, "
+        "\"csw_writes\": %d, \"tar_writes\": %d, \"usb_out\": %llu, \"usb_in\": %llu, \"poll_us\": %llu }%s\n",
+        phase->name, (unsigned long long)phase->time, (unsigned long long)phase->transport.bytes,
+        phase->transport.packets, phase->transport.round_trips, phase->transport.transfer_packets,
+        phase->transport.transfers, ops_per_packet(phase), phase->cache.csw_misses, phase->cache.tar_misses,
+        (unsigned long long)phase->transport.usb_out, (unsigned long long)phase->transport.usb_in,
+        (unsigned long long)phase->transport.poll_time, (i < g_phase_count - 1) ? "," : "");
+  }
 
-  close(fd);
+  fprintf(f, "  ]\n}\n");
 
-  return rsize;
+  if (stdout != f)
+    fclose(f);
 }
 
 //-----------------------------------------------------------------------------
-void save_file(char *name, uint8_t *data, int size)
+static char *clock_cache_path(void)
 {
-  int fd, rsize;
-
-  check(NULL != name, "output file name is not specified");
-
-  fd = open(name, O_WRONLY | O_TRUNC | O_CREAT | O_BINARY, 0644);
+  static char path[1024];
+  char *home = getenv("HOME");
 
-  if (fd < 0)
-    perror_exit("open()");
+  if (NULL == home)
+    home = getenv("USERPROFILE");
 
-  rsize = write(fd, data, size);
-
-  if (rsize < 0)
-    perror_exit("write()");
+  if (NULL == home)
+    return NULL;
 
-  check(rsize == size, "error writing the file");
+  snprintf(path, sizeof(path), "%s/%s", home, CLOCK_CACHE_FILE);
 
-  close(fd);
+  return path;
 }
 
 //-----------------------------------------------------------------------------
-uint8_t *mem_find(uint8_t *haystack, int haystack_size, uint8_t *needle, int needle_size)
+static long load_cached_clock(void)
 {
-  if (haystack_size == 0 || needle_size == 0 || haystack_size < needle_size)
-    return NULL;
+  char *path = clock_cache_path();
+  char serial[256], target[256];
+  long clock, res = 0;
+  FILE *f;
 
-  for (int i = 0; i < (haystack_size - needle_size); i++)
+  if (NULL == path || NULL == (f = fopen(path, "r")))
+    return 0;
+
+  while (3 == fscanf(f, "%255s %255s %ld", serial, target, &clock))
   {
-    if (memcmp(haystack + i, needle, needle_size) == 0)
-      return haystack + i;
+    if (0 == strcmp(serial, g_debugger_serial) && 0 == strcmp(target, g_target))
+      res = clock;
   }
 
-  return NULL;
+  fclose(f);
+
+  return res;
 }
 
 //-----------------------------------------------------------------------------
-static void print_debugger_info(debugger_t *debugger)
+static void save_cached_clock(long clock)
 {
-  uint8_t buf[256];
-  char str[512] = "Debugger: ";
-  int size;
+  char *path = clock_cache_path();
+  char serial[256], target[256];
+  char *text = NULL;
+  int size = 0;
+  long value;
+  FILE *f;
+
+  if (NULL == path)
+    return;
 
-  size = dap_info(DAP_INFO_VENDOR, buf, sizeof(buf));
-  strcat(str, size ? (char *)buf : debugger->manufacturer);
-  strcat(str, " ");
+  // Keep entries for other debuggers and targets
+  if (NULL != (f = fopen(path, "r")))
+  {
+    while (3 == fscanf(f, "%255s %255s %ld", serial, target, &value))
+    {
+      if (0 == strcmp(serial, g_debugger_serial) && 0 == strcmp(target, g_target))
+        continue;
 
-  size = dap_info(DAP_INFO_PRODUCT, buf, sizeof(buf));
-  strcat(str, size ? (char *)buf : debugger->product);
-  strcat(str, " ");
+      text = realloc(text, size + 600);
+      check(NULL != text, "out of memory");
+      size += sprintf(&text[size], "%s %s %ld\n", serial, target, value);
+    }
 
-  size = dap_info(DAP_INFO_SER_NUM, buf, sizeof(buf));
-  strcat(str, size ? (char *)buf : debugger->serial);
-  strcat(str, " ");
+    fclose(f);
+  }
 
-  size = dap_info(DAP_INFO_CMSIS_DAP_VER, buf, sizeof(buf));
-  strcat(str, (char *)buf);
-  strcat(str, " ");
+  if (NULL == (f = fopen(path, "w")))
+  {
+    warning("unable to save the clock frequency to %s", path);
+    free(text);
+    return;
+  }
 
-  size = dap_info(DAP_INFO_CAPABILITIES, buf, sizeof(buf));
-  check(size == 1 || size == 2, "incorrect DAP_INFO_CAPABILITIES size");
+  if (text)
+    fwrite(text, 1, size, f);
 
-  strcat(str, "(");
+  fprintf(f, "%s %s %ld\n", g_debugger_serial, g_target, clock);
 
-  if (buf[0] & DAP_CAP_SWD)
-    strcat(str, "S");
+  fclose(f);
+  free(text);
+}
 
-  if (buf[0] & DAP_CAP_JTAG)
-    strcat(str, "J");
+//-----------------------------------------------------------------------------
+static void select_auto_clock(void)
+{
+  long cached = load_cached_clock();
 
-  strcat(str, ", ");
+  // The search runs before the select, so the target's link setup is applied here
+  target_setup_link(g_target_ops);
 
-  if (debugger->versions & DBG_CMSIS_DAP_V1)
-    strcat(str, "1");
+  if (cached)
+  {
+    dap_swj_clock(cached);
 
-  if (debugger->versions & DBG_CMSIS_DAP_V2)
-    strcat(str, "2");
+    if (dap_check_link())
+    {
+      g_clock = cached;
+      g_selected_clock = cached;
+      verbose("Using a cached clock frequency\n");
+      return;
+    }
+  }
 
-  strcat(str, ")\n");
+  // Try descending frequencies below the failed cached value
+  for (int i = 0; i < ARRAY_SIZE(auto_clocks); i++)
+  {
+    if (cached && auto_clocks[i] >= cached)
+      continue;
 
-  verbose(str);
+    dap_swj_clock(auto_clocks[i]);
 
-  check(buf[0] & DAP_CAP_SWD, "SWD support required");
+    if (dap_check_link())
+    {
+      g_clock = auto_clocks[i];
+      g_selected_clock = g_clock;
+      save_cached_clock(g_clock);
+      return;
+    }
+  }
+
+  warning("unable to find a reliable clock frequency, using the default value");
+  dap_swj_clock(g_clock);
 }
 
 //-----------------------------------------------------------------------------
-static void print_clock_freq(int freq)
+static void clock_backoff(void)
 {
-  float value = freq;
-  char *unit;
+  long clock = dap_get_clock();
 
-  if (value < 1.0e6)
+  // A clock lowered during the session has already worked, the next session starts with it
+  if (clock && clock < g_selected_clock)
   {
-    value /= 1.0e3;
-    unit = "kHz";
+    save_cached_clock(clock);
+    return;
   }
-  else
+
+  // After any other transfer errors, recovered or not, the next session starts one step lower
+  if (!dap_get_error())
+    return;
+
+  for (int i = 0; i < ARRAY_SIZE(auto_clocks); i++)
   {
-    value /= 1.0e6;
-    unit = "MHz";
+    if (auto_clocks[i] < g_clock)
+    {
+      save_cached_clock(auto_clocks[i]);
+      break;
+    }
   }
+}
 
-  verbose("Clock frequency: %.1f %s\n", value, unit);
+//-----------------------------------------------------------------------------
+static bool open_checkpoint(void)
+{
+  char *name;
+
+  check(NULL != g_target_options.name, "file name is not specified");
+
+  name = buf_alloc(strlen(g_target_options.name) + strlen(CHECKPOINT_SUFFIX) + 1);
+  strcpy(name, g_target_options.name);
+  strcat(name, CHECKPOINT_SUFFIX);
+
+  return target_checkpoint_open(name, g_target);
 }
 
 //-----------------------------------------------------------------------------
@@ -340,17 +497,18 @@ static void disconnect_debugger(void)
   dap_led(0, 0);
   dap_disconnect();
   dbg_close();
+
+  g_debugger_open = false;
 }
 
 //-----------------------------------------------------------------------------
 static void reconnect_debugger(void)
 {
-  dap_disconnect();
-  dap_connect(DAP_INTERFACE_SWD);
-  dap_transfer_configure(0, 32768, 128);
-  dap_swd_configure(0);
-  dap_swj_clock(g_clock);
-  dap_led(0, 1);
+  configure_debugger(g_clock);
+
+  // Repeated transfer errors lower the clock during the session too
+  if (g_auto_clock)
+    dap_set_clock_steps(auto_clocks, ARRAY_SIZE(auto_clocks));
 }
 
 //-----------------------------------------------------------------------------
@@ -385,11 +543,32 @@ static void print_help(char *name)
       "  -f, --file <file>          binary file to be programmed or verified; also read output file name\n"
       "  -t, --target <name>        specify a target type (use '-t list' for a list of supported target types)\n"
       "  -l, --list                 list all available debuggers\n"
-      "  -s, --serial <number>      use a debugger with a specified serial number or index in the list\n"
-      "  -c, --clock <freq>         interface clock frequency in kHz (default 16000)\n"
+      "  -s, --serial <number>      use a debugger with a specified serial number or index in the list;\n"
+      "                             'all' or a comma-separated list programs several debuggers in parallel\n"
+      "  -c, --clock <freq>         interface clock frequency in kHz (default 16000),\n"
+      "                             'auto' to detect and remember the fastest reliable value\n"
       "  -o, --offset <offset>      offset for the operation\n"
       "  -z, --size <size>          size for the operation\n"
       "  -F, --fuse <options>       operations on the fuses (use '-F help' for details)\n"
+      "  -R, --resume               keep a checkpoint file next to the data file and continue\n"
+      "                             an interrupted program or read operation from it\n"
+      "  -S, --sim[=<options>]      use a simulated debugger instead of the attached ones;\n"
+      "                             options are 'latency=<us>,size=<bytes>,count=<packets>,\n"
+      "                             target=<name>,timing=<percent>,probes=<n>,maxclock=<kHz>'\n"
+      "  -T, --stats[=<file>]       print timing and transport statistics for each phase;\n"
+      "                             with a file name also save them as JSON ('-' for stdout)\n"
+      "  -U, --trace <file>         record every USB transaction and save them to a file at exit,\n"
+      "                             print the latency distribution for each command\n"
+      "  -W, --record <file>        save all DAP requests and responses to a file\n"
+      "  -P, --replay <options>     use the responses from a recording instead of a debugger;\n"
+      "                             options are '<file>[,timing]', 'timing' reproduces\n"
+      "                             the recorded latencies\n"
+      "  -B, --bench[=<options>]    measure probe latency and throughput instead of flash operations;\n"
+      "                             target RAM is overwritten; options are 'addr=<address>,\n"
+      "                             size=<bytes>,clocks=<kHz>:<kHz>...,time=<ms>,json=<file>'\n"
+      "  -D, --daemon <socket>      keep the debugger open and execute commands received\n"
+      "                             over a Unix domain socket\n"
+      "  -J, --job <file>           execute the steps from a job file in a single session\n"
     );
   }
 
@@ -435,6 +614,7 @@ static void parse_command_line(int argc, char **argv)
   int option_index = 0;
   int c;
   bool help = false;
+  int backends = 0;
 
   while ((c = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1)
   {
@@ -452,12 +632,26 @@ static void parse_command_line(int argc, char **argv)
       case 't': g_target = optarg; break;
       case 'l': g_list = true; break;
       case 's': g_serial = optarg; break;
-      case 'c': g_clock = strtoul(optarg, NULL, 0) * 1000; break;
-      case 'b': g_verbose = true; break;
+      case 'c':
+        if (0 == strcmp(optarg, "auto"))
+          g_auto_clock = true;
+        else
+          g_clock = strtoul(optarg, NULL, 0) * 1000;
+        break;
+      case 'b': verbose_enable(true); break;
       case 'd': g_version = strtoul(optarg, NULL, 0); break;
       case 'o': g_target_options.offset = (uint32_t)strtoul(optarg, NULL, 0); break;
       case 'z': g_target_options.size = (uint32_t)strtoul(optarg, NULL, 0); break;
       case 'F': g_target_options.fuse_cmd = optarg; break;
+      case 'R': g_resume = true; break;
+      case 'S': dbg_select_sim(optarg); g_sim = true; g_sim_options = optarg; backends++; break;
+      case 'P': dbg_select_replay(optarg); g_replay_options = optarg; backends++; break;
+      case 'D': g_daemon = optarg; break;
+      case 'J': g_job_file = optarg; break;
+      case 'B': g_bench = bench_configure(optarg); break;
+      case 'T': g_stats = true; g_stats_file = optarg; break;
+      case 'U': g_trace_file = optarg; break;
+      case 'W': g_record_file = optarg; break;
       default: exit(1); break;
     }
   }
@@ -468,31 +662,558 @@ static void parse_command_line(int argc, char **argv)
   if (g_target_options.fuse_cmd && 0 == strcmp(g_target_options.fuse_cmd, "help"))
     print_fuse_help();
 
+  check(backends < 2, "only one of the simulator and the replay may be used");
+
   check(optind >= argc, "malformed command line, use '-h' for more information");
 }
 
+//-----------------------------------------------------------------------------
+static void open_debugger(debugger_t *debugger)
+{
+  int version = select_version(debugger, g_version);
+
+  if (g_trace_file)
+    dbg_trace(g_trace_file);
+
+  if (g_record_file)
+    dbg_record(g_record_file);
+
+  connect_debugger(debugger, version);
+
+  g_debugger = debugger;
+  g_debugger_version = version;
+  g_debugger_open = true;
+
+  dap_init();
+
+  print_debugger_info(debugger);
+  verbose("Using CMSIS-DAP v%d\n", (DBG_CMSIS_DAP_V1 == version) ? 1 : 2);
+
+  reconnect_debugger();
+
+  if (g_target_options.reset > 0)
+  {
+    verbose("Resetting...");
+    dap_reset_pin(0);
+    dap_delay(g_target_options.reset * 1000);
+    dap_reset_pin(1);
+    dap_delay(10000);
+    verbose(" done.\n");
+  }
+
+  if (g_auto_clock)
+  {
+    g_debugger_serial = debugger->serial;
+    select_auto_clock();
+    atexit(clock_backoff);
+  }
+
+  print_clock_freq(g_clock);
+}
+
+//-----------------------------------------------------------------------------
+static void run_actions(target_options_t *options)
+{
+  target_ops_t *target_ops = g_target_ops;
+
+  phase_begin("select");
+  target_ops->select(options);
+  phase_end();
+
+  // The unlock option only let the target be selected, the job unlocks it itself
+  if (g_job)
+  {
+    verbose("Running %s:\n", g_job->name);
+    phase_begin("job");
+    job_run(target_ops, g_job);
+    phase_end();
+    options->unlock = false;
+  }
+
+  if (g_bench)
+  {
+    phase_begin("bench");
+    bench_run(g_bench, g_clock);
+    phase_end();
+  }
+
+  // Unlock and erase would destroy the progress of an interrupted session
+  if (g_resume && open_checkpoint())
+  {
+    verbose("Resuming from a checkpoint, skipping unlock and erase\n");
+    options->unlock = false;
+    options->erase = false;
+  }
+
+  if (options->unlock)
+  {
+    verbose("Unlocking...");
+    phase_begin("unlock");
+    target_ops->unlock();
+    phase_end();
+    verbose(" done.\n");
+  }
+
+  if (options->erase)
+  {
+    verbose("Erasing...");
+    phase_begin("erase");
+    target_ops->erase();
+    phase_end();
+    verbose(" done.\n");
+  }
+
+  if (options->program)
+  {
+    verbose("Programming...");
+    phase_begin("program");
+    target_ops->program();
+    phase_end();
+    verbose(" done.\n");
+  }
+
+  if (options->verify)
+  {
+    verbose("Verification...");
+    phase_begin("verify");
+    target_ops->verify();
+    phase_end();
+    verbose(" done.\n");
+  }
+
+  if (options->lock)
+  {
+    verbose("Locking...");
+    phase_begin("lock");
+    target_ops->lock();
+    phase_end();
+    verbose(" done.\n");
+  }
+
+  if (options->read)
+  {
+    verbose("Reading...");
+    phase_begin("read");
+    target_ops->read();
+    phase_end();
+    verbose(" done.\n");
+  }
+
+  if (g_resume)
+    target_checkpoint_close();
+
+  if (options->fuse_cmd)
+  {
+    verbose("Fuses:\n");
+    phase_begin("fuse");
+    target_fuse_commands(target_ops, options->fuse_cmd);
+    phase_end();
+    verbose("done.\n");
+  }
+
+  phase_begin("deselect");
+  target_ops->deselect();
+  dap_reset_target_hw(1);
+  phase_end();
+
+  print_cache_stats();
+  print_error_stats();
+
+  if (g_stats)
+    print_phase_stats();
+
+  if (g_stats_file)
+    save_phase_stats();
+}
+
+//-----------------------------------------------------------------------------
+static void restart_debugger(void)
+{
+  jmp_buf close_jmp;
+  jmp_buf *error_jmp;
+
+  if (g_debugger_open)
+  {
+    error_jmp = error_trap(&close_jmp);
+
+    if (0 == setjmp(close_jmp))
+      dbg_close();
+
+    error_trap(error_jmp);
+    g_debugger_open = false;
+  }
+
+  // A clock lowered after transfer errors is kept for the new connection
+  if (dap_get_clock())
+    g_clock = dap_get_clock();
+
+  connect_debugger(g_debugger, g_debugger_version);
+  g_debugger_open = true;
+
+  dap_init();
+  reconnect_debugger();
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t parse_number(char *str)
+{
+  char *end = NULL;
+  uint32_t value = strtoul(str, &end, 0);
+
+  if (str == end || *end)
+    error_exit("invalid number: %s", str);
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static void daemon_action(int argc, char **argv)
+{
+  target_options_t options = g_target_options;
+  char *cmd = argv[0];
+  bool file = false;
+
+  options.unlock = false;
+  options.erase = false;
+  options.program = false;
+  options.verify = false;
+  options.lock = false;
+  options.read = false;
+  options.fuse_cmd = NULL;
+  options.name = NULL;
+  options.offset = -1;
+  options.size = -1;
+
+  if (0 == strcmp(cmd, "unlock"))
+    options.unlock = true;
+  else if (0 == strcmp(cmd, "erase"))
+    options.erase = true;
+  else if (0 == strcmp(cmd, "lock"))
+    options.lock = true;
+  else if (0 == strcmp(cmd, "program"))
+    file = options.program = true;
+  else if (0 == strcmp(cmd, "verify"))
+    file = options.verify = true;
+  else if (0 == strcmp(cmd, "read"))
+    file = options.read = true;
+
+  if (file)
+  {
+    check(argc >= 2 && argc <= (options.read ? 4 : 3), "usage: %s <file> [<offset>%s]", cmd,
+        options.read ? " [<size>]" : "");
+
+    options.name = argv[1];
+
+    if (argc > 2)
+      options.offset = parse_number(argv[2]);
+
+    if (argc > 3)
+      options.size = parse_number(argv[3]);
+  }
+  else
+  {
+    check(1 == argc, "%s takes no arguments", cmd);
+  }
+
+  g_phase_count = 0;
+  run_actions(&options);
+}
+
+//-----------------------------------------------------------------------------
+static void daemon_link(void)
+{
+  if (!g_link_ready)
+  {
+    target_setup_link(g_target_ops);
+    dap_reset_link();
+    g_link_ready = true;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static char *daemon_command(int argc, char **argv)
+{
+  static char error[MAX_ERROR_SIZE];
+  char *cmd = argv[0];
+  jmp_buf error_jmp;
+
+  error_trap(&error_jmp);
+
+  if (setjmp(error_jmp))
+  {
+    snprintf(error, sizeof(error), "%s", error_message());
+    g_link_ready = false;
+
+    // The state of the debugger is unknown, start over with a fresh connection
+    if (0 == setjmp(error_jmp))
+      restart_debugger();
+
+    error_trap(NULL);
+
+    return error;
+  }
+
+  if (!g_debugger_open)
+    restart_debugger();
+
+  if (0 == strcmp(cmd, "unlock") || 0 == strcmp(cmd, "erase") || 0 == strcmp(cmd, "lock") ||
+      0 == strcmp(cmd, "program") || 0 == strcmp(cmd, "verify") || 0 == strcmp(cmd, "read"))
+  {
+    g_link_ready = false;
+    daemon_action(argc, argv);
+  }
+  else if (0 == strcmp(cmd, "fuse"))
+  {
+    target_options_t options = g_target_options;
+
+    check(2 == argc, "usage: fuse <operations>");
+
+    options.fuse_cmd = argv[1];
+    g_link_ready = false;
+    g_phase_count = 0;
+    run_actions(&options);
+  }
+  else if (0 == strcmp(cmd, "target"))
+  {
+    static char *target_name = NULL;
+
+    check(2 == argc, "usage: target <name>");
+    g_target_ops = target_get_ops(argv[1]);
+
+    free(target_name);
+    target_name = strdup(argv[1]);
+    g_target = target_name;
+
+    // Nothing from the previous target may carry over to the next select
+    dap_reset_target_config();
+    g_link_ready = false;
+  }
+  else if (0 == strcmp(cmd, "reset"))
+  {
+    uint32_t ms;
+
+    check(argc <= 2, "usage: reset [<ms>]");
+
+    ms = (argc > 1) ? parse_number(argv[1]) : 10;
+    g_link_ready = false;
+    dap_reset_pin(0);
+    dap_delay(ms * 1000);
+    dap_reset_pin(1);
+    dap_delay(10000);
+    dap_flush();
+  }
+  else if (0 == strcmp(cmd, "clock"))
+  {
+    check(2 == argc, "usage: clock <kHz>");
+
+    g_clock = (long)parse_number(argv[1]) * 1000;
+    check(g_clock > 0, "invalid clock frequency");
+
+    dap_swj_clock(g_clock);
+    g_link_ready = false;
+    print_clock_freq(g_clock);
+  }
+  else if (0 == strcmp(cmd, "read32"))
+  {
+    check(2 == argc, "usage: read32 <addr>");
+
+    daemon_link();
+    message("0x%08x\n", dap_read_word(parse_number(argv[1])));
+  }
+  else if (0 == strcmp(cmd, "write32"))
+  {
+    check(3 == argc, "usage: write32 <addr> <value>");
+
+    daemon_link();
+    dap_write_word(parse_number(argv[1]), parse_number(argv[2]));
+  }
+  else
+  {
+    error_exit("unknown command: %s", cmd);
+  }
+
+  error_trap(NULL);
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+static void *gang_worker(void *arg)
+{
+  gang_board_t *board = arg;
+  session_t *session = session_create();
+  target_options_t options = g_target_options;
+  uint64_t start = get_time_us();
+  jmp_buf error_jmp;
+
+  session_select(session);
+
+  output_prefix(board->debugger->serial);
+  error_trap(&error_jmp);
+
+  if (0 == setjmp(error_jmp))
+  {
+    if (g_sim)
+      dbg_select_sim(g_sim_options);
+    else if (g_replay_options)
+      dbg_select_replay(g_replay_options);
+
+    open_debugger(board->debugger);
+    run_actions(&options);
+    disconnect_debugger();
+
+    board->passed = true;
+  }
+  else
+  {
+    snprintf(board->error, sizeof(board->error), "%s", error_message());
+
+    // The state of the target is unknown, only release the debugger
+    if (g_debugger_open && 0 == setjmp(error_jmp))
+      dbg_close();
+  }
+
+  board->time = get_time_us() - start;
+
+  error_trap(NULL);
+  session_free(session);
+
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+static int run_gang(debugger_t *debuggers, int n_debuggers)
+{
+  gang_board_t boards[MAX_DEBUGGERS];
+  int count = 0, passed = 0, width = 6;
+  uint64_t start;
+
+  if (g_bench || g_resume || g_auto_clock || g_stats || g_trace_file || g_record_file ||
+      g_target_options.read || g_target_options.fuse_cmd || (g_job && g_job->read))
+    error_exit("multiple debuggers may only be used to unlock, erase, program, verify and lock");
+
+  memset(boards, 0, sizeof(boards));
+
+  if (0 == strcmp(g_serial, "all"))
+  {
+    for (int i = 0; i < n_debuggers; i++)
+      boards[count++].debugger = &debuggers[i];
+  }
+  else
+  {
+    char *serials = strdup(g_serial);
+
+    for (char *serial = strtok(serials, ","); serial; serial = strtok(NULL, ","))
+    {
+      debugger_t *debugger = &debuggers[find_debugger(debuggers, n_debuggers, serial)];
+
+      for (int i = 0; i < count; i++)
+        check(boards[i].debugger != debugger, "debugger %s is specified more than once", debugger->serial);
+
+      boards[count++].debugger = debugger;
+    }
+
+    free(serials);
+  }
+
+  check(count > 0, "no debuggers found");
+
+  // The image is loaded and checked once, each target driver makes its own copy
+  if (g_target_options.program || g_target_options.verify)
+    g_target_options.image_data = load_image(g_target_options.name, &g_target_options.image_size);
+
+  message("Programming %d boards...\n", count);
+
+  start = get_time_us();
+
+  for (int i = 0; i < count; i++)
+  {
+    if (0 != pthread_create(&boards[i].thread, NULL, gang_worker, &boards[i]))
+      error_exit("unable to create a thread");
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    int len = strlen(boards[i].debugger->serial);
+
+    pthread_join(boards[i].thread, NULL);
+
+    if (len > width)
+      width = len;
+  }
+
+  message("  Board  %-*s  Result  Time, s\n", width, "Serial");
+
+  for (int i = 0; i < count; i++)
+  {
+    gang_board_t *board = &boards[i];
+
+    message("  %5d  %-*s  %-6s  %7.3f", i, width, board->debugger->serial,
+        board->passed ? "pass" : "FAIL", board->time / 1e6);
+
+    if (board->passed)
+      passed++;
+    else
+      message("  %s", board->error);
+
+    message("\n");
+  }
+
+  message("%d of %d boards passed in %.3f s\n", passed, count, (get_time_us() - start) / 1e6);
+
+  buf_free(g_target_options.image_data);
+
+  if (g_job)
+    job_free(g_job);
+
+  return (passed == count) ? 0 : 1;
+}
+
 //-----------------------------------------------------------------------------
 int main(int argc, char **argv)
 {
   debugger_t debuggers[MAX_DEBUGGERS] = {0};
   int n_debuggers = 0;
   int debugger = -1;
-  target_ops_t *target_ops;
+  target_options_t options;
   bool active_actions;
 
+  session_select(session_create());
+
   parse_command_line(argc, argv);
 
   active_actions = g_target_options.unlock || g_target_options.erase ||
       g_target_options.program || g_target_options.verify || g_target_options.lock ||
-      g_target_options.read || g_target_options.fuse_cmd;
+      g_target_options.read || g_target_options.fuse_cmd || g_bench || g_job_file;
 
   if (!(active_actions || g_list || g_target || (g_target_options.reset == 0)))
     error_exit("no actions specified");
 
+  if (g_daemon && (active_actions || g_resume || g_stats || g_trace_file || g_record_file))
+    error_exit("daemon can't be combined with other actions");
+
   if (g_target_options.read && (g_target_options.erase || g_target_options.program ||
       g_target_options.verify || g_target_options.lock))
     error_exit("mutually exclusive actions specified");
 
+  if (g_bench && (g_target_options.unlock || g_target_options.erase || g_target_options.program ||
+      g_target_options.verify || g_target_options.lock || g_target_options.read || g_target_options.fuse_cmd))
+    error_exit("benchmark can't be combined with other actions");
+
+  if (g_resume && !(g_target_options.program || g_target_options.read))
+    error_exit("resuming requires a program or read action");
+
+  if (g_job_file && (g_target_options.unlock || g_target_options.erase || g_target_options.program ||
+      g_target_options.verify || g_target_options.lock || g_target_options.read ||
+      g_target_options.fuse_cmd || g_bench))
+    error_exit("job file can't be combined with other actions");
+
+  if (g_job_file)
+  {
+    g_job = job_load(g_job_file);
+    g_target_options.unlock = g_job->unlock;
+  }
+
   n_debuggers = dbg_enumerate(debuggers, MAX_DEBUGGERS);
 
   if (g_list)
@@ -524,32 +1245,13 @@ int main(int argc, char **argv)
     return 0;
   }
 
-  target_ops = target_get_ops(g_target);
+  g_target_ops = target_get_ops(g_target);
 
-  if (g_serial)
-  {
-    char *end = NULL;
-    int index = strtoul(g_serial, &end, 10);
+  if (g_serial && !g_daemon && (0 == strcmp(g_serial, "all") || strchr(g_serial, ',')))
+    return run_gang(debuggers, n_debuggers);
 
-    if (index < n_debuggers && end[0] == 0)
-    {
-      debugger = index;
-    }
-    else
-    {
-      for (int i = 0; i < n_debuggers; i++)
-      {
-        if (0 == strcmp(debuggers[i].serial, g_serial))
-        {
-          debugger = i;
-          break;
-        }
-      }
-    }
-
-    if (-1 == debugger)
-      error_exit("unable to find a debugger with a specified serial number");
-  }
+  if (g_serial)
+    debugger = find_debugger(debuggers, n_debuggers, g_serial);
 
   if (0 == n_debuggers)
     error_exit("no debuggers found");
@@ -558,36 +1260,17 @@ int main(int argc, char **argv)
   else if (n_debuggers > 1 && -1 == debugger)
     error_exit("more than one debugger found, please specify a serial number");
 
-  if (-1 == g_version)
-    g_version = (debuggers[debugger].versions & DBG_CMSIS_DAP_V2) ? DBG_CMSIS_DAP_V2 : DBG_CMSIS_DAP_V1;
-  else if (1 == g_version)
-    g_version = DBG_CMSIS_DAP_V1;
-  else if (2 == g_version)
-    g_version = DBG_CMSIS_DAP_V2;
-  else
-    error_exit("unsupported CMSIS-DAP version: %d", g_version);
+  open_debugger(&debuggers[debugger]);
 
-  if (0 == (g_version & debuggers[debugger].versions))
-    error_exit("selected debugger does not support this CMSIS-DAP version");
-
-  dbg_open(&debuggers[debugger], g_version);
-
-  g_debugger_open = true;
-
-  print_debugger_info(&debuggers[debugger]);
-  verbose("Using CMSIS-DAP v%d\n", (DBG_CMSIS_DAP_V1 == g_version) ? 1 : 2);
-  print_clock_freq(g_clock);
+  if (g_daemon)
+  {
+    daemon_run(g_daemon, daemon_command);
 
-  reconnect_debugger();
+    // The last restart may have failed and left the debugger closed
+    if (g_debugger_open)
+      disconnect_debugger();
 
-  if (g_target_options.reset > 0)
-  {
-    verbose("Resetting...");
-    dap_reset_pin(0);
-    sleep_ms(g_target_options.reset);
-    dap_reset_pin(1);
-    sleep_ms(10);
-    verbose(" done.\n");
+    return 0;
   }
 
   if (!active_actions)
@@ -596,63 +1279,16 @@ int main(int argc, char **argv)
     return 0;
   }
 
-  target_ops->select(&g_target_options);
-
-  if (g_target_options.unlock)
-  {
-    verbose("Unlocking...");
-    target_ops->unlock();
-    verbose(" done.\n");
-  }
-
-  if (g_target_options.erase)
-  {
-    verbose("Erasing...");
-    target_ops->erase();
-    verbose(" done.\n");
-  }
-
-  if (g_target_options.program)
-  {
-    verbose("Programming...");
-    target_ops->program();
-    verbose(" done.\n");
-  }
-
-  if (g_target_options.verify)
-  {
-    verbose("Verification...");
-    target_ops->verify();
-    verbose(" done.\n");
-  }
-
-  if (g_target_options.lock)
-  {
-    verbose("Locking...");
-    target_ops->lock();
-    verbose(" done.\n");
-  }
-
-  if (g_target_options.read)
-  {
-    verbose("Reading...");
-    target_ops->read();
-    verbose(" done.\n");
-  }
+  options = g_target_options;
+  run_actions(&options);
 
-  if (g_target_options.fuse_cmd)
-  {
-    verbose("Fuses:\n");
-    target_fuse_commands(target_ops, g_target_options.fuse_cmd);
-    verbose("done.\n");
-  }
+  disconnect_debugger();
 
-  target_ops->deselect();
+  if (g_job)
+    job_free(g_job);
 
-  dap_reset_target_hw(1);
-
-  disconnect_debugger();
+  if (g_bench)
+    bench_free(g_bench);
 
   return 0;
 }
-
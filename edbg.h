@@ -1,14 +1,17 @@
 // SPDX-License-Identifier: BSD-3-Clause
-// Copyright (c) 2013-2022, Alex Taradov <alex@taradov.com>. All rights reserved.
+// Copyright (c) 2013-2024, Alex Taradov <alex@taradov.com>. All rights reserved.
 
 #ifndef _EDBG_H_
 #define _EDBG_H_
 
 /*- Includes ----------------------------------------------------------------*/
 #include <assert.h>
+#include <stdio.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "dbg.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define ARRAY_SIZE(x)  ((int)(sizeof(x) / sizeof(0[x])))
@@ -16,20 +19,35 @@
 #define BITS_IN_HALF   16
 #define BITS_IN_WORD   32
 
+#define MAX_ERROR_SIZE 1024
+
 /*- Prototypes --------------------------------------------------------------*/
 void verbose(char *fmt, ...);
 void message(char *fmt, ...);
 void warning(char *fmt, ...);
+void verbose_enable(bool enable);
+void output_redirect(FILE *file);
+void output_prefix(char *prefix);
+jmp_buf *error_trap(jmp_buf *jmp);
+char *error_message(void);
 void check(bool cond, char *fmt, ...);
 void error_exit(char *fmt, ...);
 void sleep_ms(int ms);
+uint64_t get_time_us(void);
+uint64_t get_time_ns(void);
 void perror_exit(char *text);
 int round_up(int value, int multiple);
 void *buf_alloc(int size);
 void buf_free(void *buf);
 int load_file(char *name, uint8_t *data, int size);
+uint8_t *load_image(char *name, int *size);
 void save_file(char *name, uint8_t *data, int size);
 uint8_t *mem_find(uint8_t *haystack, int haystack_size, uint8_t *needle, int needle_size);
 
+int find_debugger(debugger_t *debuggers, int count, const char *serial);
+int select_version(debugger_t *debugger, int version);
+void connect_debugger(debugger_t *debugger, int version);
+void configure_debugger(long clock);
+
 #endif // _EDBG_H_
 
@@ -0,0 +1,319 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "edbg.h"
+#include "target.h"
+#include "job.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define MAX_LINE_SIZE    1024
+#define MAX_ARGS         4
+
+/*- Constants ---------------------------------------------------------------*/
+static const char *action_names[] =
+{
+  [JOB_UNLOCK]  = "unlock",
+  [JOB_ERASE]   = "erase",
+  [JOB_PROGRAM] = "program",
+  [JOB_VERIFY]  = "verify",
+  [JOB_READ]    = "read",
+  [JOB_FUSE]    = "fuse",
+  [JOB_LOCK]    = "lock",
+};
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static int32_t parse_number(job_t *job, job_step_t *step, char *str)
+{
+  char *end = NULL;
+  long long value = strtoll(str, &end, 0);
+
+  if (str == end || *end || value < 0 || value > INT32_MAX)
+    error_exit("%s:%d: invalid number: %s", job->name, step->line, str);
+
+  return value;
+}
+
+//-----------------------------------------------------------------------------
+static void parse_step(job_t *job, job_step_t *step, int argc, char **argv)
+{
+  int action = -1;
+
+  for (int i = 0; i < ARRAY_SIZE(action_names); i++)
+  {
+    if (0 == strcmp(argv[0], action_names[i]))
+      action = i;
+  }
+
+  if (-1 == action)
+    error_exit("%s:%d: unknown action: %s", job->name, step->line, argv[0]);
+
+  step->action = action;
+  step->offset = -1;
+  step->size = -1;
+
+  if (JOB_PROGRAM == action || JOB_VERIFY == action || JOB_READ == action)
+  {
+    // Verify without a file checks all images programmed before it
+    if (argc < 2 && JOB_VERIFY != action)
+      error_exit("%s:%d: usage: %s <file> [<offset> [<size>]]", job->name, step->line, argv[0]);
+
+    if (argc > 4)
+      error_exit("%s:%d: too many arguments", job->name, step->line);
+
+    if (argc > 1)
+      step->name = strdup(argv[1]);
+
+    if (argc > 2)
+      step->offset = parse_number(job, step, argv[2]);
+
+    if (argc > 3)
+      step->size = parse_number(job, step, argv[3]);
+
+    if (step->name && JOB_READ != action)
+      step->data = load_image(step->name, &step->data_size);
+  }
+  else if (JOB_FUSE == action)
+  {
+    if (2 != argc)
+      error_exit("%s:%d: usage: fuse <operations>", job->name, step->line);
+
+    step->name = strdup(argv[1]);
+  }
+  else if (argc > 1)
+  {
+    error_exit("%s:%d: %s takes no arguments", job->name, step->line, argv[0]);
+  }
+
+  if (JOB_UNLOCK == action)
+    job->unlock = true;
+
+  if (JOB_READ == action)
+    job->read = true;
+}
+
+//-----------------------------------------------------------------------------
+job_t *job_load(char *name)
+{
+  job_t *job = buf_alloc(sizeof(job_t));
+  char line[MAX_LINE_SIZE];
+  int line_number = 0;
+  int capacity = 0;
+  FILE *f;
+
+  job->name = name;
+
+  f = fopen(name, "r");
+
+  if (NULL == f)
+    error_exit("unable to open the job file %s", name);
+
+  while (fgets(line, sizeof(line), f))
+  {
+    char *argv[MAX_ARGS + 1];
+    char *comment = strchr(line, '#');
+    char *save = NULL;
+    int argc = 0;
+
+    line_number++;
+
+    if (comment)
+      *comment = 0;
+
+    for (char *arg = strtok_r(line, " \t\r\n", &save); arg && argc <= MAX_ARGS; arg = strtok_r(NULL, " \t\r\n", &save))
+      argv[argc++] = arg;
+
+    if (0 == argc)
+      continue;
+
+    if (job->count == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 16;
+      job->steps = realloc(job->steps, capacity * sizeof(job_step_t));
+      check(NULL != job->steps, "out of memory");
+    }
+
+    memset(&job->steps[job->count], 0, sizeof(job_step_t));
+    job->steps[job->count].line = line_number;
+
+    parse_step(job, &job->steps[job->count], argc, argv);
+
+    job->count++;
+  }
+
+  fclose(f);
+
+  check(job->count > 0, "job file %s is empty", name);
+
+  return job;
+}
+
+//-----------------------------------------------------------------------------
+void job_free(job_t *job)
+{
+  for (int i = 0; i < job->count; i++)
+  {
+    free(job->steps[i].name);
+    buf_free(job->steps[i].data);
+  }
+
+  free(job->steps);
+  buf_free(job);
+}
+
+//-----------------------------------------------------------------------------
+static void step_range(job_step_t *step, int align, int *start, int *end)
+{
+  int size = step->data_size;
+
+  if (-1 != step->size && step->size < size)
+    size = step->size;
+
+  *start = (-1 == step->offset) ? 0 : step->offset;
+  *end = *start + round_up(size, align);
+}
+
+//-----------------------------------------------------------------------------
+static void check_plan(job_t *job)
+{
+  int flash_size, align;
+  int programmed = -1;
+
+  target_flash_info(&flash_size, &align);
+
+  // Erase is a chip erase and each program step erases whole pages or sectors first,
+  // so nothing may be erased after it was programmed
+  for (int i = 0; i < job->count; i++)
+  {
+    job_step_t *step = &job->steps[i];
+    int start, end, erase_start, erase_end;
+
+    if (JOB_ERASE == step->action && programmed != -1)
+      error_exit("%s:%d: erase would remove the image programmed on line %d", job->name,
+          step->line, job->steps[programmed].line);
+
+    if (JOB_PROGRAM != step->action)
+      continue;
+
+    step_range(step, align, &start, &end);
+
+    check(0 == (start % align), "%s:%d: offset must be a multiple of %d for the selected target",
+        job->name, step->line, align);
+    check(end <= flash_size, "%s:%d: image does not fit into the flash", job->name, step->line);
+
+    erase_start = start;
+    erase_end = end;
+    target_erase_range(&erase_start, &erase_end);
+
+    for (int j = 0; j < i; j++)
+    {
+      job_step_t *prev = &job->steps[j];
+      int prev_start, prev_end, prev_erase_start, prev_erase_end;
+
+      if (JOB_PROGRAM != prev->action)
+        continue;
+
+      step_range(prev, align, &prev_start, &prev_end);
+
+      if (start < prev_end && prev_start < end)
+        error_exit("%s:%d: image overlaps the image from line %d (images are padded to %d bytes)", job->name,
+            step->line, prev->line, align);
+
+      prev_erase_start = prev_start;
+      prev_erase_end = prev_end;
+      target_erase_range(&prev_erase_start, &prev_erase_end);
+
+      if (erase_start < prev_erase_end && prev_erase_start < erase_end)
+        error_exit("%s:%d: image shares the erase sector at 0x%x with the image from line %d", job->name,
+            step->line, (erase_start > prev_erase_start) ? erase_start : prev_erase_start, prev->line);
+    }
+
+    if (-1 == programmed)
+      programmed = i;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static void run_image(target_ops_t *ops, job_step_t *step, int action)
+{
+  target_options_t options;
+
+  memset(&options, 0, sizeof(options));
+  options.program    = (JOB_PROGRAM == action);
+  options.verify     = (JOB_VERIFY == action);
+  options.read       = (JOB_READ == action);
+  options.name       = step->name;
+  options.offset     = step->offset;
+  options.size       = step->size;
+  options.image_data = step->data;
+  options.image_size = step->data_size;
+
+  target_update_options(&options);
+
+  if (JOB_PROGRAM == action)
+    ops->program();
+  else if (JOB_VERIFY == action)
+    ops->verify();
+  else
+    ops->read();
+}
+
+//-----------------------------------------------------------------------------
+void job_run(target_ops_t *ops, job_t *job)
+{
+  check_plan(job);
+
+  for (int i = 0; i < job->count; i++)
+  {
+    job_step_t *step = &job->steps[i];
+
+    verbose("%s", action_names[step->action]);
+
+    if (step->name)
+      verbose(" %s", step->name);
+
+    if (-1 != step->offset)
+      verbose(" at 0x%x", step->offset);
+
+    verbose("...");
+
+    if (JOB_UNLOCK == step->action)
+    {
+      ops->unlock();
+    }
+    else if (JOB_ERASE == step->action)
+    {
+      ops->erase();
+    }
+    else if (JOB_LOCK == step->action)
+    {
+      ops->lock();
+    }
+    else if (JOB_FUSE == step->action)
+    {
+      verbose("\n");
+      target_fuse_commands(ops, step->name);
+    }
+    else if (JOB_VERIFY == step->action && NULL == step->name)
+    {
+      for (int j = 0; j < i; j++)
+      {
+        if (JOB_PROGRAM == job->steps[j].action)
+          run_image(ops, &job->steps[j], JOB_VERIFY);
+      }
+    }
+    else
+    {
+      run_image(ops, step, step->action);
+    }
+
+    verbose(" done.\n");
+  }
+}
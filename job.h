@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+#ifndef _JOB_H_
+#define _JOB_H_
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+#include <stdbool.h>
+#include "target.h"
+
+/*- Definitions -------------------------------------------------------------*/
+enum
+{
+  JOB_UNLOCK,
+  JOB_ERASE,
+  JOB_PROGRAM,
+  JOB_VERIFY,
+  JOB_READ,
+  JOB_FUSE,
+  JOB_LOCK,
+};
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  int          action;
+  int          line;
+  char         *name;  // File name or fuse operations
+  int32_t      offset;
+  int32_t      size;
+  uint8_t      *data;  // Image contents for program and verify
+  int          data_size;
+} job_step_t;
+
+typedef struct
+{
+  char         *name;
+  job_step_t   *steps;
+  int          count;
+  bool         unlock;
+  bool         read;
+} job_t;
+
+/*- Prototypes --------------------------------------------------------------*/
+job_t *job_load(char *name);
+void job_free(job_t *job);
+void job_run(target_ops_t *ops, job_t *job);
+
+#endif // _JOB_H_
@@ -0,0 +1,442 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include "edbg.h"
+#include "dap.h"
+#include "dbg.h"
+#include "target.h"
+#include "session.h"
+#include "libedbg.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define MAX_DEBUGGERS     20
+#define DEFAULT_CLOCK     16000000
+
+/*- Types -------------------------------------------------------------------*/
+struct edbg_t
+{
+  session_t    *session;
+  debugger_t   debuggers[MAX_DEBUGGERS];
+  debugger_t   *debugger;
+  int          version;
+  long         clock;
+  target_ops_t *ops;
+  bool         open;
+  bool         link_ready;
+  jmp_buf      *error_jmp;
+  char         error[MAX_ERROR_SIZE];
+};
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+static void enter(edbg_t *edbg, jmp_buf *jmp)
+{
+  session_select(edbg->session);
+  edbg->error[0] = 0;
+  edbg->error_jmp = error_trap(jmp);
+}
+
+//-----------------------------------------------------------------------------
+static int leave(edbg_t *edbg, bool ok)
+{
+  jmp_buf error_jmp;
+
+  if (!ok)
+  {
+    snprintf(edbg->error, sizeof(edbg->error), "%s", error_message());
+
+    // The state of the debugger is unknown, it is reopened by the next call
+    error_trap(&error_jmp);
+
+    if (0 == setjmp(error_jmp))
+    {
+      if (edbg->open)
+        dbg_close();
+    }
+
+    edbg->open = false;
+  }
+
+  error_trap(edbg->error_jmp);
+
+  return ok ? EDBG_OK : EDBG_ERROR;
+}
+
+//-----------------------------------------------------------------------------
+static void open_debugger(edbg_t *edbg)
+{
+  if (edbg->open)
+    return;
+
+  connect_debugger(edbg->debugger, edbg->version);
+  edbg->open = true;
+  edbg->link_ready = false;
+
+  dap_init();
+  configure_debugger(edbg->clock);
+}
+
+//-----------------------------------------------------------------------------
+static void init_options(target_options_t *options)
+{
+  memset(options, 0, sizeof(target_options_t));
+  options->offset = -1;
+  options->size = -1;
+}
+
+//-----------------------------------------------------------------------------
+static void run_target(edbg_t *edbg, target_options_t *options)
+{
+  open_debugger(edbg);
+
+  edbg->link_ready = false;
+  edbg->ops->select(options);
+
+  if (options->unlock)
+    edbg->ops->unlock();
+
+  if (options->erase)
+    edbg->ops->erase();
+
+  if (options->program)
+    edbg->ops->program();
+
+  if (options->verify)
+    edbg->ops->verify();
+
+  if (options->lock)
+    edbg->ops->lock();
+
+  if (options->read)
+    edbg->ops->read();
+
+  edbg->ops->deselect();
+  dap_reset_target_hw(1);
+}
+
+//-----------------------------------------------------------------------------
+static int fuse_read(edbg_t *edbg, int section, uint8_t *data)
+{
+  target_options_t options;
+  int size;
+
+  init_options(&options);
+  open_debugger(edbg);
+
+  edbg->link_ready = false;
+  edbg->ops->select(&options);
+
+  size = edbg->ops->fread(section, data);
+  check(size > 0, "requested section (%d) does not exist on the target", section);
+
+  return size;
+}
+
+//-----------------------------------------------------------------------------
+static void mem_connect(edbg_t *edbg)
+{
+  open_debugger(edbg);
+
+  if (!edbg->link_ready)
+  {
+    // No select has run on a new connection, so the target's DP setup is applied here
+    target_setup_link(edbg->ops);
+    dap_reset_link();
+    edbg->link_ready = true;
+  }
+}
+
+//-----------------------------------------------------------------------------
+static int run_action(edbg_t *edbg, target_options_t *options)
+{
+  jmp_buf error_jmp;
+
+  enter(edbg, &error_jmp);
+
+  if (setjmp(error_jmp))
+    return leave(edbg, false);
+
+  run_target(edbg, options);
+
+  return leave(edbg, true);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_version(void)
+{
+  return LIBEDBG_VERSION;
+}
+
+//-----------------------------------------------------------------------------
+int edbg_open(edbg_t **edbg_ptr, const edbg_config_t *config)
+{
+  edbg_t *edbg = calloc(1, sizeof(edbg_t));
+  jmp_buf error_jmp;
+  int n_debuggers;
+  int index;
+
+  *edbg_ptr = edbg;
+
+  if (NULL == edbg)
+    return EDBG_ERROR;
+
+  enter(edbg, &error_jmp);
+
+  if (setjmp(error_jmp))
+    return leave(edbg, false);
+
+  check(NULL != config, "no configuration specified");
+
+  edbg->session = session_create();
+  session_select(edbg->session);
+
+  if (config->sim)
+    dbg_select_sim((char *)config->sim);
+
+  check(NULL != config->target, "no target type specified");
+  edbg->ops = target_get_ops(config->target);
+
+  n_debuggers = dbg_enumerate(edbg->debuggers, MAX_DEBUGGERS);
+
+  if (config->serial)
+  {
+    index = find_debugger(edbg->debuggers, n_debuggers, config->serial);
+  }
+  else
+  {
+    check(n_debuggers > 0, "no debuggers found");
+    check(1 == n_debuggers, "more than one debugger found, please specify a serial number");
+    index = 0;
+  }
+
+  edbg->debugger = &edbg->debuggers[index];
+  edbg->version = select_version(edbg->debugger, config->version);
+
+  edbg->clock = config->clock ? config->clock : DEFAULT_CLOCK;
+
+  open_debugger(edbg);
+
+  return leave(edbg, true);
+}
+
+//-----------------------------------------------------------------------------
+void edbg_close(edbg_t *edbg)
+{
+  jmp_buf error_jmp;
+
+  if (NULL == edbg)
+    return;
+
+  enter(edbg, &error_jmp);
+
+  if (0 == setjmp(error_jmp))
+  {
+    if (edbg->open)
+    {
+      edbg->open = false;
+      dap_led(0, 0);
+      dap_disconnect();
+      dbg_close();
+    }
+  }
+
+  if (edbg->session)
+    session_free(edbg->session);
+
+  error_trap(edbg->error_jmp);
+  free(edbg);
+}
+
+//-----------------------------------------------------------------------------
+const char *edbg_error(edbg_t *edbg)
+{
+  if (NULL == edbg)
+    return "out of memory";
+
+  return edbg->error;
+}
+
+//-----------------------------------------------------------------------------
+int edbg_erase(edbg_t *edbg)
+{
+  target_options_t options;
+
+  init_options(&options);
+  options.erase = true;
+
+  return run_action(edbg, &options);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_unlock(edbg_t *edbg)
+{
+  target_options_t options;
+
+  init_options(&options);
+  options.unlock = true;
+
+  return run_action(edbg, &options);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_lock(edbg_t *edbg)
+{
+  target_options_t options;
+
+  init_options(&options);
+  options.lock = true;
+
+  return run_action(edbg, &options);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_program(edbg_t *edbg, const uint8_t *data, int size, int offset)
+{
+  target_options_t options;
+
+  init_options(&options);
+  options.program = true;
+  options.image_data = (uint8_t *)data;
+  options.image_size = size;
+  options.offset = offset;
+
+  return run_action(edbg, &options);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_verify(edbg_t *edbg, const uint8_t *data, int size, int offset)
+{
+  target_options_t options;
+
+  init_options(&options);
+  options.verify = true;
+  options.image_data = (uint8_t *)data;
+  options.image_size = size;
+  options.offset = offset;
+
+  return run_action(edbg, &options);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_read(edbg_t *edbg, uint8_t *data, int size, int offset)
+{
+  target_options_t options;
+
+  init_options(&options);
+  options.read = true;
+  options.read_data = data;
+  options.size = size;
+  options.offset = offset;
+
+  return run_action(edbg, &options);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_fuse_read(edbg_t *edbg, int section, uint8_t *data, int size)
+{
+  uint8_t buf[MAX_FUSE_SIZE];
+  jmp_buf error_jmp;
+  int res;
+
+  enter(edbg, &error_jmp);
+
+  if (setjmp(error_jmp))
+    return leave(edbg, false);
+
+  res = fuse_read(edbg, section, buf);
+  check(res <= size, "section %d is %d byte(s), the buffer is too small", section, res);
+  memcpy(data, buf, res);
+
+  edbg->ops->deselect();
+  dap_reset_target_hw(1);
+
+  leave(edbg, true);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+int edbg_fuse_write(edbg_t *edbg, int section, const uint8_t *data, int size)
+{
+  uint8_t buf[MAX_FUSE_SIZE];
+  jmp_buf error_jmp;
+  int res;
+
+  enter(edbg, &error_jmp);
+
+  if (setjmp(error_jmp))
+    return leave(edbg, false);
+
+  res = fuse_read(edbg, section, buf);
+  check(res == size, "section %d is %d byte(s), not %d", section, res, size);
+  memcpy(buf, data, size);
+
+  edbg->ops->fwrite(section, buf);
+
+  edbg->ops->deselect();
+  dap_reset_target_hw(1);
+
+  return leave(edbg, true);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_mem_read(edbg_t *edbg, uint32_t addr, uint8_t *data, int size)
+{
+  jmp_buf error_jmp;
+
+  enter(edbg, &error_jmp);
+
+  if (setjmp(error_jmp))
+    return leave(edbg, false);
+
+  mem_connect(edbg);
+  dap_read_block(addr, data, size);
+
+  return leave(edbg, true);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_mem_write(edbg_t *edbg, uint32_t addr, const uint8_t *data, int size)
+{
+  jmp_buf error_jmp;
+
+  enter(edbg, &error_jmp);
+
+  if (setjmp(error_jmp))
+    return leave(edbg, false);
+
+  mem_connect(edbg);
+  dap_write_block(addr, (uint8_t *)data, size);
+
+  return leave(edbg, true);
+}
+
+//-----------------------------------------------------------------------------
+int edbg_reset(edbg_t *edbg, int ms)
+{
+  jmp_buf error_jmp;
+
+  enter(edbg, &error_jmp);
+
+  if (setjmp(error_jmp))
+    return leave(edbg, false);
+
+  open_debugger(edbg);
+
+  edbg->link_ready = false;
+  dap_reset_pin(0);
+  dap_delay(ms * 1000);
+  dap_reset_pin(1);
+  dap_delay(10000);
+  dap_flush();
+
+  return leave(edbg, true);
+}
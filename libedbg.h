@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+#ifndef _LIBEDBG_H_
+#define _LIBEDBG_H_
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*- Definitions -------------------------------------------------------------*/
+#define LIBEDBG_VERSION    1
+
+// Define LIBEDBG_STATIC when linking with libedbg.a on Windows
+#if defined(_WIN32) && defined(LIBEDBG_BUILD)
+  #define LIBEDBG_API      __declspec(dllexport)
+#elif defined(_WIN32) && !defined(LIBEDBG_STATIC)
+  #define LIBEDBG_API      __declspec(dllimport)
+#elif defined(_WIN32)
+  #define LIBEDBG_API
+#else
+  #define LIBEDBG_API      __attribute__((visibility("default")))
+#endif
+
+#define EDBG_OK            0
+#define EDBG_ERROR         (-1)
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct edbg_t edbg_t;
+
+typedef struct
+{
+  const char *serial;  // Serial number or index of the debugger, NULL if only one is attached
+  const char *target;  // Target type, same as for '-t'
+  long       clock;    // Interface clock frequency in Hz, 0 for the default
+  int        version;  // CMSIS-DAP version (1 or 2), 0 to pick automatically
+  const char *sim;     // Simulator options (same as for '-S'), NULL to use the attached debuggers
+} edbg_config_t;
+
+/*- Prototypes --------------------------------------------------------------*/
+// Unless noted otherwise, functions return EDBG_OK on success and EDBG_ERROR on
+// failure, edbg_error() then returns the message. A handle may be used from any
+// thread, but only from one thread at a time.
+
+// Returns LIBEDBG_VERSION of the library
+LIBEDBG_API int edbg_version(void);
+
+// The handle is returned even if opening fails, so the error can be retrieved,
+// it must be closed in either case
+LIBEDBG_API int edbg_open(edbg_t **edbg, const edbg_config_t *config);
+LIBEDBG_API void edbg_close(edbg_t *edbg);
+
+// Returns the message of the last failed call, an empty string after a successful one
+LIBEDBG_API const char *edbg_error(edbg_t *edbg);
+
+LIBEDBG_API int edbg_erase(edbg_t *edbg);
+LIBEDBG_API int edbg_unlock(edbg_t *edbg);
+LIBEDBG_API int edbg_lock(edbg_t *edbg);
+LIBEDBG_API int edbg_program(edbg_t *edbg, const uint8_t *data, int size, int offset);
+LIBEDBG_API int edbg_verify(edbg_t *edbg, const uint8_t *data, int size, int offset);
+LIBEDBG_API int edbg_read(edbg_t *edbg, uint8_t *data, int size, int offset);
+
+// Fuse sections are read and written as a whole. The read returns the section
+// size in bytes on success, the write returns EDBG_OK.
+LIBEDBG_API int edbg_fuse_read(edbg_t *edbg, int section, uint8_t *data, int size);
+LIBEDBG_API int edbg_fuse_write(edbg_t *edbg, int section, const uint8_t *data, int size);
+
+LIBEDBG_API int edbg_mem_read(edbg_t *edbg, uint32_t addr, uint8_t *data, int size);
+LIBEDBG_API int edbg_mem_write(edbg_t *edbg, uint32_t addr, const uint8_t *data, int size);
+LIBEDBG_API int edbg_reset(edbg_t *edbg, int ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LIBEDBG_H_
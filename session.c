@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+/*- Includes ----------------------------------------------------------------*/
+#include <stddef.h>
+#include "edbg.h"
+#include "dbg.h"
+#include "dap.h"
+#include "target.h"
+#include "session.h"
+
+/*- Variables ---------------------------------------------------------------*/
+_Thread_local session_t *g_session = NULL;
+
+/*- Implementations ---------------------------------------------------------*/
+
+//-----------------------------------------------------------------------------
+session_t *session_create(void)
+{
+  session_t *session = buf_alloc(sizeof(session_t));
+
+  dbg_session_init(session);
+  dap_session_init(session);
+  target_session_init(session);
+
+  return session;
+}
+
+//-----------------------------------------------------------------------------
+void session_free(session_t *session)
+{
+  if (NULL == session)
+    return;
+
+  if (g_session == session)
+    g_session = NULL;
+
+  target_session_free(session);
+  dap_session_free(session);
+  dbg_session_free(session);
+
+  buf_free(session);
+}
+
+//-----------------------------------------------------------------------------
+void session_select(session_t *session)
+{
+  g_session = session;
+}
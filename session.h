@@ -0,0 +1,29 @@
+// SPDX-License-Identifier: BSD-3-Clause
+// Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+
+#ifndef _SESSION_H_
+#define _SESSION_H_
+
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  void     *dbg_state;
+  void     *hw_state;
+  void     *sim_state;
+  void     *model_state;
+  void     *replay_state;
+  void     *dap_state;
+  void     *target_state;
+  void     *layout_state;
+  void     *checkpoint_state;
+} session_t;
+
+/*- Variables ---------------------------------------------------------------*/
+extern _Thread_local session_t *g_session;
+
+/*- Prototypes --------------------------------------------------------------*/
+session_t *session_create(void);
+void session_free(session_t *session);
+void session_select(session_t *session);
+
+#endif // _SESSION_H_
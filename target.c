@@ -2,17 +2,20 @@
 // Copyright (c) 2013-2022, Alex Taradov <alex@taradov.com>. All rights reserved.
 
 /*- Includes ----------------------------------------------------------------*/
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include "target.h"
 #include "edbg.h"
+#include "utils.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define MAX_FAMILIES   100 // Maximum number of families supported by a single driver
-#define MAX_FUSE_SIZE  2048
+#define MAX_CHECKPOINT_HEADER  256
 
 /*- Types -------------------------------------------------------------------*/
 typedef struct
@@ -22,6 +25,36 @@ typedef struct
   target_ops_t *ops;
 } target_t;
 
+typedef struct
+{
+  uint32_t     offset;
+  uint32_t     size;
+  uint32_t     crc;
+} checkpoint_entry_t;
+
+typedef struct
+{
+  target_options_t   *options;
+  int                flash_size; // Limits given to the last target_check_options()
+  int                align;
+  const int          *erase_sectors; // Non-uniform erase sectors, NULL if they match the alignment
+  int                erase_count;
+  int                erase_unit;
+} layout_state_t;
+
+typedef struct
+{
+  target_options_t   *options;
+  char               *name;
+  char               header[MAX_CHECKPOINT_HEADER];
+  FILE               *file;
+  FILE               *output;
+  checkpoint_entry_t *entries;
+  int                count;
+  int                capacity;
+  int                index;
+} checkpoint_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 extern target_ops_t target_atmel_cm0p_ops;
 extern target_ops_t target_atmel_cm3_ops;
@@ -58,6 +91,79 @@ static target_t targets[] =
 
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline layout_state_t *layout_state(void)
+{
+  return (layout_state_t *)g_session->layout_state;
+}
+
+//-----------------------------------------------------------------------------
+static inline checkpoint_state_t *checkpoint_state(void)
+{
+  return (checkpoint_state_t *)g_session->checkpoint_state;
+}
+
+//-----------------------------------------------------------------------------
+void target_session_init(session_t *session)
+{
+  session->layout_state = buf_alloc(sizeof(layout_state_t));
+  session->checkpoint_state = buf_alloc(sizeof(checkpoint_state_t));
+}
+
+//-----------------------------------------------------------------------------
+void target_session_free(session_t *session)
+{
+  checkpoint_state_t *state = session->checkpoint_state;
+  layout_state_t *layout_state = session->layout_state;
+
+  if (state)
+  {
+    if (state->file)
+      fclose(state->file);
+
+    if (state->output)
+      fclose(state->output);
+
+    buf_free(state->entries);
+  }
+
+  // A session that ended with an error never reached the deselect of its target
+  if (layout_state && layout_state->options)
+    target_free_options(layout_state->options);
+
+  buf_free(state);
+  buf_free(layout_state);
+  buf_free(session->target_state);
+
+  session->checkpoint_state = NULL;
+  session->layout_state = NULL;
+  session->target_state = NULL;
+}
+
+//-----------------------------------------------------------------------------
+void *target_create_state(int size)
+{
+  layout_state_t *layout = layout_state();
+  checkpoint_state_t *checkpoint = checkpoint_state();
+
+  // Options of a target that failed before its deselect are still allocated
+  if (layout->options)
+    target_free_options(layout->options);
+
+  // Each target driver keeps its own state type, a new one is made on every select
+  buf_free(g_session->target_state);
+  g_session->target_state = buf_alloc(size);
+
+  checkpoint->options = NULL;
+  layout->options = NULL;
+  layout->erase_sectors = NULL;
+
+  // Drivers that need a different DP or a larger auto-increment range set them after this
+  dap_reset_target_config();
+
+  return g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 void target_list(void)
 {
@@ -134,12 +240,30 @@ target_ops_t *target_get_ops(const char *name)
   return NULL;
 }
 
+//-----------------------------------------------------------------------------
+void target_setup_link(target_ops_t *ops)
+{
+  // Most targets work with the default DPv1 link, the rest declare theirs
+  dap_reset_target_config();
+
+  if (ops && ops->link)
+    ops->link();
+}
+
 //-----------------------------------------------------------------------------
 void target_check_options(target_options_t *options, int size, int align)
 {
+  layout_state_t *layout = layout_state();
+  checkpoint_state_t *checkpoint = checkpoint_state();
+
   options->file_data = NULL;
   options->file_size = 0;
 
+  checkpoint->options = options;
+  layout->options = options;
+  layout->flash_size = size;
+  layout->align = align;
+
   if (-1 == options->offset)
     options->offset = 0;
 
@@ -158,7 +282,17 @@ void target_check_options(target_options_t *options, int size, int align)
   if (options->program || options->verify)
   {
     options->file_data = buf_alloc(options->size);
-    options->file_size = load_file(options->name, options->file_data, options->size);
+
+    if (options->image_data)
+    {
+      options->file_size = (options->image_size < options->size) ? options->image_size : options->size;
+      memcpy(options->file_data, options->image_data, options->file_size);
+    }
+    else
+    {
+      options->file_size = load_file(options->name, options->file_data, options->size);
+    }
+
     memset(&options->file_data[options->file_size], 0xff, options->size - options->file_size);
 
     check((options->file_size + options->offset) <= size, "file is too big for the selected target");
@@ -174,6 +308,321 @@ void target_check_options(target_options_t *options, int size, int align)
 void target_free_options(target_options_t *options)
 {
   buf_free(options->file_data);
+  options->file_data = NULL;
+}
+
+//-----------------------------------------------------------------------------
+void target_flash_info(int *size, int *align)
+{
+  layout_state_t *layout = layout_state();
+
+  check(NULL != layout->options, "the selected target does not support jobs");
+
+  *size = layout->flash_size;
+  *align = layout->align;
+}
+
+//-----------------------------------------------------------------------------
+void target_set_erase_sectors(const int *sizes, int count, int unit)
+{
+  layout_state_t *layout = layout_state();
+
+  layout->erase_sectors = sizes;
+  layout->erase_count = count;
+  layout->erase_unit = unit;
+}
+
+//-----------------------------------------------------------------------------
+void target_erase_range(int *start, int *end)
+{
+  layout_state_t *layout = layout_state();
+  int sector_start = 0;
+  int first = *start;
+  int last = *end;
+
+  if (NULL == layout->erase_sectors)
+  {
+    *start -= *start % layout->align;
+    *end = round_up(*end, layout->align);
+    return;
+  }
+
+  for (int i = 0; i < layout->erase_count; i++)
+  {
+    int sector_end = sector_start + layout->erase_sectors[i] * layout->erase_unit;
+
+    if (sector_start <= first && first < sector_end)
+      *start = sector_start;
+
+    if (sector_start < last && last <= sector_end)
+      *end = sector_end;
+
+    sector_start = sector_end;
+  }
+}
+
+//-----------------------------------------------------------------------------
+void target_update_options(target_options_t *options)
+{
+  layout_state_t *layout = layout_state();
+  target_options_t *current = layout->options;
+
+  check(NULL != current, "the selected target does not support jobs");
+
+  target_free_options(current);
+
+  current->program    = options->program;
+  current->verify     = options->verify;
+  current->read       = options->read;
+  current->name       = options->name;
+  current->offset     = options->offset;
+  current->size       = options->size;
+  current->image_data = options->image_data;
+  current->image_size = options->image_size;
+  current->read_data  = options->read_data;
+
+  target_check_options(current, layout->flash_size, layout->align);
+}
+
+//-----------------------------------------------------------------------------
+void target_save_data(target_options_t *options, uint8_t *data, int size)
+{
+  if (options->read_data)
+    memcpy(options->read_data, data, size);
+  else
+    save_file(options->name, data, size);
+}
+
+//-----------------------------------------------------------------------------
+static void build_checkpoint_header(char *target)
+{
+  checkpoint_state_t *checkpoint = checkpoint_state();
+  target_options_t *options = checkpoint->options;
+  uint32_t crc = 0;
+
+  // A checkpoint is only valid for the same operation on the same data
+  if (options->program)
+    crc = crc32(options->file_data, options->size);
+
+  snprintf(checkpoint->header, sizeof(checkpoint->header), "edbg checkpoint %s %s 0x%x 0x%x 0x%08x\n",
+      options->program ? "program" : "read", target, options->offset, options->size, crc);
+}
+
+//-----------------------------------------------------------------------------
+static void write_checkpoint(void)
+{
+  checkpoint_state_t *checkpoint = checkpoint_state();
+
+  checkpoint->file = fopen(checkpoint->name, "w");
+
+  if (NULL == checkpoint->file)
+    perror_exit("fopen()");
+
+  fputs(checkpoint->header, checkpoint->file);
+
+  for (int i = 0; i < checkpoint->count; i++)
+  {
+    checkpoint_entry_t *entry = &checkpoint->entries[i];
+    fprintf(checkpoint->file, "0x%x 0x%x 0x%08x\n", entry->offset, entry->size, entry->crc);
+  }
+
+  fflush(checkpoint->file);
+}
+
+//-----------------------------------------------------------------------------
+static void add_checkpoint_entry(checkpoint_entry_t *entry)
+{
+  checkpoint_state_t *checkpoint = checkpoint_state();
+
+  if (checkpoint->count == checkpoint->capacity)
+  {
+    checkpoint->capacity = checkpoint->capacity ? (checkpoint->capacity * 2) : 1024;
+    checkpoint->entries = realloc(checkpoint->entries, checkpoint->capacity * sizeof(checkpoint_entry_t));
+
+    if (NULL == checkpoint->entries)
+      error_exit("out of memory");
+  }
+
+  checkpoint->entries[checkpoint->count++] = *entry;
+}
+
+//-----------------------------------------------------------------------------
+bool target_checkpoint_open(char *name, char *target)
+{
+  checkpoint_state_t *checkpoint = checkpoint_state();
+  char line[MAX_CHECKPOINT_HEADER];
+  checkpoint_entry_t entry;
+  FILE *file;
+
+  if (NULL == checkpoint->options)
+  {
+    warning("resuming is not supported for the selected target");
+    return false;
+  }
+
+  checkpoint->name = name;
+  checkpoint->count = 0;
+  checkpoint->index = 0;
+
+  build_checkpoint_header(target);
+
+  file = fopen(checkpoint->name, "r");
+
+  if (file)
+  {
+    if (fgets(line, sizeof(line), file) && 0 == strcmp(line, checkpoint->header))
+    {
+      while (3 == fscanf(file, "%x %x %x", &entry.offset, &entry.size, &entry.crc))
+      {
+        if (0 == entry.size || (entry.offset + entry.size) > (uint32_t)checkpoint->options->size)
+          break;
+
+        add_checkpoint_entry(&entry);
+      }
+    }
+    else
+    {
+      warning("checkpoint file '%s' does not match this session, starting over", checkpoint->name);
+    }
+
+    fclose(file);
+  }
+
+  if (checkpoint->options->read)
+  {
+    checkpoint->output = fopen(checkpoint->options->name, checkpoint->count ? "r+b" : "w+b");
+
+    if (NULL == checkpoint->output)
+      perror_exit("fopen()");
+  }
+
+  write_checkpoint();
+
+  return checkpoint->count > 0;
+}
+
+//-----------------------------------------------------------------------------
+static bool confirm_checkpoint_entry(uint32_t addr, checkpoint_entry_t *entry)
+{
+  checkpoint_state_t *checkpoint = checkpoint_state();
+  uint8_t *data = &checkpoint->options->file_data[entry->offset];
+  bool res;
+
+  // Read data comes from the partial output file, programmed data is read back from the target
+  if (checkpoint->options->read)
+  {
+    if (fseek(checkpoint->output, entry->offset, SEEK_SET) || 1 != fread(data, entry->size, 1, checkpoint->output))
+      return false;
+
+    return crc32(data, entry->size) == entry->crc;
+  }
+
+  data = buf_alloc(entry->size);
+  dap_read_block(addr, data, entry->size);
+  res = (crc32(data, entry->size) == entry->crc);
+  buf_free(data);
+
+  return res;
+}
+
+//-----------------------------------------------------------------------------
+bool target_checkpoint_skip(uint32_t addr, int offset, int size)
+{
+  checkpoint_state_t *checkpoint = checkpoint_state();
+  checkpoint_entry_t *entry;
+
+  if (NULL == checkpoint->file || checkpoint->index == checkpoint->count)
+    return false;
+
+  entry = &checkpoint->entries[checkpoint->index];
+
+  if (entry->offset == (uint32_t)offset && entry->size == (uint32_t)size &&
+      confirm_checkpoint_entry(addr, entry))
+  {
+    if (++checkpoint->index == checkpoint->count)
+      verbose(" resuming at offset 0x%x...", offset + size);
+
+    return true;
+  }
+
+  verbose(" resuming at offset 0x%x...", offset);
+
+  // Everything starting from the first mismatch is done again
+  fclose(checkpoint->file);
+  checkpoint->count = checkpoint->index;
+  write_checkpoint();
+
+  return false;
+}
+
+//-----------------------------------------------------------------------------
+void target_checkpoint_rewind(int offset)
+{
+  checkpoint_state_t *checkpoint = checkpoint_state();
+
+  if (NULL == checkpoint->file)
+    return;
+
+  // Confirmed entries past the offset are done again and recorded anew
+  while (checkpoint->index > 0 && (int)checkpoint->entries[checkpoint->index - 1].offset >= offset)
+    checkpoint->index--;
+
+  if (checkpoint->index == checkpoint->count)
+    return;
+
+  verbose(" resuming at offset 0x%x...", offset);
+
+  fclose(checkpoint->file);
+  checkpoint->count = checkpoint->index;
+  write_checkpoint();
+}
+
+//-----------------------------------------------------------------------------
+void target_checkpoint(int offset, int size)
+{
+  checkpoint_state_t *checkpoint = checkpoint_state();
+  uint8_t *data;
+
+  if (NULL == checkpoint->file)
+    return;
+
+  data = &checkpoint->options->file_data[offset];
+
+  if (checkpoint->output)
+  {
+    if (fseek(checkpoint->output, offset, SEEK_SET) || 1 != fwrite(data, size, 1, checkpoint->output))
+      perror_exit("fwrite()");
+
+    fflush(checkpoint->output);
+  }
+
+  fprintf(checkpoint->file, "0x%x 0x%x 0x%08x\n", offset, size, crc32(data, size));
+  fflush(checkpoint->file);
+}
+
+//-----------------------------------------------------------------------------
+void target_checkpoint_close(void)
+{
+  checkpoint_state_t *checkpoint = checkpoint_state();
+
+  if (NULL == checkpoint->file)
+    return;
+
+  fclose(checkpoint->file);
+  checkpoint->file = NULL;
+
+  if (checkpoint->output)
+  {
+    fclose(checkpoint->output);
+    checkpoint->output = NULL;
+  }
+
+  remove(checkpoint->name);
+
+  free(checkpoint->entries);
+  checkpoint->entries = NULL;
+  checkpoint->count = 0;
+  checkpoint->capacity = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -462,4 +911,3 @@ void target_fuse_commands(target_ops_t *ops, char *cmd)
   }
 }
 
-
@@ -8,6 +8,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdalign.h>
+#include "session.h"
+
+/*- Definitions -------------------------------------------------------------*/
+#define MAX_FUSE_SIZE  2048
 
 /*- Types -------------------------------------------------------------------*/
 typedef struct
@@ -23,6 +27,9 @@ typedef struct
   int32_t      offset;
   int32_t      size;
   char         *fuse_cmd;
+  uint8_t      *image_data; // File contents, if they were loaded in advance
+  int          image_size;
+  uint8_t      *read_data;  // Destination for the read contents instead of the file
 
   // For target use only
   int          file_size;
@@ -42,15 +49,31 @@ typedef struct
   int  (*fread)(int section, uint8_t *data);
   void (*fwrite)(int section, uint8_t *data);
   char *(*enumerate)(int i);
+  void (*link)(void); // Optional, sets up the DP before the link is used without a select
   char *help;
 } target_ops_t;
 
 /*- Prototypes --------------------------------------------------------------*/
+void target_session_init(session_t *session);
+void target_session_free(session_t *session);
+void *target_create_state(int size);
 void target_list(void);
 target_ops_t *target_get_ops(const char *name);
+void target_setup_link(target_ops_t *ops);
 void target_check_options(target_options_t *options, int size, int align);
 void target_free_options(target_options_t *options);
+void target_save_data(target_options_t *options, uint8_t *data, int size);
+void target_flash_info(int *size, int *align);
+void target_set_erase_sectors(const int *sizes, int count, int unit);
+void target_erase_range(int *start, int *end);
+void target_update_options(target_options_t *options);
 void target_fuse_commands(target_ops_t *ops, char *cmd);
 
+bool target_checkpoint_open(char *name, char *target);
+bool target_checkpoint_skip(uint32_t addr, int offset, int size);
+void target_checkpoint_rewind(int offset);
+void target_checkpoint(int offset, int size);
+void target_checkpoint_close(void);
+
 #endif // _TARGET_H_
 
@@ -10,6 +10,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_ADDR             0
@@ -74,6 +75,12 @@ typedef struct
   uint32_t  flash_size;
 } device_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+} target_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static device_t devices[] =
 {
@@ -235,16 +242,19 @@ static device_t devices[] =
   { 0x11060007, "pic32cm_jh", "PIC32CM2532JH01032", 256*1024 },
 };
 
-static device_t target_device;
-static target_options_t target_options;
-
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static void reset_with_extension(void)
 {
   dap_reset_target_hw(0);
-  sleep_ms(10);
+  dap_delay(10000);
   dap_reset_link();
 }
 
@@ -252,9 +262,10 @@ static void reset_with_extension(void)
 static void finish_reset(void)
 {
   // Stop the core
-  dap_write_word(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
-  dap_write_word(DEMCR, DEMCR_VC_CORERESET);
-  dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_write_word_req(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
+  dap_write_word_req(DEMCR, DEMCR_VC_CORERESET);
+  dap_write_word_req(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_transfer();
 
   // Release the reset
   dap_write_byte(DSU_STATUSA, DSU_STATUSA_CRSTEXT);
@@ -263,9 +274,12 @@ static void finish_reset(void)
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
   uint32_t dsu_did, id, rev;
   bool locked;
 
+  target = target_create_state(sizeof(target_state_t));
+
   reset_with_extension();
 
   dsu_did = dap_read_word(DSU_DID);
@@ -279,10 +293,10 @@ static void target_select(target_options_t *options)
 
     verbose("Target: %s (Rev %c)\n", devices[i].name, 'A' + rev);
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
-    target_check_options(&target_options, devices[i].flash_size, FLASH_ROW_SIZE);
+    target_check_options(&target->options, devices[i].flash_size, FLASH_ROW_SIZE);
 
     locked = dap_read_byte(DSU_STATUSB) & DSU_STATUSB_PROT;
 
@@ -301,10 +315,12 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(DEMCR, 0);
   dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
 
-  target_free_options(&target_options);
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
@@ -312,8 +328,8 @@ static void target_erase(void)
 {
   dap_write_byte(DSU_STATUSA, DSU_STATUSA_DONE);
   dap_write_byte(DSU_CTRL, DSU_CTRL_CE);
-  sleep_ms(100);
-  while (0 == (dap_read_byte(DSU_STATUSA) & DSU_STATUSA_DONE));
+  dap_delay(100000);
+  dap_wait_byte(DSU_STATUSA, DSU_STATUSA_DONE, DSU_STATUSA_DONE);
 
   reset_with_extension();
   finish_reset();
@@ -328,27 +344,36 @@ static void target_lock(void)
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
   uint32_t number_of_rows;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   number_of_rows = (size + FLASH_ROW_SIZE - 1) / FLASH_ROW_SIZE;
 
+  while (offs < size && target_checkpoint_skip(addr, offs, FLASH_ROW_SIZE))
+  {
+    addr += FLASH_ROW_SIZE;
+    offs += FLASH_ROW_SIZE;
+  }
+
   dap_write_word(NVMCTRL_CTRLB, 0); // Enable automatic write
 
-  for (uint32_t row = 0; row < number_of_rows; row++)
+  for (uint32_t row = offs / FLASH_ROW_SIZE; row < number_of_rows; row++)
   {
-    dap_write_word(NVMCTRL_ADDR, addr >> 1);
+    dap_write_word_req(NVMCTRL_ADDR, addr >> 1);
 
-    dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CMD_UR); // Unlock Region
-    while (0 == (dap_read_byte(NVMCTRL_INTFLAG) & NVMCTRL_INTFLAG_READY));
+    dap_write_half_req(NVMCTRL_CTRLA, NVMCTRL_CMD_UR); // Unlock Region
+    dap_wait_byte_req(NVMCTRL_INTFLAG, NVMCTRL_INTFLAG_READY, NVMCTRL_INTFLAG_READY);
 
-    dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CMD_ER); // Erase Row
-    while (0 == (dap_read_byte(NVMCTRL_INTFLAG) & NVMCTRL_INTFLAG_READY));
+    dap_write_half_req(NVMCTRL_CTRLA, NVMCTRL_CMD_ER); // Erase Row
+    dap_wait_byte_req(NVMCTRL_INTFLAG, NVMCTRL_INTFLAG_READY, NVMCTRL_INTFLAG_READY);
+    dap_transfer();
 
     dap_write_block(addr, &buf[offs], FLASH_ROW_SIZE);
+    target_checkpoint(offs, FLASH_ROW_SIZE);
 
     addr += FLASH_ROW_SIZE;
     offs += FLASH_ROW_SIZE;
@@ -361,12 +386,13 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  uint32_t size = target->options.file_size;
   int row = 0;
 
   bufb = buf_alloc(FLASH_ROW_SIZE);
@@ -402,15 +428,24 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
   int row = 0;
 
+  while (size && target_checkpoint_skip(addr, offs, FLASH_ROW_SIZE))
+  {
+    addr += FLASH_ROW_SIZE;
+    offs += FLASH_ROW_SIZE;
+    size -= FLASH_ROW_SIZE;
+  }
+
   while (size)
   {
     dap_read_block(addr, &buf[offs], FLASH_ROW_SIZE);
+    target_checkpoint(offs, FLASH_ROW_SIZE);
 
     addr += FLASH_ROW_SIZE;
     offs += FLASH_ROW_SIZE;
@@ -420,7 +455,7 @@ static void target_read(void)
       verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
@@ -442,7 +477,7 @@ static void target_fuse_write(int section, uint8_t *data)
   dap_write_word(NVMCTRL_CTRLB, 0);
   dap_write_word(NVMCTRL_ADDR, USER_ROW_ADDR >> 1);
   dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CMD_EAR);
-  while (0 == (dap_read_byte(NVMCTRL_INTFLAG) & NVMCTRL_INTFLAG_READY));
+  dap_wait_byte(NVMCTRL_INTFLAG, NVMCTRL_INTFLAG_READY, NVMCTRL_INTFLAG_READY);
 
   dap_write_block(USER_ROW_ADDR, data, USER_ROW_SIZE);
 }
@@ -11,6 +11,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define DHCSR                  0xe000edf0
@@ -63,6 +64,12 @@ typedef struct
   } plane[2];
 } device_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+} target_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static device_t devices[] =
 {
@@ -81,22 +88,26 @@ static device_t devices[] =
   { 0x28190561, "sam3u", "ATSAM3U1E", 0x400e0740, 1, {{ 0x400e0800, 0x80000,  64*1024 }} },
 };
 
-static device_t target_device;
-static target_options_t target_options;
-
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static uint32_t get_flash_addr(uint32_t addr)
 {
+  target_state_t *target = target_state();
   uint32_t offs = addr;
 
-  for (int i = 0; i < target_device.n_planes; i++)
+  for (int i = 0; i < target->device.n_planes; i++)
   {
-    if (offs >= target_device.plane[i].size)
-      offs -= target_device.plane[i].size;
+    if (offs >= target->device.plane[i].size)
+      offs -= target->device.plane[i].size;
     else
-      return target_device.plane[i].addr + offs;
+      return target->device.plane[i].addr + offs;
   }
 
   error_exit("internal error in get_flash_addr()");
@@ -107,15 +118,16 @@ static uint32_t get_flash_addr(uint32_t addr)
 //-----------------------------------------------------------------------------
 static uint32_t get_eefc_base(uint32_t addr)
 {
+  target_state_t *target = target_state();
   uint32_t flash_addr = get_flash_addr(addr);
 
-  for (int i = 0; i < target_device.n_planes; i++)
+  for (int i = 0; i < target->device.n_planes; i++)
   {
-    uint32_t a = target_device.plane[i].addr;
-    uint32_t s = target_device.plane[i].size;
+    uint32_t a = target->device.plane[i].addr;
+    uint32_t s = target->device.plane[i].size;
 
     if (a <= flash_addr && flash_addr < (a + s))
-      return target_device.plane[i].eefc_base;
+      return target->device.plane[i].eefc_base;
   }
 
   error_exit("internal error in get_eefc_base()");
@@ -126,13 +138,19 @@ static uint32_t get_eefc_base(uint32_t addr)
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
+  target = target_create_state(sizeof(target_state_t));
+
+  dap_set_tar_wrap_size(4096);
+
   dap_reset_target_hw(1);
   dap_reset_link();
 
   // Stop the core
-  dap_write_word(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
-  dap_write_word(DEMCR, DEMCR_VC_CORERESET);
-  dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_write_word_req(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
+  dap_write_word_req(DEMCR, DEMCR_VC_CORERESET);
+  dap_write_word_req(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_transfer();
 
   for (int i = 0; i < ARRAY_SIZE(devices); i++)
   {
@@ -153,7 +171,7 @@ static void target_select(target_options_t *options)
       uint32_t eefc_base = devices[i].plane[i].eefc_base;
 
       dap_write_word(EEFC_FCR(eefc_base), CMD_GETD);
-      while (0 == (dap_read_word(EEFC_FSR(eefc_base)) & FSR_FRDY));
+      dap_wait_word(EEFC_FSR(eefc_base), FSR_FRDY, FSR_FRDY);
 
       fl_id = dap_read_word(EEFC_FRR(eefc_base));
       check(fl_id, "Cannot read flash descriptor, check Erase pin state");
@@ -175,10 +193,10 @@ static void target_select(target_options_t *options)
       flash_size += fl_size;
     }
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
-    target_check_options(&target_options, flash_size, FLASH_PAGE_SIZE);
+    target_check_options(&target->options, flash_size, FLASH_PAGE_SIZE);
 
     return;
   }
@@ -189,48 +207,62 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(DEMCR, 0);
   dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
 
-  target_free_options(&target_options);
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_erase(void)
 {
-  for (int i = 0; i < target_device.n_planes; i++)
-    dap_write_word(EEFC_FCR(target_device.plane[i].eefc_base), CMD_EA);
+  target_state_t *target = target_state();
+
+  for (int i = 0; i < target->device.n_planes; i++)
+    dap_write_word(EEFC_FCR(target->device.plane[i].eefc_base), CMD_EA);
 
-  for (int i = 0; i < target_device.n_planes; i++)
-    while (0 == (dap_read_word(EEFC_FSR(target_device.plane[i].eefc_base)) & FSR_FRDY));
+  for (int i = 0; i < target->device.n_planes; i++)
+    dap_wait_word(EEFC_FSR(target->device.plane[i].eefc_base), FSR_FRDY, FSR_FRDY);
 }
 
 //-----------------------------------------------------------------------------
 static void target_lock(void)
 {
-  for (int i = 0; i < target_device.n_planes; i++)
-    dap_write_word(EEFC_FCR(target_device.plane[i].eefc_base), CMD_SGPB | (0 << 8));
+  target_state_t *target = target_state();
+
+  for (int i = 0; i < target->device.n_planes; i++)
+    dap_write_word(EEFC_FCR(target->device.plane[i].eefc_base), CMD_SGPB | (0 << 8));
 }
 
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = target->options.offset;
   uint32_t number_of_pages, eefc_base;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   number_of_pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
 
-  for (uint32_t page = 0; page < number_of_pages; page++)
+  while (offs < size && target_checkpoint_skip(get_flash_addr(addr), offs, FLASH_PAGE_SIZE))
+  {
+    addr += FLASH_PAGE_SIZE;
+    offs += FLASH_PAGE_SIZE;
+  }
+
+  for (uint32_t page = offs / FLASH_PAGE_SIZE; page < number_of_pages; page++)
   {
     eefc_base = get_eefc_base(addr);
 
     dap_write_block(get_flash_addr(addr), &buf[offs], FLASH_PAGE_SIZE);
 
     dap_write_word(EEFC_FCR(eefc_base), CMD_EWP | (page << 8));
-    while (0 == (dap_read_word(EEFC_FSR(eefc_base)) & FSR_FRDY));
+    dap_wait_word(EEFC_FSR(eefc_base), FSR_FRDY, FSR_FRDY);
+    target_checkpoint(offs, FLASH_PAGE_SIZE);
 
     addr += FLASH_PAGE_SIZE;
     offs += FLASH_PAGE_SIZE;
@@ -242,12 +274,13 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = target->options.offset;
   uint32_t block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   bufb = buf_alloc(FLASH_PAGE_SIZE);
 
@@ -281,14 +314,23 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
+
+  while (size && target_checkpoint_skip(get_flash_addr(addr), offs, FLASH_PAGE_SIZE))
+  {
+    addr += FLASH_PAGE_SIZE;
+    offs += FLASH_PAGE_SIZE;
+    size -= FLASH_PAGE_SIZE;
+  }
 
   while (size)
   {
     dap_read_block(get_flash_addr(addr), &buf[offs], FLASH_PAGE_SIZE);
+    target_checkpoint(offs, FLASH_PAGE_SIZE);
 
     addr += FLASH_PAGE_SIZE;
     offs += FLASH_PAGE_SIZE;
@@ -297,7 +339,7 @@ static void target_read(void)
     verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
@@ -309,7 +351,7 @@ static int target_fuse_read(int section, uint8_t *data)
     return 0;
 
   dap_write_word(EEFC_FCR(get_eefc_base(0)), CMD_GGPB);
-  while (0 == (dap_read_word(EEFC_FSR(get_eefc_base(0))) & FSR_FRDY));
+  dap_wait_word(EEFC_FSR(get_eefc_base(0)), FSR_FRDY, FSR_FRDY);
   gpnvm = dap_read_word(EEFC_FRR(get_eefc_base(0)));
 
   data[0] = gpnvm;
@@ -9,6 +9,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_START            0x00400000
@@ -62,6 +63,12 @@ typedef struct
   uint32_t  flash_size;
 } device_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+} target_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static device_t devices[] =
 {
@@ -122,23 +129,32 @@ static device_t devices[] =
   { 0x295b0ae0, 0x00000000, "sam4n",  "SAM4N8C (Rev A)",     1,  512*1024 },
 };
 
-static device_t target_device;
-static target_options_t target_options;
-
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
   uint32_t chip_id, chip_exid;
 
+  target = target_create_state(sizeof(target_state_t));
+
+  dap_set_tar_wrap_size(4096);
+
   dap_reset_target_hw(1);
   dap_reset_link();
 
   // Stop the core
-  dap_write_word(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
-  dap_write_word(DEMCR, DEMCR_VC_CORERESET);
-  dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_write_word_req(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
+  dap_write_word_req(DEMCR, DEMCR_VC_CORERESET);
+  dap_write_word_req(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_transfer();
 
   chip_id = dap_read_word(CHIPID_CIDR);
   chip_exid = dap_read_word(CHIPID_EXID);
@@ -155,7 +171,7 @@ static void target_select(target_options_t *options)
     for (int plane = 0; plane < devices[i].n_planes; plane++)
     {
       dap_write_word(EEFC_FCR(plane), CMD_GETD);
-      while (0 == (dap_read_word(EEFC_FSR(plane)) & FSR_FRDY));
+      dap_wait_word(EEFC_FSR(plane), FSR_FRDY, FSR_FRDY);
 
       fl_id = dap_read_word(EEFC_FRR(plane));
       check(fl_id, "Cannot read flash descriptor, check Erase pin state");
@@ -175,10 +191,10 @@ static void target_select(target_options_t *options)
         dap_read_word(EEFC_FRR(plane));
     }
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
-    target_check_options(&target_options, devices[i].flash_size * target_device.n_planes,
+    target_check_options(&target->options, devices[i].flash_size * target->device.n_planes,
         FLASH_PAGE_SIZE * PAGES_IN_ERASE_BLOCK);
 
     return;
@@ -190,20 +206,24 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(DEMCR, 0);
   dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
 
-  target_free_options(&target_options);
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_erase(void)
 {
-  for (int plane = 0; plane < target_device.n_planes; plane++)
+  target_state_t *target = target_state();
+
+  for (int plane = 0; plane < target->device.n_planes; plane++)
     dap_write_word(EEFC_FCR(plane), CMD_EA);
 
-  for (int plane = 0; plane < target_device.n_planes; plane++)
-    while (0 == (dap_read_word(EEFC_FSR(plane)) & FSR_FRDY));
+  for (int plane = 0; plane < target->device.n_planes; plane++)
+    dap_wait_word(EEFC_FSR(plane), FSR_FRDY, FSR_FRDY);
 }
 
 //-----------------------------------------------------------------------------
@@ -216,37 +236,53 @@ static void target_lock(void)
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = FLASH_START + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_START + target->options.offset;
   uint32_t number_of_pages, plane, page_offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   number_of_pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
-  page_offset = target_options.offset / FLASH_PAGE_SIZE;
+  page_offset = target->options.offset / FLASH_PAGE_SIZE;
 
-  for (uint32_t page = 0; page < number_of_pages; page += PAGES_IN_ERASE_BLOCK)
+  while (offs < size && target_checkpoint_skip(addr, offs, FLASH_PAGE_SIZE))
+    offs += FLASH_PAGE_SIZE;
+
+  // The page after the confirmed ones may be partly written, pages are written without
+  // an erase, so the whole erase block is erased and programmed again
+  if (offs < size)
   {
-    plane = (page + page_offset) / (target_device.flash_size / FLASH_PAGE_SIZE);
+    offs -= offs % (FLASH_PAGE_SIZE * PAGES_IN_ERASE_BLOCK);
+    target_checkpoint_rewind(offs);
+  }
+
+  addr += offs;
+
+  for (uint32_t page = offs / FLASH_PAGE_SIZE; page < number_of_pages; page += PAGES_IN_ERASE_BLOCK)
+  {
+    plane = (page + page_offset) / (target->device.flash_size / FLASH_PAGE_SIZE);
 
     dap_write_word(EEFC_FCR(plane), CMD_EPA | (((page_offset + page) | 2) << 8));
-    while (0 == (dap_read_word(EEFC_FSR(plane)) & FSR_FRDY));
+    dap_wait_word(EEFC_FSR(plane), FSR_FRDY, FSR_FRDY);
 
     verbose(".");
   }
 
   verbose(",");
 
-  for (uint32_t page = 0; page < number_of_pages; page++)
+  for (uint32_t page = offs / FLASH_PAGE_SIZE; page < number_of_pages; page++)
   {
     dap_write_block(addr, &buf[offs], FLASH_PAGE_SIZE);
-    addr += FLASH_PAGE_SIZE;
-    offs += FLASH_PAGE_SIZE;
 
-    plane = (page + page_offset) / (target_device.flash_size / FLASH_PAGE_SIZE);
+    plane = (page + page_offset) / (target->device.flash_size / FLASH_PAGE_SIZE);
 
     dap_write_word(EEFC_FCR(plane), CMD_WP | ((page + page_offset) << 8));
-    while (0 == (dap_read_word(EEFC_FSR(plane)) & FSR_FRDY));
+    dap_wait_word(EEFC_FSR(plane), FSR_FRDY, FSR_FRDY);
+    target_checkpoint(offs, FLASH_PAGE_SIZE);
+
+    addr += FLASH_PAGE_SIZE;
+    offs += FLASH_PAGE_SIZE;
 
     verbose(".");
   }
@@ -255,12 +291,13 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = FLASH_START + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_START + target->options.offset;
   uint32_t block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   bufb = buf_alloc(FLASH_PAGE_SIZE);
 
@@ -294,14 +331,23 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_START + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_START + target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
+
+  while (size && target_checkpoint_skip(addr, offs, FLASH_PAGE_SIZE))
+  {
+    addr += FLASH_PAGE_SIZE;
+    offs += FLASH_PAGE_SIZE;
+    size -= FLASH_PAGE_SIZE;
+  }
 
   while (size)
   {
     dap_read_block(addr, &buf[offs], FLASH_PAGE_SIZE);
+    target_checkpoint(offs, FLASH_PAGE_SIZE);
 
     addr += FLASH_PAGE_SIZE;
     offs += FLASH_PAGE_SIZE;
@@ -310,29 +356,31 @@ static void target_read(void)
     verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
 static int target_fuse_read(int section, uint8_t *data)
 {
+  target_state_t *target = target_state();
+
   if (0 == section)
   {
     dap_write_word(EEFC_FCR(0), CMD_GGPB);
-    while (0 == (dap_read_word(EEFC_FSR(0)) & FSR_FRDY));
+    dap_wait_word(EEFC_FSR(0), FSR_FRDY, FSR_FRDY);
     data[0] = dap_read_word(EEFC_FRR(0));
     return GPNVM_SIZE;
   }
   else if (1 == section)
   {
-    int size = target_device.flash_size / LOCK_REGION_SIZE;
+    int size = target->device.flash_size / LOCK_REGION_SIZE;
 
-    for (int plane = 0; plane < target_device.n_planes; plane++)
+    for (int plane = 0; plane < target->device.n_planes; plane++)
     {
       uint32_t value = 0;
 
       dap_write_word(EEFC_FCR(plane), CMD_GLB);
-      while (0 == (dap_read_word(EEFC_FSR(plane)) & FSR_FRDY));
+      dap_wait_word(EEFC_FSR(plane), FSR_FRDY, FSR_FRDY);
 
       for (int i = 0; i < size; i++)
       {
@@ -349,7 +397,7 @@ static int target_fuse_read(int section, uint8_t *data)
       }
     }
 
-    return (size * target_device.n_planes) / BITS_IN_BYTE;
+    return (size * target->device.n_planes) / BITS_IN_BYTE;
   }
 
   return 0;
@@ -358,6 +406,8 @@ static int target_fuse_read(int section, uint8_t *data)
 //-----------------------------------------------------------------------------
 static void target_fuse_write(int section, uint8_t *data)
 {
+  target_state_t *target = target_state();
+
   if (0 == section)
   {
     for (int i = 0; i < (GPNVM_SIZE * BITS_IN_BYTE); i++)
@@ -367,14 +417,14 @@ static void target_fuse_write(int section, uint8_t *data)
       else
         dap_write_word(EEFC_FCR(0), CMD_CGPB | (i << 8));
 
-      while (0 == (dap_read_word(EEFC_FSR(0)) & FSR_FRDY));
+      dap_wait_word(EEFC_FSR(0), FSR_FRDY, FSR_FRDY);
     }
   }
   else if (1 == section)
   {
-    int size = target_device.flash_size / LOCK_REGION_SIZE;
+    int size = target->device.flash_size / LOCK_REGION_SIZE;
 
-    for (int plane = 0; plane < target_device.n_planes; plane++)
+    for (int plane = 0; plane < target->device.n_planes; plane++)
     {
       for (int i = 0; i < size; i++)
       {
@@ -386,7 +436,7 @@ static void target_fuse_write(int section, uint8_t *data)
         else
           dap_write_word(EEFC_FCR(plane), CMD_CLB | (page << 8));
 
-        while (0 == (dap_read_word(EEFC_FSR(plane)) & FSR_FRDY));
+        dap_wait_word(EEFC_FSR(plane), FSR_FRDY, FSR_FRDY);
       }
     }
   }
@@ -428,4 +478,3 @@ target_ops_t target_atmel_cm4_ops =
   .help      = target_help,
 };
 
-
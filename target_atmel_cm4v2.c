@@ -9,6 +9,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_ADDR             0
@@ -79,6 +80,12 @@ typedef struct
   uint32_t  flash_size;
 } device_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+} target_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static device_t devices[] =
 {
@@ -107,16 +114,19 @@ static device_t devices[] =
   { 0x61840002, "same54", "SAM E54N20A",     1*1024*1024 },
 };
 
-static device_t target_device;
-static target_options_t target_options;
-
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static void reset_with_extension(void)
 {
   dap_reset_target_hw(0);
-  sleep_ms(10);
+  dap_delay(10000);
   dap_reset_link();
 }
 
@@ -124,9 +134,10 @@ static void reset_with_extension(void)
 static void finish_reset(void)
 {
   // Stop the core
-  dap_write_word(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
-  dap_write_word(DEMCR, DEMCR_VC_CORERESET);
-  dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_write_word_req(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
+  dap_write_word_req(DEMCR, DEMCR_VC_CORERESET);
+  dap_write_word_req(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_transfer();
 
   // Release the reset
   dap_write_byte(DSU_STATUSA, DSU_STATUSA_CRSTEXT);
@@ -135,9 +146,14 @@ static void finish_reset(void)
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
   uint32_t dsu_did, id, rev;
   bool locked;
 
+  target = target_create_state(sizeof(target_state_t));
+
+  dap_set_tar_wrap_size(4096);
+
   reset_with_extension();
 
   dsu_did = dap_read_word(DSU_DID);
@@ -151,10 +167,10 @@ static void target_select(target_options_t *options)
 
     verbose("Target: %s (Rev %c)\n", devices[i].name, 'A' + rev);
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
-    target_check_options(&target_options, devices[i].flash_size, FLASH_ROW_SIZE);
+    target_check_options(&target->options, devices[i].flash_size, FLASH_ROW_SIZE);
 
     locked = dap_read_byte(DSU_STATUSB) & DSU_STATUSB_PROT;
 
@@ -173,17 +189,19 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(DEMCR, 0);
   dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
-  target_free_options(&target_options);
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_erase(void)
 {
   dap_write_byte(DSU_CTRL, DSU_CTRL_CE); // Chip erase
-  sleep_ms(100);
-  while (0 == (dap_read_byte(DSU_STATUSA) & DSU_STATUSA_DONE));
+  dap_delay(100000);
+  dap_wait_byte(DSU_STATUSA, DSU_STATUSA_DONE, DSU_STATUSA_DONE);
 
   reset_with_extension();
   finish_reset();
@@ -198,43 +216,52 @@ static void target_lock(void)
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
   uint32_t number_of_rows;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CTRLA_AUTOWS | NVMCTRL_CTRLA_WMODE_MAN |
       NVMCTRL_CTRLA_PRM_MANUAL | NVMCTRL_CTRLA_CACHEDIS0 | NVMCTRL_CTRLA_CACHEDIS1);
 
   number_of_rows = (size + FLASH_ROW_SIZE - 1) / FLASH_ROW_SIZE;
 
-  for (uint32_t row = 0; row < number_of_rows; row++)
+  while (offs < size && target_checkpoint_skip(addr, offs, FLASH_ROW_SIZE))
+  {
+    addr += FLASH_ROW_SIZE;
+    offs += FLASH_ROW_SIZE;
+  }
+
+  for (uint32_t row = offs / FLASH_ROW_SIZE; row < number_of_rows; row++)
   {
     dap_write_word(NVMCTRL_ADDR, addr);
 
     dap_write_half(NVMCTRL_CTRLB, NVMCTRL_CMD_UR); // Unlock Region
-    while (0 == (dap_read_half(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+    dap_wait_half(NVMCTRL_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY);
 
     dap_write_half(NVMCTRL_CTRLB, NVMCTRL_CMD_EB);
-    while (0 == (dap_read_half(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+    dap_wait_half(NVMCTRL_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY);
 
     for (int page = 0; page < PAGES_IN_ERASE_BLOCK; page++)
     {
       dap_write_word(NVMCTRL_ADDR, addr);
 
       dap_write_half(NVMCTRL_CTRLB, NVMCTRL_CMD_PBC);
-      while (0 == (dap_read_half(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+      dap_wait_half(NVMCTRL_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY);
 
       dap_write_block(addr, &buf[offs], FLASH_PAGE_SIZE);
 
       dap_write_half(NVMCTRL_CTRLB, NVMCTRL_CMD_WP); // Write page
-      while (0 == (dap_read_half(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+      dap_wait_half(NVMCTRL_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY);
 
       addr += FLASH_PAGE_SIZE;
       offs += FLASH_PAGE_SIZE;
     }
 
+    target_checkpoint(offs - FLASH_ROW_SIZE, FLASH_ROW_SIZE);
+
     verbose(".");
   }
 }
@@ -242,12 +269,13 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   bufb = buf_alloc(FLASH_PAGE_SIZE);
 
@@ -281,14 +309,23 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
+
+  while (size && target_checkpoint_skip(addr, offs, FLASH_PAGE_SIZE))
+  {
+    addr += FLASH_PAGE_SIZE;
+    offs += FLASH_PAGE_SIZE;
+    size -= FLASH_PAGE_SIZE;
+  }
 
   while (size)
   {
     dap_read_block(addr, &buf[offs], FLASH_PAGE_SIZE);
+    target_checkpoint(offs, FLASH_PAGE_SIZE);
 
     addr += FLASH_PAGE_SIZE;
     offs += FLASH_PAGE_SIZE;
@@ -297,7 +334,7 @@ static void target_read(void)
     verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
@@ -321,10 +358,10 @@ static void target_fuse_write(int section, uint8_t *data)
   dap_write_word(NVMCTRL_ADDR, USER_ROW_ADDR);
 
   dap_write_half(NVMCTRL_CTRLB, NVMCTRL_CMD_EP);
-  while (0 == (dap_read_half(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+  dap_wait_half(NVMCTRL_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY);
 
   dap_write_half(NVMCTRL_CTRLB, NVMCTRL_CMD_PBC);
-  while (0 == (dap_read_half(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+  dap_wait_half(NVMCTRL_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY);
 
   for (int i = 0; i < (USER_ROW_SIZE / USER_ROW_PAGE_SIZE); i++)
   {
@@ -333,7 +370,7 @@ static void target_fuse_write(int section, uint8_t *data)
     dap_write_block(addr, data, USER_ROW_PAGE_SIZE);
 
     dap_write_half(NVMCTRL_CTRLB, NVMCTRL_CMD_WQW);
-    while (0 == (dap_read_half(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+    dap_wait_half(NVMCTRL_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY);
 
     addr += USER_ROW_PAGE_SIZE;
     data += USER_ROW_PAGE_SIZE;
@@ -9,6 +9,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_START            0x00400000
@@ -61,6 +62,12 @@ typedef struct
   uint32_t  flash_size;
 } device_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+} target_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static device_t devices[] =
 {
@@ -102,16 +109,24 @@ static device_t devices[] =
   { 0xa1220e00, 0x00000000, "samv71", "SAM V71J21", 2*1024*1024 },
 };
 
-static device_t target_device;
-static target_options_t target_options;
-
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
   uint32_t chip_id, chip_exid, id, rev;
 
+  target = target_create_state(sizeof(target_state_t));
+
+  dap_set_tar_wrap_size(4096);
+
   dap_reset_link();
 
   // Stop the core
@@ -137,7 +152,7 @@ static void target_select(target_options_t *options)
     verbose("Target: %s (Rev %c)\n", devices[i].name, 'A' + rev);
 
     dap_write_word(EEFC_FCR, CMD_GETD);
-    while (0 == (dap_read_word(EEFC_FSR) & FSR_FRDY));
+    dap_wait_word(EEFC_FSR, FSR_FRDY, FSR_FRDY);
 
     fl_id = dap_read_word(EEFC_FRR);
     check(fl_id, "Cannot read flash descriptor, check Erase pin state");
@@ -156,10 +171,10 @@ static void target_select(target_options_t *options)
     for (uint32_t i = 0; i < fl_nb_lock; i++)
       dap_read_word(EEFC_FRR);
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
-    target_check_options(&target_options, devices[i].flash_size,
+    target_check_options(&target->options, devices[i].flash_size,
         FLASH_PAGE_SIZE * PAGES_IN_ERASE_BLOCK);
 
     return;
@@ -171,18 +186,20 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(DHCSR, DHCSR_DBGKEY);
   dap_write_word(DEMCR, 0);
   dap_reset_target_hw(1);
 
-  target_free_options(&target_options);
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_erase(void)
 {
   dap_write_word(EEFC_FCR, CMD_EA);
-  while (0 == (dap_read_word(EEFC_FSR) & FSR_FRDY));
+  dap_wait_word(EEFC_FSR, FSR_FRDY, FSR_FRDY);
 }
 
 //-----------------------------------------------------------------------------
@@ -194,33 +211,49 @@ static void target_lock(void)
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = FLASH_START + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_START + target->options.offset;
   uint32_t number_of_pages, page_offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   number_of_pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
-  page_offset = target_options.offset / FLASH_PAGE_SIZE;
+  page_offset = target->options.offset / FLASH_PAGE_SIZE;
+
+  while (offs < size && target_checkpoint_skip(addr, offs, FLASH_PAGE_SIZE))
+    offs += FLASH_PAGE_SIZE;
+
+  // The page after the confirmed ones may be partly written, pages are written without
+  // an erase, so the whole erase block is erased and programmed again
+  if (offs < size)
+  {
+    offs -= offs % (FLASH_PAGE_SIZE * PAGES_IN_ERASE_BLOCK);
+    target_checkpoint_rewind(offs);
+  }
 
-  for (uint32_t page = 0; page < number_of_pages; page += PAGES_IN_ERASE_BLOCK)
+  addr += offs;
+
+  for (uint32_t page = offs / FLASH_PAGE_SIZE; page < number_of_pages; page += PAGES_IN_ERASE_BLOCK)
   {
     dap_write_word(EEFC_FCR, CMD_EPA | (((page_offset + page) | 2) << 8));
-    while (0 == (dap_read_word(EEFC_FSR) & FSR_FRDY));
+    dap_wait_word(EEFC_FSR, FSR_FRDY, FSR_FRDY);
 
     verbose(".");
   }
 
   verbose(",");
 
-  for (uint32_t page = 0; page < number_of_pages; page++)
+  for (uint32_t page = offs / FLASH_PAGE_SIZE; page < number_of_pages; page++)
   {
     dap_write_block(addr, &buf[offs], FLASH_PAGE_SIZE);
-    addr += FLASH_PAGE_SIZE;
-    offs += FLASH_PAGE_SIZE;
 
     dap_write_word(EEFC_FCR, CMD_WP | ((page + page_offset) << 8));
-    while (0 == (dap_read_word(EEFC_FSR) & FSR_FRDY));
+    dap_wait_word(EEFC_FSR, FSR_FRDY, FSR_FRDY);
+    target_checkpoint(offs, FLASH_PAGE_SIZE);
+
+    addr += FLASH_PAGE_SIZE;
+    offs += FLASH_PAGE_SIZE;
 
     verbose(".");
   }
@@ -229,12 +262,13 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = FLASH_START + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_START + target->options.offset;
   uint32_t block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   bufb = buf_alloc(FLASH_PAGE_SIZE);
 
@@ -268,14 +302,23 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_START + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_START + target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
+
+  while (size && target_checkpoint_skip(addr, offs, FLASH_PAGE_SIZE))
+  {
+    addr += FLASH_PAGE_SIZE;
+    offs += FLASH_PAGE_SIZE;
+    size -= FLASH_PAGE_SIZE;
+  }
 
   while (size)
   {
     dap_read_block(addr, &buf[offs], FLASH_PAGE_SIZE);
+    target_checkpoint(offs, FLASH_PAGE_SIZE);
 
     addr += FLASH_PAGE_SIZE;
     offs += FLASH_PAGE_SIZE;
@@ -284,7 +327,7 @@ static void target_read(void)
     verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
@@ -296,7 +339,7 @@ static int target_fuse_read(int section, uint8_t *data)
     return 0;
 
   dap_write_word(EEFC_FCR, CMD_GGPB);
-  while (0 == (dap_read_word(EEFC_FSR) & FSR_FRDY));
+  dap_wait_word(EEFC_FSR, FSR_FRDY, FSR_FRDY);
   gpnvm = dap_read_word(EEFC_FRR);
 
   data[0] = gpnvm;
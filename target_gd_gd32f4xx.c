@@ -10,6 +10,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_ADDR             0x08000000
@@ -104,6 +105,12 @@ typedef struct
   char         *name;
 } device_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+} target_state_t;
+
 /*- Constants ---------------------------------------------------------------*/
 static const device_t devices[] =
 {
@@ -124,20 +131,24 @@ static const int flash_sector_index[FLASH_SECTOR_COUNT] =
   12, 13, 14, 15
 };
 
-/*- Variables ---------------------------------------------------------------*/
-static device_t target_device;
-static target_options_t target_options;
-
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static void flash_wait_done(void)
 {
   uint32_t stat;
 
-  while (dap_read_word(FMC_STAT) & FMC_STAT_BUSY);
+  dap_wait_word_req(FMC_STAT, FMC_STAT_BUSY, 0);
+  dap_read_word_req(FMC_STAT);
+  dap_transfer();
 
-  stat = dap_read_word(FMC_STAT);
+  stat = dap_get_response(1);
 
   if (stat & FMC_STAT_ALL_ERRORS)
     error_exit("flash operation failed. FMC_STAT = 0x%08x", stat);
@@ -146,14 +157,20 @@ static void flash_wait_done(void)
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
   uint32_t idcode, flash_size;
   bool locked, ctl_lk, ob_lk;
 
+  target = target_create_state(sizeof(target_state_t));
+
+  dap_set_tar_wrap_size(4096);
+
   dap_reset_pin(0);
   dap_reset_link();
-  dap_write_word(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
-  dap_write_word(DEMCR, DEMCR_VC_CORERESET);
-  dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_write_word_req(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
+  dap_write_word_req(DEMCR, DEMCR_VC_CORERESET);
+  dap_write_word_req(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_transfer();
   dap_reset_pin(1);
 
   idcode = dap_read_word(DBG_ID);
@@ -165,8 +182,8 @@ static void target_select(target_options_t *options)
 
     verbose("Target: %s\n", devices[i].name);
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
     locked = (0xaa != dap_read_byte(OPTIONS_SPC));
 
@@ -175,7 +192,8 @@ static void target_select(target_options_t *options)
 
     flash_size = (dap_read_word(FLASH_SRAM_SIZE_REG) >> FLASH_SIZE_REG_OFFS) * FLASH_SIZE_REG_MULT;
 
-    target_check_options(&target_options, flash_size, FLASH_ALIGN_SIZE);
+    target_check_options(&target->options, flash_size, FLASH_ALIGN_SIZE);
+    target_set_erase_sectors(flash_sector_size, FLASH_SECTOR_COUNT, 1024);
 
     dap_write_word(FMC_KEY, FMC_KEY_KEY1);
     dap_write_word(FMC_KEY, FMC_KEY_KEY2);
@@ -196,10 +214,12 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(DEMCR, 0);
   dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
 
-  target_free_options(&target_options);
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
@@ -242,10 +262,11 @@ static void target_unlock(void)
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.file_size;
   int start_sector, end_sector;
   int sector_offset = 0;
 
@@ -254,7 +275,7 @@ static void target_program(void)
   for (start_sector = 0; start_sector < FLASH_SECTOR_COUNT; start_sector++)
   {
     int sector_end = sector_offset + flash_sector_size[start_sector] * 1024;
-    int start = target_options.offset;
+    int start = target->options.offset;
 
     if (sector_offset <= start && start < sector_end)
       break;
@@ -265,7 +286,7 @@ static void target_program(void)
   for (end_sector = start_sector; end_sector < FLASH_SECTOR_COUNT; end_sector++)
   {
     int sector_end = sector_offset + flash_sector_size[end_sector] * 1024;
-    int end = target_options.offset + size;
+    int end = target->options.offset + size;
 
     if (sector_offset <= end && end <= sector_end)
       break;
@@ -310,12 +331,13 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   bufb = buf_alloc(FLASH_ALIGN_SIZE);
 
@@ -350,16 +372,25 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
 
   size = round_up(size, FLASH_ALIGN_SIZE);
 
+  while (size && target_checkpoint_skip(addr, offs, FLASH_ALIGN_SIZE))
+  {
+    addr += FLASH_ALIGN_SIZE;
+    offs += FLASH_ALIGN_SIZE;
+    size -= FLASH_ALIGN_SIZE;
+  }
+
   while (size)
   {
     dap_read_block(addr, &buf[offs], FLASH_ALIGN_SIZE);
+    target_checkpoint(offs, FLASH_ALIGN_SIZE);
 
     addr += FLASH_ALIGN_SIZE;
     offs += FLASH_ALIGN_SIZE;
@@ -369,7 +400,7 @@ static void target_read(void)
       verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
@@ -9,6 +9,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 enum
@@ -81,6 +82,12 @@ typedef struct
   uint64_t  feature;
 } jed_file_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+} target_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static device_t devices[] =
 {
@@ -89,18 +96,23 @@ static device_t devices[] =
   { 0x012bb043, "lcmxo2", "LCMXO2-2000HC" },
 };
 
-static device_t target_device;
-static target_options_t target_options;
-
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static bool bitstream_valid(uint8_t *data, int size)
 {
+  target_state_t *target = target_state();
+
   if (size < 1024)
     return false;
 
-  if (NULL == mem_find(data, 1024, (uint8_t *)target_device.name, strlen(target_device.name)))
+  if (NULL == mem_find(data, 1024, (uint8_t *)target->device.name, strlen(target->device.name)))
     return false;
 
   return true;
@@ -192,9 +204,12 @@ static void parse_jed_file(jed_file_t *file, uint8_t *data, int size)
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
   uint32_t chain[MAX_CHAIN_COUNT];
   int chain_count;
 
+  target = target_create_state(sizeof(target_state_t));
+
   dap_connect(DAP_INTERFACE_JTAG);
 
   chain_count = dap_jtag_scan_chain(chain, MAX_CHAIN_COUNT);
@@ -216,8 +231,8 @@ static void target_select(target_options_t *options)
 
     verbose("Target: %s\n", devices[i].name);
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
     return;
   }
@@ -316,12 +331,13 @@ static void target_unlock(void)
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
+  target_state_t *target = target_state();
   uint8_t *file_data;
   int file_size, row_count;
   jed_file_t jed;
 
   file_data = buf_alloc(MAX_FILE_SIZE);
-  file_size = load_file(target_options.name, file_data, MAX_FILE_SIZE);
+  file_size = load_file(target->options.name, file_data, MAX_FILE_SIZE);
 
   jed.config = buf_alloc(MAX_CONFIG_SIZE);
   jed.config_size = MAX_CONFIG_SIZE;
@@ -330,7 +346,7 @@ static void target_program(void)
 
   row_count = jed.config_size / FLASH_ROW_SIZE;
 
-  if (!target_options.erase)
+  if (!target->options.erase)
     target_erase();
   else
     erase_sram();
@@ -383,6 +399,7 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
+  target_state_t *target = target_state();
   uint8_t *file_data;
   int file_size, row_count;
   jed_file_t jed;
@@ -390,7 +407,7 @@ static void target_verify(void)
   uint64_t feature;
 
   file_data = buf_alloc(MAX_FILE_SIZE);
-  file_size = load_file(target_options.name, file_data, MAX_FILE_SIZE);
+  file_size = load_file(target->options.name, file_data, MAX_FILE_SIZE);
 
   jed.config = buf_alloc(MAX_CONFIG_SIZE);
   jed.config_size = MAX_CONFIG_SIZE;
@@ -498,4 +515,3 @@ target_ops_t target_lattice_lcmxo2_ops =
   .help      = target_help,
 };
 
-
@@ -11,6 +11,7 @@
 #include "utils.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_ADDR             0
@@ -101,6 +102,20 @@ typedef struct
   int       crc_offset;
 } device_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+
+  uint32_t         NVMCTRL_CTRLA;
+  uint32_t         NVMCTRL_CTRLB;
+  uint32_t         NVMCTRL_CTRLC;
+  uint32_t         NVMCTRL_STATUS;
+  uint32_t         NVMCTRL_ADDR;
+
+  bool             in_park_mode;
+} target_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static device_t devices[] =
 {
@@ -128,22 +143,19 @@ static device_t devices[] =
   { 0x20870002, "pic32cm_ls", "PIC32CM5164LS60048", 512*1024, true,  32 },
 };
 
-static device_t target_device;
-static target_options_t target_options;
-
-static uint32_t NVMCTRL_CTRLA;
-static uint32_t NVMCTRL_CTRLB;
-static uint32_t NVMCTRL_CTRLC;
-static uint32_t NVMCTRL_STATUS;
-static uint32_t NVMCTRL_ADDR;
-
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static void reset_with_extension(void)
 {
   dap_reset_target_hw(0);
-  sleep_ms(10);
+  dap_delay(10000);
   dap_reset_link();
   dap_write_byte(DSU_STATUSA, DSU_STATUSA_CRSTEXT);
 }
@@ -152,14 +164,14 @@ static void reset_with_extension(void)
 static void bootrom_data(uint32_t data)
 {
   dap_write_word(DSU_BCC0, data);
-  while (dap_read_byte(DSU_STATUSB) & DSU_STATUSB_BCCD0);
+  dap_wait_byte(DSU_STATUSB, DSU_STATUSB_BCCD0, 0);
 }
 
 //-----------------------------------------------------------------------------
 static void bootrom_command(int cmd)
 {
   dap_write_word(DSU_BCC0, CMD_PREFIX | cmd);
-  while (dap_read_byte(DSU_STATUSB) & DSU_STATUSB_BCCD0);
+  dap_wait_byte(DSU_STATUSB, DSU_STATUSB_BCCD0, 0);
 }
 
 //-----------------------------------------------------------------------------
@@ -193,10 +205,10 @@ static int bootrom_expect(int status)
 //-----------------------------------------------------------------------------
 static void bootrom_park(void)
 {
-  static bool in_park_mode = false;
+  target_state_t *target = target_state();
   int response;
 
-  if (!in_park_mode)
+  if (!target->in_park_mode)
   {
     reset_with_extension();
 
@@ -209,15 +221,18 @@ static void bootrom_park(void)
           response, SIG_BOOTOK);
     }
 
-    in_park_mode = true;
+    target->in_park_mode = true;
   }
 }
 
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
   uint32_t dsu_did, id, rev;
 
+  target = target_create_state(sizeof(target_state_t));
+
   reset_with_extension();
 
   dsu_did = dap_read_word(DSU_DID);
@@ -231,27 +246,27 @@ static void target_select(target_options_t *options)
 
     verbose("Target: %s (Rev %c)\n", devices[i].name, 'A' + rev);
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
-    if (target_device.trust_zone)
+    if (target->device.trust_zone)
     {
-      NVMCTRL_CTRLA  = NVMCTRL_NSEC_CTRLA + NVMCTRL_SEC_OFFSET;
-      NVMCTRL_CTRLB  = NVMCTRL_NSEC_CTRLB + NVMCTRL_SEC_OFFSET;
-      NVMCTRL_CTRLC  = NVMCTRL_NSEC_CTRLC + NVMCTRL_SEC_OFFSET;
-      NVMCTRL_STATUS = NVMCTRL_NSEC_STATUS + NVMCTRL_SEC_OFFSET;
-      NVMCTRL_ADDR   = NVMCTRL_NSEC_ADDR + NVMCTRL_SEC_OFFSET;
+      target->NVMCTRL_CTRLA  = NVMCTRL_NSEC_CTRLA + NVMCTRL_SEC_OFFSET;
+      target->NVMCTRL_CTRLB  = NVMCTRL_NSEC_CTRLB + NVMCTRL_SEC_OFFSET;
+      target->NVMCTRL_CTRLC  = NVMCTRL_NSEC_CTRLC + NVMCTRL_SEC_OFFSET;
+      target->NVMCTRL_STATUS = NVMCTRL_NSEC_STATUS + NVMCTRL_SEC_OFFSET;
+      target->NVMCTRL_ADDR   = NVMCTRL_NSEC_ADDR + NVMCTRL_SEC_OFFSET;
     }
     else
     {
-      NVMCTRL_CTRLA  = NVMCTRL_NSEC_CTRLA;
-      NVMCTRL_CTRLB  = NVMCTRL_NSEC_CTRLB;
-      NVMCTRL_CTRLC  = NVMCTRL_NSEC_CTRLC;
-      NVMCTRL_STATUS = NVMCTRL_NSEC_STATUS;
-      NVMCTRL_ADDR   = NVMCTRL_NSEC_ADDR;
+      target->NVMCTRL_CTRLA  = NVMCTRL_NSEC_CTRLA;
+      target->NVMCTRL_CTRLB  = NVMCTRL_NSEC_CTRLB;
+      target->NVMCTRL_CTRLC  = NVMCTRL_NSEC_CTRLC;
+      target->NVMCTRL_STATUS = NVMCTRL_NSEC_STATUS;
+      target->NVMCTRL_ADDR   = NVMCTRL_NSEC_ADDR;
     }
 
-    target_check_options(&target_options, target_device.flash_size, FLASH_ROW_SIZE);
+    target_check_options(&target->options, target->device.flash_size, FLASH_ROW_SIZE);
 
     return;
   }
@@ -262,15 +277,19 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
-  target_free_options(&target_options);
+  target_state_t *target = target_state();
+
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_erase(void)
 {
+  target_state_t *target = target_state();
+
   reset_with_extension();
 
-  sleep_ms(10);
+  dap_delay(10000);
 
   if (dap_read_byte(DSU_STATUSB) & DSU_STATUSB_BCCD1)
   {
@@ -283,7 +302,7 @@ static void target_erase(void)
     bootrom_expect(SIG_COMM);
   }
 
-  if (target_device.trust_zone)
+  if (target->device.trust_zone)
   {
     bootrom_command(CMD_CE2);
     bootrom_expect(SIG_CMD_VALID);
@@ -306,20 +325,23 @@ static void target_erase(void)
 //-----------------------------------------------------------------------------
 static void target_lock(void)
 {
+  target_state_t *target = target_state();
+
   bootrom_park();
 
-  dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CMD_SDAL0);
-  while (0 == (dap_read_byte(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+  dap_write_half(target->NVMCTRL_CTRLA, NVMCTRL_CMD_SDAL0);
+  dap_wait_byte(target->NVMCTRL_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY);
 }
 
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
   uint32_t number_of_rows;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   bootrom_park();
 
@@ -328,16 +350,23 @@ static void target_program(void)
 
   number_of_rows = (size + FLASH_ROW_SIZE - 1) / FLASH_ROW_SIZE;
 
-  dap_write_byte(NVMCTRL_CTRLC, 0); // Enable automatic write
+  while (offs < size && target_checkpoint_skip(addr, offs, FLASH_ROW_SIZE))
+  {
+    addr += FLASH_ROW_SIZE;
+    offs += FLASH_ROW_SIZE;
+  }
+
+  dap_write_byte(target->NVMCTRL_CTRLC, 0); // Enable automatic write
 
-  for (uint32_t row = 0; row < number_of_rows; row++)
+  for (uint32_t row = offs / FLASH_ROW_SIZE; row < number_of_rows; row++)
   {
-    dap_write_word(NVMCTRL_ADDR, addr);
+    dap_write_word(target->NVMCTRL_ADDR, addr);
 
-    dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CMD_ER);
-    while (0 == (dap_read_byte(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+    dap_write_half(target->NVMCTRL_CTRLA, NVMCTRL_CMD_ER);
+    dap_wait_byte(target->NVMCTRL_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY);
 
     dap_write_block(addr, &buf[offs], FLASH_ROW_SIZE);
+    target_checkpoint(offs, FLASH_ROW_SIZE);
 
     addr += FLASH_ROW_SIZE;
     offs += FLASH_ROW_SIZE;
@@ -349,12 +378,13 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   bootrom_park();
 
@@ -393,19 +423,28 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
 
   bootrom_park();
 
   if ((dap_read_byte(DSU_STATUSB) & 0x03) != 0x02)
     error_exit("device is locked (DAL is not 2), unable to read");
 
+  while (size && target_checkpoint_skip(addr, offs, FLASH_ROW_SIZE))
+  {
+    addr += FLASH_ROW_SIZE;
+    offs += FLASH_ROW_SIZE;
+    size -= FLASH_ROW_SIZE;
+  }
+
   while (size)
   {
     dap_read_block(addr, &buf[offs], FLASH_ROW_SIZE);
+    target_checkpoint(offs, FLASH_ROW_SIZE);
 
     addr += FLASH_ROW_SIZE;
     offs += FLASH_ROW_SIZE;
@@ -414,7 +453,7 @@ static void target_read(void)
     verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
@@ -439,16 +478,17 @@ static int target_fuse_read(int section, uint8_t *data)
 //-----------------------------------------------------------------------------
 static void target_fuse_write(int section, uint8_t *data)
 {
+  target_state_t *target = target_state();
   uint32_t addr = 0;
 
   if (0 == section)
   {
-    uint32_t crc = crc32(&data[8], target_device.crc_offset-8);
+    uint32_t crc = crc32(&data[8], target->device.crc_offset-8);
 
-    data[target_device.crc_offset + 0] = crc;
-    data[target_device.crc_offset + 1] = crc >> 8;
-    data[target_device.crc_offset + 2] = crc >> 16;
-    data[target_device.crc_offset + 3] = crc >> 24;
+    data[target->device.crc_offset + 0] = crc;
+    data[target->device.crc_offset + 1] = crc >> 8;
+    data[target->device.crc_offset + 2] = crc >> 16;
+    data[target->device.crc_offset + 3] = crc >> 24;
 
     addr = USER_ROW_ADDR;
   }
@@ -478,10 +518,10 @@ static void target_fuse_write(int section, uint8_t *data)
 
   bootrom_park();
 
-  dap_write_byte(NVMCTRL_CTRLC, 0);
-  dap_write_word(NVMCTRL_ADDR, addr);
-  dap_write_half(NVMCTRL_CTRLA, NVMCTRL_CMD_ER);
-  while (0 == (dap_read_byte(NVMCTRL_STATUS) & NVMCTRL_STATUS_READY));
+  dap_write_byte(target->NVMCTRL_CTRLC, 0);
+  dap_write_word(target->NVMCTRL_ADDR, addr);
+  dap_write_half(target->NVMCTRL_CTRLA, NVMCTRL_CMD_ER);
+  dap_wait_byte(target->NVMCTRL_STATUS, NVMCTRL_STATUS_READY, NVMCTRL_STATUS_READY);
 
   dap_write_block(addr, data, FLASH_ROW_SIZE);
 }
@@ -521,4 +561,3 @@ target_ops_t target_mchp_cm23_ops =
   .help      = target_help,
 };
 
-
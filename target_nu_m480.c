@@ -10,6 +10,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_PAGE_SIZE        4096
@@ -99,31 +100,43 @@ typedef struct
   int       flash_size;
 } device_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+} target_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static device_t devices[] =
 {
   { 0x00d48410, "m480", "M484SIDAE", 512*1024 },
 };
 
-static device_t target_device;
-static target_options_t target_options;
-
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static void fmc_cmd(int cmd, int delay)
 {
   uint32_t sts;
 
-  dap_write_word(FMC_ISPCMD, cmd);
-  dap_write_word(FMC_ISPTRG, FMC_ISPTRG_ISPGO);
+  dap_write_word_req(FMC_ISPCMD, cmd);
+  dap_write_word_req(FMC_ISPTRG, FMC_ISPTRG_ISPGO);
+  dap_transfer();
 
   if (delay)
-    sleep_ms(delay);
+    dap_delay(delay * 1000);
 
-  while (dap_read_word(FMC_ISPTRG));
+  dap_wait_word_req(FMC_ISPTRG, 0xffffffff, 0);
+  dap_read_word_req(FMC_ISPSTS);
+  dap_transfer();
 
-  sts = dap_read_word(FMC_ISPSTS);
+  sts = dap_get_response(1);
   if (sts & FMC_ISPSTS_ISPFF)
     error_exit("flash error while executing command 0x%02x", cmd);
 }
@@ -131,42 +144,51 @@ static void fmc_cmd(int cmd, int delay)
 //-----------------------------------------------------------------------------
 static uint32_t fmc_read(uint32_t addr)
 {
-  dap_write_word(FMC_ISPCMD, FMC_ISPCMD_READ);
-  dap_write_word(FMC_ISPADDR, addr);
-  dap_write_word(FMC_ISPDAT, 0);
-  dap_write_word(FMC_ISPTRG, FMC_ISPTRG_ISPGO);
-  while (dap_read_word(FMC_ISPTRG));
-  return dap_read_word(FMC_ISPDAT);
+  dap_write_word_req(FMC_ISPCMD, FMC_ISPCMD_READ);
+  dap_write_word_req(FMC_ISPADDR, addr);
+  dap_write_word_req(FMC_ISPDAT, 0);
+  dap_write_word_req(FMC_ISPTRG, FMC_ISPTRG_ISPGO);
+  dap_wait_word_req(FMC_ISPTRG, 0xffffffff, 0);
+  dap_read_word_req(FMC_ISPDAT);
+  dap_transfer();
+  return dap_get_response(5);
 }
 
 //-----------------------------------------------------------------------------
 static void fmc_write(uint32_t addr, uint32_t data)
 {
-  dap_write_word(FMC_ISPCMD, FMC_ISPCMD_32B_PROG);
-  dap_write_word(FMC_ISPADDR, addr);
-  dap_write_word(FMC_ISPDAT, data);
-  dap_write_word(FMC_ISPTRG, FMC_ISPTRG_ISPGO);
-  while (dap_read_word(FMC_ISPTRG));
+  dap_write_word_req(FMC_ISPCMD, FMC_ISPCMD_32B_PROG);
+  dap_write_word_req(FMC_ISPADDR, addr);
+  dap_write_word_req(FMC_ISPDAT, data);
+  dap_write_word_req(FMC_ISPTRG, FMC_ISPTRG_ISPGO);
+  dap_wait_word_req(FMC_ISPTRG, 0xffffffff, 0);
+  dap_transfer();
 }
 
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
   uint32_t idcode;
   bool locked;
 
+  target = target_create_state(sizeof(target_state_t));
+
+  dap_set_tar_wrap_size(4096);
+
   dap_disconnect();
   dap_connect(DAP_INTERFACE_SWD);
   dap_reset_pin(0);
   dap_reset_link();
 
   // Stop the core
-  dap_write_word(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
-  dap_write_word(DEMCR, DEMCR_VC_CORERESET);
-  dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_write_word_req(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
+  dap_write_word_req(DEMCR, DEMCR_VC_CORERESET);
+  dap_write_word_req(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_transfer();
 
   dap_reset_pin(1);
-  sleep_ms(10);
+  dap_delay(10000);
 
   idcode = dap_read_word(SYS_PDID);
 
@@ -177,10 +199,10 @@ static void target_select(target_options_t *options)
 
     verbose("Target: %s\n", devices[i].name);
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
-    target_check_options(&target_options, devices[i].flash_size, FLASH_PAGE_SIZE);
+    target_check_options(&target->options, devices[i].flash_size, FLASH_PAGE_SIZE);
 
     dap_write_word(SYS_REGLCTL, 0x59);
     dap_write_word(SYS_REGLCTL, 0x16);
@@ -202,15 +224,19 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(DEMCR, 0);
   dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
 
-  target_free_options(&target_options);
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
 static void target_erase(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(FMC_ISPCTL, FMC_ISPCTL_ISPEN | FMC_ISPCTL_APUEN);
 
   // Bank 0
@@ -218,7 +244,7 @@ static void target_erase(void)
   fmc_cmd(FMC_ISPCMD_BANK_ERASE, BANK_ERASE_TIME);
 
   // Bank 1
-  dap_write_word(FMC_ISPADDR, target_device.flash_size / 2);
+  dap_write_word(FMC_ISPADDR, target->device.flash_size / 2);
   fmc_cmd(FMC_ISPCMD_BANK_ERASE, BANK_ERASE_TIME);
 }
 
@@ -244,18 +270,25 @@ static void target_unlock(void)
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = target->options.offset;
   uint32_t offs = 0;
   uint32_t start_page, number_of_pages;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
-  start_page = target_options.offset / FLASH_PAGE_SIZE;
+  start_page = target->options.offset / FLASH_PAGE_SIZE;
   number_of_pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
 
+  while (offs < size && target_checkpoint_skip(addr, offs, FLASH_PAGE_SIZE))
+  {
+    addr += FLASH_PAGE_SIZE;
+    offs += FLASH_PAGE_SIZE;
+  }
+
   dap_write_word(FMC_ISPCTL, FMC_ISPCTL_ISPEN | FMC_ISPCTL_APUEN);
 
-  for (uint32_t page = 0; page < number_of_pages; page++)
+  for (uint32_t page = offs / FLASH_PAGE_SIZE; page < number_of_pages; page++)
   {
     dap_write_word(FMC_ISPADDR, (start_page + page) * FLASH_PAGE_SIZE);
 
@@ -269,7 +302,7 @@ static void target_program(void)
 
   dap_write_word(FMC_ISPCMD, FMC_ISPCMD_64B_PROG);
 
-  for (uint32_t page = 0; page < number_of_pages; page++)
+  for (uint32_t page = offs / FLASH_PAGE_SIZE; page < number_of_pages; page++)
   {
     for (uint32_t i = 0; i < FLASH_PAGE_SIZE / sizeof(uint64_t); i++)
     {
@@ -282,6 +315,7 @@ static void target_program(void)
     }
 
     dap_transfer();
+    target_checkpoint(offs - FLASH_PAGE_SIZE, FLASH_PAGE_SIZE);
 
     if (0 == (page % STATUS_INTERVAL))
       verbose(".");
@@ -294,12 +328,13 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = target->options.offset;
   uint32_t block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   bufb = buf_alloc(FLASH_PAGE_SIZE);
 
@@ -334,14 +369,23 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
+
+  while (size && target_checkpoint_skip(addr, offs, FLASH_PAGE_SIZE))
+  {
+    addr += FLASH_PAGE_SIZE;
+    offs += FLASH_PAGE_SIZE;
+    size -= FLASH_PAGE_SIZE;
+  }
 
   while (size)
   {
     dap_read_block(addr, &buf[offs], FLASH_PAGE_SIZE);
+    target_checkpoint(offs, FLASH_PAGE_SIZE);
 
     addr += FLASH_PAGE_SIZE;
     offs += FLASH_PAGE_SIZE;
@@ -351,7 +395,7 @@ static void target_read(void)
       verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
@@ -427,4 +471,3 @@ target_ops_t target_nu_m480_ops =
   .help      = target_help,
 };
 
-
@@ -10,6 +10,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_ADDR             0x08000000
@@ -82,6 +83,12 @@ typedef struct
   uint32_t  flash_size;
 } device_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+} target_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static device_t devices[] =
 {
@@ -89,17 +96,22 @@ static device_t devices[] =
   { 0x20220064, "py32f0", "PY32F002Bxx5", 24*1024 },
 };
 
-static device_t target_device;
-static target_options_t target_options;
-
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static void flash_wait_done(void)
 {
-  while (dap_read_word(FLASH_SR) & FLASH_SR_BSY);
+  dap_wait_word_req(FLASH_SR, FLASH_SR_BSY, 0);
+  dap_read_word_req(FLASH_SR);
+  dap_transfer();
 
-  uint32_t sr = dap_read_word(FLASH_SR);
+  uint32_t sr = dap_get_response(1);
 
   if (sr & FLASH_SR_ALL_ERRORS)
     error_exit("flash operation failed. FLASH_SR = 0x%08x", sr);
@@ -108,21 +120,25 @@ static void flash_wait_done(void)
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
   uint32_t idcode;
   bool locked;
 
+  target = target_create_state(sizeof(target_state_t));
+
   dap_disconnect();
   dap_connect(DAP_INTERFACE_SWD);
   dap_reset_pin(0);
   dap_reset_link();
 
   // Stop the core
-  dap_write_word(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
-  dap_write_word(DEMCR, DEMCR_VC_CORERESET);
-  dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_write_word_req(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
+  dap_write_word_req(DEMCR, DEMCR_VC_CORERESET);
+  dap_write_word_req(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_transfer();
 
   dap_reset_pin(1);
-  sleep_ms(10);
+  dap_delay(10000);
 
   idcode = dap_read_word(DBG_IDCODE);
 
@@ -133,10 +149,10 @@ static void target_select(target_options_t *options)
 
     verbose("Target: %s\n", devices[i].name);
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
-    target_check_options(&target_options, target_device.flash_size, FLASH_PAGE_SIZE);
+    target_check_options(&target->options, target->device.flash_size, FLASH_PAGE_SIZE);
 
     locked = (0xaa != (dap_read_word(OPTIONS_OPTR) & FLASH_OPTR_RDP_MASK));
 
@@ -161,10 +177,12 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(DEMCR, 0);
   dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
 
-  target_free_options(&target_options);
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
@@ -208,16 +226,24 @@ static void target_unlock(void)
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
   uint32_t number_of_pages;
-  uint32_t *buf = (uint32_t *)target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint32_t *buf = (uint32_t *)target->options.file_data;
+  uint32_t size = target->options.file_size;
   int word_size = FLASH_PAGE_SIZE / sizeof(uint32_t);
 
   number_of_pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
 
-  for (uint32_t page = 0; page < number_of_pages; page++)
+  while (offs * sizeof(uint32_t) < size &&
+      target_checkpoint_skip(addr, offs * sizeof(uint32_t), FLASH_PAGE_SIZE))
+  {
+    addr += FLASH_PAGE_SIZE;
+    offs += word_size;
+  }
+
+  for (uint32_t page = offs / word_size; page < number_of_pages; page++)
   {
     // Erase Page
     dap_write_word_req(FLASH_CR, FLASH_CR_PER);
@@ -242,6 +268,7 @@ static void target_program(void)
     dap_transfer();
 
     flash_wait_done();
+    target_checkpoint((offs - word_size) * sizeof(uint32_t), FLASH_PAGE_SIZE);
 
     if (0 == (page % STATUS_INTERVAL))
       verbose(".");
@@ -253,12 +280,13 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  uint32_t size = target->options.file_size;
   int page = 0;
 
   bufb = buf_alloc(FLASH_PAGE_SIZE);
@@ -294,15 +322,24 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
   int page = 0;
 
+  while (size && target_checkpoint_skip(addr, offs, FLASH_PAGE_SIZE))
+  {
+    addr += FLASH_PAGE_SIZE;
+    offs += FLASH_PAGE_SIZE;
+    size -= FLASH_PAGE_SIZE;
+  }
+
   while (size)
   {
     dap_read_block(addr, &buf[offs], FLASH_PAGE_SIZE);
+    target_checkpoint(offs, FLASH_PAGE_SIZE);
 
     addr += FLASH_PAGE_SIZE;
     offs += FLASH_PAGE_SIZE;
@@ -312,7 +349,7 @@ static void target_read(void)
       verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
@@ -397,4 +434,3 @@ target_ops_t target_puya_py32f0_ops =
   .help      = target_help,
 };
 
-
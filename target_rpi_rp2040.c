@@ -10,6 +10,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_ADDR             0x13000000 // XIP_NOCACHE_NOALLOC
@@ -191,15 +192,24 @@
 
 #define STATUS_INTERVAL            4 // sectors
 
-/*- Variables ---------------------------------------------------------------*/
-static target_options_t target_options;
-static int flash_cmd_sector_erase = FLASH_CMD_SECTOR_ERASE;
-static int flash_cmd_read_data = FLASH_CMD_READ_DATA;
-static int flash_wait_cycles = 0;
-static bool flash_quad_mode = false;
+/*- Types -------------------------------------------------------------------*/
+typedef struct
+{
+  target_options_t options;
+  int              flash_cmd_sector_erase;
+  int              flash_cmd_read_data;
+  int              flash_wait_cycles;
+  bool             flash_quad_mode;
+} target_state_t;
 
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static void spi_select_req(int ss)
 {
@@ -229,7 +239,7 @@ static void spi_transfer(uint8_t *data, int size, int rx_skip)
 
   dap_transfer();
 
-  while (dap_read_word(DMA_CH0_CTRL) & DMA_CHx_CTRL_BUSY);
+  dap_wait_word(DMA_CH0_CTRL, DMA_CHx_CTRL_BUSY, 0);
 
   dap_read_block(RAM_HALF_ADDR + rx_skip, data, size - rx_skip);
 }
@@ -264,13 +274,15 @@ static void spi_normal_mode(void)
 //-----------------------------------------------------------------------------
 static void spi_xip_mode(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word_req(GPIO_QSPI_SS_CTRL, GPIO_QSPI_xx_CTRL_OUTOVER_NORMAL);
   dap_write_word_req(QSPI_SSIENR, 0);
-  dap_write_word_req(QSPI_CTRLR0, (flash_quad_mode ? QSPI_CTRLR0_SPI_FRF_QUAD : QSPI_CTRLR0_SPI_FRF_STD) |
+  dap_write_word_req(QSPI_CTRLR0, (target->flash_quad_mode ? QSPI_CTRLR0_SPI_FRF_QUAD : QSPI_CTRLR0_SPI_FRF_STD) |
       QSPI_CTRLR0_TMOD_EEPROM_READ | QSPI_CTRLR0_DFS_32(32-1));
-  dap_write_word_req(QSPI_SPI_CTRLR0, QSPI_SPI_CTRLR0_XIP_CMD(flash_cmd_read_data) |
+  dap_write_word_req(QSPI_SPI_CTRLR0, QSPI_SPI_CTRLR0_XIP_CMD(target->flash_cmd_read_data) |
     QSPI_SPI_CTRLR0_ADDR_L(24 / 4) | QSPI_SPI_CTRLR0_INST_L_8B | QSPI_SPI_CTRLR0_TRANS_TYPE_1C1A |
-    QSPI_SPI_CTRLR0_WAIT_CYCLES(flash_wait_cycles));
+    QSPI_SPI_CTRLR0_WAIT_CYCLES(target->flash_wait_cycles));
   dap_write_word_req(QSPI_SSIENR, QSPI_SSIENR_SSI_EN);
 
   dap_write_word_req(QSPI_DMACR, 0);
@@ -335,6 +347,7 @@ static void flash_prepare(void)
 //----------------------------------------------------------------------------
 static int flash_get_size(void)
 {
+  target_state_t *target = target_state();
   uint8_t buf[128];
   int flash_size = 0;
 
@@ -367,16 +380,16 @@ static int flash_get_size(void)
     if ((w1 & 0x3) != 0x1)
       error_exit("4 KB erase is not supported");
 
-    flash_cmd_sector_erase = (w1 >> 8) & 0xff;
+    target->flash_cmd_sector_erase = (w1 >> 8) & 0xff;
 
     if (((w1 >> 17) & 0x3) != 0x0)
       error_exit("flash must support only 3-byte addressing");
 
     if (w1 & (1 << 22))
-      flash_quad_mode = true;
+      target->flash_quad_mode = true;
 
-    flash_cmd_read_data = (w3 >> 24) & 0xff;
-    flash_wait_cycles   = (w3 >> 16) & 0x1f;
+    target->flash_cmd_read_data = (w3 >> 24) & 0xff;
+    target->flash_wait_cycles   = (w3 >> 16) & 0x1f;
 
     if (w2 & 0x80000000)
       flash_size = (1ull << (w2 & 0x7fffffff)) / 8;
@@ -429,7 +442,8 @@ static void flash_write_enable(void)
 //-----------------------------------------------------------------------------
 static void flash_erase_sector(int addr)
 {
-  uint8_t buf[4] = { flash_cmd_sector_erase, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff };
+  target_state_t *target = target_state();
+  uint8_t buf[4] = { target->flash_cmd_sector_erase, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff };
 
   flash_write_enable();
 
@@ -461,12 +475,26 @@ static void flash_program_page(int addr, uint8_t *data)
   while (flash_is_busy());
 }
 
+//-----------------------------------------------------------------------------
+static void target_link(void)
+{
+  // The multidrop DP only answers after a TARGETSEL with the core ID
+  dap_set_dp_version(2);
+  dap_set_target_id(TARGET_ID_CORE0);
+}
+
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
   uint32_t idr;
   int flash_size, rev;
 
+  target = target_create_state(sizeof(target_state_t));
+
+  target->flash_cmd_sector_erase = FLASH_CMD_SECTOR_ERASE;
+  target->flash_cmd_read_data = FLASH_CMD_READ_DATA;
+
   dap_set_dp_version(2);
 
   dap_set_target_id(TARGET_ID_RESCUE);
@@ -477,9 +505,10 @@ static void target_select(target_options_t *options)
   dap_reset_link();
 
   // Stop the core
-  dap_write_word(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
-  dap_write_word(DEMCR, DEMCR_VC_CORERESET);
-  dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_write_word_req(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
+  dap_write_word_req(DEMCR, DEMCR_VC_CORERESET);
+  dap_write_word_req(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_transfer();
 
   idr = dap_read_word(QSPI_IDR);
 
@@ -505,17 +534,19 @@ static void target_select(target_options_t *options)
 
   check(flash_size <= 16*1024*1024, "flash size larger than 16 MB is not supported");
 
-  target_options = *options;
-  target_check_options(&target_options, flash_size, FLASH_SECTOR_SIZE);
+  target->options = *options;
+  target_check_options(&target->options, flash_size, FLASH_SECTOR_SIZE);
 }
 
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(DEMCR, 0);
   dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
 
-  target_free_options(&target_options);
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
@@ -556,15 +587,27 @@ static void target_unlock(void)
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = target->options.offset;
   uint32_t offs = 0;
   uint32_t number_of_pages;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   number_of_pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
 
-  for (uint32_t page = 0; page < number_of_pages; page++)
+  // Completed sectors can only be read back through XIP
+  spi_xip_mode();
+
+  while (offs < size && target_checkpoint_skip(FLASH_ADDR + addr, offs, FLASH_SECTOR_SIZE))
+  {
+    addr += FLASH_SECTOR_SIZE;
+    offs += FLASH_SECTOR_SIZE;
+  }
+
+  flash_prepare();
+
+  for (uint32_t page = offs / FLASH_PAGE_SIZE; page < number_of_pages; page++)
   {
     if (0 == (addr % FLASH_SECTOR_SIZE))
       flash_erase_sector(addr);
@@ -574,6 +617,9 @@ static void target_program(void)
     addr += FLASH_PAGE_SIZE;
     offs += FLASH_PAGE_SIZE;
 
+    if (0 == (addr % FLASH_SECTOR_SIZE))
+      target_checkpoint(offs - FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+
     if (0 == (addr % (FLASH_SECTOR_SIZE * STATUS_INTERVAL)))
       verbose(".");
   }
@@ -582,12 +628,13 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  uint32_t size = target->options.file_size;
   int sector = 0;
 
   bufb = buf_alloc(FLASH_SECTOR_SIZE);
@@ -625,17 +672,26 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
   int sector = 0;
 
   spi_xip_mode();
 
+  while (size && target_checkpoint_skip(addr, offs, FLASH_SECTOR_SIZE))
+  {
+    addr += FLASH_SECTOR_SIZE;
+    offs += FLASH_SECTOR_SIZE;
+    size -= FLASH_SECTOR_SIZE;
+  }
+
   while (size)
   {
     dap_read_block(addr, &buf[offs], FLASH_SECTOR_SIZE);
+    target_checkpoint(offs, FLASH_SECTOR_SIZE);
 
     addr += FLASH_SECTOR_SIZE;
     offs += FLASH_SECTOR_SIZE;
@@ -645,7 +701,7 @@ static void target_read(void)
       verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
@@ -693,7 +749,7 @@ target_ops_t target_rpi_rp2040_ops =
   .fread     = target_fuse_read,
   .fwrite    = target_fuse_write,
   .enumerate = target_enumerate,
+  .link      = target_link,
   .help      = target_help,
 };
 
-
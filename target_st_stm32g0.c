@@ -10,6 +10,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_ADDR             0x08000000
@@ -120,6 +121,12 @@ typedef struct
   uint32_t     secr;
 } fuse_options_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+} target_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static device_t devices[] =
 {
@@ -127,20 +134,26 @@ static device_t devices[] =
   { 0x6466, "stm32g0", "STM32G031/41" },
 };
 
-static device_t target_device;
-static target_options_t target_options;
 //static fuse_options_t fuse_options;
 
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static void flash_wait_done(void)
 {
   uint32_t sr;
 
-  while (dap_read_word(FLASH_SR) & FLASH_SR_BSY1);
+  dap_wait_word_req(FLASH_SR, FLASH_SR_BSY1, 0);
+  dap_read_word_req(FLASH_SR);
+  dap_transfer();
 
-  sr = dap_read_word(FLASH_SR);
+  sr = dap_get_response(1);
 
   if (sr & FLASH_SR_ALL_ERRORS)
     error_exit("flash operation failed. FLASH_SR = 0x%08x", sr);
@@ -149,21 +162,25 @@ static void flash_wait_done(void)
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
   uint32_t idcode, flash_size;
   bool locked;
 
+  target = target_create_state(sizeof(target_state_t));
+
   dap_disconnect();
   dap_connect(DAP_INTERFACE_SWD);
   dap_reset_pin(0);
   dap_reset_link();
 
   // Stop the core
-  dap_write_word(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
-  dap_write_word(DEMCR, DEMCR_VC_CORERESET);
-  dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_write_word_req(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
+  dap_write_word_req(DEMCR, DEMCR_VC_CORERESET);
+  dap_write_word_req(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_transfer();
 
   dap_reset_pin(1);
-  sleep_ms(10);
+  dap_delay(10000);
 
   idcode = dap_read_word(DBG_IDCODE);
 
@@ -174,12 +191,12 @@ static void target_select(target_options_t *options)
 
     verbose("Target: %s\n", devices[i].name);
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
     flash_size = (dap_read_word(FLASH_SIZE_REG) & FLASH_SIZE_REG_MASK) * FLASH_SIZE_REG_MULT;
 
-    target_check_options(&target_options, flash_size, FLASH_PAGE_SIZE);
+    target_check_options(&target->options, flash_size, FLASH_PAGE_SIZE);
 
     locked = (0xaa != (dap_read_word(OPTIONS_OPTR) & FLASH_OPTR_RDP_MASK));
 
@@ -203,10 +220,12 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(DEMCR, 0);
   dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
 
-  target_free_options(&target_options);
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
@@ -233,16 +252,23 @@ static void target_unlock(void)
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
   uint32_t start_page, number_of_pages;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
-  start_page = target_options.offset / FLASH_PAGE_SIZE;
+  start_page = target->options.offset / FLASH_PAGE_SIZE;
   number_of_pages = (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
 
-  for (uint32_t page = 0; page < number_of_pages; page++)
+  while (offs < size && target_checkpoint_skip(addr, offs, FLASH_PAGE_SIZE))
+  {
+    addr += FLASH_PAGE_SIZE;
+    offs += FLASH_PAGE_SIZE;
+  }
+
+  for (uint32_t page = offs / FLASH_PAGE_SIZE; page < number_of_pages; page++)
   {
     // Erase Page
     dap_write_word(FLASH_CR, FLASH_CR_PER | FLASH_CR_PNB(start_page + page));
@@ -262,6 +288,7 @@ static void target_program(void)
     verbose(".");
 
     flash_wait_done();
+    target_checkpoint(offs - FLASH_PAGE_SIZE, FLASH_PAGE_SIZE);
   }
 
   dap_write_word(FLASH_CR, 0);
@@ -270,12 +297,13 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
   bufb = buf_alloc(FLASH_ROW_SIZE);
 
@@ -310,14 +338,23 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
+
+  while (size && target_checkpoint_skip(addr, offs, FLASH_ROW_SIZE))
+  {
+    addr += FLASH_ROW_SIZE;
+    offs += FLASH_ROW_SIZE;
+    size -= FLASH_ROW_SIZE;
+  }
 
   while (size)
   {
     dap_read_block(addr, &buf[offs], FLASH_ROW_SIZE);
+    target_checkpoint(offs, FLASH_ROW_SIZE);
 
     addr += FLASH_ROW_SIZE;
     offs += FLASH_ROW_SIZE;
@@ -326,7 +363,7 @@ static void target_read(void)
     verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
@@ -385,4 +422,3 @@ target_ops_t target_st_stm32g0_ops =
   .help      = target_help,
 };
 
-
@@ -10,6 +10,7 @@
 #include "target.h"
 #include "edbg.h"
 #include "dap.h"
+#include "session.h"
 
 /*- Definitions -------------------------------------------------------------*/
 #define FLASH_ADDR             0x08000000
@@ -111,6 +112,15 @@ typedef struct
   char      *name;
 } device_t;
 
+typedef struct
+{
+  device_t         device;
+  target_options_t options;
+  bool             dbank;
+  int              page_size;
+  int              row_size;
+} target_state_t;
+
 /*- Variables ---------------------------------------------------------------*/
 static device_t devices[] =
 {
@@ -119,20 +129,22 @@ static device_t devices[] =
   { 0x6479, "stm32g4", "STM32G491/A1" },
 };
 
-static device_t target_device;
-static target_options_t target_options;
-static bool target_dbank;
-static int target_page_size;
-static int target_row_size;
-
 /*- Implementations ---------------------------------------------------------*/
 
+//-----------------------------------------------------------------------------
+static inline target_state_t *target_state(void)
+{
+  return (target_state_t *)g_session->target_state;
+}
+
 //-----------------------------------------------------------------------------
 static void flash_wait_done(void)
 {
-  while (dap_read_word(FLASH_SR) & FLASH_SR_BSY);
+  dap_wait_word_req(FLASH_SR, FLASH_SR_BSY, 0);
+  dap_read_word_req(FLASH_SR);
+  dap_transfer();
 
-  uint32_t sr = dap_read_word(FLASH_SR);
+  uint32_t sr = dap_get_response(1);
 
   if (sr & FLASH_SR_ALL_ERRORS)
     error_exit("flash operation failed. FLASH_SR = 0x%08x", sr);
@@ -141,18 +153,24 @@ static void flash_wait_done(void)
 //-----------------------------------------------------------------------------
 static void target_select(target_options_t *options)
 {
+  target_state_t *target;
+  target = target_create_state(sizeof(target_state_t));
+
+  dap_set_tar_wrap_size(4096);
+
   dap_disconnect();
   dap_connect(DAP_INTERFACE_SWD);
   dap_reset_pin(0);
   dap_reset_link();
 
   // Stop the core
-  dap_write_word(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
-  dap_write_word(DEMCR, DEMCR_VC_CORERESET);
-  dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_write_word_req(DHCSR, DHCSR_DBGKEY | DHCSR_DEBUGEN | DHCSR_HALT);
+  dap_write_word_req(DEMCR, DEMCR_VC_CORERESET);
+  dap_write_word_req(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
+  dap_transfer();
 
   dap_reset_pin(1);
-  sleep_ms(10);
+  dap_delay(10000);
 
   uint32_t idcode = dap_read_word(DBGMCU_IDCODE);
 
@@ -163,18 +181,18 @@ static void target_select(target_options_t *options)
 
     verbose("Target: %s\n", devices[i].name);
 
-    target_device = devices[i];
-    target_options = *options;
+    target->device = devices[i];
+    target->options = *options;
 
     uint32_t flash_size = (dap_read_word(FLASH_SIZE_REG) & FLASH_SIZE_REG_MASK) * FLASH_SIZE_REG_MULT;
 
-    target_dbank     = (dap_read_word(FLASH_OPTR) & FLASH_OPTR_DBANK);
-    target_page_size = target_dbank ? FLASH_PAGE_SIZE_2 : FLASH_PAGE_SIZE_1;
-    target_row_size  = target_dbank ? FLASH_ROW_SIZE_2 : FLASH_ROW_SIZE_1;
+    target->dbank     = (dap_read_word(FLASH_OPTR) & FLASH_OPTR_DBANK);
+    target->page_size = target->dbank ? FLASH_PAGE_SIZE_2 : FLASH_PAGE_SIZE_1;
+    target->row_size  = target->dbank ? FLASH_ROW_SIZE_2 : FLASH_ROW_SIZE_1;
 
-    verbose("Flash size: %d bytes (%s bank mode)\n", flash_size, target_dbank ? "dual" : "single");
+    verbose("Flash size: %d bytes (%s bank mode)\n", flash_size, target->dbank ? "dual" : "single");
 
-    target_check_options(&target_options, flash_size, target_page_size);
+    target_check_options(&target->options, flash_size, target->page_size);
 
     bool locked = (0xaa != (dap_read_word(FLASH_OPTR) & FLASH_OPTR_RDP_MASK));
 
@@ -198,10 +216,12 @@ static void target_select(target_options_t *options)
 //-----------------------------------------------------------------------------
 static void target_deselect(void)
 {
+  target_state_t *target = target_state();
+
   dap_write_word(DEMCR, 0);
   dap_write_word(AIRCR, AIRCR_VECTKEY | AIRCR_SYSRESETREQ);
 
-  target_free_options(&target_options);
+  target_free_options(&target->options);
 }
 
 //-----------------------------------------------------------------------------
@@ -228,16 +248,23 @@ static void target_unlock(void)
 //-----------------------------------------------------------------------------
 static void target_program(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
   uint32_t start_page, number_of_pages;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.file_size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.file_size;
 
-  start_page = target_options.offset / target_page_size;
-  number_of_pages = (size + target_page_size - 1) / target_page_size;
+  start_page = target->options.offset / target->page_size;
+  number_of_pages = (size + target->page_size - 1) / target->page_size;
+
+  while (offs < size && target_checkpoint_skip(addr, offs, target->page_size))
+  {
+    addr += target->page_size;
+    offs += target->page_size;
+  }
 
-  for (uint32_t page = 0; page < number_of_pages; page++)
+  for (uint32_t page = offs / target->page_size; page < number_of_pages; page++)
   {
     // Erase Page
     dap_write_word(FLASH_CR, FLASH_CR_PER | FLASH_CR_PNB(start_page + page));
@@ -247,14 +274,15 @@ static void target_program(void)
     dap_write_word(FLASH_CR, FLASH_CR_PG);
 
     // Program Page
-    for (int i = 0; i < (target_page_size / target_row_size); i++)
+    for (int i = 0; i < (target->page_size / target->row_size); i++)
     {
-      dap_write_block(addr, &buf[offs], target_row_size);
-      addr += target_row_size;
-      offs += target_row_size;
+      dap_write_block(addr, &buf[offs], target->row_size);
+      addr += target->row_size;
+      offs += target->row_size;
     }
 
     flash_wait_done();
+    target_checkpoint(offs - target->page_size, target->page_size);
 
     verbose(".");
   }
@@ -265,20 +293,21 @@ static void target_program(void)
 //-----------------------------------------------------------------------------
 static void target_verify(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   int block_size;
   uint32_t offs = 0;
   uint8_t *bufb;
-  uint8_t *bufa = target_options.file_data;
-  int size = target_options.file_size;
+  uint8_t *bufa = target->options.file_data;
+  int size = target->options.file_size;
 
-  bufb = buf_alloc(target_row_size);
+  bufb = buf_alloc(target->row_size);
 
   while (size)
   {
-    dap_read_block(addr, bufb, target_row_size);
+    dap_read_block(addr, bufb, target->row_size);
 
-    block_size = (size > target_row_size) ? target_row_size : size;
+    block_size = (size > target->row_size) ? target->row_size : size;
 
     for (int i = 0; i < block_size; i++)
     {
@@ -291,11 +320,11 @@ static void target_verify(void)
       }
     }
 
-    addr += target_row_size;
-    offs += target_row_size;
+    addr += target->row_size;
+    offs += target->row_size;
     size -= block_size;
 
-    if (0 == (offs % target_page_size))
+    if (0 == (offs % target->page_size))
       verbose(".");
   }
 
@@ -305,24 +334,33 @@ static void target_verify(void)
 //-----------------------------------------------------------------------------
 static void target_read(void)
 {
-  uint32_t addr = FLASH_ADDR + target_options.offset;
+  target_state_t *target = target_state();
+  uint32_t addr = FLASH_ADDR + target->options.offset;
   uint32_t offs = 0;
-  uint8_t *buf = target_options.file_data;
-  uint32_t size = target_options.size;
+  uint8_t *buf = target->options.file_data;
+  uint32_t size = target->options.size;
+
+  while (size && target_checkpoint_skip(addr, offs, target->row_size))
+  {
+    addr += target->row_size;
+    offs += target->row_size;
+    size -= target->row_size;
+  }
 
   while (size)
   {
-    dap_read_block(addr, &buf[offs], target_row_size);
+    dap_read_block(addr, &buf[offs], target->row_size);
+    target_checkpoint(offs, target->row_size);
 
-    addr += target_row_size;
-    offs += target_row_size;
-    size -= target_row_size;
+    addr += target->row_size;
+    offs += target->row_size;
+    size -= target->row_size;
 
-    if (0 == (offs % target_page_size))
+    if (0 == (offs % target->page_size))
       verbose(".");
   }
 
-  save_file(target_options.name, buf, target_options.size);
+  target_save_data(&target->options, buf, target->options.size);
 }
 
 //-----------------------------------------------------------------------------
@@ -414,4 +452,3 @@ target_ops_t target_st_stm32g4_ops =
   .help      = target_help,
 };
 
-
@@ -0,0 +1,143 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-3-Clause
+# Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+#
+# Daemon checks on the simulated debugger. Usage: tests/daemon.sh [<edbg binary>]
+
+EDBG=$(cd "$(dirname "${1:-./edbg}")" && pwd)/$(basename "${1:-./edbg}")
+DIR=$(mktemp -d)
+FAILED=0
+LOOPS=40
+
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+if ! command -v python3 > /dev/null; then
+  echo "skip daemon: python3 is required for the socket client"
+  exit 0
+fi
+
+head -c 5000 /dev/urandom > a.bin
+head -c 5000 /dev/urandom > b.bin
+
+# Usage: send, reads commands from stdin and prints the responses
+send()
+{
+  python3 -c '
+import socket, sys
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+f = s.makefile("rw")
+for line in sys.stdin:
+  f.write(line)
+  f.flush()
+  while True:
+    r = f.readline()
+    if not r:
+      sys.exit(0)
+    sys.stdout.write(r)
+    if r.startswith("OK") or r.startswith("ERROR"):
+      break
+' edbg.sock
+}
+
+# Usage: expect <name> <expected response count> <response> <commands...>
+expect()
+{
+  name=$1 count=$2 response=$3
+  shift 3
+
+  out=$(printf '%s\n' "$@" | send)
+  n=$(printf '%s\n' "$out" | grep -c "^$response")
+
+  if [ "$n" -ne "$count" ]; then
+    echo "FAIL $name: $out"
+    FAILED=1
+  else
+    echo "ok   $name"
+  fi
+}
+
+# Usage: failing <name>, sends rounds of failing operations
+failing()
+{
+  out=$(for i in $(seq $LOOPS); do
+    echo "verify b.bin"
+    echo "program missing.bin"
+    echo "read out.bin 0x10"
+  done | send)
+
+  if [ "$(printf '%s\n' "$out" | grep -c "^ERROR")" -ne $((LOOPS*3)) ]; then
+    echo "FAIL $1: $out"
+    FAILED=1
+  else
+    echo "ok   $1"
+  fi
+}
+
+rss()
+{
+  awk '/^VmRSS:/ { print $2 }' /proc/$PID/status 2> /dev/null
+}
+
+# Usage: start <target>, starts a daemon on the simulated target
+start()
+{
+  # The socket must not be accessible to others even with a permissive umask
+  (umask 000; exec "$EDBG" --sim=target=$1,timing=0 -t $1 -D edbg.sock) &
+  PID=$!
+
+  for i in $(seq 50); do
+    [ -S edbg.sock ] && break
+    sleep 0.1
+  done
+}
+
+# Usage: stop, shuts the daemon down
+stop()
+{
+  expect "shutdown"       1 "OK" "shutdown"
+
+  if ! wait $PID; then
+    echo "FAIL daemon exit code"
+    FAILED=1
+  fi
+}
+
+start samd21
+
+mode=$(ls -l edbg.sock | cut -c 1-10)
+
+if [ "$mode" != "srwx------" ]; then
+  echo "FAIL socket permissions: $mode"
+  FAILED=1
+else
+  echo "ok   socket permissions"
+fi
+
+expect "program"        2 "OK" "program a.bin" "verify a.bin"
+failing "failing operations"
+
+before=$(rss)
+failing "more failures"
+after=$(rss)
+
+# Each leaked flash buffer would be 256 KB
+if [ -n "$before" ] && [ -n "$after" ] && [ $((after - before)) -gt 2048 ]; then
+  echo "FAIL memory: grew from $before KB to $after KB after $((LOOPS*3)) failed operations"
+  FAILED=1
+elif [ -n "$before" ]; then
+  echo "ok   memory"
+fi
+
+expect "after failures" 2 "OK" "verify a.bin" "read32 0x0"
+stop
+
+# Memory commands set up the multidrop DP without a select, a target switch drops it
+start rp2040
+expect "multidrop read32"   1 "OK" "read32 0x20000000"
+expect "target switch"      1 "ERROR" "program a.bin" "target samd21" "read32 0x20000000"
+expect "target switch back" 2 "OK" "target rp2040" "read32 0x20000000"
+stop
+
+exit $FAILED
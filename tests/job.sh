@@ -0,0 +1,53 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-3-Clause
+# Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+#
+# Job file checks on the simulated debugger. Usage: tests/job.sh [<edbg binary>]
+
+EDBG=$(cd "$(dirname "${1:-./edbg}")" && pwd)/$(basename "${1:-./edbg}")
+DIR=$(mktemp -d)
+FAILED=0
+
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+head -c 5000 /dev/urandom > a.bin
+head -c 3000 /dev/urandom > b.bin
+
+# Usage: run <name> <pass|fail> <expected output> <sim target> <job lines...>
+run()
+{
+  name=$1 result=$2 expect=$3 target=$4
+  shift 4
+  printf '%s\n' "$@" > test.job
+
+  out=$("$EDBG" --sim=target=$target,timing=0 -t $target -J test.job 2>&1)
+  rc=$?
+
+  if { [ $result = pass ] && [ $rc -ne 0 ]; } || { [ $result = fail ] && [ $rc -eq 0 ]; } ||
+      { [ -n "$expect" ] && ! printf '%s' "$out" | grep -q "$expect"; }; then
+    echo "FAIL $name: $out"
+    FAILED=1
+  else
+    echo "ok   $name"
+  fi
+}
+
+run "several images"        pass ""                    samd21   "erase" "program a.bin 0x0" "program b.bin 0x8000" "verify"
+run "read back"             pass ""                    samd21   "program a.bin 0x1000" "read out.bin 0x1000 0x1400"
+
+if ! head -c 5000 out.bin 2>/dev/null | cmp -s - a.bin; then
+  echo "FAIL read back: data does not match"
+  FAILED=1
+fi
+
+run "overlapping images"    fail "overlaps"            samd21   "program a.bin 0x0" "program b.bin 0x1000"
+run "erase after program"   fail "erase would remove"  samd21   "program a.bin" "erase"
+run "unaligned offset"      fail "multiple of 256"     samd21   "program a.bin 0x10"
+run "images past the flash" fail "does not fit"        samd21   "program a.bin 0x3ff00"
+run "offset out of range"   fail "invalid number"      samd21   "program a.bin 0x80000000"
+run "shared sector"         fail "erase sector at 0x0" gd32f4xx "program a.bin 0x0" "program b.bin 0x2000" "verify"
+run "separate sectors"      pass ""                    gd32f4xx "program a.bin 0x0" "program b.bin 0x4000" "verify"
+run "two sectors"           pass ""                    gd32f4xx "program a.bin 0x0" "program b.bin 0x3ff00" "verify"
+
+exit $FAILED
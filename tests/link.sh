@@ -0,0 +1,51 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-3-Clause
+# Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+#
+# Link and clock checks on the simulated debugger. Usage: tests/link.sh [<edbg binary>]
+
+EDBG=$(cd "$(dirname "${1:-./edbg}")" && pwd)/$(basename "${1:-./edbg}")
+DIR=$(mktemp -d)
+FAILED=0
+
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+# The selected clock is cached in the home directory
+HOME=$DIR
+export HOME
+
+head -c 5000 /dev/urandom > a.bin
+
+# Usage: run <name> <expected output> <unexpected output> <sim options> <edbg arguments...>
+run()
+{
+  name=$1 expect=$2 unexpect=$3 sim=$4
+  shift 4
+
+  out=$("$EDBG" --sim=$sim "$@" 2>&1)
+  rc=$?
+
+  if [ $rc -ne 0 ] || { [ -n "$expect" ] && ! printf '%s' "$out" | grep -q "$expect"; } ||
+      { [ -n "$unexpect" ] && printf '%s' "$out" | grep -q "$unexpect"; }; then
+    echo "FAIL $name: $out"
+    FAILED=1
+  else
+    echo "ok   $name"
+  fi
+}
+
+run "auto clock"                "24.0 MHz"                         "unable to find" target=samd21,timing=0 -b -t samd21 -c auto -pv -f a.bin
+run "cached clock"              "cached"                           ""               target=samd21,timing=0 -b -t samd21 -c auto -pv -f a.bin
+run "auto clock, multidrop"     "24.0 MHz"                         "unable to find" target=rp2040,timing=0 -b -t rp2040 -c auto -pv -f a.bin
+
+# The simulator faults DRW accesses above maxclock, so these runs only succeed
+# if transfer errors are retried and the clock is lowered until they stop
+rm -f .edbg_clock
+run "clock back-off"            "lowering the clock to 8000 kHz"   ""               target=samd21,timing=0,maxclock=8000 -b -t samd21 -c auto -pv -f a.bin
+rm -f .edbg_clock
+run "error recovery"            "recovered from [1-9]"             ""               target=samd21,timing=0,maxclock=8000 -b -t samd21 -c auto -pv -f a.bin
+rm -f .edbg_clock
+run "error recovery, multidrop" "recovered from [1-9]"             ""               target=rp2040,timing=0,maxclock=8000 -b -t rp2040 -c auto -pv -f a.bin
+
+exit $FAILED
@@ -0,0 +1,59 @@
+#!/bin/sh
+# SPDX-License-Identifier: BSD-3-Clause
+# Copyright (c) 2024, Alex Taradov <alex@taradov.com>. All rights reserved.
+#
+# Recording and replay checks on the simulated debugger. Each model is programmed and
+# verified with -W, the new recording is replayed with -P, and so is the one saved in
+# tests/replay. A change in the request encoding makes the saved replay fail.
+# Usage: tests/replay.sh [<edbg binary>] [update]
+
+EDBG=$(cd "$(dirname "${1:-./edbg}")" && pwd)/$(basename "${1:-./edbg}")
+SAVED=$(cd "$(dirname "$0")" && pwd)/replay
+DIR=$(mktemp -d)
+FAILED=0
+
+MODELS="samd21 samd51 saml10 sam3x sam4s same70 stm32g0 stm32g4 stm32wb55 gd32f4xx m480 py32f0 rp2040"
+
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+# The saved recordings depend on the image contents, so it is not random
+LC_ALL=C awk 'BEGIN { for (i = 0; i < 3000; i++) printf "%c", (i * 73 + int(i / 256)) % 255 + 1 }' > image.bin
+
+# Usage: check <name> <edbg arguments...>
+check()
+{
+  name=$1
+  shift
+
+  if ! out=$("$EDBG" "$@" -t $model -bpv -f image.bin 2>&1); then
+    echo "FAIL $name: $out"
+    FAILED=1
+  else
+    echo "ok   $name"
+  fi
+}
+
+for model in $MODELS; do
+  check "$model record" --sim=target=$model,timing=0 -W $model.rec
+  check "$model replay" -P $model.rec
+
+  if [ "$2" = update ]; then
+    cp $model.rec "$SAVED/$model.rec"
+  else
+    check "$model saved replay" -P "$SAVED/$model.rec"
+  fi
+done
+
+# A record header with a size of 0x80000000 must be reported, not read past the file
+printf 'EDBGREC1S\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\200' > bad.rec
+out=$("$EDBG" -P bad.rec -t samd21 -b 2>&1)
+
+if [ $? -ne 1 ] || ! printf '%s' "$out" | grep -q "truncated record"; then
+  echo "FAIL corrupt recording: $out"
+  FAILED=1
+else
+  echo "ok   corrupt recording"
+fi
+
+exit $FAILED